@@ -0,0 +1,185 @@
+/*
+ columns_bench.c: the same questions about 10 million pets, asked of an
+ array of struct petData and of pets_columns.h.
+
+ Makes 10 million pets (or loads them from a CSV file) into one array of
+ struct petData, copies them into PetColumns, and answers three queries:
+
+   avg(age) by species                    every pet, grouped
+   count, min, max by species, age 5-10   a filter and a group-by
+   avg(age) where species = dog           a filter, no group-by
+
+ each of these ways:
+
+   aos       a loop over the structs; the species string is looked up in
+             the same dictionary the columns use, or strcmp()ed for the filter
+   scalar    pets_columns.h, one pet at a time over the columns
+   avx2      pets_columns.h, 32 pets at a time
+   N threads avx2 (or scalar) with the rows split N ways
+
+ Each is run 3 times and the best time printed, with how many times faster
+ than the struct loop it is; every answer is checked against that loop's.
+
+ Compile: gcc -Wall -g -O2 -pthread columns_bench.c -o columns_bench
+ Usage: ./columns_bench [-n pets] [-j max threads] [file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "pets_columns.h"
+
+#define RUNS 3
+
+struct petData* pets;
+size_t numPets;
+PetColumns cols;
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The same pets csv_bench.c writes, straight into memory
+int makePets(size_t n){
+  pets = malloc(n * sizeof(struct petData));
+  if(!pets){
+    perror("malloc");
+    return -1;
+  }
+  unsigned seed = CSV_FAKE_SEED;
+  for(size_t i = 0; i < n; i++){
+    csvFakePet(&seed, i, &pets[i]);
+  }
+  numPets = n;
+  return 0;
+}
+
+// The query as a loop over the structs
+int aosRun(const ColQuery* q, const char* species, ColAgg* out){
+  int groups = q->bySpecies ? cols.numSpecies : 1;
+  colAggInit(out, groups);
+  for(size_t i = 0; i < numPets; i++){
+    const struct petData* p = &pets[i];
+    if(p->age < q->minAge || p->age > q->maxAge) continue;
+    if(species && strcmp(p->species, species) != 0) continue;
+    ColAgg* g = &out[q->bySpecies ? colSpeciesCode(&cols, p->species) : 0];
+    g->count++;
+    g->sum += p->age;
+    if(p->age < g->min) g->min = p->age;
+    if(p->age > g->max) g->max = p->age;
+  }
+  return groups;
+}
+
+double aosSecs;
+ColAgg expect[COL_MAX_SPECIES];
+int expectGroups;
+
+void report(const char* method, int threads, double secs, const ColAgg* got, int groups){
+  int same = groups == expectGroups;
+  for(int g = 0; same && g < groups; g++){
+    same = got[g].count == expect[g].count && got[g].sum == expect[g].sum &&
+           got[g].min == expect[g].min && got[g].max == expect[g].max;
+  }
+  printf("  %-8s %7d %9.1f %9.0f %7.1fx%s\n", method, threads, secs * 1e3,
+         numPets / secs / 1e6, aosSecs / secs, same ? "" : "   (wrong answer!)");
+  fflush(stdout);
+}
+
+void runQuery(const char* title, ColQuery q, const char* species, int maxThreads){
+  ColAgg got[COL_MAX_SPECIES];
+  printf("%s\n", title);
+  printf("  %-8s %7s %9s %9s %8s\n", "method", "threads", "ms", "Mpets/s", "speedup");
+  aosSecs = 1e30;
+  for(int r = 0; r < RUNS; r++){
+    double start = now();
+    expectGroups = aosRun(&q, species, expect);
+    if(now() - start < aosSecs) aosSecs = now() - start;
+  }
+  report("aos", 1, aosSecs, expect, expectGroups);
+
+  int best = colPickIsa();
+  for(int threads = 1; threads <= maxThreads; threads *= 2){
+    for(int isa = threads == 1 ? COL_SCALAR : best; isa <= best; isa++){
+      colIsa = isa;
+      double secs = 1e30;
+      int groups = 0;
+      for(int r = 0; r < RUNS; r++){
+        double start = now();
+        groups = colRun(&cols, &q, threads, got);
+        if(now() - start < secs) secs = now() - start;
+      }
+      report(colIsaName(isa), threads, secs, got, groups);
+    }
+  }
+  colIsa = COL_AUTO;
+}
+
+int main(int argc, char* argv[]){
+  size_t n = 10000000;
+  int maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(maxThreads < 4) maxThreads = 4;
+  int opt;
+  while((opt = getopt(argc, argv, "n:j:")) != -1){
+    if(opt == 'n' && atol(optarg) > 0){
+      n = atol(optarg);
+    } else if(opt == 'j' && atoi(optarg) > 0){
+      maxThreads = atoi(optarg) < COL_MAX_THREADS ? atoi(optarg) : COL_MAX_THREADS;
+    } else {
+      fprintf(stderr, "Usage: %s [-n pets] [-j max threads] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+  double start = now();
+  if(optind < argc){
+    if(csvLoadPets(argv[optind], maxThreads, &pets, &numPets, NULL) == -1){
+      perror(argv[optind]);
+      return 1;
+    }
+  } else if(makePets(n) == -1){
+    return 1;
+  }
+  double loadSecs = now() - start;
+
+  colInit(&cols);
+  start = now();
+  if(colAppend(&cols, pets, numPets) == -1){
+    perror("colAppend");
+    return 1;
+  }
+  printf("%zu pets (%.2f s to make, %.2f s to copy into columns), %d species\n", numPets,
+         loadSecs, now() - start, cols.numSpecies);
+  printf("structs: %.0f MB; columns: age %.0f MB, species %.0f MB, names %.0f MB + %.0f MB "
+         "of offsets\n\n", numPets * sizeof(struct petData) / 1e6, numPets * 4 / 1e6,
+         numPets / 1e6, cols.namesLen / 1e6, numPets * 4 / 1e6);
+
+  ColQuery q = colQueryAll();
+  q.bySpecies = 1;
+  runQuery("avg(age) by species", q, NULL, maxThreads);
+
+  q.minAge = 5;
+  q.maxAge = 10;
+  runQuery("count, min, max by species where age between 5 and 10", q, NULL, maxThreads);
+
+  q = colQueryAll();
+  q.species = colSpeciesCode(&cols, "dog");
+  runQuery("avg(age) where species = dog", q, "dog", maxThreads);
+
+  // The answer to the first one
+  ColAgg bySpecies[COL_MAX_SPECIES];
+  q = colQueryAll();
+  q.bySpecies = 1;
+  int groups = colRun(&cols, &q, 1, bySpecies);
+  printf("\n%-10s %10s %8s %4s %4s\n", "species", "pets", "avg age", "min", "max");
+  for(int g = 0; g < groups; g++){
+    printf("%-10s %10zu %8.3f %4d %4d\n", cols.speciesNames[g], bySpecies[g].count,
+           colAvg(&bySpecies[g]), bySpecies[g].min, bySpecies[g].max);
+  }
+  colFree(&cols);
+  free(pets);
+  return 0;
+}
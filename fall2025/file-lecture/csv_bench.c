@@ -0,0 +1,196 @@
+/*
+ csv_bench.c: how many pets a second can we read out of a CSV file?
+
+ petsDB2.c reads pets.txt with readPet(), one fscanf() per line. This
+ makes a big file of pets in the same format (1GB in /tmp unless you name
+ one), reads it once so it's in the page cache, and then parses all of it
+ each of these ways, adding up the ages so every pet is really looked at:
+
+   fscanf        readPet() from petsDB2.c in a loop
+   scalar        pets_csv.h, delimiters found one byte at a time
+   sse2, avx2    pets_csv.h, delimiters found 16 or 32 bytes per compare
+   N threads     pets_csv.h with the best search, the file split N ways
+   load          csvLoadPets(): every pet into one array (if it fits in
+                 half the memory; 1GB of CSV is about 4.7GB of structs)
+
+ and prints the time, pets per second and MB per second for each, and how
+ many times faster than fscanf() it is.
+
+ Compile: gcc -Wall -g -O2 -pthread csv_bench.c -o csv_bench
+ Usage: ./csv_bench [-s MB] [-j max threads] [file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "pets_csv.h"
+
+struct totals {
+  pthread_mutex_t lock;
+  size_t pets;
+  long long ageSum;
+};
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int readPet(FILE* f, struct petData* p){
+  return fscanf(f, "%49[^,],%49[^,],%d\n", p->name, p->species, &p->age);
+}
+
+// The sink for csvScanPets(): add up a batch, then the batch into the totals
+void addUp(void* ctx, const struct petData* pets, size_t n){
+  struct totals* t = ctx;
+  long long sum = 0;
+  for(size_t i = 0; i < n; i++){
+    sum += pets[i].age;
+  }
+  pthread_mutex_lock(&t->lock);
+  t->pets += n;
+  t->ageSum += sum;
+  pthread_mutex_unlock(&t->lock);
+}
+
+// Write about size bytes of pets to path (to the end of the line that
+// crosses size), unless a file that size is already there
+int makeFile(const char* path, long long size){
+  struct stat st;
+  if(stat(path, &st) == 0 && st.st_size >= size && st.st_size < size + 64){
+    return 0;
+  }
+  fprintf(stderr, "Writing %lld MB of pets to %s...\n", size >> 20, path);
+  FILE* f = fopen(path, "w");
+  if(!f){
+    perror(path);
+    return -1;
+  }
+  unsigned seed = CSV_FAKE_SEED;
+  long long written = 0;
+  for(long i = 0; written < size; i++){
+    struct petData p;
+    csvFakePet(&seed, i, &p);
+    written += fprintf(f, "%s,%s,%d\n", p.name, p.species, p.age);
+  }
+  if(fclose(f) != 0){
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+void warmCache(const char* path){
+  char* buf = malloc(1 << 20);
+  FILE* f = fopen(path, "r");
+  while(f && fread(buf, 1, 1 << 20, f) > 0){
+  }
+  if(f) fclose(f);
+  free(buf);
+}
+
+double fscanfSecs;
+size_t expectPets;
+long long expectSum;
+double fileMb;
+
+void report(const char* method, int threads, double secs, size_t pets, long long sum){
+  printf("%-8s %7d %8.2f %10.2f %8.0f %7.1fx%s\n", method, threads, secs, pets / secs / 1e6,
+         fileMb / secs, fscanfSecs / secs,
+         pets == expectPets && sum == expectSum ? "" : "   (wrong answer!)");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]){
+  long long sizeMb = 1024;
+  int maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(maxThreads < 4) maxThreads = 4;
+  int opt;
+  while((opt = getopt(argc, argv, "s:j:")) != -1){
+    if(opt == 's' && atoll(optarg) > 0){
+      sizeMb = atoll(optarg);
+    } else if(opt == 'j' && atoi(optarg) > 0){
+      maxThreads = atoi(optarg) < CSV_MAX_THREADS ? atoi(optarg) : CSV_MAX_THREADS;
+    } else {
+      fprintf(stderr, "Usage: %s [-s MB] [-j max threads] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+  const char* path = "/tmp/csv_bench.csv";
+  if(optind < argc){
+    path = argv[optind];
+  } else if(makeFile(path, sizeMb << 20) == -1){
+    return 1;
+  }
+  struct stat st;
+  if(stat(path, &st) == -1){
+    perror(path);
+    return 1;
+  }
+  fileMb = st.st_size / 1048576.0;
+  warmCache(path);
+
+  // fscanf() first: the baseline, and the answer everything else must match
+  double start = now();
+  FILE* f = fopen(path, "r");
+  struct petData p;
+  while(readPet(f, &p) == 3){
+    expectPets++;
+    expectSum += p.age;
+  }
+  fclose(f);
+  fscanfSecs = now() - start;
+  printf("%s: %.0f MB, %zu pets, warm page cache\n", path, fileMb, expectPets);
+  printf("%-8s %7s %8s %10s %8s %8s\n", "method", "threads", "seconds", "Mpets/s", "MB/s",
+         "speedup");
+  report("fscanf", 1, fscanfSecs, expectPets, expectSum);
+
+  int best = csvPickIsa();
+  CsvStats cs;
+  for(int isa = CSV_SCALAR; isa <= best; isa++){
+    struct totals t = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+    csvIsa = isa;
+    start = now();
+    if(csvScanPets(path, 1, addUp, &t, &cs) == -1){
+      perror(path);
+      return 1;
+    }
+    report(csvIsaName(isa), 1, now() - start, t.pets, t.ageSum);
+  }
+  csvIsa = best;
+  for(int threads = 2; threads <= maxThreads; threads *= 2){
+    struct totals t = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+    start = now();
+    csvScanPets(path, threads, addUp, &t, &cs);
+    report(csvIsaName(best), threads, now() - start, t.pets, t.ageSum);
+  }
+
+  long long memory = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  if((long long)(expectPets * sizeof(struct petData)) > memory / 2){
+    printf("load     skipped: %zu pets take %.1f GB as structs; try -s %lld\n", expectPets,
+           expectPets * sizeof(struct petData) / 1e9,
+           sizeMb * (memory / 2) / (long long)(expectPets * sizeof(struct petData)));
+    return 0;
+  }
+  for(int threads = 1; threads <= maxThreads; threads *= 2){
+    struct petData* pets;
+    size_t count;
+    start = now();
+    if(csvLoadPets(path, threads, &pets, &count, &cs) == -1){
+      perror(path);
+      return 1;
+    }
+    double secs = now() - start;
+    long long sum = 0;
+    for(size_t i = 0; i < count; i++){
+      sum += pets[i].age;
+    }
+    report("load", threads, secs, count, sum);
+    free(pets);
+  }
+  return 0;
+}
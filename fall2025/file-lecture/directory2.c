@@ -0,0 +1,362 @@
+/*
+ directory2.c: directory1.c for whole trees, on every core.
+
+ directory1.c lists one directory with readdir() and skips whatever is
+ inside its subdirectories. This walks everything under the directories
+ you give it, like find or du:
+
+   - directories are read with getdents64() into a 256KB buffer, so one
+     system call returns thousands of entries (readdir() asks for 32KB)
+   - each entry's d_type says whether it's a file, a directory or a link,
+     so nothing is stat()ed just to find out. Only filesystems that leave
+     d_type as DT_UNKNOWN cost a statx() per entry, and sizes (-s) cost a
+     statx() per file, asking for just the size and block count
+   - every thread has a deque of directories still to read. It pushes the
+     subdirectories it finds onto the bottom of its own deque and pops from
+     the bottom too (depth first, so the directories it just saw are still
+     in the cache). A thread with nothing left steals from the top of
+     someone else's deque: the oldest entry, usually the biggest subtree,
+     so a steal buys a lot of work
+
+ Compile: gcc -Wall -g -pthread directory2.c -o directory2
+ Usage: ./directory2 [-j threads] [-s] [-p] [directory ...]
+        (-s adds up sizes, -p prints every path; the current directory if
+        none is given)
+*/
+
+#define _GNU_SOURCE   // statx()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>    // DT_DIR and friends
+
+#define MAX_THREADS 64
+#define DENTS_SIZE (256 * 1024)
+#define OUT_SIZE (64 * 1024)
+
+// What getdents64() fills its buffer with (glibc has no struct for it)
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;   // Bytes to the next entry
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Directories one thread still has to read. lock guards everything
+struct deque {
+  pthread_mutex_t lock;
+  char** paths;
+  size_t cap;       // A power of two
+  size_t top;       // Thieves take from here
+  size_t bottom;    // The owner pushes and pops here
+};
+
+struct counts {
+  long files, dirs, links, other, errors;
+  long long bytes, blocks;
+  long getdents, statx;
+};
+
+struct worker {
+  int id;
+  pthread_t tid;
+  struct deque dq;
+  struct counts n;
+  char* dents;      // getdents64() buffer
+  char out[OUT_SIZE];   // -p: paths waiting to be printed
+  size_t outLen;
+};
+
+int numThreads;
+int wantSizes = 0;
+int printPaths = 0;
+struct worker workers[MAX_THREADS];
+
+// Directories pushed but not finished; 0 means the walk is over
+long pending = 0;
+pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+int sleepers = 0;
+pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void push(struct worker* w, char* path){
+  __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+  struct deque* d = &w->dq;
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom - d->top == d->cap){
+    size_t newCap = d->cap ? d->cap * 2 : 64;
+    char** bigger = malloc(newCap * sizeof(char*));
+    for(size_t i = d->top; i < d->bottom; i++){
+      bigger[i & (newCap - 1)] = d->paths[i & (d->cap - 1)];
+    }
+    free(d->paths);
+    d->paths = bigger;
+    d->cap = newCap;
+  }
+  d->paths[d->bottom++ & (d->cap - 1)] = path;
+  pthread_mutex_unlock(&d->lock);
+
+  if(__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0){
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_signal(&workCond);
+    pthread_mutex_unlock(&idleLock);
+  }
+}
+
+// The owner's end: the newest directory
+char* popBottom(struct deque* d){
+  char* path = NULL;
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom > d->top){
+    path = d->paths[--d->bottom & (d->cap - 1)];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return path;
+}
+
+// A thief's end: the oldest directory
+char* stealTop(struct deque* d){
+  char* path = NULL;
+  pthread_mutex_lock(&d->lock);
+  if(d->bottom > d->top){
+    path = d->paths[d->top++ & (d->cap - 1)];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return path;
+}
+
+// Next directory for w: its own, or one stolen from the others in turn
+char* findWork(struct worker* w){
+  char* path = popBottom(&w->dq);
+  for(int i = 1; !path && i < numThreads; i++){
+    path = stealTop(&workers[(w->id + i) % numThreads].dq);
+  }
+  return path;
+}
+
+void emit(struct worker* w, const char* path, size_t len){
+  if(w->outLen + len + 1 > OUT_SIZE){
+    pthread_mutex_lock(&outLock);
+    fwrite(w->out, 1, w->outLen, stdout);
+    pthread_mutex_unlock(&outLock);
+    w->outLen = 0;
+  }
+  memcpy(w->out + w->outLen, path, len);
+  w->out[w->outLen + len] = '\n';
+  w->outLen += len + 1;
+}
+
+// Ask only for what we need: the type, and the size if -s
+int statEntry(struct worker* w, int dirFd, const char* name, struct statx* sx){
+  unsigned mask = STATX_TYPE | (wantSizes ? STATX_SIZE | STATX_BLOCKS : 0);
+  w->n.statx++;
+  if(statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, sx) == -1){
+    w->n.errors++;
+    return -1;
+  }
+  return 0;
+}
+
+// Read one directory: count what's in it and queue its subdirectories
+void walkDir(struct worker* w, char* path){
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if(fd == -1){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    w->n.errors++;
+    return;
+  }
+  size_t pathLen = strlen(path);
+  while(1){
+    long n = syscall(SYS_getdents64, fd, w->dents, DENTS_SIZE);
+    w->n.getdents++;
+    if(n <= 0){
+      if(n < 0){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        w->n.errors++;
+      }
+      break;
+    }
+    for(long off = 0; off < n; ){
+      struct linux_dirent64* e = (struct linux_dirent64*)(w->dents + off);
+      off += e->d_reclen;
+      const char* name = e->d_name;
+      if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+        continue;
+      }
+
+      int type = e->d_type;
+      struct statx sx;
+      int haveStat = 0;
+      if(type == DT_UNKNOWN || (wantSizes && type == DT_REG)){
+        if(statEntry(w, fd, name, &sx) == -1){
+          continue;
+        }
+        haveStat = 1;
+        type = S_ISDIR(sx.stx_mode) ? DT_DIR : S_ISREG(sx.stx_mode) ? DT_REG
+             : S_ISLNK(sx.stx_mode) ? DT_LNK : DT_UNKNOWN;
+      }
+
+      size_t nameLen = strlen(name);
+      char* child = NULL;
+      if(type == DT_DIR || printPaths){
+        child = malloc(pathLen + nameLen + 2);
+        memcpy(child, path, pathLen);
+        child[pathLen] = '/';
+        memcpy(child + pathLen + 1, name, nameLen + 1);
+        if(printPaths){
+          emit(w, child, pathLen + nameLen + 1);
+        }
+      }
+      if(type == DT_DIR){
+        w->n.dirs++;
+        push(w, child);
+        continue;
+      }
+      free(child);
+      if(type == DT_REG){
+        w->n.files++;
+        if(haveStat && wantSizes){
+          w->n.bytes += sx.stx_size;
+          w->n.blocks += sx.stx_blocks;
+        }
+      } else if(type == DT_LNK){
+        w->n.links++;
+      } else {
+        w->n.other++;
+      }
+    }
+  }
+  close(fd);
+}
+
+void* walker(void* arg){
+  struct worker* w = arg;
+  w->dents = malloc(DENTS_SIZE);
+  while(1){
+    char* path = findWork(w);
+    if(path){
+      walkDir(w, path);
+      free(path);
+      __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    // Nothing to take. Either the walk is over, or the others are still
+    // reading directories that will give us more
+    if(__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0){
+      break;
+    }
+    pthread_mutex_lock(&idleLock);
+    sleepers++;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 1000000;     // Recheck every 1ms in case we missed a push
+    if(until.tv_nsec >= 1000000000){
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&workCond, &idleLock, &until);
+    sleepers--;
+    pthread_mutex_unlock(&idleLock);
+  }
+
+  // The last thread out wakes the rest
+  pthread_mutex_lock(&idleLock);
+  pthread_cond_broadcast(&workCond);
+  pthread_mutex_unlock(&idleLock);
+  if(w->outLen){
+    pthread_mutex_lock(&outLock);
+    fwrite(w->out, 1, w->outLen, stdout);
+    pthread_mutex_unlock(&outLock);
+  }
+  free(w->dents);
+  return NULL;
+}
+
+int main(int argc, char* argv[]){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  numThreads = cpus > 0 ? cpus : 1;
+  int opt;
+  while((opt = getopt(argc, argv, "j:sp")) != -1){
+    if(opt == 'j' && atoi(optarg) > 0){
+      numThreads = atoi(optarg);
+    } else if(opt == 's'){
+      wantSizes = 1;
+    } else if(opt == 'p'){
+      printPaths = 1;
+    } else {
+      fprintf(stderr, "Usage: %s [-j threads] [-s] [-p] [directory ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(numThreads > MAX_THREADS){
+    numThreads = MAX_THREADS;
+  }
+
+  for(int i = 0; i < numThreads; i++){
+    workers[i].id = i;
+    pthread_mutex_init(&workers[i].dq.lock, NULL);
+  }
+  // The starting directories go to the first thread; the rest steal them
+  if(optind == argc){
+    push(&workers[0], strdup("."));
+  }
+  for(int i = optind; i < argc; i++){
+    size_t len = strlen(argv[i]);
+    while(len > 1 && argv[i][len - 1] == '/') len--;
+    push(&workers[0], strndup(argv[i], len));
+  }
+
+  double start = now();
+  for(int i = 0; i < numThreads; i++){
+    if(pthread_create(&workers[i].tid, NULL, walker, &workers[i]) != 0){
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  struct counts total = {0};
+  for(int i = 0; i < numThreads; i++){
+    pthread_join(workers[i].tid, NULL);
+    struct counts* c = &workers[i].n;
+    total.files += c->files;
+    total.dirs += c->dirs;
+    total.links += c->links;
+    total.other += c->other;
+    total.errors += c->errors;
+    total.bytes += c->bytes;
+    total.blocks += c->blocks;
+    total.getdents += c->getdents;
+    total.statx += c->statx;
+    free(workers[i].dq.paths);
+  }
+  double secs = now() - start;
+  fflush(stdout);
+
+  long entries = total.files + total.dirs + total.links + total.other;
+  fprintf(stderr, "%ld entries: %ld files, %ld directories, %ld symlinks, %ld other",
+          entries, total.files, total.dirs, total.links, total.other);
+  if(total.errors){
+    fprintf(stderr, " (%ld errors)", total.errors);
+  }
+  fprintf(stderr, "\n");
+  if(wantSizes){
+    fprintf(stderr, "%lld bytes in files, %lld bytes on disk\n", total.bytes,
+            total.blocks * 512);
+  }
+  fprintf(stderr, "%.3f s with %d threads: %ld getdents64, %ld statx\n", secs, numThreads,
+          total.getdents, total.statx);
+  return total.errors ? 1 : 0;
+}
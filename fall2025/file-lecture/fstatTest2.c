@@ -0,0 +1,177 @@
+/*
+ fstatTest2.c: fstatTest.c for thousands of paths, asked about again and
+ again, through stat_cache.h.
+
+ Collects every regular file under the directories you give it (or /usr/include),
+ then looks up each one's size and modification time, rounds times over:
+
+   stat()         one stat() per path per round, like fstatTest.c
+   cache          stat_cache.h: the first round sends all the paths to the
+                  kernel in io_uring batches, later rounds are hash lookups
+   cache, no ring the same, but the first round makes one statx() per path
+
+ Then it shows invalidation: it writes to a file in a watched directory and
+ times how long until the cache reports the new size.
+
+ Compile: gcc -Wall -g -O2 -pthread fstatTest2.c -o fstatTest2
+ Usage: ./fstatTest2 [-r rounds] [directory ...]
+*/
+
+#define _GNU_SOURCE   // statx(), nftw()'s FTW_PHYS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "stat_cache.h"
+
+char** paths = NULL;
+size_t numPaths = 0;
+size_t pathCap = 0;
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int addPath(const char* path, const struct stat* st, int type, struct FTW* ftw){
+  if(type != FTW_F){
+    return 0;
+  }
+  if(numPaths == pathCap){
+    pathCap = pathCap ? pathCap * 2 : 1024;
+    paths = realloc(paths, pathCap * sizeof(char*));
+  }
+  paths[numPaths++] = strdup(path);
+  return 0;
+}
+
+// Every path, every round, through the cache; returns the time for each round
+void cacheRounds(int useRing, int rounds, double* firstRound, double* laterRounds,
+                 ScStats* stats){
+  StatCache sc;
+  if(scOpen(&sc, useRing) == -1){
+    perror("scOpen");
+    exit(1);
+  }
+  struct statx* out = malloc(numPaths * sizeof(struct statx));
+  int* errs = malloc(numPaths * sizeof(int));
+  *laterRounds = 0;
+  for(int r = 0; r < rounds; r++){
+    double start = now();
+    scStatBatch(&sc, (const char* const*)paths, numPaths, STATX_SIZE | STATX_MTIME, out, errs);
+    if(r == 0){
+      *firstRound = now() - start;
+    } else {
+      *laterRounds += now() - start;
+    }
+  }
+  scStats(&sc, stats);
+  scClose(&sc);
+  free(out);
+  free(errs);
+}
+
+int main(int argc, char* argv[]){
+  int rounds = 10;
+  int opt;
+  while((opt = getopt(argc, argv, "r:")) != -1){
+    if(opt == 'r' && atoi(optarg) > 1){
+      rounds = atoi(optarg);
+    } else {
+      fprintf(stderr, "Usage: %s [-r rounds] [directory ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(optind == argc){
+    nftw("/usr/include", addPath, 64, FTW_PHYS);
+  }
+  for(int i = optind; i < argc; i++){
+    if(nftw(argv[i], addPath, 64, FTW_PHYS) == -1){
+      perror(argv[i]);
+      return 1;
+    }
+  }
+  if(numPaths == 0){
+    fprintf(stderr, "No files found\n");
+    return 1;
+  }
+
+  // stat() every path every round
+  struct stat st;
+  double start = now();
+  long long total = 0;
+  for(int r = 0; r < rounds; r++){
+    for(size_t i = 0; i < numPaths; i++){
+      if(stat(paths[i], &st) == 0){
+        total += st.st_size;
+      }
+    }
+  }
+  double plain = now() - start;
+
+  printf("%zu files, %d rounds\n", numPaths, rounds);
+  printf("%-16s %12s %12s   %s\n", "", "first round", "each later", "");
+  printf("%-16s %10.1f ms %10.1f ms   %zu stat() calls a round\n", "stat()",
+         plain / rounds * 1e3, plain / rounds * 1e3, numPaths);
+  for(int useRing = 1; useRing >= 0; useRing--){
+    double first, later;
+    ScStats s;
+    cacheRounds(useRing, rounds, &first, &later, &s);
+    printf("%-16s %10.1f ms %10.1f ms   ", useRing ? "cache" : "cache, no ring", first * 1e3,
+           later / (rounds - 1) * 1e3);
+    printf("%lu statx, %lu io_uring_enter, %lu hits; %zu paths, %zu inodes, %zu watches\n",
+           s.statxCalls, s.enterCalls, s.hits, s.paths, s.inodes, s.watches);
+  }
+
+  // Change a file under the cache and see how long the cache takes to notice
+  char dir[] = "/tmp/fstatTest2.XXXXXX";
+  if(!mkdtemp(dir)){
+    perror("mkdtemp");
+    return 1;
+  }
+  char file[64];
+  snprintf(file, sizeof(file), "%s/watched.txt", dir);
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  StatCache sc;
+  scOpen(&sc, 1);
+  struct statx sx;
+  scStat(&sc, file, STATX_SIZE, &sx);
+  long long before = sx.stx_size;
+  write(fd, "hello\n", 6);
+  start = now();
+  int polls = 0;
+  do {
+    scStat(&sc, file, STATX_SIZE, &sx);
+    polls++;
+  } while(sx.stx_size == before && now() - start < 1);
+  printf("\nWrote 6 bytes to %s: cache said %lld, then %lld bytes after %.0f us (%d lookups)\n",
+         file, before, (long long)sx.stx_size, (now() - start) * 1e6, polls);
+
+  // A missing file is cached as missing, until it's created
+  char missing[64];
+  snprintf(missing, sizeof(missing), "%s/later.txt", dir);
+  int r1 = scStat(&sc, missing, STATX_SIZE, &sx);
+  close(open(missing, O_WRONLY | O_CREAT, 0644));
+  start = now();
+  int r2;
+  while((r2 = scStat(&sc, missing, STATX_SIZE, &sx)) == -1 && now() - start < 1){
+  }
+  printf("%s: %s, then %s after %.0f us\n", missing, r1 == 0 ? "found" : "missing",
+         r2 == 0 ? "found" : "still missing", (now() - start) * 1e6);
+
+  scClose(&sc);
+  close(fd);
+  unlink(file);
+  unlink(missing);
+  rmdir(dir);
+  for(size_t i = 0; i < numPaths; i++){
+    free(paths[i]);
+  }
+  free(paths);
+  return total < 0;
+}
@@ -0,0 +1,507 @@
+/*
+ lineEditor2.c: lineEditor.c, but saving doesn't rewrite the whole file.
+
+ lineEditor.c saves by truncating the file to 0 and fputs()ing every line
+ back, so saving a 40MB file after changing one line writes 40MB, and if
+ the program dies in the middle of that the file is gone.
+
+ Here every edit is appended to <file>.journal as soon as you make it:
+
+   EDJ1 <inode of the file>          (header, written once)
+   R 12 5                            (op, line number, length of text)
+   hello                             (the text)
+
+ and fdatasync()'d, so it is safe on disk right away and costs one tiny
+ write. If the editor crashes, the next run replays the journal on top of
+ the file. The header names the file's inode so a journal is never
+ replayed onto a different version of the file.
+
+ When you quit (or once the journal passes 1MB), the journal is folded into
+ the file ("compaction"):
+   - a new copy is written to <file>.tmp and rename()d over the file, so
+     the file is always either all old or all new
+   - the lines before the first one you changed are copied by the kernel
+     with copy_file_range(); only the lines from there on are written out
+
+ Opening doesn't read the file either. lineEditor.c fgets()es every line
+ into its own malloc() before showing anything, so a 2GB log takes seconds
+ and 2GB more memory. Here the file is mmap()ed and we only find where each
+ line starts, scanning 16 or 32 bytes at a time for '\n' with SSE2/AVX2
+ (plain C on other CPUs). A line points straight into the mapping until you
+ edit it; only then does it get a malloc()ed copy.
+
+ Compile: gcc -Wall -g lineEditor2.c -o lineEditor2
+ Usage: ./lineEditor2 filename.txt
+*/
+
+#define _GNU_SOURCE   // copy_file_range()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+const int linesize = 1024;
+const long journalLimit = 1024 * 1024;
+
+struct line {
+  const char* text;  // Points into the mapped file until the line is edited
+  int len;           // Not counting the '\n'
+  int owned;         // 1 once text is our own malloc()ed copy
+};
+
+char* path;          // The file we're editing
+const char* map;     // The file, mmap()ed read-only
+size_t mapLen;
+struct line* lines;
+int numLines = 0;
+int capLines = 0;
+int dirty = 0;       // Edits not yet written to the file itself
+int firstDirty;      // First line changed since the file was last written
+FILE* journal;
+long journalBytes = 0;
+
+void growLines(){
+  if(numLines == capLines){
+    capLines = capLines ? capLines * 2 : 1024;
+    lines = realloc(lines, capLines * sizeof(struct line));
+  }
+}
+
+// Our own copy of text (up to its first '\n')
+struct line makeLine(const char* text, int len){
+  struct line l;
+  char* copy = malloc(len + 1);
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  l.text = copy;
+  l.len = len;
+  l.owned = 1;
+  return l;
+}
+
+void freeLine(struct line l){
+  if(l.owned){
+    free((char*)l.text);
+  }
+}
+
+// A line that is still just a view of the mapped file
+void addMappedLine(size_t start, size_t end){
+  growLines();
+  lines[numLines].text = map + start;
+  lines[numLines].len = end - start;
+  lines[numLines].owned = 0;
+  numLines++;
+}
+
+/*
+ Find every '\n' in the mapped file. The SIMD versions compare a whole
+ block against '\n' at once; movemask turns the result into one bit per
+ byte, and __builtin_ctz() finds each set bit (each newline) in turn.
+*/
+size_t scanTail(size_t i, size_t* start){
+  for(; i < mapLen; i++){
+    if(map[i] == '\n'){
+      addMappedLine(*start, i);
+      *start = i + 1;
+    }
+  }
+  return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void indexLinesAvx2(){
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t start = 0, i = 0;
+  for(; i + 32 <= mapLen; i += 32){
+    __m256i block = _mm256_loadu_si256((const __m256i*)(map + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+    while(mask){
+      size_t pos = i + __builtin_ctz(mask);
+      addMappedLine(start, pos);
+      start = pos + 1;
+      mask &= mask - 1;   // Clear the lowest set bit
+    }
+  }
+  scanTail(i, &start);
+  if(start < mapLen) addMappedLine(start, mapLen);   // Last line, no '\n'
+}
+
+void indexLinesSse2(){
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t start = 0, i = 0;
+  for(; i + 16 <= mapLen; i += 16){
+    __m128i block = _mm_loadu_si128((const __m128i*)(map + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+    while(mask){
+      size_t pos = i + __builtin_ctz(mask);
+      addMappedLine(start, pos);
+      start = pos + 1;
+      mask &= mask - 1;
+    }
+  }
+  scanTail(i, &start);
+  if(start < mapLen) addMappedLine(start, mapLen);
+}
+#endif
+
+void indexLines(){
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("avx2")){
+    indexLinesAvx2();
+  } else {
+    indexLinesSse2();
+  }
+#else
+  size_t start = 0;
+  scanTail(0, &start);
+  if(start < mapLen) addMappedLine(start, mapLen);
+#endif
+}
+
+void startJournal(ino_t ino){
+  ftruncate(fileno(journal), 0);
+  fseek(journal, 0, SEEK_SET);
+  journalBytes = fprintf(journal, "EDJ1 %lu\n", (unsigned long)ino);
+  fflush(journal);
+  fdatasync(fileno(journal));
+}
+
+// Append one edit and make sure it's on disk before going on
+void logEdit(char op, int line, const char* text, int len){
+  journalBytes += fprintf(journal, "%c %d %d\n%.*s\n", op, line, len, len, text);
+  fflush(journal);
+  fdatasync(fileno(journal));
+  dirty = 1;
+  if(line < firstDirty){
+    firstDirty = line;
+  }
+}
+
+// Replay the journal, if it belongs to this version of the file
+void replayJournal(ino_t ino){
+  char jname[PATH_MAX];
+  snprintf(jname, sizeof(jname), "%s.journal", path);
+  journal = fopen(jname, "a+");
+  if(journal == NULL){
+    perror(jname);
+    exit(1);
+  }
+  fseek(journal, 0, SEEK_SET);
+
+  unsigned long owner = 0;
+  int replayed = 0;
+  long good = 0;
+  char header[64];
+  if(fgets(header, sizeof(header), journal) && sscanf(header, "EDJ1 %lu", &owner) == 1 &&
+     owner == ino){
+    good = ftell(journal);
+    char op;
+    int line, len;
+    char text[linesize];
+    while(fgets(header, sizeof(header), journal) &&
+          sscanf(header, "%c %d %d", &op, &line, &len) == 3 && len >= 0 && len < linesize){
+      // A record cut short by a crash is ignored
+      if(len > 0 && fread(text, 1, len, journal) != (size_t)len) break;
+      if(fgetc(journal) != '\n') break;
+      if(op == 'I' && line >= 0 && line <= numLines){
+        growLines();
+        memmove(&lines[line + 1], &lines[line], (numLines - line) * sizeof(struct line));
+        lines[line] = makeLine(text, len);
+        numLines++;
+      } else if(op == 'D' && line >= 0 && line < numLines){
+        freeLine(lines[line]);
+        memmove(&lines[line], &lines[line + 1], (numLines - line - 1) * sizeof(struct line));
+        numLines--;
+      } else if(op == 'R' && line >= 0 && line < numLines){
+        freeLine(lines[line]);
+        lines[line] = makeLine(text, len);
+      } else {
+        break;
+      }
+      if(line < firstDirty) firstDirty = line;
+      dirty = 1;
+      replayed++;
+      good = ftell(journal);
+    }
+  }
+  if(replayed > 0){
+    printf("Recovered %d edits from %s\n", replayed, jname);
+    ftruncate(fileno(journal), good);   // Drop any half-written record
+    journalBytes = good;
+  } else {
+    startJournal(ino);
+  }
+}
+
+// Copy the first len bytes of src into dst without bringing them into
+// our memory
+int copyPrefix(int src, int dst, long len){
+  loff_t in = 0, out = 0;
+  while(in < len){
+    ssize_t n = copy_file_range(src, &in, dst, &out, len - in, 0);
+    if(n > 0) continue;
+    if(n == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL)) return -1;
+    char buf[65536];   // No copy_file_range() here: do it by hand
+    while(in < len){
+      n = pread(src, buf, len - in < (long)sizeof(buf) ? len - in : (long)sizeof(buf), in);
+      if(n <= 0 || pwrite(dst, buf, n, out) != n) return -1;
+      in += n;
+      out += n;
+    }
+  }
+  return 0;
+}
+
+// fsync() the directory holding path, so a rename() in it is on disk too
+int syncDir(const char* path){
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char* slash = strrchr(dir, '/');
+  if(slash == NULL){
+    strcpy(dir, ".");
+  } else if(slash == dir){
+    dir[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if(fd < 0) return -1;
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+// Fold the journal into the file
+void compact(){
+  if(!dirty) return;
+
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  struct stat st;
+  if(stat(path, &st) < 0){
+    perror(path);
+    return;
+  }
+
+  long prefix = 0;
+  for(int i = 0; i < firstDirty && i < numLines; i++){
+    prefix += lines[i].len + 1;
+  }
+  if(firstDirty > 0 && prefix > st.st_size){
+    // The file's last line had no '\n'; write that line out again too
+    firstDirty--;
+    prefix -= lines[firstDirty].len + 1;
+  }
+
+  int src = open(path, O_RDONLY);
+  int dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if(src < 0 || dst < 0 || copyPrefix(src, dst, prefix) < 0){
+    perror("compact");
+    if(src >= 0) close(src);
+    if(dst >= 0){
+      close(dst);
+      unlink(tmp);
+    }
+    return;
+  }
+  close(src);
+
+  FILE* out = fdopen(dst, "w");
+  if(out == NULL){
+    perror("compact");
+    close(dst);
+    unlink(tmp);
+    return;
+  }
+  // Any failed write (disk full, file size limit...) leaves a short copy:
+  // throw it away and keep the journal, which still has every edit
+  int ok = fseek(out, prefix, SEEK_SET) == 0;
+  for(int i = firstDirty; ok && i < numLines; i++){
+    ok = fwrite(lines[i].text, 1, lines[i].len, out) == (size_t)lines[i].len &&
+         fputc('\n', out) != EOF;
+  }
+  ok = ok && fflush(out) == 0 && fdatasync(dst) == 0 && fstat(dst, &st) == 0;
+  if(!ok) perror("compact");
+  if(fclose(out) == EOF && ok){
+    perror("compact");
+    ok = 0;
+  }
+  if(!ok){
+    unlink(tmp);
+    return;
+  }
+
+  // From here on the file holds every edit. If we crash before the journal
+  // is reset, its header names the old inode and it won't be replayed
+  if(rename(tmp, path) < 0){
+    perror("rename");
+    unlink(tmp);
+    return;
+  }
+  // Until the directory is synced the rename may not survive a crash, and
+  // then the journal is what brings the edits back
+  if(syncDir(path) < 0){
+    perror("compact");
+    return;
+  }
+  startJournal(st.st_ino);
+  dirty = 0;
+  firstDirty = numLines;
+}
+
+void cleanUp(){
+  compact();
+  fclose(journal);
+  if(!dirty){
+    // Everything is in the file; keep the journal if compaction failed
+    char jname[PATH_MAX];
+    snprintf(jname, sizeof(jname), "%s.journal", path);
+    unlink(jname);
+  }
+  for(int i = 0; i < numLines; i++){
+    freeLine(lines[i]);
+  }
+  free(lines);
+  if(map){
+    munmap((void*)map, mapLen);
+  }
+}
+
+void printFile(){
+  printf("The state of the file is: \n");
+  for(int i = 0; i < numLines; i++){
+    printf("%d: %.*s\n", i, lines[i].len, lines[i].text);
+  }
+}
+
+void insLine(int line){
+  if(line < 0 || line > numLines){
+    printf("No such line\n");
+    return;
+  }
+  char* newLine = malloc(linesize * sizeof(char));
+  int c;
+  printf("New text to insert at line %d:\n", line);
+  while((c = getchar()) != '\n' && c != EOF);
+  if(fgets(newLine, linesize, stdin) == NULL){
+    free(newLine);
+    return;
+  }
+
+  growLines();
+  memmove(&lines[line + 1], &lines[line], (numLines - line) * sizeof(struct line));
+  lines[line] = makeLine(newLine, strcspn(newLine, "\n"));
+  numLines++;
+  free(newLine);
+  logEdit('I', line, lines[line].text, lines[line].len);
+}
+
+void delLine(int line){
+  if(line < 0 || line >= numLines){
+    printf("No such line\n");
+    return;
+  }
+  freeLine(lines[line]);
+  memmove(&lines[line], &lines[line + 1], (numLines - line - 1) * sizeof(struct line));
+  numLines--;
+  logEdit('D', line, "", 0);
+}
+
+void editLine(int line){
+  if(line < 0 || line >= numLines){
+    printf("No such line\n");
+    return;
+  }
+  printf("Type the text you want to replace line %d:\n", line);
+  int c;
+  while((c = getchar()) != '\n' && c != EOF);
+  char* newLine = malloc(linesize * sizeof(char));
+  if(fgets(newLine, linesize, stdin) == NULL){
+    free(newLine);
+    return;
+  }
+  freeLine(lines[line]);
+  lines[line] = makeLine(newLine, strcspn(newLine, "\n"));
+  free(newLine);
+  logEdit('R', line, lines[line].text, lines[line].len);
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 2){
+    printf("Usage: %s filename.txt\n", argv[0]);
+    return 1;
+  }
+  path = argv[1];
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    perror(path);
+    return 1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  mapLen = st.st_size;
+  if(mapLen > 0){
+    map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED){
+      perror("mmap");
+      return 1;
+    }
+  }
+  close(fd);   // The mapping doesn't need the descriptor
+  indexLines();
+
+  firstDirty = numLines;
+  replayJournal(st.st_ino);
+
+  int option = 0;
+  while(1){
+    printf("Welcome to our goofy file editor:\n");
+    printFile();
+    printf("\n0: edit a line\n");
+    printf("1: delete a line\n");
+    printf("2: insert a line\n");
+    printf("3: quit\n");
+
+    if(scanf("%d", &option) != 1){
+      option = 3;
+    }
+    int line = -1;
+    switch(option){
+    case 0:
+      printf("Which line to edit?: ");
+      scanf("%d", &line);
+      editLine(line);
+      break;
+    case 1:
+      printf("Which line to delete?: ");
+      scanf("%d", &line);
+      delLine(line);
+      break;
+    case 2:
+      printf("Which line to insert?: ");
+      scanf("%d", &line);
+      insLine(line);
+      break;
+    case 3:
+      printf("Goodbye!\n");
+      cleanUp();
+      return 0;
+    }
+    if(journalBytes > journalLimit){
+      compact();
+    }
+  }
+
+  return 0;
+}
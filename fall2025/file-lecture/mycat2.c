@@ -0,0 +1,254 @@
+/*
+ mycat2.c: mycat.c, but the bytes don't have to pass through us.
+
+ mycat.c read()s 1KB into a stack buffer and write()s it back out, so a
+ 2GB log costs four million system calls and every byte is copied into
+ our memory and back out again. When neither end needs to see the data,
+ the kernel can move it for us, and which call does that depends on what
+ stdout is:
+
+   a regular file       copy_file_range(): file to file inside the kernel
+                        (a block copy, or just sharing extents on btrfs/xfs)
+   a pipe               splice(): the file's page-cache pages go into the
+                        pipe without being copied (also used when stdin is
+                        a pipe). We grow the pipe to 1MB first, so each
+                        splice() moves 16 times as much
+   a socket (or other)  sendfile(): page cache straight to the socket
+
+ Each call moves up to 1GB at a time, so a 2GB file takes a handful of
+ calls. If a call isn't supported for this pair of files (EINVAL, EXDEV,
+ ...) before it has moved anything, we drop to the next one, and last to
+ read()/write() with a buffer of 64 blocks of the file's st_blksize
+ (aligned to a block) instead of 1KB.
+
+ Every regular input gets posix_fadvise(SEQUENTIAL), which tells the
+ kernel to read ahead more aggressively.
+
+ Compile: gcc -Wall -g mycat2.c -o mycat2
+ Usage: ./mycat2 [-m auto|copy|splice|sendfile|read] [-s] [file ...]
+        (no files or "-" reads stdin; -m forces one path, -s prints the
+        path used, the number of system calls and the speed to stderr)
+*/
+
+#define _GNU_SOURCE   // copy_file_range(), splice()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define CHUNK (1L << 30)  // Most one kernel copy is asked to move
+#define BUF_BLOCKS 64
+#define PIPE_SIZE (1 << 20)  // Grow an output pipe to this (the default limit)
+
+enum { AUTO, COPY, SPLICE, SENDFILE, READ };
+const char* pathNames[] = {"auto", "copy_file_range", "splice", "sendfile", "read/write"};
+
+int mode = AUTO;
+long syscalls = 0;
+long long totalBytes = 0;
+int usedPath[READ + 1];   // Which paths actually moved data, for -s
+
+char* buf = NULL;         // For the read()/write() path, made on first use
+size_t bufSize = 0;
+
+/*
+ Move the rest of in to out with one of the kernel copies. Returns 0 when
+ it's all gone, 1 if this call can't handle these files (nothing moved
+ yet, so the caller can try another), or -1 on a real error.
+*/
+int kernelCopy(int path, int in, int out){
+  long long moved = 0;
+  while(1){
+    ssize_t n;
+    if(path == COPY){
+      n = copy_file_range(in, NULL, out, NULL, CHUNK, 0);
+    } else if(path == SPLICE){
+      n = splice(in, NULL, out, NULL, CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else {
+      n = sendfile(out, in, NULL, CHUNK);
+    }
+    syscalls++;
+    if(n == 0){
+      break;
+    }
+    if(n < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      if(moved == 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                        errno == EOPNOTSUPP || errno == EBADF)){
+        return 1;
+      }
+      return -1;
+    }
+    moved += n;
+  }
+  totalBytes += moved;
+  usedPath[path] = 1;
+  return 0;
+}
+
+// Write all len bytes, however many write()s that takes
+int writeAll(int fd, const char* data, size_t len){
+  while(len > 0){
+    ssize_t n = write(fd, data, len);
+    syscalls++;
+    if(n < 0){
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int readCopy(int in, int out, struct stat* inSt, struct stat* outSt){
+  if(!buf){
+    size_t block = inSt->st_blksize > outSt->st_blksize ? inSt->st_blksize : outSt->st_blksize;
+    if(block < 512) block = 4096;
+    bufSize = block * BUF_BLOCKS;
+    if(posix_memalign((void**)&buf, block, bufSize) != 0){
+      return -1;
+    }
+  }
+  ssize_t n;
+  while((n = read(in, buf, bufSize)) != 0){
+    syscalls++;
+    if(n < 0){
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    if(writeAll(out, buf, n) == -1){
+      return -1;
+    }
+    totalBytes += n;
+  }
+  syscalls++;   // The read() that returned 0
+  usedPath[READ] = 1;
+  return 0;
+}
+
+// The paths worth trying for these two files, best first. splice() needs
+// a pipe on one side, and is the only one that can read from a pipe
+void pathsFor(struct stat* inSt, struct stat* outSt, int* paths){
+  int n = 0;
+  if(mode != AUTO){
+    paths[n++] = mode;
+  } else if(S_ISFIFO(inSt->st_mode) || S_ISFIFO(outSt->st_mode)){
+    paths[n++] = SPLICE;
+  } else if(S_ISREG(outSt->st_mode)){
+    paths[n++] = COPY;
+    paths[n++] = SENDFILE;
+  } else {
+    paths[n++] = SENDFILE;
+  }
+  if(paths[n - 1] != READ){
+    paths[n++] = READ;
+  }
+  paths[n] = -1;
+}
+
+int catFile(int in, const char* name, struct stat* outSt){
+  struct stat inSt;
+  if(fstat(in, &inSt) == -1){
+    perror(name);
+    return -1;
+  }
+  syscalls++;
+  if(S_ISREG(inSt.st_mode)){
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    syscalls++;
+  }
+
+  int paths[4];
+  pathsFor(&inSt, outSt, paths);
+  for(int i = 0; paths[i] != -1; i++){
+    int r = paths[i] == READ ? readCopy(in, STDOUT_FILENO, &inSt, outSt)
+                             : kernelCopy(paths[i], in, STDOUT_FILENO);
+    if(r == 0){
+      return 0;
+    }
+    if(r == -1){
+      break;
+    }
+  }
+  perror(name);
+  return -1;
+}
+
+int main(int argc, char* argv[]){
+  int stats = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "m:s")) != -1){
+    if(opt == 's'){
+      stats = 1;
+    } else if(opt == 'm' && strcmp(optarg, "auto") == 0){
+      mode = AUTO;
+    } else if(opt == 'm' && strcmp(optarg, "copy") == 0){
+      mode = COPY;
+    } else if(opt == 'm' && strcmp(optarg, "splice") == 0){
+      mode = SPLICE;
+    } else if(opt == 'm' && strcmp(optarg, "sendfile") == 0){
+      mode = SENDFILE;
+    } else if(opt == 'm' && strcmp(optarg, "read") == 0){
+      mode = READ;
+    } else {
+      fprintf(stderr, "Usage: %s [-m auto|copy|splice|sendfile|read] [-s] [file ...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct stat outSt;
+  if(fstat(STDOUT_FILENO, &outSt) == -1){
+    perror("stdout");
+    return 1;
+  }
+  syscalls++;
+  if(S_ISFIFO(outSt.st_mode) && mode != READ){
+    // A splice() moves at most a pipe's worth (64KB by default)
+    fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
+    syscalls++;
+  }
+
+  int status = 0;
+  if(optind == argc){
+    status |= catFile(STDIN_FILENO, "stdin", &outSt) == -1;
+  }
+  for(int i = optind; i < argc; i++){
+    if(strcmp(argv[i], "-") == 0){
+      status |= catFile(STDIN_FILENO, "stdin", &outSt) == -1;
+      continue;
+    }
+    int fd = open(argv[i], O_RDONLY);
+    syscalls++;
+    if(fd == -1){
+      perror(argv[i]);
+      status = 1;
+      continue;
+    }
+    status |= catFile(fd, argv[i], &outSt) == -1;
+    close(fd);
+    syscalls++;
+  }
+
+  if(stats){
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    for(int p = COPY; p <= READ; p++){
+      if(usedPath[p]) fprintf(stderr, "%s ", pathNames[p]);
+    }
+    fprintf(stderr, "%lld bytes, %ld syscalls, %.3f s, %.0f MB/s\n",
+            totalBytes, syscalls, secs, secs > 0 ? totalBytes / secs / 1e6 : 0);
+  }
+  free(buf);
+  return status;
+}
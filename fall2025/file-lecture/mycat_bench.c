@@ -0,0 +1,217 @@
+/*
+ mycat_bench.c: how fast can mycat and mycat2 push a big file into a file,
+ a pipe and a socket?
+
+ Makes a test file (2GB of log-like lines in /tmp unless you name one),
+ reads it once so it is in the page cache, then runs ./mycat,
+ ./mycat2 -m read and ./mycat2 (which picks copy_file_range(), splice() or
+ sendfile() for the output) with stdout pointed at each kind of output:
+
+   file     /tmp/mycat_bench.out, truncated before each run
+   pipe     we splice() the other end to /dev/null
+   socket   one end of a socketpair(); we read() the other end
+
+ and prints the wall time, the throughput and the system calls each one
+ made. mycat2 counts its own (-s); mycat always uses read() and write() of
+ 1KB, so its count is worked out from the file size.
+
+ Compile: gcc -Wall -g mycat_bench.c -o mycat_bench
+ Usage: ./mycat_bench [-g GB] [file]
+        (run it from this directory after make mycat mycat2)
+*/
+
+#define _GNU_SOURCE   // splice()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+const char* outFile = "/tmp/mycat_bench.out";
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill path with size bytes of numbered log lines, unless it's already there
+int makeInput(const char* path, long long size){
+  struct stat st;
+  if(stat(path, &st) == 0 && st.st_size == size){
+    return 0;
+  }
+  printf("Writing %.1f GB to %s...\n", size / 1e9, path);
+  FILE* f = fopen(path, "w");
+  if(!f){
+    perror(path);
+    return -1;
+  }
+  char line[128];
+  long long written = 0;
+  for(long n = 0; written < size; n++){
+    int len = snprintf(line, sizeof(line),
+                       "2025-10-%02ld 12:%02ld:%02ld host%03ld sshd[%ld]: request %ld served\n",
+                       n % 28 + 1, n / 60 % 60, n % 60, n % 997, n % 65536, n);
+    if(written + len > size){
+      len = size - written;
+    }
+    fwrite(line, 1, len, f);
+    written += len;
+  }
+  fclose(f);
+  return 0;
+}
+
+// Read the file once so every run starts with it in the page cache
+void warmCache(const char* path){
+  int fd = open(path, O_RDONLY);
+  char* buf = malloc(1 << 20);
+  while(read(fd, buf, 1 << 20) > 0){
+  }
+  free(buf);
+  close(fd);
+}
+
+/*
+ Run prog with stdout going to output ("file", "pipe" or "socket") and its
+ stderr captured into report. Returns the wall time, or -1.
+*/
+double runOne(char* const argv[], const char* output, char* report, size_t reportLen){
+  int out = -1, drain = -1;
+  if(strcmp(output, "file") == 0){
+    out = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else if(strcmp(output, "pipe") == 0){
+    int p[2];
+    if(pipe(p) == 0){
+      drain = p[0];
+      out = p[1];
+    }
+  } else {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0){
+      drain = sv[0];
+      out = sv[1];
+    }
+  }
+  int errPipe[2];
+  if(out == -1 || pipe(errPipe) == -1){
+    perror(output);
+    return -1;
+  }
+
+  double start = now();
+  pid_t pid = fork();
+  if(pid == 0){
+    dup2(out, STDOUT_FILENO);
+    dup2(errPipe[1], STDERR_FILENO);
+    close(out);
+    close(errPipe[0]);
+    close(errPipe[1]);
+    if(drain != -1) close(drain);
+    execv(argv[0], argv);
+    perror(argv[0]);
+    exit(127);
+  }
+  close(out);
+  close(errPipe[1]);
+
+  // Keep the pipe or socket empty so the writer never waits on us for long
+  if(drain != -1){
+    int devNull = open("/dev/null", O_WRONLY);
+    if(strcmp(output, "pipe") == 0){
+      while(splice(drain, NULL, devNull, NULL, 1 << 30, SPLICE_F_MOVE) > 0){
+      }
+    } else {
+      char* buf = malloc(1 << 20);
+      while(read(drain, buf, 1 << 20) > 0){
+      }
+      free(buf);
+    }
+    close(devNull);
+    close(drain);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  double elapsed = now() - start;
+
+  ssize_t n = read(errPipe[0], report, reportLen - 1);
+  report[n > 0 ? n : 0] = '\0';
+  report[strcspn(report, "\n")] = '\0';
+  close(errPipe[0]);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+    fprintf(stderr, "%s failed: %s\n", argv[0], report);
+    return -1;
+  }
+  return elapsed;
+}
+
+int main(int argc, char* argv[]){
+  double gb = 2;
+  int opt;
+  while((opt = getopt(argc, argv, "g:")) != -1){
+    if(opt == 'g' && atof(optarg) > 0){
+      gb = atof(optarg);
+    } else {
+      fprintf(stderr, "Usage: %s [-g GB] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+  char* input = "/tmp/mycat_bench.dat";
+  if(optind < argc){
+    input = argv[optind];
+  } else if(makeInput(input, (long long)(gb * 1e9)) == -1){
+    return 1;
+  }
+  struct stat st;
+  if(stat(input, &st) == -1){
+    perror(input);
+    return 1;
+  }
+  warmCache(input);
+
+  const char* outputs[] = {"file", "pipe", "socket"};
+  char* const programs[][5] = {
+    {"./mycat", input, NULL},
+    {"./mycat2", "-s", "-m", "read", input},
+    {"./mycat2", "-s", input, NULL},
+  };
+  const char* names[] = {"mycat", "mycat2 -m read", "mycat2"};
+
+  printf("%.2f GB, warm page cache\n", st.st_size / 1e9);
+  printf("%-7s %-15s %-16s %10s %8s %8s\n", "output", "program", "path", "syscalls",
+         "seconds", "MB/s");
+  for(int o = 0; o < 3; o++){
+    for(int p = 0; p < 3; p++){
+      char* args[6];
+      memcpy(args, programs[p], sizeof(programs[p]));
+      args[5] = NULL;
+      char report[256];
+      double secs = runOne(args, outputs[o], report, sizeof(report));
+      if(secs < 0){
+        continue;
+      }
+      char path[64] = "read/write";
+      long syscalls;
+      if(p == 0){
+        long blocks = (st.st_size + 1023) / 1024;
+        syscalls = 2 * blocks + 1;  // A read() and a write() per 1KB, and the last read()
+      } else {
+        // "<path> <bytes> bytes, <n> syscalls, ..."
+        char* comma = strstr(report, " bytes, ");
+        syscalls = comma ? atol(comma + 8) : 0;
+        sscanf(report, "%63s", path);
+      }
+      printf("%-7s %-15s %-16s %10ld %8.2f %8.0f\n", outputs[o], names[p], path, syscalls,
+             secs, st.st_size / secs / 1e6);
+      fflush(stdout);
+    }
+  }
+  unlink(outFile);
+  return 0;
+}
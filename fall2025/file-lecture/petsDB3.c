@@ -0,0 +1,490 @@
+/*
+ petsDB3.c: petsDB2.c with a binary file you don't have to parse.
+
+ petsDB2.c fscanf()s pets.txt one line at a time every time it runs, and
+ finding a pet means reading them all. Here the pets are converted once
+ into pets.db, laid out so the program can mmap() it and use it as is:
+
+   header        magic, record size, count, and where each part starts
+   records       struct petData as in petsDB2.c (104 bytes), in CSV order
+   name index    one entry per pet, sorted by name: the first 8 bytes of
+                 the name and the record number, so a binary search
+                 compares prefixes in the index and only looks at a record
+                 when they tie
+   age index     (age, record number) pairs, sorted by age then name
+
+ Opening the database is an open(), an fstat() and an mmap(), however many
+ pets there are; the pages come off the disk as they're touched. Finding a
+ pet by name is a binary search, O(log n); listing the pets aged 3 to 5 is a
+ binary search for the first 3 and a walk until the ages pass 5.
+
+ Numbers are stored in this machine's byte order.
+
+ Compile: gcc -Wall -g -O2 petsDB3.c -o petsDB3
+ Usage: ./petsDB3 convert pets.txt pets.db    (CSV to binary)
+        ./petsDB3 find pets.db name
+        ./petsDB3 ages pets.db min max
+        ./petsDB3 list pets.db
+        ./petsDB3 generate pets.csv count       (random pets, for testing)
+        ./petsDB3 bench pets.csv pets.db        (fscanf load vs mmap lookups)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pets_csv.h"     // struct petData, csvFakePet()
+
+#define DB_MAGIC "PETSDB1"
+#define PREFIX_LEN 8
+
+struct dbHeader {
+  char magic[8];
+  uint32_t recordSize;    // sizeof(struct petData) when it was written
+  uint32_t unused;
+  uint64_t count;
+  uint64_t recordsOff;    // Offsets from the start of the file
+  uint64_t namesOff;
+  uint64_t agesOff;
+};
+
+struct nameEntry {
+  char prefix[PREFIX_LEN];    // Not '\0'-terminated if the name is longer
+  uint32_t record;
+  uint32_t unused;
+};
+
+struct ageEntry {
+  int32_t age;
+  uint32_t record;
+};
+
+// An open database: pointers into the mapping
+struct petDB {
+  const char* map;
+  size_t mapLen;
+  uint64_t count;
+  const struct petData* pets;
+  const struct nameEntry* names;
+  const struct ageEntry* ages;
+};
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void printPet(FILE* f, const struct petData* p){
+  fprintf(f, "%s,%s,%d\n", p->name, p->species, p->age);
+}
+
+int readPet(FILE* f, struct petData* p){
+  return fscanf(f, "%49[^,],%49[^,],%d\n", p->name, p->species, &p->age);
+}
+
+/*
+ Split one CSV line into p, cutting names and species at 49 characters like
+ readPet() does. Returns 1, or 0 for a line that isn't name,species,age
+*/
+int parseLine(char* line, struct petData* p){
+  char* comma1 = strchr(line, ',');
+  char* comma2 = comma1 ? strchr(comma1 + 1, ',') : NULL;
+  if(!comma2){
+    return 0;
+  }
+  size_t nameLen = comma1 - line;
+  size_t speciesLen = comma2 - comma1 - 1;
+  if(nameLen > 49) nameLen = 49;
+  if(speciesLen > 49) speciesLen = 49;
+  memset(p, 0, sizeof(*p));   // No stray bytes in the file
+  memcpy(p->name, line, nameLen);
+  memcpy(p->species, comma1 + 1, speciesLen);
+  p->age = atoi(comma2 + 1);
+  return 1;
+}
+
+// For sorting the indexes: the records they point into
+const struct petData* sortPets;
+
+int byName(const void* a, const void* b){
+  const struct nameEntry* x = a;
+  const struct nameEntry* y = b;
+  // Most pairs differ in the first 8 bytes, which are right here
+  int c = strncmp(x->prefix, y->prefix, PREFIX_LEN);
+  if(c == 0 && strnlen(x->prefix, PREFIX_LEN) == PREFIX_LEN){
+    c = strcmp(sortPets[x->record].name, sortPets[y->record].name);
+  }
+  return c ? c : (x->record > y->record) - (x->record < y->record);
+}
+
+int byAge(const void* a, const void* b){
+  const struct ageEntry* x = a;
+  const struct ageEntry* y = b;
+  if(x->age != y->age){
+    return x->age < y->age ? -1 : 1;
+  }
+  return strcmp(sortPets[x->record].name, sortPets[y->record].name);
+}
+
+int writeAll(int fd, const void* data, size_t len){
+  const char* p = data;
+  while(len > 0){
+    ssize_t n = write(fd, p, len);
+    if(n < 0){
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ Read the whole CSV, build both indexes in memory, and write the database
+ to a temporary file that's renamed over dbPath once it's complete, so a
+ crash never leaves half a database behind
+*/
+int convert(const char* csvPath, const char* dbPath){
+  FILE* in = fopen(csvPath, "r");
+  if(!in){
+    perror(csvPath);
+    return 1;
+  }
+  size_t count = 0, cap = 1024;
+  struct petData* pets = malloc(cap * sizeof(struct petData));
+  char line[256];
+  long lineNo = 0;
+  while(fgets(line, sizeof(line), in)){
+    lineNo++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if(line[0] == '\0'){
+      continue;
+    }
+    if(count == cap){
+      cap *= 2;
+      pets = realloc(pets, cap * sizeof(struct petData));
+    }
+    if(!parseLine(line, &pets[count])){
+      fprintf(stderr, "%s:%ld: not name,species,age; skipped\n", csvPath, lineNo);
+      continue;
+    }
+    count++;
+  }
+  fclose(in);
+  if(count > UINT32_MAX){
+    fprintf(stderr, "%s: too many pets\n", csvPath);
+    return 1;
+  }
+
+  struct nameEntry* names = calloc(count ? count : 1, sizeof(struct nameEntry));
+  struct ageEntry* ages = malloc((count ? count : 1) * sizeof(struct ageEntry));
+  for(size_t i = 0; i < count; i++){
+    strncpy(names[i].prefix, pets[i].name, PREFIX_LEN);
+    names[i].record = i;
+    ages[i].age = pets[i].age;
+    ages[i].record = i;
+  }
+  sortPets = pets;
+  qsort(names, count, sizeof(struct nameEntry), byName);
+  qsort(ages, count, sizeof(struct ageEntry), byAge);
+
+  struct dbHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, DB_MAGIC, 8);
+  h.recordSize = sizeof(struct petData);
+  h.count = count;
+  h.recordsOff = sizeof(h);
+  h.namesOff = h.recordsOff + count * sizeof(struct petData);
+  h.agesOff = h.namesOff + count * sizeof(struct nameEntry);
+
+  char tmpPath[4096];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", dbPath);
+  int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1){
+    perror(tmpPath);
+    return 1;
+  }
+  if(writeAll(fd, &h, sizeof(h)) == -1 ||
+     writeAll(fd, pets, count * sizeof(struct petData)) == -1 ||
+     writeAll(fd, names, count * sizeof(struct nameEntry)) == -1 ||
+     writeAll(fd, ages, count * sizeof(struct ageEntry)) == -1 ||
+     fsync(fd) == -1){
+    perror(tmpPath);
+    close(fd);
+    unlink(tmpPath);
+    return 1;
+  }
+  close(fd);
+  if(rename(tmpPath, dbPath) == -1){
+    perror(dbPath);
+    return 1;
+  }
+  printf("%zu pets from %s into %s (%zu bytes)\n", count, csvPath, dbPath,
+         (size_t)h.agesOff + count * sizeof(struct ageEntry));
+  free(pets);
+  free(names);
+  free(ages);
+  return 0;
+}
+
+// Map dbPath and check it's one of ours. Returns 0 or -1
+int openDB(const char* dbPath, struct petDB* db){
+  int fd = open(dbPath, O_RDONLY);
+  if(fd == -1){
+    perror(dbPath);
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1){
+    perror(dbPath);
+    close(fd);
+    return -1;
+  }
+  if((size_t)st.st_size < sizeof(struct dbHeader)){
+    fprintf(stderr, "%s: not a pets database\n", dbPath);
+    close(fd);
+    return -1;
+  }
+  db->mapLen = st.st_size;
+  db->map = mmap(NULL, db->mapLen, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);    // The mapping keeps the file
+  if(db->map == MAP_FAILED){
+    perror(dbPath);
+    return -1;
+  }
+
+  const struct dbHeader* h = (const struct dbHeader*)db->map;
+  uint64_t n = h->count;
+  if(memcmp(h->magic, DB_MAGIC, 8) != 0 || h->recordSize != sizeof(struct petData) ||
+     n > UINT32_MAX || h->recordsOff != sizeof(struct dbHeader) ||
+     h->namesOff != h->recordsOff + n * sizeof(struct petData) ||
+     h->agesOff != h->namesOff + n * sizeof(struct nameEntry) ||
+     h->agesOff + n * sizeof(struct ageEntry) != db->mapLen){
+    fprintf(stderr, "%s: not a pets database, or a damaged one\n", dbPath);
+    munmap((void*)db->map, db->mapLen);
+    return -1;
+  }
+  db->count = n;
+  db->pets = (const struct petData*)(db->map + h->recordsOff);
+  db->names = (const struct nameEntry*)(db->map + h->namesOff);
+  db->ages = (const struct ageEntry*)(db->map + h->agesOff);
+  return 0;
+}
+
+void closeDB(struct petDB* db){
+  munmap((void*)db->map, db->mapLen);
+}
+
+// Compare name with index entry e, touching the record only on a prefix tie
+int compareName(const struct petDB* db, const char* name, const struct nameEntry* e){
+  int c = strncmp(name, e->prefix, PREFIX_LEN);
+  if(c != 0 || strnlen(e->prefix, PREFIX_LEN) < PREFIX_LEN){
+    return c;
+  }
+  return strcmp(name, db->pets[e->record].name);
+}
+
+// Index position of the first pet called name (or where it would go)
+uint64_t findName(const struct petDB* db, const char* name){
+  uint64_t lo = 0, hi = db->count;
+  while(lo < hi){
+    uint64_t mid = lo + (hi - lo) / 2;
+    if(compareName(db, name, &db->names[mid]) > 0){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Index position of the first pet at least age years old
+uint64_t findAge(const struct petDB* db, int age){
+  uint64_t lo = 0, hi = db->count;
+  while(lo < hi){
+    uint64_t mid = lo + (hi - lo) / 2;
+    if(db->ages[mid].age < age){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Print every pet called name; returns how many there were
+int findPets(const struct petDB* db, const char* name, FILE* out){
+  int found = 0;
+  for(uint64_t i = findName(db, name);
+      i < db->count && compareName(db, name, &db->names[i]) == 0; i++){
+    if(out){
+      printPet(out, &db->pets[db->names[i].record]);
+    }
+    found++;
+  }
+  return found;
+}
+
+// Write count pets with made-up names to path
+int generate(const char* path, long count){
+  FILE* f = fopen(path, "w");
+  if(!f){
+    perror(path);
+    return 1;
+  }
+  unsigned seed = CSV_FAKE_SEED;
+  for(long i = 0; i < count; i++){
+    struct petData p;
+    csvFakePet(&seed, i, &p);
+    fprintf(f, "%s,%s,%d\n", p.name, p.species, p.age);
+  }
+  if(fclose(f) != 0){
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ What it costs to answer "how old is <name>?": petsDB2.c's way (fscanf()
+ every line into an array, then search it) against opening the database
+ and binary searching it. The linear search only gets the first
+ SCAN_LOOKUPS names; at 10M pets each one takes a while
+*/
+#define SCAN_LOOKUPS 10
+
+int bench(const char* csvPath, const char* dbPath){
+  const int lookups = 1000;
+  double start = now();
+  FILE* f = fopen(csvPath, "r");
+  if(!f){
+    perror(csvPath);
+    return 1;
+  }
+  size_t count = 0, cap = 1024;
+  struct petData* pets = malloc(cap * sizeof(struct petData));
+  while(1){
+    if(count == cap){
+      cap *= 2;
+      pets = realloc(pets, cap * sizeof(struct petData));
+    }
+    if(readPet(f, &pets[count]) != 3) break;
+    count++;
+  }
+  fclose(f);
+  double loaded = now() - start;
+  if(count == 0){
+    fprintf(stderr, "%s: no pets\n", csvPath);
+    return 1;
+  }
+
+  // Look up names spread through the file, some of them missing
+  char (*wanted)[50] = malloc(lookups * sizeof(*wanted));
+  for(int i = 0; i < lookups; i++){
+    if(i % 10 == 9){
+      snprintf(wanted[i], 50, "nobody%d", i);
+    } else {
+      strcpy(wanted[i], pets[(size_t)i * 7919 % count].name);
+    }
+  }
+  start = now();
+  int scanFound = 0;
+  for(int i = 0; i < SCAN_LOOKUPS; i++){
+    for(size_t j = 0; j < count; j++){
+      if(strcmp(pets[j].name, wanted[i]) == 0) scanFound++;
+    }
+  }
+  double scanned = now() - start;
+
+  start = now();
+  struct petDB db;
+  if(openDB(dbPath, &db) == -1){
+    return 1;
+  }
+  double opened = now() - start;
+  start = now();
+  int dbFound = 0, checkFound = 0;
+  for(int i = 0; i < lookups; i++){
+    dbFound += findPets(&db, wanted[i], NULL);
+    if(i == SCAN_LOOKUPS - 1) checkFound = dbFound;
+  }
+  double searched = now() - start;
+
+  printf("%zu pets, %d lookups (%d found)\n", count, lookups, dbFound);
+  printf("fscanf load         %10.3f s\n", loaded);
+  printf("linear search       %10.3f s   %8.1f us per lookup\n", scanned,
+         scanned / SCAN_LOOKUPS * 1e6);
+  printf("open + mmap         %10.6f s\n", opened);
+  printf("binary search       %10.6f s   %8.2f us per lookup\n", searched,
+         searched / lookups * 1e6);
+  if(scanFound != checkFound){
+    fprintf(stderr, "The two disagree: %d vs %d found\n", scanFound, checkFound);
+    return 1;
+  }
+  closeDB(&db);
+  free(pets);
+  free(wanted);
+  return 0;
+}
+
+void usage(const char* prog){
+  fprintf(stderr, "Usage: %s convert pets.txt pets.db\n"
+                  "       %s find pets.db name\n"
+                  "       %s ages pets.db min max\n"
+                  "       %s list pets.db\n"
+                  "       %s generate pets.csv count\n"
+                  "       %s bench pets.csv pets.db\n", prog, prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 3){
+    usage(argv[0]);
+    return 1;
+  }
+  const char* cmd = argv[1];
+  if(strcmp(cmd, "convert") == 0 && argc == 4){
+    return convert(argv[2], argv[3]);
+  }
+  if(strcmp(cmd, "generate") == 0 && argc == 4 && atol(argv[3]) > 0){
+    return generate(argv[2], atol(argv[3]));
+  }
+  if(strcmp(cmd, "bench") == 0 && argc == 4){
+    return bench(argv[2], argv[3]);
+  }
+
+  struct petDB db;
+  if(strcmp(cmd, "find") == 0 && argc == 4){
+    if(openDB(argv[2], &db) == -1) return 1;
+    int found = findPets(&db, argv[3], stdout);
+    if(!found){
+      printf("No pet called %s\n", argv[3]);
+    }
+    closeDB(&db);
+    return found ? 0 : 1;
+  }
+  if(strcmp(cmd, "ages") == 0 && argc == 5){
+    int min = atoi(argv[3]), max = atoi(argv[4]);
+    if(openDB(argv[2], &db) == -1) return 1;
+    for(uint64_t i = findAge(&db, min); i < db.count && db.ages[i].age <= max; i++){
+      printPet(stdout, &db.pets[db.ages[i].record]);
+    }
+    closeDB(&db);
+    return 0;
+  }
+  if(strcmp(cmd, "list") == 0 && argc == 3){
+    if(openDB(argv[2], &db) == -1) return 1;
+    for(uint64_t i = 0; i < db.count; i++){
+      printPet(stdout, &db.pets[db.names[i].record]);
+    }
+    closeDB(&db);
+    return 0;
+  }
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,1041 @@
+/*
+ petsDB4.c: petsDB2.c where changing a pet costs one small append.
+
+ petsDB2.c keeps the pets in pets2.txt, so changing one pet's age means
+ writing the whole file again. Here the database is a directory of
+ segment files, and every change is appended to the newest one:
+
+   put     an entry (name, species, age) on the end of the active segment
+   delete  a "tombstone" entry saying the name is gone
+
+ Nothing is ever written in place, so writes go to the disk one after
+ another at its sequential speed. An in-memory hash table maps each name
+ to the segment and offset of its newest entry, so a get is one hash
+ lookup and one pread().
+
+ Old versions pile up, so:
+
+   - A segment that reaches SEG_MAX is sealed and a new one is started.
+     With the sealed segment goes a hint file: just the name, offset and
+     length of every entry, without the data.
+   - Once there are COMPACT_SEGS sealed segments, a background thread
+     merges them: it copies only the entries the index still points at
+     into new segments (tombstones and overwritten pets are dropped), moves
+     the index over, and deletes the old files.
+   - Starting up, the index is rebuilt from the hint files, so only the
+     active segment (at most SEG_MAX) is read in full. Segments without a
+     valid hint are scanned instead.
+
+ Every entry carries a CRC-32, so a torn write at the end of the active
+ segment after a crash is found and cut off. Segments are replayed in
+ order of their names, <id>.<part>.seg, and compaction writes its output
+ as parts of the highest id it merged, so the output replays after
+ everything it replaces and before anything written since.
+
+ Compile: gcc -Wall -g -O2 -pthread petsDB4.c -o petsDB4
+ Usage: ./petsDB4 dir put name species age
+        ./petsDB4 dir get name
+        ./petsDB4 dir delete name
+        ./petsDB4 dir list
+        ./petsDB4 dir import pets.txt
+        ./petsDB4 dir compact
+        ./petsDB4 dir stats
+        ./petsDB4 dir bench [puts] [keys]   (updates/s, and startup times)
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "pets_csv.h"
+
+#define SEG_MAX (16 << 20)      // Seal the active segment at this size
+#define COMPACT_SEGS 4          // Sealed segments that start a compaction
+#define WRITE_BUF (256 * 1024)  // Appends are buffered up to this much
+#define MAX_SEGS 4096
+#define HINT_MAGIC 0x544e4948   // "HINT"
+#define TOMBSTONE 1
+
+// On disk, before the name and the species
+struct entryHeader {
+  uint32_t crc;           // Of everything after this field
+  uint8_t nameLen;
+  uint8_t speciesLen;
+  uint8_t flags;          // TOMBSTONE
+  uint8_t unused;
+  int32_t age;
+};
+
+// One entry in a hint file, before the name
+struct hintEntry {
+  uint32_t off;
+  uint16_t len;           // Of the whole entry
+  uint8_t nameLen;
+  uint8_t flags;
+};
+
+// Written after the last hint entry: proof the hint file is complete
+struct hintTrailer {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t crc;           // Of every byte before the trailer
+};
+
+struct segment {
+  int used;               // 2: a compaction output, not in the store yet
+  unsigned long long id;
+  unsigned part;
+  int fd;
+  uint64_t size;          // Bytes in the file (plus the buffer, if active)
+  int sealed;
+};
+
+// Where a name's newest entry is
+struct indexNode {
+  struct indexNode* next;
+  uint64_t hash;
+  uint32_t seg;           // Slot in segs[]
+  uint32_t off;
+  uint16_t len;
+  uint8_t nameLen;
+  char name[];
+};
+
+// A growable byte buffer, for write batching and hint files
+struct buffer {
+  char* data;
+  size_t len;
+  size_t cap;
+};
+
+const char* dir;
+int dirFd;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;     // Everything below
+struct segment segs[MAX_SEGS];
+int active = -1;              // Slot of the segment we append to
+struct buffer writeBuf;       // Appended but not yet written
+uint64_t flushedSize;         // Bytes of the active segment on disk
+struct buffer activeHints;    // Hint entries for the active segment
+
+struct indexNode** buckets;
+size_t numBuckets = 1 << 16;
+size_t numKeys;
+uint64_t liveBytes;           // Bytes of entries the index points at
+uint64_t appended;            // Bytes put since we started
+
+pthread_t compactor;
+pthread_cond_t compactCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t compactDone = PTHREAD_COND_INITIALIZER;
+int compactWanted = 0;
+int compacting = 0;
+int stopping = 0;
+unsigned long compactions = 0;
+
+uint32_t crcTable[256];
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void crcInit(){
+  for(uint32_t i = 0; i < 256; i++){
+    uint32_t c = i;
+    for(int k = 0; k < 8; k++){
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crcTable[i] = c;
+  }
+}
+
+uint32_t crc32(const void* data, size_t len){
+  const unsigned char* p = data;
+  uint32_t c = 0xffffffff;
+  for(size_t i = 0; i < len; i++){
+    c = crcTable[(c ^ p[i]) & 0xff] ^ (c >> 8);
+  }
+  return c ^ 0xffffffff;
+}
+
+uint64_t hashName(const char* name, size_t len){
+  uint64_t h = 14695981039346656037ull;
+  for(size_t i = 0; i < len; i++){
+    h = (h ^ (unsigned char)name[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+void append(struct buffer* b, const void* data, size_t len){
+  if(b->len + len > b->cap){
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    while(b->cap < b->len + len) b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+int writeAll(int fd, const void* data, size_t len){
+  const char* p = data;
+  while(len > 0){
+    ssize_t n = write(fd, p, len);
+    if(n < 0){
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+void segName(char* out, size_t size, unsigned long long id, unsigned part, const char* ext){
+  snprintf(out, size, "%010llu.%u.%s", id, part, ext);
+}
+
+// Index
+
+struct indexNode** findSlot(const char* name, size_t nameLen, uint64_t hash){
+  struct indexNode** link = &buckets[hash & (numBuckets - 1)];
+  for(; *link; link = &(*link)->next){
+    if((*link)->hash == hash && (*link)->nameLen == nameLen &&
+       memcmp((*link)->name, name, nameLen) == 0){
+      break;
+    }
+  }
+  return link;
+}
+
+void growIndex(){
+  size_t newCount = numBuckets * 2;
+  struct indexNode** table = calloc(newCount, sizeof(struct indexNode*));
+  if(!table) return;
+  for(size_t b = 0; b < numBuckets; b++){
+    while(buckets[b]){
+      struct indexNode* n = buckets[b];
+      buckets[b] = n->next;
+      n->next = table[n->hash & (newCount - 1)];
+      table[n->hash & (newCount - 1)] = n;
+    }
+  }
+  free(buckets);
+  buckets = table;
+  numBuckets = newCount;
+}
+
+// The newest entry for name is at (seg, off), or it's a tombstone
+void indexSet(const char* name, size_t nameLen, int flags, uint32_t seg, uint32_t off,
+              uint16_t len){
+  uint64_t hash = hashName(name, nameLen);
+  struct indexNode** link = findSlot(name, nameLen, hash);
+  if(flags & TOMBSTONE){
+    if(*link){
+      struct indexNode* dead = *link;
+      *link = dead->next;
+      liveBytes -= dead->len;
+      free(dead);
+      numKeys--;
+    }
+    return;
+  }
+  if(!*link){
+    struct indexNode* n = malloc(sizeof(struct indexNode) + nameLen);
+    n->next = NULL;
+    n->hash = hash;
+    n->nameLen = nameLen;
+    memcpy(n->name, name, nameLen);
+    n->len = 0;
+    *link = n;
+    if(++numKeys > numBuckets) growIndex();
+    link = findSlot(name, nameLen, hash);
+  }
+  liveBytes += len;
+  liveBytes -= (*link)->len;
+  (*link)->seg = seg;
+  (*link)->off = off;
+  (*link)->len = len;
+}
+
+// Segments
+
+int newSlot(){
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(!segs[i].used) return i;
+  }
+  return -1;
+}
+
+int flushWrites(){
+  if(writeBuf.len == 0) return 0;
+  if(writeAll(segs[active].fd, writeBuf.data, writeBuf.len) == -1){
+    perror("write");
+    return -1;
+  }
+  flushedSize += writeBuf.len;
+  writeBuf.len = 0;
+  return 0;
+}
+
+// Write a hint file for segment (id, part): temp file, fsync, rename
+int writeHints(unsigned long long id, unsigned part, struct buffer* hints){
+  char name[64], tmp[80];
+  segName(name, sizeof(name), id, part, "hint");
+  snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+  struct hintTrailer t = {HINT_MAGIC, 0, crc32(hints->data, hints->len)};
+  for(size_t off = 0; off < hints->len; t.count++){
+    struct hintEntry* h = (struct hintEntry*)(hints->data + off);
+    off += sizeof(*h) + h->nameLen;
+  }
+  int fd = openat(dirFd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || writeAll(fd, hints->data, hints->len) == -1 ||
+     writeAll(fd, &t, sizeof(t)) == -1 || fsync(fd) == -1){
+    perror(tmp);
+    if(fd != -1) close(fd);
+    return -1;
+  }
+  close(fd);
+  return renameat(dirFd, tmp, dirFd, name);
+}
+
+int openSegment(unsigned long long id, unsigned part, int create){
+  int slot = newSlot();
+  if(slot == -1){
+    fprintf(stderr, "Too many segments\n");
+    return -1;
+  }
+  char name[64];
+  segName(name, sizeof(name), id, part, "seg");
+  int fd = openat(dirFd, name, create ? O_RDWR | O_CREAT | O_APPEND : O_RDWR | O_APPEND, 0644);
+  if(fd == -1){
+    perror(name);
+    return -1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  segs[slot] = (struct segment){1, id, part, fd, st.st_size, 0};
+  return slot;
+}
+
+// Start a new active segment after everything that exists
+int startSegment(){
+  unsigned long long maxId = 0;
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(segs[i].used && segs[i].id > maxId) maxId = segs[i].id;
+  }
+  active = openSegment(maxId + 1, 0, 1);
+  flushedSize = 0;
+  activeHints.len = 0;
+  fsync(dirFd);
+  return active == -1 ? -1 : 0;
+}
+
+// Seal the active segment (and hint it), start the next, maybe compact.
+// Called with the lock held
+int rollSegment(){
+  if(flushWrites() == -1 || fsync(segs[active].fd) == -1) return -1;
+  segs[active].sealed = 1;
+  writeHints(segs[active].id, segs[active].part, &activeHints);
+  if(startSegment() == -1) return -1;
+  int sealed = 0;
+  for(int i = 0; i < MAX_SEGS; i++){
+    sealed += segs[i].used && segs[i].sealed;
+  }
+  if(sealed >= COMPACT_SEGS && !compacting){
+    compactWanted = 1;
+    pthread_cond_signal(&compactCond);
+  }
+  return 0;
+}
+
+// Append one entry; the caller holds the lock
+int putEntry(const char* name, const char* species, int age, int flags){
+  size_t nameLen = strnlen(name, 49), speciesLen = strnlen(species, 49);
+  char entry[sizeof(struct entryHeader) + 98];
+  struct entryHeader* h = (struct entryHeader*)entry;
+  h->nameLen = nameLen;
+  h->speciesLen = speciesLen;
+  h->flags = flags;
+  h->unused = 0;
+  h->age = age;
+  memcpy(entry + sizeof(*h), name, nameLen);
+  memcpy(entry + sizeof(*h) + nameLen, species, speciesLen);
+  size_t len = sizeof(*h) + nameLen + speciesLen;
+  h->crc = crc32(entry + 4, len - 4);
+
+  if(segs[active].size + len > SEG_MAX && rollSegment() == -1) return -1;
+  uint32_t off = segs[active].size;
+  append(&writeBuf, entry, len);
+  segs[active].size += len;
+  appended += len;
+  if(writeBuf.len >= WRITE_BUF && flushWrites() == -1) return -1;
+
+  struct hintEntry he = {off, len, nameLen, flags};
+  append(&activeHints, &he, sizeof(he));
+  append(&activeHints, name, nameLen);
+  indexSet(name, nameLen, flags, active, off, len);
+  return 0;
+}
+
+// Read the entry the index has for name into p. Returns 1, 0 if there's
+// no such pet, or -1
+int getPet(const char* name, struct petData* p){
+  size_t nameLen = strnlen(name, 49);
+  pthread_mutex_lock(&lock);
+  struct indexNode* n = *findSlot(name, nameLen, hashName(name, nameLen));
+  if(!n){
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  if(n->seg == (uint32_t)active && n->off + n->len > flushedSize && flushWrites() == -1){
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  char entry[sizeof(struct entryHeader) + 98];
+  ssize_t got = pread(segs[n->seg].fd, entry, n->len, n->off);
+  pthread_mutex_unlock(&lock);
+  struct entryHeader* h = (struct entryHeader*)entry;
+  if(got != n->len || h->crc != crc32(entry + 4, n->len - 4)){
+    fprintf(stderr, "%s: damaged entry\n", name);
+    return -1;
+  }
+  memcpy(p->name, entry + sizeof(*h), h->nameLen);
+  p->name[h->nameLen] = '\0';
+  memcpy(p->species, entry + sizeof(*h) + h->nameLen, h->speciesLen);
+  p->species[h->speciesLen] = '\0';
+  p->age = h->age;
+  return 1;
+}
+
+/*
+ Call fn for every entry in a segment, from its hint file if it has a valid
+ one, otherwise from the data (checking every CRC). Returns the bytes of
+ good entries in the data, so a torn tail can be cut off, or -1.
+*/
+typedef void (*entryFn)(void* ctx, const char* name, size_t nameLen, int flags, uint32_t off,
+                        uint16_t len);
+
+long long forEachEntry(int slot, entryFn fn, void* ctx, int* usedHints){
+  struct segment* s = &segs[slot];
+  char name[64];
+  segName(name, sizeof(name), s->id, s->part, "hint");
+  *usedHints = 0;
+  int fd = openat(dirFd, name, O_RDONLY);
+  if(fd != -1){
+    struct stat st;
+    fstat(fd, &st);
+    char* hints = malloc(st.st_size + 1);
+    struct hintTrailer t;
+    if(st.st_size >= (off_t)sizeof(t) && pread(fd, hints, st.st_size, 0) == st.st_size){
+      size_t len = st.st_size - sizeof(t);
+      memcpy(&t, hints + len, sizeof(t));
+      if(t.magic == HINT_MAGIC && t.crc == crc32(hints, len)){
+        for(size_t off = 0; off < len; ){
+          struct hintEntry* h = (struct hintEntry*)(hints + off);
+          fn(ctx, hints + off + sizeof(*h), h->nameLen, h->flags, h->off, h->len);
+          off += sizeof(*h) + h->nameLen;
+        }
+        *usedHints = 1;
+      }
+    }
+    free(hints);
+    close(fd);
+    if(*usedHints) return s->size;
+  }
+
+  // No usable hints: read the segment itself
+  FILE* f = fdopen(dup(s->fd), "r");
+  if(!f) return -1;
+  fseek(f, 0, SEEK_SET);
+  char entry[sizeof(struct entryHeader) + 98];
+  struct entryHeader* h = (struct entryHeader*)entry;
+  long long off = 0;
+  while(fread(h, sizeof(*h), 1, f) == 1){
+    size_t rest = h->nameLen + h->speciesLen;
+    if(h->nameLen > 49 || h->speciesLen > 49 || fread(entry + sizeof(*h), 1, rest, f) != rest ||
+       h->crc != crc32(entry + 4, sizeof(*h) - 4 + rest)){
+      break;    // A torn or damaged entry: nothing after it can be trusted
+    }
+    fn(ctx, entry + sizeof(*h), h->nameLen, h->flags, off, sizeof(*h) + rest);
+    off += sizeof(*h) + rest;
+  }
+  fclose(f);
+  return off;
+}
+
+// Replaying a segment into the index; hints is set for the last one, which
+// we'll go on appending to
+struct replay {
+  int slot;
+  struct buffer* hints;
+};
+
+void replayEntry(void* ctx, const char* name, size_t nameLen, int flags, uint32_t off,
+                 uint16_t len){
+  struct replay* r = ctx;
+  indexSet(name, nameLen, flags, r->slot, off, len);
+  if(r->hints){
+    struct hintEntry he = {off, len, nameLen, flags};
+    append(r->hints, &he, sizeof(he));
+    append(r->hints, name, nameLen);
+  }
+}
+
+int bySegmentOrder(const void* a, const void* b){
+  const struct segment* x = &segs[*(const int*)a];
+  const struct segment* y = &segs[*(const int*)b];
+  if(x->id != y->id) return x->id < y->id ? -1 : 1;
+  return (x->part > y->part) - (x->part < y->part);
+}
+
+// Find the segments in dir and rebuild the index from them
+int openStore(int* hinted, int* scanned){
+  mkdir(dir, 0755);
+  dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+  if(dirFd == -1){
+    perror(dir);
+    return -1;
+  }
+  buckets = calloc(numBuckets, sizeof(struct indexNode*));
+  DIR* d = fdopendir(dup(dirFd));
+  struct dirent* e;
+  int order[MAX_SEGS], n = 0;
+  while((e = readdir(d))){
+    unsigned long long id;
+    unsigned part;
+    int end = 0;
+    if(sscanf(e->d_name, "%llu.%u.seg%n", &id, &part, &end) == 2 && e->d_name[end] == '\0'){
+      int slot = openSegment(id, part, 0);
+      if(slot == -1) return -1;
+      segs[slot].sealed = 1;
+      order[n++] = slot;
+    } else if(strstr(e->d_name, ".tmp")){
+      unlinkat(dirFd, e->d_name, 0);    // Left by a crash mid-write
+    }
+  }
+  closedir(d);
+  qsort(order, n, sizeof(int), bySegmentOrder);
+
+  *hinted = *scanned = 0;
+  activeHints.len = 0;
+  int reuse = -1;
+  for(int i = 0; i < n; i++){
+    // The last segment is still the active one if it was never sealed: it's
+    // the first part of its id (not a compaction's output) and has no hints
+    int last = i == n - 1 && segs[order[i]].part == 0;
+    struct replay r = {order[i], last ? &activeHints : NULL};
+    int used;
+    long long good = forEachEntry(order[i], replayEntry, &r, &used);
+    if(used){
+      (*hinted)++;
+      continue;
+    }
+    (*scanned)++;
+    if(last) reuse = order[i];
+    if(good >= 0 && (uint64_t)good < segs[order[i]].size){
+      fprintf(stderr, "%s: cutting %llu damaged bytes off the end of a segment\n", dir,
+              (unsigned long long)(segs[order[i]].size - good));
+      ftruncate(segs[order[i]].fd, good);
+      segs[order[i]].size = good;
+    }
+  }
+  if(reuse != -1 && segs[reuse].size < SEG_MAX){
+    active = reuse;
+    segs[active].sealed = 0;
+    flushedSize = segs[active].size;
+    return 0;
+  }
+  return startSegment();
+}
+
+// Compaction
+
+struct move {
+  char name[50];
+  uint8_t nameLen;
+  uint32_t oldSeg, oldOff;
+  uint32_t newSeg, newOff;
+  uint16_t len;
+};
+
+struct compactCtx {
+  int slot;               // The segment being read
+  int out;                // The segment being written
+  struct buffer data;     // Entries for out, not written yet
+  struct buffer hints;
+  struct move* moves;
+  size_t numMoves, capMoves;
+  int outs[MAX_SEGS];
+  int numOuts;
+  unsigned long long id;
+  unsigned nextPart;
+  int failed;
+};
+
+int finishOutput(struct compactCtx* c){
+  struct segment* s = &segs[c->out];
+  if(writeAll(s->fd, c->data.data, c->data.len) == -1 || fsync(s->fd) == -1 ||
+     writeHints(s->id, s->part, &c->hints) == -1){
+    return -1;
+  }
+  c->data.len = c->hints.len = 0;
+  return 0;
+}
+
+int nextOutput(struct compactCtx* c){
+  pthread_mutex_lock(&lock);
+  int slot = openSegment(c->id, c->nextPart++, 1);
+  if(slot != -1){
+    segs[slot].sealed = 1;
+    segs[slot].used = 2;    // Not part of the store until we're done
+  }
+  pthread_mutex_unlock(&lock);
+  if(slot == -1) return -1;
+  c->out = slot;
+  c->outs[c->numOuts++] = slot;
+  return 0;
+}
+
+// Copy one entry to the output if the index still points at it
+void keepLive(void* ctx, const char* name, size_t nameLen, int flags, uint32_t off,
+              uint16_t len){
+  struct compactCtx* c = ctx;
+  if((flags & TOMBSTONE) || c->failed) return;
+  pthread_mutex_lock(&lock);
+  struct indexNode* n = *findSlot(name, nameLen, hashName(name, nameLen));
+  int live = n && n->seg == (uint32_t)c->slot && n->off == off;
+  pthread_mutex_unlock(&lock);
+  if(!live) return;
+
+  if(segs[c->out].size + len > SEG_MAX){
+    if(finishOutput(c) == -1 || nextOutput(c) == -1){
+      c->failed = 1;
+      return;
+    }
+  }
+  char entry[sizeof(struct entryHeader) + 98];
+  if(pread(segs[c->slot].fd, entry, len, off) != len){
+    c->failed = 1;
+    return;
+  }
+  uint32_t newOff = segs[c->out].size;
+  append(&c->data, entry, len);
+  segs[c->out].size += len;
+  struct hintEntry he = {newOff, len, nameLen, 0};
+  append(&c->hints, &he, sizeof(he));
+  append(&c->hints, name, nameLen);
+  if(c->numMoves == c->capMoves){
+    c->capMoves = c->capMoves ? c->capMoves * 2 : 1024;
+    c->moves = realloc(c->moves, c->capMoves * sizeof(struct move));
+  }
+  struct move* m = &c->moves[c->numMoves++];
+  memcpy(m->name, name, nameLen);
+  m->nameLen = nameLen;
+  m->oldSeg = c->slot;
+  m->oldOff = off;
+  m->newSeg = c->out;
+  m->newOff = newOff;
+  m->len = len;
+  if(c->data.len >= WRITE_BUF){
+    if(writeAll(segs[c->out].fd, c->data.data, c->data.len) == -1) c->failed = 1;
+    c->data.len = 0;
+  }
+}
+
+// Close a segment and delete it and its hints
+void removeSegment(int slot){
+  struct segment* s = &segs[slot];
+  char name[64];
+  close(s->fd);
+  segName(name, sizeof(name), s->id, s->part, "seg");
+  unlinkat(dirFd, name, 0);
+  segName(name, sizeof(name), s->id, s->part, "hint");
+  unlinkat(dirFd, name, 0);
+  s->used = 0;
+}
+
+// Merge every sealed segment into new ones holding only live entries
+void compact(){
+  pthread_mutex_lock(&lock);
+  int old[MAX_SEGS], numOld = 0;
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(segs[i].used == 1 && segs[i].sealed) old[numOld++] = i;
+  }
+  pthread_mutex_unlock(&lock);
+  if(numOld == 0) return;
+  qsort(old, numOld, sizeof(int), bySegmentOrder);
+
+  // The output goes in as more parts of the newest id merged, so it sorts
+  // after all of them and before the active segment
+  struct compactCtx c;
+  memset(&c, 0, sizeof(c));
+  struct segment* last = &segs[old[numOld - 1]];
+  c.id = last->id;
+  c.nextPart = last->part + 1;
+  if(nextOutput(&c) == -1) return;
+  for(int i = 0; i < numOld && !c.failed; i++){
+    int used;
+    c.slot = old[i];
+    forEachEntry(old[i], keepLive, &c, &used);
+  }
+  if(c.failed || finishOutput(&c) == -1){
+    fprintf(stderr, "%s: compaction failed; keeping the old segments\n", dir);
+    pthread_mutex_lock(&lock);
+    for(int i = 0; i < c.numOuts; i++){
+      removeSegment(c.outs[i]);
+    }
+    pthread_mutex_unlock(&lock);
+    free(c.moves);
+    free(c.data.data);
+    free(c.hints.data);
+    return;
+  }
+  fsync(dirFd);
+
+  // Point the index at the copies, unless a name was written again since
+  pthread_mutex_lock(&lock);
+  for(size_t i = 0; i < c.numMoves; i++){
+    struct move* m = &c.moves[i];
+    struct indexNode* n = *findSlot(m->name, m->nameLen, hashName(m->name, m->nameLen));
+    if(n && n->seg == m->oldSeg && n->off == m->oldOff){
+      n->seg = m->newSeg;
+      n->off = m->newOff;
+    }
+  }
+  for(int i = 0; i < c.numOuts; i++){
+    // Everything may have been written again since: then there's no output
+    if(segs[c.outs[i]].size == 0){
+      removeSegment(c.outs[i]);
+    } else {
+      segs[c.outs[i]].used = 1;
+    }
+  }
+  // Oldest first: a crash part way never leaves an old value with the
+  // tombstone that deleted it gone
+  for(int i = 0; i < numOld; i++){
+    removeSegment(old[i]);
+  }
+  compactions++;
+  pthread_mutex_unlock(&lock);
+  fsync(dirFd);
+  free(c.moves);
+  free(c.data.data);
+  free(c.hints.data);
+}
+
+void* compactLoop(void* arg){
+  pthread_mutex_lock(&lock);
+  while(1){
+    while(!compactWanted && !stopping){
+      pthread_cond_wait(&compactCond, &lock);
+    }
+    if(stopping) break;
+    compactWanted = 0;
+    compacting = 1;
+    pthread_mutex_unlock(&lock);
+    compact();
+    pthread_mutex_lock(&lock);
+    compacting = 0;
+    pthread_cond_broadcast(&compactDone);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Wait for a running compaction, then stop the thread and write what's buffered
+int closeStore(){
+  pthread_mutex_lock(&lock);
+  while(compacting || compactWanted){
+    pthread_cond_wait(&compactDone, &lock);
+  }
+  stopping = 1;
+  pthread_cond_signal(&compactCond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(compactor, NULL);
+  int r = flushWrites();
+  if(r == 0) r = fsync(segs[active].fd);
+  // An empty active segment is just clutter
+  if(segs[active].size == 0){
+    removeSegment(active);
+  }
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(segs[i].used) close(segs[i].fd);
+  }
+  return r;
+}
+
+// Commands
+
+void importPets(void* ctx, const struct petData* pets, size_t n){
+  pthread_mutex_lock(&lock);
+  for(size_t i = 0; i < n; i++){
+    putEntry(pets[i].name, pets[i].species, pets[i].age, 0);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void printStats(){
+  pthread_mutex_lock(&lock);
+  int numSegs = 0;
+  uint64_t bytes = 0;
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(segs[i].used){
+      numSegs++;
+      bytes += segs[i].size;
+    }
+  }
+  printf("%zu pets, %d segments, %llu bytes (%llu live, %.0f%%), %lu compactions\n", numKeys,
+         numSegs, (unsigned long long)bytes, (unsigned long long)liveBytes,
+         bytes ? 100.0 * liveBytes / bytes : 100.0, compactions);
+  pthread_mutex_unlock(&lock);
+}
+
+// Updates per second, and what starting up costs with and without hints
+int bench(long puts, long keys){
+  const char* species[] = {"cat", "dog", "rabbit", "hamster", "parrot", "goldfish"};
+  char name[32];
+  double start = now();
+  pthread_mutex_lock(&lock);
+  for(long i = 0; i < puts; i++){
+    long k = (i * 2654435761u) % keys;
+    snprintf(name, sizeof(name), "pet%ld", k);
+    if(putEntry(name, species[k % 6], i % 30, 0) == -1){
+      pthread_mutex_unlock(&lock);
+      return 1;
+    }
+    // Let the compactor at the lock now and then
+    if(i % 4096 == 0){
+      pthread_mutex_unlock(&lock);
+      pthread_mutex_lock(&lock);
+    }
+  }
+  flushWrites();
+  fsync(segs[active].fd);
+  pthread_mutex_unlock(&lock);
+  double secs = now() - start;
+  double mb = appended / 1e6;
+  printf("%ld puts over %ld pets: %.2f s, %.0f puts/s, %.0f MB/s appended\n", puts, keys, secs,
+         puts / secs, mb / secs);
+
+  // The ceiling: the same bytes in big sequential write()s, and an fsync()
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/sequential.tmp", dir);
+  char* block = calloc(1, WRITE_BUF);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  start = now();
+  for(uint64_t done = 0; fd != -1 && done < appended; done += WRITE_BUF){
+    writeAll(fd, block, WRITE_BUF);
+  }
+  fsync(fd);
+  secs = now() - start;
+  close(fd);
+  unlink(path);
+  free(block);
+  printf("Writing %.0f MB sequentially with write(): %.2f s, %.0f MB/s\n", mb, secs, mb / secs);
+
+  // petsDB2's way: rewrite a text file of all the pets for one update
+  snprintf(path, sizeof(path), "%s/rewrite.txt", dir);
+  start = now();
+  int rewrites = 0;
+  while(now() - start < 1 || rewrites < 3){
+    FILE* f = fopen(path, "w");
+    for(long k = 0; k < keys; k++){
+      fprintf(f, "pet%ld,%s,%ld\n", k, species[k % 6], k % 30);
+    }
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    rewrites++;
+  }
+  unlink(path);
+  printf("Rewriting all %ld pets as text, like petsDB2: %.1f ms per update\n", keys,
+         (now() - start) / rewrites * 1e3);
+  return 0;
+}
+
+// Drop everything openStore() built, and the empty active segment it made
+void closeQuietly(){
+  for(size_t b = 0; b < numBuckets; b++){
+    while(buckets[b]){
+      struct indexNode* next = buckets[b]->next;
+      free(buckets[b]);
+      buckets[b] = next;
+    }
+  }
+  free(buckets);
+  for(int i = 0; i < MAX_SEGS; i++){
+    if(!segs[i].used) continue;
+    close(segs[i].fd);
+    if(i == active && segs[i].size == 0){
+      char name[64];
+      segName(name, sizeof(name), segs[i].id, segs[i].part, "seg");
+      unlinkat(dirFd, name, 0);
+    }
+  }
+  close(dirFd);
+}
+
+// Rename every hint file to .off (or back), so openStore() can't see them
+void hideHints(int hide){
+  DIR* d = opendir(dir);
+  struct dirent* e;
+  while(d && (e = readdir(d))){
+    size_t len = strlen(e->d_name);
+    char to[300];
+    if(hide && len > 5 && strcmp(e->d_name + len - 5, ".hint") == 0){
+      snprintf(to, sizeof(to), "%s.off", e->d_name);
+    } else if(!hide && len > 9 && strcmp(e->d_name + len - 9, ".hint.off") == 0){
+      snprintf(to, sizeof(to), "%.*s", (int)len - 4, e->d_name);
+    } else {
+      continue;
+    }
+    renameat(dirfd(d), e->d_name, dirfd(d), to);
+  }
+  if(d) closedir(d);
+}
+
+double timedOpen(int* hinted, int* scanned){
+  memset(segs, 0, sizeof(segs));
+  numKeys = liveBytes = 0;
+  numBuckets = 1 << 16;
+  double start = now();
+  if(openStore(hinted, scanned) == -1) return -1;
+  return now() - start;
+}
+
+// Time opening the store as it is, then as if it had no hint files
+int benchStartup(){
+  int hinted, scanned;
+  double withHints = timedOpen(&hinted, &scanned);
+  size_t keys = numKeys;
+  closeQuietly();
+  printf("Startup with hints:    %.3f s (%d segments from hints, %d scanned)\n", withHints,
+         hinted, scanned);
+  hideHints(1);
+  double without = timedOpen(&hinted, &scanned);
+  closeQuietly();
+  hideHints(0);
+  printf("Startup without hints: %.3f s (%d segments from hints, %d scanned), %zu pets both times\n",
+         without, hinted, scanned, keys);
+  return keys == numKeys ? 0 : 1;
+}
+
+void usage(const char* prog){
+  fprintf(stderr, "Usage: %s dir put name species age\n"
+                  "       %s dir get name\n"
+                  "       %s dir delete name\n"
+                  "       %s dir list\n"
+                  "       %s dir import pets.txt\n"
+                  "       %s dir compact\n"
+                  "       %s dir stats\n"
+                  "       %s dir bench [puts] [keys]\n",
+          prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 3){
+    usage(argv[0]);
+    return 1;
+  }
+  crcInit();
+  dir = argv[1];
+  const char* cmd = argv[2];
+  int hinted, scanned;
+  if(openStore(&hinted, &scanned) == -1){
+    return 1;
+  }
+  pthread_create(&compactor, NULL, compactLoop, NULL);
+
+  int status = 0;
+  struct petData p;
+  if(strcmp(cmd, "put") == 0 && argc == 6){
+    pthread_mutex_lock(&lock);
+    status = putEntry(argv[3], argv[4], atoi(argv[5]), 0) == -1;
+    pthread_mutex_unlock(&lock);
+  } else if(strcmp(cmd, "get") == 0 && argc == 4){
+    int r = getPet(argv[3], &p);
+    if(r == 1){
+      printf("%s is a %s and is %d years old\n", p.name, p.species, p.age);
+    } else if(r == 0){
+      printf("No pet called %s\n", argv[3]);
+    }
+    status = r != 1;
+  } else if(strcmp(cmd, "delete") == 0 && argc == 4){
+    pthread_mutex_lock(&lock);
+    int exists = *findSlot(argv[3], strnlen(argv[3], 49), hashName(argv[3], strnlen(argv[3], 49)))
+                 != NULL;
+    if(exists){
+      status = putEntry(argv[3], "", 0, TOMBSTONE) == -1;
+    } else {
+      printf("No pet called %s\n", argv[3]);
+      status = 1;
+    }
+    pthread_mutex_unlock(&lock);
+  } else if(strcmp(cmd, "list") == 0 && argc == 3){
+    // Names from the index, each read back from its segment
+    pthread_mutex_lock(&lock);
+    size_t n = 0;
+    char (*names)[50] = malloc((numKeys ? numKeys : 1) * sizeof(*names));
+    for(size_t b = 0; b < numBuckets; b++){
+      for(struct indexNode* e = buckets[b]; e; e = e->next){
+        memcpy(names[n], e->name, e->nameLen);
+        names[n++][e->nameLen] = '\0';
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    for(size_t i = 0; i < n; i++){
+      if(getPet(names[i], &p) == 1){
+        printf("%s,%s,%d\n", p.name, p.species, p.age);
+      }
+    }
+    free(names);
+  } else if(strcmp(cmd, "import") == 0 && argc == 4){
+    CsvStats st;
+    double start = now();
+    // One thread, so a name that appears twice keeps its last line
+    if(csvScanPets(argv[3], 1, importPets, NULL, &st) == -1){
+      perror(argv[3]);
+      status = 1;
+    } else {
+      printf("%zu pets imported in %.2f s (%zu lines skipped)\n", st.rows, now() - start,
+             st.skipped);
+    }
+  } else if(strcmp(cmd, "compact") == 0 && argc == 3){
+    pthread_mutex_lock(&lock);
+    if(segs[active].size > 0){
+      status = rollSegment() == -1;
+    }
+    compactWanted = 1;
+    pthread_cond_signal(&compactCond);
+    pthread_mutex_unlock(&lock);
+  } else if(strcmp(cmd, "stats") == 0 && argc == 3){
+    printf("Opened from %d hint files, %d segments scanned\n", hinted, scanned);
+  } else if(strcmp(cmd, "bench") == 0 && argc <= 5){
+    long puts = argc > 3 ? atol(argv[3]) : 10000000;
+    long keys = argc > 4 ? atol(argv[4]) : 100000;
+    status = puts <= 0 || keys <= 0 || bench(puts, keys);
+    printStats();
+  } else {
+    usage(argv[0]);
+    status = 1;
+  }
+  if(closeStore() == -1){
+    perror(dir);
+    status = 1;
+  }
+  if(strcmp(cmd, "compact") == 0 || strcmp(cmd, "stats") == 0){
+    printStats();
+  }
+  if(strcmp(cmd, "bench") == 0 && status == 0){
+    status = benchStartup();
+  }
+  return status;
+}
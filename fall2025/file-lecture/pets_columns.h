@@ -0,0 +1,440 @@
+/* pets_columns.h */
+
+/*
+ * Pets stored a column at a time, for queries that read one or two fields
+ * of millions of pets.
+ *
+ * An array of struct petData keeps each pet's 50-byte name, 50-byte species
+ * and age together, so adding up ages drags 104 bytes per pet through the
+ * cache to use 4 of them. PetColumns keeps each field in its own array:
+ *
+ *   age       one int32_t per pet
+ *   species   one byte per pet: a code into a dictionary of the distinct
+ *             species names (up to COL_MAX_SPECIES of them)
+ *   names     every name, '\0'-terminated, end to end in one arena, with
+ *             each pet's offset into it
+ *
+ * so a query over age and species reads 5 bytes per pet, and comparing a
+ * species is comparing a byte instead of a string.
+ *
+ * colRun() answers one ColQuery: the count, sum, min and max (and so the
+ * average) of age, over the pets that pass its filters (an age range, one
+ * species), either in total or grouped by species. The rows are cut into
+ * one range per thread and each thread aggregates its range on its own;
+ * the partial results are added up at the end. With AVX2, and ages that
+ * all fit in a byte (0 to 255, as pets' do), a thread packs 32 ages into
+ * one vector and checks 32 pets against the filters per compare. Then, for
+ * every species, it picks out that species' ages with one more compare
+ * and adds them up 32 at a time. That's a pass per species, so it only
+ * pays with a few of them: above COL_VECTOR_GROUPS species, without AVX2,
+ * or with bigger ages, it's plain C, a pet at a time.
+ *
+ * colAppend() adds pets from an array of struct petData; colLoadCsv() fills
+ * the columns straight from a CSV file through pets_csv.h, without ever
+ * holding all the structs (the pets end up in no particular order).
+ */
+
+#ifndef PETS_COLUMNS_H
+#define PETS_COLUMNS_H
+
+#include <errno.h>
+#include <limits.h>
+#include "pets_csv.h"
+
+#define COL_MAX_SPECIES 256         // Species codes are one byte
+#define COL_MAX_THREADS 64
+#define COL_VECTOR_GROUPS 32        // Most species the AVX2 group-by takes on
+#define COL_BLOCK 4096              // Rows per block in the AVX2 loop
+#define COL_ANY INT_MIN             // ColQuery.species: no species filter
+
+// Which query loop to use: COL_AUTO picks the best the CPU has
+enum { COL_AUTO = -1, COL_SCALAR, COL_AVX2 };
+static int colIsa = COL_AUTO;       // Set this to force one
+
+static inline const char* colIsaName(int isa) {
+    return isa == COL_AVX2 ? "avx2" : "scalar";
+}
+
+static inline int colPickIsa(void) {
+    if (colIsa != COL_AUTO) return colIsa;
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2") ? COL_AVX2 : COL_SCALAR;
+#else
+    return COL_SCALAR;
+#endif
+}
+
+typedef struct {
+    size_t count;
+    size_t cap;
+    int32_t* age;
+    uint8_t* species;
+    uint32_t* nameOff;          // Name i is names + nameOff[i]
+    char* names;
+    size_t namesLen;
+    size_t namesCap;
+    int minAge;                 // Of every pet, so colRun() knows if bytes will do
+    int maxAge;
+
+    // The species dictionary: code -> name, and a hash table name -> code + 1
+    int numSpecies;
+    char speciesNames[COL_MAX_SPECIES][50];
+    uint16_t speciesSlots[COL_MAX_SPECIES * 2];
+
+    pthread_mutex_t lock;       // For colLoadCsv()'s threads
+} PetColumns;
+
+// One query: the pets with minAge <= age <= maxAge (and of one species,
+// unless species is COL_ANY; a code no pet has matches nothing), aggregated
+// in total or per species
+typedef struct {
+    int minAge;
+    int maxAge;
+    int species;
+    int bySpecies;
+} ColQuery;
+
+typedef struct {
+    size_t count;
+    long long sum;
+    int min;                    // INT_MAX and INT_MIN when count is 0
+    int max;
+} ColAgg;
+
+static inline ColQuery colQueryAll(void) {
+    ColQuery q = {INT_MIN, INT_MAX, COL_ANY, 0};
+    return q;
+}
+
+static inline double colAvg(const ColAgg* a) {
+    return a->count ? (double)a->sum / a->count : 0;
+}
+
+static inline void colInit(PetColumns* c) {
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+}
+
+static inline void colFree(PetColumns* c) {
+    free(c->age);
+    free(c->species);
+    free(c->nameOff);
+    free(c->names);
+    pthread_mutex_destroy(&c->lock);
+    memset(c, 0, sizeof(*c));
+}
+
+static inline const char* colName(const PetColumns* c, size_t i) {
+    return c->names + c->nameOff[i];
+}
+
+static inline uint32_t colHash(const char* s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+// The code for a species name, or -1 if no pet has it
+static inline int colSpeciesCode(const PetColumns* c, const char* name) {
+    uint32_t mask = COL_MAX_SPECIES * 2 - 1;
+    for (uint32_t h = colHash(name) & mask; c->speciesSlots[h]; h = (h + 1) & mask) {
+        int code = c->speciesSlots[h] - 1;
+        if (strcmp(c->speciesNames[code], name) == 0) return code;
+    }
+    return -1;
+}
+
+// The code for a species name, adding it if it's new; -1 if the dictionary is full
+static inline int colAddSpecies(PetColumns* c, const char* name) {
+    uint32_t mask = COL_MAX_SPECIES * 2 - 1;
+    uint32_t h = colHash(name) & mask;
+    for (; c->speciesSlots[h]; h = (h + 1) & mask) {
+        int code = c->speciesSlots[h] - 1;
+        if (strcmp(c->speciesNames[code], name) == 0) return code;
+    }
+    if (c->numSpecies == COL_MAX_SPECIES) return -1;
+    snprintf(c->speciesNames[c->numSpecies], 50, "%s", name);
+    c->speciesSlots[h] = ++c->numSpecies;
+    return c->numSpecies - 1;
+}
+
+static inline int colGrow(void** p, size_t* cap, size_t need, size_t size) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : 4096;
+    while (n < need) n *= 2;
+    void* q = realloc(*p, n * size);
+    if (!q) return -1;
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+/*
+ * Add n pets to the columns. Returns 0, or -1 with errno set: ENOMEM, or
+ * EOVERFLOW if there would be more than COL_MAX_SPECIES species or 4GB of
+ * names (pets before the one that didn't fit are added).
+ */
+static inline int colAppend(PetColumns* c, const struct petData* pets, size_t n) {
+    size_t cap = c->cap;
+    if (colGrow((void**)&c->age, &cap, c->count + n, sizeof(int32_t)) == -1) return -1;
+    cap = c->cap;
+    if (colGrow((void**)&c->species, &cap, c->count + n, 1) == -1) return -1;
+    cap = c->cap;
+    if (colGrow((void**)&c->nameOff, &cap, c->count + n, sizeof(uint32_t)) == -1) return -1;
+    c->cap = cap;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strnlen(pets[i].name, 49) + 1;
+        int code = colAddSpecies(c, pets[i].species);
+        if (code == -1 || c->namesLen + len > UINT32_MAX) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        if (colGrow((void**)&c->names, &c->namesCap, c->namesLen + len, 1) == -1) return -1;
+        memcpy(c->names + c->namesLen, pets[i].name, len - 1);
+        c->names[c->namesLen + len - 1] = '\0';
+        c->nameOff[c->count] = c->namesLen;
+        c->namesLen += len;
+        c->age[c->count] = pets[i].age;
+        c->species[c->count] = code;
+        if (c->count == 0 || pets[i].age < c->minAge) c->minAge = pets[i].age;
+        if (c->count == 0 || pets[i].age > c->maxAge) c->maxAge = pets[i].age;
+        c->count++;
+    }
+    return 0;
+}
+
+typedef struct {
+    PetColumns* cols;
+    int failed;
+    int error;
+} ColLoad;
+
+static inline void colSink(void* ctx, const struct petData* pets, size_t n) {
+    ColLoad* l = ctx;
+    pthread_mutex_lock(&l->cols->lock);
+    if (!l->failed && colAppend(l->cols, pets, n) == -1) {
+        l->failed = 1;
+        l->error = errno;
+    }
+    pthread_mutex_unlock(&l->cols->lock);
+}
+
+/*
+ * Parse path with pets_csv.h, threads threads, and add every pet to c.
+ * Returns 0, or -1 with errno set.
+ */
+static inline int colLoadCsv(const char* path, int threads, PetColumns* c, CsvStats* st) {
+    ColLoad l = {c, 0, 0};
+    if (csvScanPets(path, threads, colSink, &l, st) == -1) return -1;
+    if (l.failed) {
+        errno = l.error;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void colAggInit(ColAgg* a, int n) {
+    for (int g = 0; g < n; g++) {
+        a[g].count = 0;
+        a[g].sum = 0;
+        a[g].min = INT_MAX;
+        a[g].max = INT_MIN;
+    }
+}
+
+static inline void colAggMerge(ColAgg* into, const ColAgg* from, int n) {
+    for (int g = 0; g < n; g++) {
+        into[g].count += from[g].count;
+        into[g].sum += from[g].sum;
+        if (from[g].min < into[g].min) into[g].min = from[g].min;
+        if (from[g].max > into[g].max) into[g].max = from[g].max;
+    }
+}
+
+// Rows from to to, a pet at a time
+static inline void colRunScalar(const PetColumns* c, const ColQuery* q, size_t from, size_t to,
+                                ColAgg* out) {
+    const int32_t* age = c->age;
+    const uint8_t* species = c->species;
+    for (size_t i = from; i < to; i++) {
+        int a = age[i];
+        if (a < q->minAge || a > q->maxAge) continue;
+        if (q->species != COL_ANY && species[i] != q->species) continue;
+        ColAgg* g = &out[q->bySpecies ? species[i] : 0];
+        g->count++;
+        g->sum += a;
+        if (a < g->min) g->min = a;
+        if (a > g->max) g->max = a;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Rows from to to, 32 at a time, for columns whose ages are all 0 to 255.
+ * A block of COL_BLOCK rows at a time: first the block's ages are packed
+ * into bytes, and each row's filters and species become one byte key, its
+ * group or 255 if it didn't pass. Then for each group, 32 keys are compared
+ * with it at once, and the matching ages are summed with vpsadbw (which
+ * adds up groups of 8 bytes into 64-bit lanes, so nothing overflows) and
+ * maxed with vpmaxub. The count is the same sum over the 0xff match bytes,
+ * divided by 255, and the min is a max over 255 - age.
+ */
+__attribute__((target("avx2")))
+static inline void colRunAvx2(const PetColumns* c, const ColQuery* q, size_t from, size_t to,
+                              ColAgg* out) {
+    int groups = q->bySpecies ? c->numSpecies : 1;
+    uint8_t ages[COL_BLOCK], keys[COL_BLOCK];
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i sums[COL_VECTOR_GROUPS], counts[COL_VECTOR_GROUPS];
+    __m256i maxes[COL_VECTOR_GROUPS], flippedMins[COL_VECTOR_GROUPS];
+    for (int g = 0; g < groups; g++) {
+        sums[g] = counts[g] = maxes[g] = flippedMins[g] = zero;
+    }
+    // The age range, cut down to bytes; empty if it misses 0 to 255
+    int lowAge = q->minAge < 0 ? 0 : q->minAge;
+    int highAge = q->maxAge > 255 ? 255 : q->maxAge;
+    if (lowAge > highAge) {
+        from = to;
+    }
+    const __m256i low = _mm256_set1_epi8((char)lowAge);
+    const __m256i high = _mm256_set1_epi8((char)highAge);
+    const __m256i wanted = _mm256_set1_epi8((char)q->species);
+    size_t i = from;
+    while (i + 32 <= to) {
+        size_t n = (to - i) & ~(size_t)31;
+        if (n > COL_BLOCK) n = COL_BLOCK;
+        for (size_t k = 0; k < n; k += 32) {
+            const __m256i* a32 = (const __m256i*)(c->age + i + k);
+            __m256i a = _mm256_packus_epi16(
+                _mm256_packus_epi32(_mm256_loadu_si256(a32), _mm256_loadu_si256(a32 + 1)),
+                _mm256_packus_epi32(_mm256_loadu_si256(a32 + 2), _mm256_loadu_si256(a32 + 3)));
+            a = _mm256_permutevar8x32_epi32(a, order);      // The packs work per 128 bits
+            __m256i code = _mm256_loadu_si256((const __m256i*)(c->species + i + k));
+            __m256i pass = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, low), a),
+                                            _mm256_cmpeq_epi8(_mm256_min_epu8(a, high), a));
+            if (q->species != COL_ANY) {
+                pass = _mm256_and_si256(pass, _mm256_cmpeq_epi8(code, wanted));
+            }
+            __m256i key = q->bySpecies ? code : zero;
+            key = _mm256_or_si256(_mm256_and_si256(pass, key), _mm256_andnot_si256(pass, ones));
+            _mm256_storeu_si256((__m256i*)(ages + k), a);
+            _mm256_storeu_si256((__m256i*)(keys + k), key);
+        }
+        for (int g = 0; g < groups; g++) {
+            const __m256i group = _mm256_set1_epi8((char)g);
+            __m256i sum = sums[g], count = counts[g], hi = maxes[g], lo = flippedMins[g];
+            for (size_t k = 0; k < n; k += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(ages + k));
+                __m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(keys + k)),
+                                              group);
+                __m256i am = _mm256_and_si256(m, a);
+                sum = _mm256_add_epi64(sum, _mm256_sad_epu8(am, zero));
+                count = _mm256_add_epi64(count, _mm256_sad_epu8(m, zero));
+                hi = _mm256_max_epu8(hi, am);
+                lo = _mm256_max_epu8(lo, _mm256_andnot_si256(a, m));    // 255 - a where m
+            }
+            sums[g] = sum;
+            counts[g] = count;
+            maxes[g] = hi;
+            flippedMins[g] = lo;
+        }
+        i += n;
+    }
+    for (int g = 0; g < groups; g++) {
+        uint64_t s[4], n[4];
+        uint8_t hi[32], lo[32];
+        _mm256_storeu_si256((__m256i*)s, sums[g]);
+        _mm256_storeu_si256((__m256i*)n, counts[g]);
+        _mm256_storeu_si256((__m256i*)hi, maxes[g]);
+        _mm256_storeu_si256((__m256i*)lo, flippedMins[g]);
+        size_t count = (n[0] + n[1] + n[2] + n[3]) / 255;
+        if (count == 0) continue;
+        out[g].count += count;
+        out[g].sum += s[0] + s[1] + s[2] + s[3];
+        int max = 0, flippedMin = 0;
+        for (int l = 0; l < 32; l++) {
+            if (hi[l] > max) max = hi[l];
+            if (lo[l] > flippedMin) flippedMin = lo[l];
+        }
+        if (255 - flippedMin < out[g].min) out[g].min = 255 - flippedMin;
+        if (max > out[g].max) out[g].max = max;
+    }
+    colRunScalar(c, q, i, to, out);     // The last few rows
+}
+#endif
+
+// One thread's share of the rows
+typedef struct {
+    const PetColumns* cols;
+    const ColQuery* q;
+    size_t from;
+    size_t to;
+    int isa;
+    ColAgg out[COL_MAX_SPECIES];
+} ColJob;
+
+static inline void* colWorker(void* arg) {
+    ColJob* job = arg;
+    int groups = job->q->bySpecies ? job->cols->numSpecies : 1;
+    colAggInit(job->out, groups);
+    int species = job->q->species;
+    if (species != COL_ANY && (species < 0 || species >= job->cols->numSpecies)) {
+        return NULL;    // colSpeciesCode()'s -1, say: no such pets
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    const PetColumns* c = job->cols;
+    if (job->isa == COL_AVX2 && groups <= COL_VECTOR_GROUPS && c->minAge >= 0 &&
+        c->maxAge <= 255) {
+        colRunAvx2(job->cols, job->q, job->from, job->to, job->out);
+        return NULL;
+    }
+#endif
+    colRunScalar(job->cols, job->q, job->from, job->to, job->out);
+    return NULL;
+}
+
+/*
+ * Run q over c with threads threads. out gets c->numSpecies results, indexed
+ * by species code, if q->bySpecies, and one result if not. Returns how many
+ * results it wrote, or -1 with errno set.
+ */
+static inline int colRun(const PetColumns* c, const ColQuery* q, int threads, ColAgg* out) {
+    if (threads < 1) threads = 1;
+    if (threads > COL_MAX_THREADS) threads = COL_MAX_THREADS;
+    ColJob* jobs = malloc(threads * sizeof(ColJob));
+    if (!jobs) return -1;
+    // Ranges start on 64-row boundaries, so threads don't share cache lines
+    size_t per = (c->count / threads + 63) & ~(size_t)63;
+    int isa = colPickIsa();
+    for (int t = 0; t < threads; t++) {
+        jobs[t].cols = c;
+        jobs[t].q = q;
+        jobs[t].from = per * t < c->count ? per * t : c->count;
+        jobs[t].to = t == threads - 1 || per * (t + 1) > c->count ? c->count : per * (t + 1);
+        jobs[t].isa = isa;
+    }
+    pthread_t tids[COL_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < threads - 1; t++) {
+        if (pthread_create(&tids[started], NULL, colWorker, &jobs[t]) == 0) {
+            started++;
+        } else {
+            colWorker(&jobs[t]);        // No thread for it: do it ourselves
+        }
+    }
+    colWorker(&jobs[threads - 1]);
+    for (int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    int groups = q->bySpecies ? c->numSpecies : 1;
+    colAggInit(out, groups);
+    for (int t = 0; t < threads; t++) {
+        colAggMerge(out, jobs[t].out, groups);
+    }
+    free(jobs);
+    return groups;
+}
+
+#endif
@@ -0,0 +1,490 @@
+/* pets_csv.h */
+
+/*
+ * A fast loader for pets.txt-style CSV (name,species,age per line), for
+ * files far too big to fscanf() a line at a time.
+ *
+ * petsDB2.c's readPet() calls fscanf("%49[^,],%49[^,],%d\n") once per pet,
+ * and fscanf() interprets its format string, one character at a time, for
+ * every line. Here:
+ *
+ *   - The file is mmap()ed, so nothing is copied into a read buffer.
+ *   - Commas and newlines are found 64 bytes at a time. SSE2 (16 bytes per
+ *     compare) or AVX2 (32), whichever the CPU has, turns each 64-byte block
+ *     into a 64-bit mask with a bit set for every delimiter, and the parser
+ *     jumps from one set bit to the next with __builtin_ctzll() instead of
+ *     looking at every byte. Other CPUs build the same mask in plain C.
+ *   - The age is turned into a number without a loop or a branch per digit:
+ *     up to 8 digits are loaded as one 64-bit word, checked all at once, and
+ *     combined with three multiplies (csvAtoi()).
+ *   - The file is cut into one range per thread, each starting just after a
+ *     newline, and the threads parse their ranges at the same time.
+ *
+ * csvLoadPets() puts every pet into one array of struct petData. It first
+ * counts the newlines in each range (the same SIMD compare), so it knows
+ * where each thread's pets start, and then every thread parses straight
+ * into its own part of the array: no per-thread buffers, no copying after.
+ * csvScanPets() is for files whose pets don't fit in memory: each thread
+ * fills a small buffer and hands it to a callback, over and over.
+ *
+ * Names and species longer than 49 characters are cut short; lines that
+ * aren't name,species,age (or whose age isn't 1 to 8 digits) are skipped
+ * and counted. "\r\n" line endings are fine.
+ */
+
+#ifndef PETS_CSV_H
+#define PETS_CSV_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define CSV_MAX_THREADS 64
+#define CSV_BATCH 4096              // Pets per callback from csvScanPets()
+
+struct petData {
+    char name[50];
+    char species[50];
+    int age;
+};
+
+// Which delimiter search to use: CSV_AUTO picks the best the CPU has
+enum { CSV_AUTO = -1, CSV_SCALAR, CSV_SSE2, CSV_AVX2 };
+static int csvIsa = CSV_AUTO;       // Set this to force one
+
+static inline const char* csvIsaName(int isa) {
+    static const char* names[] = {"scalar", "sse2", "avx2"};
+    return names[isa];
+}
+
+typedef void (*CsvSink)(void* ctx, const struct petData* pets, size_t n);
+
+typedef struct {
+    size_t rows;                // Pets parsed
+    size_t skipped;             // Lines that weren't pets (blank lines included)
+    size_t bytes;
+    int threads;
+    int isa;                    // The search that was used
+} CsvStats;
+
+static inline int csvPickIsa(void) {
+    if (csvIsa != CSV_AUTO) return csvIsa;
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2") ? CSV_AVX2 : CSV_SSE2;
+#else
+    return CSV_SCALAR;
+#endif
+}
+
+/*
+ * Branchless atoi for 1 to 8 digits at s (len of them). The digits are
+ * loaded as one little-endian word, first digit in the low byte, and shifted
+ * up so the missing leading digits become zeros. All 8 are checked at once,
+ * then each pair of neighbouring digits, each pair of pairs, and the two
+ * quads are combined with one multiply apiece. Returns -1 if len is 0 or
+ * over 8, or any of the bytes isn't a digit.
+ */
+static inline int csvAtoi(const char* s, size_t len, const char* limit) {
+    int lenOk = len - 1 < 8;                // len 0 wraps around
+    size_t l = lenOk ? len : 8;
+    uint64_t w = 0;
+    if (s + 8 <= limit) {
+        memcpy(&w, s, 8);
+    } else {
+        memcpy(&w, s, lenOk ? len : 0);     // Near the end of the mapping
+    }
+    unsigned shift = (8 - l) * 8;
+    w <<= shift;
+    // '0'..'9' xor 0x30 is 0..9, and a byte over 9 gets its top bit set by
+    // adding 0x76. The bytes shifted in are zeros: leading zero digits
+    uint64_t digits = w ^ (0x3030303030303030ull << shift);
+    int ok = lenOk & ((((digits + 0x7676767676767676ull) | digits) & 0x8080808080808080ull) == 0);
+    digits = (digits * 10 + (digits >> 8)) & 0x00ff00ff00ff00ffull;
+    digits = (digits * 100 + (digits >> 16)) & 0x0000ffff0000ffffull;
+    digits = (digits * 10000 + (digits >> 32)) & 0xffffffffull;
+    return ok ? (int)digits : -1;
+}
+
+// Bit i set if p[i] is a comma or a newline, for i < len (at most 64)
+static inline uint64_t csvMaskScalar(const char* p, size_t len) {
+    uint64_t m = 0;
+    for (size_t i = 0; i < len; i++) {
+        m |= (uint64_t)(p[i] == ',' || p[i] == '\n') << i;
+    }
+    return m;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __attribute__((always_inline)) uint64_t csvMaskSse2(const char* p) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m = 0;
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, nl));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(hit) << (16 * k);
+    }
+    return m;
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) uint64_t csvMaskAvx2(const char* p) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    uint32_t mlo = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(lo, comma),
+                                                        _mm256_cmpeq_epi8(lo, nl)));
+    uint32_t mhi = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(hi, comma),
+                                                        _mm256_cmpeq_epi8(hi, nl)));
+    return (uint64_t)mhi << 32 | mlo;
+}
+#endif
+
+// Where one thread's parser is: output, the line so far, and what it found
+typedef struct {
+    struct petData* out;
+    size_t n;                   // Pets in out
+    size_t cap;
+    CsvSink sink;               // Called when out is full (csvScanPets())
+    void* ctx;
+    size_t rows;
+    size_t skipped;
+    const char* limit;          // End of the mapping, for csvAtoi()
+    const char* start[3];       // Where each field of this line starts
+    const char* end[2];         // Where name and species end
+    int field;                  // Which field we're in; 3 = too many commas
+} CsvParser;
+
+static inline __attribute__((always_inline)) void csvRow(CsvParser* ps, const char* lineEnd) {
+    if (ps->field != 2) {
+        ps->skipped++;
+        return;
+    }
+    if (lineEnd > ps->start[2] && lineEnd[-1] == '\r') lineEnd--;
+    int age = csvAtoi(ps->start[2], lineEnd - ps->start[2], ps->limit);
+    if (age < 0) {
+        ps->skipped++;
+        return;
+    }
+    if (ps->n == ps->cap) {
+        if (!ps->sink) return;      // Can't happen: csvLoadPets() counted the lines
+        ps->sink(ps->ctx, ps->out, ps->n);
+        ps->n = 0;
+    }
+    ps->rows++;
+    struct petData* p = &ps->out[ps->n++];
+    size_t nameLen = ps->end[0] - ps->start[0];
+    size_t speciesLen = ps->end[1] - ps->start[1];
+    if (nameLen > 49) nameLen = 49;
+    if (speciesLen > 49) speciesLen = 49;
+    memcpy(p->name, ps->start[0], nameLen);
+    p->name[nameLen] = '\0';
+    memcpy(p->species, ps->start[1], speciesLen);
+    p->species[speciesLen] = '\0';
+    p->age = age;
+}
+
+static inline __attribute__((always_inline)) void csvDelims(CsvParser* ps, const char* block,
+                                                            uint64_t m) {
+    while (m) {
+        const char* d = block + __builtin_ctzll(m);
+        m &= m - 1;
+        if (*d == ',') {
+            if (ps->field < 2) {
+                ps->end[ps->field] = d;
+                ps->start[++ps->field] = d + 1;
+            } else {
+                ps->field = 3;
+            }
+        } else {
+            csvRow(ps, d);
+            ps->field = 0;
+            ps->start[0] = d + 1;
+        }
+    }
+}
+
+// The parse loop, once per delimiter search; MASK(p) covers p[0..64)
+#define CSV_PARSE_LOOP(MASK)                                                   \
+    const char* block = from;                                                  \
+    ps->field = 0;                                                             \
+    ps->start[0] = from;                                                       \
+    for (; block + 64 <= to; block += 64) {                                    \
+        csvDelims(ps, block, MASK(block));                                     \
+    }                                                                          \
+    csvDelims(ps, block, csvMaskScalar(block, to - block));                    \
+    if (ps->start[0] < to) csvRow(ps, to);  /* A last line with no newline */
+
+#define CSV_MASK_SCALAR(p) csvMaskScalar(p, 64)
+
+static inline void csvParseScalar(CsvParser* ps, const char* from, const char* to) {
+    CSV_PARSE_LOOP(CSV_MASK_SCALAR)
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline void csvParseSse2(CsvParser* ps, const char* from, const char* to) {
+    CSV_PARSE_LOOP(csvMaskSse2)
+}
+
+__attribute__((target("avx2")))
+static inline void csvParseAvx2(CsvParser* ps, const char* from, const char* to) {
+    CSV_PARSE_LOOP(csvMaskAvx2)
+}
+#endif
+
+// Parse the lines in [from, to) with the given delimiter search
+static inline void csvParse(CsvParser* ps, int isa, const char* from, const char* to) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (isa == CSV_AVX2) {
+        csvParseAvx2(ps, from, to);
+        return;
+    }
+    if (isa == CSV_SSE2) {
+        csvParseSse2(ps, from, to);
+        return;
+    }
+#endif
+    csvParseScalar(ps, from, to);
+}
+
+// Newlines in [p, p + len): an SSE2 compare and popcount per 16 bytes on x86
+// (the AVX2 setting uses it too), one byte at a time otherwise
+static inline size_t csvCountLines(int isa, const char* p, size_t len) {
+    size_t count = 0, i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (isa != CSV_SCALAR) {
+        const __m128i nl = _mm_set1_epi8('\n');
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        count += p[i] == '\n';
+    }
+    return count;
+}
+
+// One thread's share of the file
+typedef struct {
+    const char* from;
+    const char* to;
+    int isa;
+    CsvParser ps;
+    int counting;               // csvLoadPets()'s first pass: just count lines
+    size_t lines;
+} CsvJob;
+
+static inline void* csvWorker(void* arg) {
+    CsvJob* job = arg;
+    if (job->counting) {
+        size_t len = job->to - job->from;
+        job->lines = csvCountLines(job->isa, job->from, len);
+        if (len > 0 && job->to[-1] != '\n') job->lines++;
+        return NULL;
+    }
+    csvParse(&job->ps, job->isa, job->from, job->to);
+    if (job->ps.sink && job->ps.n > 0) {
+        job->ps.sink(job->ps.ctx, job->ps.out, job->ps.n);
+        job->ps.n = 0;
+    }
+    return NULL;
+}
+
+// Run every job, one thread each (the last one on this thread)
+static inline void csvRunJobs(CsvJob* jobs, int threads) {
+    pthread_t tids[CSV_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < threads - 1; t++) {
+        if (pthread_create(&tids[started], NULL, csvWorker, &jobs[t]) == 0) {
+            started++;
+        } else {
+            csvWorker(&jobs[t]);        // No thread for it: do it ourselves
+        }
+    }
+    csvWorker(&jobs[threads - 1]);
+    for (int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+}
+
+typedef struct {
+    const char* map;
+    size_t len;
+} CsvFile;
+
+static inline int csvMap(const char* path, CsvFile* f) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    f->len = st.st_size;
+    f->map = NULL;
+    if (f->len > 0) {
+        void* map = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        f->map = map;
+        madvise(map, f->len, MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+    close(fd);
+    return 0;
+}
+
+// Cut the file into threads ranges, each ending just after a newline
+static inline int csvSplit(const CsvFile* f, int threads, int isa, CsvJob* jobs) {
+    if (threads < 1) threads = 1;
+    if (threads > CSV_MAX_THREADS) threads = CSV_MAX_THREADS;
+    const char* end = f->map + f->len;
+    const char* from = f->map;
+    for (int t = 0; t < threads; t++) {
+        const char* to = t == threads - 1 ? end : f->map + f->len / threads * (t + 1);
+        if (to < from) to = from;
+        if (to < end) {
+            const char* nl = memchr(to, '\n', end - to);
+            to = nl ? nl + 1 : end;
+        }
+        memset(&jobs[t], 0, sizeof(CsvJob));
+        jobs[t].from = from;
+        jobs[t].to = to;
+        jobs[t].isa = isa;
+        jobs[t].ps.limit = end;
+        from = to;
+    }
+    return threads;
+}
+
+static inline void csvTotals(const CsvJob* jobs, int threads, const CsvFile* f, CsvStats* st) {
+    if (!st) return;
+    memset(st, 0, sizeof(*st));
+    st->bytes = f->len;
+    st->threads = threads;
+    st->isa = jobs[0].isa;
+    for (int t = 0; t < threads; t++) {
+        st->rows += jobs[t].ps.rows;
+        st->skipped += jobs[t].ps.skipped;
+    }
+}
+
+/*
+ * Load every pet in path into one malloc()ed array (*pets, *count; free() it
+ * when done), using threads threads. Returns 0, or -1 with errno set.
+ */
+static inline int csvLoadPets(const char* path, int threads, struct petData** pets,
+                              size_t* count, CsvStats* st) {
+    CsvFile f;
+    if (csvMap(path, &f) == -1) return -1;
+    CsvJob jobs[CSV_MAX_THREADS];
+    threads = csvSplit(&f, threads, csvPickIsa(), jobs);
+
+    // Pass 1: lines per range, which bound the pets in it
+    for (int t = 0; t < threads; t++) jobs[t].counting = 1;
+    csvRunJobs(jobs, threads);
+    size_t total = 0;
+    for (int t = 0; t < threads; t++) total += jobs[t].lines;
+    struct petData* all = malloc((total ? total : 1) * sizeof(struct petData));
+    if (!all) {
+        if (f.map) munmap((void*)f.map, f.len);
+        return -1;
+    }
+
+    // Pass 2: every thread parses into its own slice of the array
+    size_t slot = 0;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].counting = 0;
+        jobs[t].ps.out = all + slot;
+        jobs[t].ps.cap = jobs[t].lines;
+        slot += jobs[t].lines;
+    }
+    csvRunJobs(jobs, threads);
+
+    // Skipped lines leave gaps at the ends of the slices; close them up
+    size_t n = 0;
+    for (int t = 0; t < threads; t++) {
+        if (jobs[t].ps.out != all + n) {
+            memmove(all + n, jobs[t].ps.out, jobs[t].ps.n * sizeof(struct petData));
+        }
+        n += jobs[t].ps.n;
+    }
+    csvTotals(jobs, threads, &f, st);
+    if (f.map) munmap((void*)f.map, f.len);
+    *pets = all;
+    *count = n;
+    return 0;
+}
+
+/*
+ * Parse path with threads threads, handing the pets to sink CSV_BATCH at a
+ * time. sink runs on the parsing threads, so it must be thread-safe; pets
+ * arrive in file order within a range but ranges interleave. Returns 0, or
+ * -1 with errno set.
+ */
+static inline int csvScanPets(const char* path, int threads, CsvSink sink, void* ctx,
+                              CsvStats* st) {
+    CsvFile f;
+    if (csvMap(path, &f) == -1) return -1;
+    CsvJob jobs[CSV_MAX_THREADS];
+    threads = csvSplit(&f, threads, csvPickIsa(), jobs);
+    struct petData* buffers = malloc((size_t)threads * CSV_BATCH * sizeof(struct petData));
+    if (!buffers) {
+        if (f.map) munmap((void*)f.map, f.len);
+        return -1;
+    }
+    for (int t = 0; t < threads; t++) {
+        jobs[t].ps.out = buffers + (size_t)t * CSV_BATCH;
+        jobs[t].ps.cap = CSV_BATCH;
+        jobs[t].ps.sink = sink;
+        jobs[t].ps.ctx = ctx;
+    }
+    csvRunJobs(jobs, threads);
+    csvTotals(jobs, threads, &f, st);
+    free(buffers);
+    if (f.map) munmap((void*)f.map, f.len);
+    return 0;
+}
+
+/*
+ * Made-up pets, for tests and benchmarks. Pet number i gets a name of two
+ * to four syllables followed by i (so no two share a name), a species and
+ * an age from 0 to 24. Start seed at CSV_FAKE_SEED and make the pets in
+ * order: every program that does gets the same ones.
+ */
+#define CSV_FAKE_SEED 12345
+
+static inline void csvFakePet(unsigned* seed, size_t i, struct petData* p) {
+    static const char* syllables[] = {"ba", "ko", "mi", "ra", "tu", "li", "ze", "po",
+                                      "fi", "no", "sa", "de", "gu", "ly", "ch", "wo"};
+    static const char* species[] = {"cat", "dog", "rabbit", "hamster", "parrot", "goldfish",
+                                    "turtle", "ferret", "gecko", "horse", "snake", "mouse"};
+    unsigned s = *seed;
+    int len = 0;
+    s = s * 1103515245 + 12345;
+    int parts = 2 + (s >> 16) % 3;
+    for (int k = 0; k < parts; k++) {
+        s = s * 1103515245 + 12345;
+        len += sprintf(p->name + len, "%s", syllables[(s >> 16) % 16]);
+    }
+    sprintf(p->name + len, "%zu", i);
+    s = s * 1103515245 + 12345;
+    strcpy(p->species, species[(s >> 16) % 12]);
+    p->age = (s >> 8) % 25;
+    *seed = s;
+}
+
+#endif
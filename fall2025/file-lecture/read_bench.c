@@ -0,0 +1,293 @@
+/*
+ read_bench.c: what does reading a file N bytes at a time actually cost?
+
+ read3.c reads 10 bytes per read(), mycat.c 1KB, lineEditor.c whatever
+ fgets() asks stdio for. This reads the same generated file every way
+ those programs could, sweeping the buffer size from 16 bytes to 4MB:
+
+   stdio    fread() of the buffer size (stdio reads st_blksize underneath)
+   read     read() into the buffer
+   pread    pread() with an explicit offset
+   readv    readv() into READV_IOVS pieces that add up to the buffer size
+   mmap     mmap() a window of the buffer size (at least a page), read it,
+            munmap() it
+
+ and does each twice: with the file in the page cache (warm), and after
+ posix_fadvise(DONTNEED) has thrown it out (cold, so it comes off the
+ disk). Every method adds up every 8 bytes it reads, so none of them gets
+ away without touching the data.
+
+ For each run it prints a CSV line:
+
+   method,cache,buffer_bytes,mb_per_s,syscalls_per_mb,user_ms,sys_ms,faults
+
+ syscalls_per_mb counts the read calls the kernel saw (syscr in
+ /proc/self/io) plus our mmap()/munmap() calls; user_ms and sys_ms are the
+ CPU time from getrusage(), and faults the page faults (what mmap pays
+ instead of system calls).
+
+ Compile: gcc -Wall -g -O2 read_bench.c -o read_bench
+ Usage: ./read_bench [-s MB] [-r runs] [-m method,...] [-o file.csv] [file]
+        (makes a 64MB file in /tmp unless you name one; each line is the
+        best of runs, default 3)
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#define READV_IOVS 4
+
+const char* methods[] = {"stdio", "read", "pread", "readv", "mmap"};
+#define NUM_METHODS 5
+
+const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1 << 20, 4 << 20};
+#define NUM_SIZES 10
+
+const char* path = "/tmp/read_bench.dat";
+long long fileSize;
+long pageSize;
+uint64_t checksum;      // Printed at the end so the compiler can't skip the reads
+long mapCalls;          // mmap() and munmap() calls in this run
+
+struct sample {
+  double secs;
+  double userMs, sysMs;
+  long syscalls;
+  long faults;
+};
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read system calls so far, as the kernel counts them
+long readCalls(){
+  FILE* f = fopen("/proc/self/io", "r");
+  char line[128];
+  long n = 0;
+  while(f && fgets(line, sizeof(line), f)){
+    if(sscanf(line, "syscr: %ld", &n) == 1) break;
+  }
+  if(f) fclose(f);
+  return n;
+}
+
+void consume(const char* data, size_t len){
+  uint64_t sum = 0, word;
+  size_t i = 0;
+  for(; i + 8 <= len; i += 8){
+    memcpy(&word, data + i, 8);
+    sum += word;
+  }
+  for(; i < len; i++){
+    sum += (unsigned char)data[i];
+  }
+  checksum += sum;
+}
+
+// Make the test file, unless one of the right size is already there
+int makeFile(long long size){
+  struct stat st;
+  if(stat(path, &st) == 0 && st.st_size == size){
+    return 0;
+  }
+  fprintf(stderr, "Writing %lld MB to %s...\n", size >> 20, path);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1){
+    perror(path);
+    return -1;
+  }
+  char* block = malloc(1 << 20);
+  for(int i = 0; i < (1 << 20); i++){
+    block[i] = "abcdefghijklmnopqrstuvwxyz0123456789\n"[(i * 7) % 37];
+  }
+  for(long long done = 0; done < size; done += 1 << 20){
+    size_t len = size - done < (1 << 20) ? size - done : (1 << 20);
+    if(write(fd, block, len) != (ssize_t)len){
+      perror(path);
+      return -1;
+    }
+  }
+  free(block);
+  fsync(fd);    // DONTNEED only drops pages that are already on disk
+  close(fd);
+  return 0;
+}
+
+// Read the whole file one way; returns 0 or -1
+int readFile(int method, size_t bufSize, char* buf){
+  if(method == 0){
+    FILE* f = fopen(path, "r");
+    if(!f) return -1;
+    size_t n;
+    while((n = fread(buf, 1, bufSize, f)) > 0){
+      consume(buf, n);
+    }
+    fclose(f);
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) return -1;
+  if(method == 4){
+    size_t window = bufSize < (size_t)pageSize ? pageSize : bufSize;
+    for(long long off = 0; off < fileSize; off += window){
+      size_t len = fileSize - off < (long long)window ? fileSize - off : window;
+      char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, off);
+      mapCalls++;
+      if(map == MAP_FAILED){
+        close(fd);
+        return -1;
+      }
+      consume(map, len);
+      munmap(map, len);
+      mapCalls++;
+    }
+    close(fd);
+    return 0;
+  }
+
+  ssize_t n;
+  long long off = 0;
+  struct iovec iov[READV_IOVS];
+  size_t piece = bufSize / READV_IOVS ? bufSize / READV_IOVS : 1;
+  for(int i = 0; i < READV_IOVS; i++){
+    iov[i].iov_base = buf + i * piece;
+    iov[i].iov_len = piece;
+  }
+  while(1){
+    if(method == 1){
+      n = read(fd, buf, bufSize);
+    } else if(method == 2){
+      n = pread(fd, buf, bufSize, off);
+    } else {
+      n = readv(fd, iov, READV_IOVS);
+    }
+    if(n <= 0) break;
+    consume(buf, n);
+    off += n;
+  }
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+// Throw the file out of the page cache
+void dropCache(){
+  int fd = open(path, O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Warm the cache back up
+void warmCache(){
+  char* buf = malloc(1 << 20);
+  int fd = open(path, O_RDONLY);
+  while(read(fd, buf, 1 << 20) > 0){
+  }
+  close(fd);
+  free(buf);
+}
+
+int measure(int method, size_t bufSize, int cold, char* buf, struct sample* s){
+  if(cold) dropCache();
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  long calls = readCalls();
+  mapCalls = 0;
+  double start = now();
+  int r = readFile(method, bufSize, buf);
+  s->secs = now() - start;
+  // The first readCalls() read() shows up in the second one's count
+  s->syscalls = readCalls() - calls - 1 + mapCalls;
+  getrusage(RUSAGE_SELF, &after);
+  s->userMs = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e3 +
+              (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e3;
+  s->sysMs = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e3 +
+             (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e3;
+  s->faults = (after.ru_minflt - before.ru_minflt) + (after.ru_majflt - before.ru_majflt);
+  return r;
+}
+
+int main(int argc, char* argv[]){
+  long long sizeMb = 64;
+  int runs = 3;
+  int useMethod[NUM_METHODS] = {1, 1, 1, 1, 1};
+  FILE* out = stdout;
+  int opt;
+  while((opt = getopt(argc, argv, "s:r:m:o:")) != -1){
+    if(opt == 's' && atoll(optarg) > 0){
+      sizeMb = atoll(optarg);
+    } else if(opt == 'r' && atoi(optarg) > 0){
+      runs = atoi(optarg);
+    } else if(opt == 'm'){
+      memset(useMethod, 0, sizeof(useMethod));
+      for(char* name = strtok(optarg, ","); name; name = strtok(NULL, ",")){
+        for(int m = 0; m < NUM_METHODS; m++){
+          if(strcmp(name, methods[m]) == 0) useMethod[m] = 1;
+        }
+      }
+    } else if(opt == 'o'){
+      out = fopen(optarg, "w");
+      if(!out){
+        perror(optarg);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [-s MB] [-r runs] [-m method,...] [-o file.csv] [file]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if(optind < argc){
+    path = argv[optind];
+  } else if(makeFile(sizeMb << 20) == -1){
+    return 1;
+  }
+  struct stat st;
+  if(stat(path, &st) == -1){
+    perror(path);
+    return 1;
+  }
+  fileSize = st.st_size;
+  pageSize = sysconf(_SC_PAGESIZE);
+  double mb = fileSize / (double)(1 << 20);
+  char* buf = aligned_alloc(pageSize, sizes[NUM_SIZES - 1]);
+
+  fprintf(out, "method,cache,buffer_bytes,mb_per_s,syscalls_per_mb,user_ms,sys_ms,faults\n");
+  for(int cold = 0; cold <= 1; cold++){
+    if(!cold) warmCache();
+    for(int m = 0; m < NUM_METHODS; m++){
+      if(!useMethod[m]) continue;
+      for(int i = 0; i < NUM_SIZES; i++){
+        struct sample best = {0}, s;
+        for(int r = 0; r < runs; r++){
+          if(measure(m, sizes[i], cold, buf, &s) == -1){
+            perror(path);
+            return 1;
+          }
+          if(r == 0 || s.secs < best.secs) best = s;
+        }
+        fprintf(out, "%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%ld\n", methods[m], cold ? "cold" : "warm",
+                sizes[i], mb / best.secs, best.syscalls / mb, best.userMs, best.sysMs,
+                best.faults);
+        fflush(out);
+        fprintf(stderr, ".");
+      }
+    }
+  }
+  fprintf(stderr, "\n(checksum %llx)\n", (unsigned long long)checksum);
+  free(buf);
+  return 0;
+}
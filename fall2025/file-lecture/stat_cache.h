@@ -0,0 +1,833 @@
+/* stat_cache.h */
+
+/*
+ * A cache of file metadata, so asking "how big is this file, and when did it
+ * last change?" for the same paths over and over costs a hash lookup instead
+ * of a system call each time.
+ *
+ * fstatTest.c and lstatTest.c call stat() once per path, which is fine once.
+ * A web server stats index.html on every request, an editor stats the file
+ * it is about to save, a tree walker stats every file again on the next run;
+ * the answer is almost always the same. Here:
+ *
+ *   - Lookups come in batches (scStatBatch()). The paths that aren't cached
+ *     are handed to the kernel together: one io_uring_enter() submits a
+ *     statx() for each of them and waits for all the answers. Where io_uring
+ *     isn't available, they are statx()ed one at a time.
+ *   - statx() is asked only for the fields the caller wants (STATX_SIZE,
+ *     STATX_MTIME, ...). An entry remembers which fields it has, and a later
+ *     lookup that wants more fetches again.
+ *   - Metadata is stored once per file, keyed by (device, inode), and paths
+ *     point at it, so two names for the same file (hard links, "a/../b" and
+ *     "b") share the metadata, though each name is a path entry of its own.
+ *     Failed lookups are cached too: a missing file stays missing until
+ *     something is created in its directory.
+ *   - Every directory holding a cached path gets an inotify watch. A
+ *     background thread reads the events and throws out the entries for
+ *     whatever changed (a write, chmod, rename, delete, create), so there's
+ *     nothing to check on the lookup path. If the kernel's event queue
+ *     overflows, the whole cache is dropped. A directory reached by several
+ *     names ("." and its absolute path, a symlinked parent, "a/..") has one
+ *     watch, which keeps every name, so an event drops the path under each.
+ *   - At most SC_MAX_PATHS paths are kept; past that the least recently
+ *     used go, and a directory left with none loses its watch.
+ *
+ * What it can't see: a file changed through a hard link in a directory we
+ * aren't watching, the target of a symlink changing (paths are followed,
+ * like stat()), and anything on network filesystems, where inotify only
+ * hears about local changes. A change reaches the cache after the event
+ * thread has read it, so a lookup right after a write may see the old
+ * metadata for a few microseconds.
+ *
+ * Relative paths are taken relative to the working directory at lookup
+ * time; don't chdir() while the cache holds any. All functions are safe to
+ * call from several threads. Needs _GNU_SOURCE (for statx()) and -pthread.
+ */
+
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <linux/io_uring.h>
+
+#define SC_RING 256                 // statx() requests per io_uring_enter()
+#define SC_BUCKETS_MIN 1024
+#define SC_MAX_PATHS (256 * 1024)   // Past this, the least recently used paths go
+#define SC_WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+                       IN_ONLYDIR)
+
+// One file's metadata, shared by every path that leads to it
+typedef struct ScInode {
+    struct ScInode* next;       // Hash chain
+    uint64_t dev;
+    uint64_t ino;
+    unsigned mask;              // The STATX_ fields st holds
+    struct statx st;
+} ScInode;
+
+// A path we've looked up: the file it led to, or the error it gave
+typedef struct ScPath {
+    struct ScPath* next;        // Hash chain
+    struct ScPath* newer;       // Use order: the next more recently used path
+    struct ScPath* older;
+    uint64_t hash;
+    int err;                    // 0, or the errno statx() gave (ENOENT, ...)
+    int wd;                     // Watch on the directory it's in
+    uint64_t dev;
+    uint64_t ino;
+    char path[];
+} ScPath;
+
+// Directory name to wd, so a miss in a directory we already watch costs no
+// inotify_add_watch()
+typedef struct ScDir {
+    struct ScDir* next;         // Hash chain
+    struct ScDir* sibling;      // The next name for the same wd
+    uint64_t hash;
+    int wd;
+    char dir[];
+} ScDir;
+
+// A watched directory. wds are small integers, so they index an array
+typedef struct {
+    ScDir* names;               // Every name we've reached it by; NULL if this wd isn't ours
+    size_t paths;               // Cached paths in it
+    unsigned long gen;          // Bumped by every event in it
+} ScWatch;
+
+#define SC_DIR_BUCKETS 1024
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long statxCalls;   // statx() requests made, through io_uring or not
+    unsigned long enterCalls;   // io_uring_enter() calls
+    unsigned long invalidations;    // Paths thrown out (events, scInvalidate())
+    unsigned long flushes;      // Whole-cache drops (event queue overflow)
+    unsigned long evictions;    // Paths dropped to stay under SC_MAX_PATHS
+    size_t paths;
+    size_t inodes;
+    size_t watches;
+} ScStats;
+
+typedef struct {
+    pthread_mutex_t lock;       // Everything below except the ring
+    ScPath** paths;
+    size_t pathBuckets;
+    size_t pathCount;
+    ScPath* newest;             // Use order, for eviction
+    ScPath* oldest;
+    ScInode** inodes;
+    size_t inodeBuckets;
+    size_t inodeCount;
+    ScWatch* watches;
+    size_t watchCap;
+    size_t watchCount;
+    ScDir* dirs[SC_DIR_BUCKETS];
+    unsigned long gen;          // Bumped when the whole cache is dropped
+    ScStats stats;
+
+    int inotifyFd;
+    int stopPipe[2];            // Written by scClose() to stop the event thread
+    pthread_t eventThread;
+
+    pthread_mutex_t ringLock;   // One batch at a time uses the ring
+    int ringFd;                 // -1 if io_uring isn't available
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_sqe* sqes;
+    void* sqMap;
+    size_t sqMapLen;
+    void* cqMap;
+    size_t cqMapLen;
+    size_t sqesLen;
+    unsigned ringEntries;
+} StatCache;
+
+static inline uint64_t scHash(const char* s) {
+    uint64_t h = 14695981039346656037ull;      // FNV-1a
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 1099511628211ull;
+    }
+    return h;
+}
+
+static inline size_t scInodeSlot(const StatCache* sc, uint64_t dev, uint64_t ino) {
+    return ((ino * 0x9e3779b97f4a7c15ull) ^ dev) & (sc->inodeBuckets - 1);
+}
+
+static inline ScPath* scFindPath(const StatCache* sc, const char* path, uint64_t hash) {
+    for (ScPath* p = sc->paths[hash & (sc->pathBuckets - 1)]; p; p = p->next) {
+        if (p->hash == hash && strcmp(p->path, path) == 0) return p;
+    }
+    return NULL;
+}
+
+static inline ScInode* scFindInode(const StatCache* sc, uint64_t dev, uint64_t ino) {
+    for (ScInode* n = sc->inodes[scInodeSlot(sc, dev, ino)]; n; n = n->next) {
+        if (n->dev == dev && n->ino == ino) return n;
+    }
+    return NULL;
+}
+
+static inline void scUnlinkUse(StatCache* sc, ScPath* p) {
+    if (p->newer) p->newer->older = p->older; else sc->newest = p->older;
+    if (p->older) p->older->newer = p->newer; else sc->oldest = p->newer;
+}
+
+// p was just looked up: move it to the newest end
+static inline void scUsed(StatCache* sc, ScPath* p) {
+    if (sc->newest == p) return;
+    scUnlinkUse(sc, p);
+    p->newer = NULL;
+    p->older = sc->newest;
+    if (sc->newest) sc->newest->newer = p; else sc->oldest = p;
+    sc->newest = p;
+}
+
+static inline void scDropInode(StatCache* sc, uint64_t dev, uint64_t ino) {
+    ScInode** link = &sc->inodes[scInodeSlot(sc, dev, ino)];
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->dev == dev && (*link)->ino == ino) {
+            ScInode* dead = *link;
+            *link = dead->next;
+            free(dead);
+            sc->inodeCount--;
+            return;
+        }
+    }
+}
+
+// Forget one path, and the metadata of the file it led to (which other
+// paths to the same file will then fetch again)
+static inline void scFreePath(StatCache* sc, ScPath** link) {
+    ScPath* dead = *link;
+    *link = dead->next;
+    scUnlinkUse(sc, dead);
+    if (dead->err == 0) scDropInode(sc, dead->dev, dead->ino);
+    if (dead->wd >= 0 && (size_t)dead->wd < sc->watchCap) sc->watches[dead->wd].paths--;
+    free(dead);
+    sc->pathCount--;
+}
+
+// The same, because it may have changed
+static inline void scDropPath(StatCache* sc, ScPath** link) {
+    scFreePath(sc, link);
+    sc->stats.invalidations++;
+}
+
+// Double a hash table once it holds as many entries as buckets
+static inline void scGrowPaths(StatCache* sc) {
+    size_t buckets = sc->pathBuckets * 2;
+    ScPath** table = calloc(buckets, sizeof(ScPath*));
+    if (!table) return;
+    for (size_t b = 0; b < sc->pathBuckets; b++) {
+        while (sc->paths[b]) {
+            ScPath* p = sc->paths[b];
+            sc->paths[b] = p->next;
+            p->next = table[p->hash & (buckets - 1)];
+            table[p->hash & (buckets - 1)] = p;
+        }
+    }
+    free(sc->paths);
+    sc->paths = table;
+    sc->pathBuckets = buckets;
+}
+
+static inline void scGrowInodes(StatCache* sc) {
+    size_t old = sc->inodeBuckets;
+    ScInode** oldTable = sc->inodes;
+    ScInode** table = calloc(old * 2, sizeof(ScInode*));
+    if (!table) return;
+    sc->inodes = table;
+    sc->inodeBuckets = old * 2;
+    for (size_t b = 0; b < old; b++) {
+        while (oldTable[b]) {
+            ScInode* n = oldTable[b];
+            oldTable[b] = n->next;
+            size_t slot = scInodeSlot(sc, n->dev, n->ino);
+            n->next = table[slot];
+            table[slot] = n;
+        }
+    }
+    free(oldTable);
+}
+
+static inline ScDir* scFindDir(const StatCache* sc, const char* dir, uint64_t hash) {
+    for (ScDir* d = sc->dirs[hash % SC_DIR_BUCKETS]; d; d = d->next) {
+        if (d->hash == hash && strcmp(d->dir, dir) == 0) return d;
+    }
+    return NULL;
+}
+
+// The watch is gone: forget every name it had
+static inline void scForgetNames(StatCache* sc, ScWatch* w) {
+    while (w->names) {
+        ScDir* dead = w->names;
+        w->names = dead->sibling;
+        ScDir** link = &sc->dirs[dead->hash % SC_DIR_BUCKETS];
+        while (*link != dead) link = &(*link)->next;
+        *link = dead->next;
+        free(dead);
+    }
+}
+
+// Drop every path in one directory (its watch went away), or everything
+static inline void scDropWhere(StatCache* sc, int wd) {
+    for (size_t b = 0; b < sc->pathBuckets; b++) {
+        ScPath** link = &sc->paths[b];
+        while (*link) {
+            if (wd < 0 || (*link)->wd == wd) {
+                scDropPath(sc, link);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+    if (wd < 0) {
+        sc->gen++;
+    } else {
+        sc->watches[wd].gen++;
+    }
+}
+
+/*
+ * Drop the least recently used paths until there are at most SC_MAX_PATHS.
+ * A directory left with no cached paths loses its watch too, so neither
+ * grows without bound on a long walk. Its names are forgotten now rather
+ * than when IN_IGNORED arrives, so no new path gets cached under the dead
+ * wd. Called with the lock held.
+ */
+static inline void scEvict(StatCache* sc) {
+    while (sc->pathCount > SC_MAX_PATHS) {
+        ScPath* old = sc->oldest;
+        ScPath** link = &sc->paths[old->hash & (sc->pathBuckets - 1)];
+        while (*link != old) link = &(*link)->next;
+        int wd = old->wd;
+        scFreePath(sc, link);
+        sc->stats.evictions++;
+        if (wd < 0 || (size_t)wd >= sc->watchCap) continue;
+        ScWatch* w = &sc->watches[wd];
+        if (w->names && w->paths == 0) {
+            inotify_rm_watch(sc->inotifyFd, wd);
+            scForgetNames(sc, w);
+            w->gen++;
+            sc->watchCount--;
+        }
+    }
+}
+
+// Act on one inotify event. Called with the lock held
+static inline void scHandleEvent(StatCache* sc, const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so anything could be stale
+        scDropWhere(sc, -1);
+        sc->stats.flushes++;
+        return;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= sc->watchCap || !sc->watches[ev->wd].names) return;
+    ScWatch* w = &sc->watches[ev->wd];
+    w->gen++;
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+        // The directory itself is gone or moved: its paths mean something else now
+        scDropWhere(sc, ev->wd);
+        if (ev->mask & IN_IGNORED) {
+            scForgetNames(sc, w);
+            sc->watchCount--;
+        }
+        return;
+    }
+    if (ev->len == 0) return;       // The directory's own attributes
+
+    // The file may be cached under any of the directory's names
+    for (ScDir* d = w->names; d; d = d->sibling) {
+        size_t dirLen = strlen(d->dir);
+        char path[PATH_MAX];
+        if (dirLen + 1 + strlen(ev->name) >= sizeof(path)) continue;
+        if (strcmp(d->dir, ".") == 0) {
+            strcpy(path, ev->name);     // Cached as "name", not "./name"
+        } else if (strcmp(d->dir, "/") == 0) {
+            snprintf(path, sizeof(path), "/%s", ev->name);
+        } else {
+            memcpy(path, d->dir, dirLen);
+            path[dirLen] = '/';
+            strcpy(path + dirLen + 1, ev->name);
+        }
+        uint64_t hash = scHash(path);
+        ScPath** link = &sc->paths[hash & (sc->pathBuckets - 1)];
+        for (; *link; link = &(*link)->next) {
+            if ((*link)->hash == hash && strcmp((*link)->path, path) == 0) {
+                scDropPath(sc, link);
+                break;
+            }
+        }
+    }
+}
+
+static inline void* scEventLoop(void* arg) {
+    StatCache* sc = arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {{sc->inotifyFd, POLLIN, 0}, {sc->stopPipe[0], POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        ssize_t n = read(sc->inotifyFd, buf, sizeof(buf));
+        if (n <= 0) continue;
+        pthread_mutex_lock(&sc->lock);
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            scHandleEvent(sc, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&sc->lock);
+    }
+    return NULL;
+}
+
+// Set up an io_uring with room for SC_RING requests; on any failure the
+// cache just makes plain statx() calls
+static inline void scRingSetup(StatCache* sc) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    sc->ringFd = syscall(__NR_io_uring_setup, SC_RING, &p);
+    if (sc->ringFd < 0) {
+        sc->ringFd = -1;
+        return;
+    }
+    sc->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    sc->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sc->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    sc->sqMap = mmap(NULL, sc->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     sc->ringFd, IORING_OFF_SQ_RING);
+    sc->cqMap = mmap(NULL, sc->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     sc->ringFd, IORING_OFF_CQ_RING);
+    sc->sqes = mmap(NULL, sc->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    sc->ringFd, IORING_OFF_SQES);
+    if (sc->sqMap == MAP_FAILED || sc->cqMap == MAP_FAILED || sc->sqes == MAP_FAILED) {
+        if (sc->sqMap != MAP_FAILED) munmap(sc->sqMap, sc->sqMapLen);
+        if (sc->cqMap != MAP_FAILED) munmap(sc->cqMap, sc->cqMapLen);
+        if (sc->sqes != MAP_FAILED) munmap(sc->sqes, sc->sqesLen);
+        close(sc->ringFd);
+        sc->ringFd = -1;
+        return;
+    }
+    char* sq = sc->sqMap;
+    char* cq = sc->cqMap;
+    sc->sqHead = (unsigned*)(sq + p.sq_off.head);
+    sc->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    sc->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sc->sqArray = (unsigned*)(sq + p.sq_off.array);
+    sc->cqHead = (unsigned*)(cq + p.cq_off.head);
+    sc->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    sc->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    sc->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    sc->ringEntries = p.sq_entries;
+}
+
+// statx() paths[0..n) for the fields in masks[0..n) into out[], errors (as
+// positive errno) into errs[]. Through the ring if we have one: one
+// io_uring_enter() per SC_RING paths
+static inline void scFetch(StatCache* sc, const char* const* paths, size_t n,
+                           const unsigned* masks, struct statx* out, int* errs) {
+    if (sc->ringFd == -1) {
+        for (size_t i = 0; i < n; i++) {
+            errs[i] = statx(AT_FDCWD, paths[i], AT_STATX_SYNC_AS_STAT, masks[i], &out[i])
+                      == -1 ? errno : 0;
+        }
+        pthread_mutex_lock(&sc->lock);
+        sc->stats.statxCalls += n;
+        pthread_mutex_unlock(&sc->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&sc->ringLock);
+    unsigned long enters = 0;
+    for (size_t done = 0; done < n; ) {
+        unsigned batch = n - done < sc->ringEntries ? n - done : sc->ringEntries;
+        unsigned tail = *sc->sqTail;
+        for (unsigned i = 0; i < batch; i++) {
+            unsigned slot = (tail + i) & *sc->sqMask;
+            struct io_uring_sqe* sqe = &sc->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)paths[done + i];
+            sqe->len = masks[done + i];
+            sqe->off = (uint64_t)(uintptr_t)&out[done + i];
+            sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+            sqe->user_data = done + i;
+            sc->sqArray[slot] = slot;
+        }
+        __atomic_store_n(sc->sqTail, tail + batch, __ATOMIC_RELEASE);
+
+        unsigned reaped = 0;
+        while (reaped < batch) {
+            // Whatever the kernel hasn't taken yet (all of it, unless an
+            // earlier call was interrupted part way)
+            unsigned toSubmit = tail + batch - __atomic_load_n(sc->sqHead, __ATOMIC_ACQUIRE);
+            int r = syscall(__NR_io_uring_enter, sc->ringFd, toSubmit, batch - reaped,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+            enters++;
+            if (r < 0 && errno != EINTR) {
+                // The ring broke; answer the rest the slow way
+                for (size_t i = done; i < n; i++) {
+                    errs[i] = statx(AT_FDCWD, paths[i], AT_STATX_SYNC_AS_STAT, masks[i],
+                                    &out[i]) == -1 ? errno : 0;
+                }
+                pthread_mutex_unlock(&sc->ringLock);
+                return;
+            }
+            unsigned head = *sc->cqHead;
+            unsigned cqTail = __atomic_load_n(sc->cqTail, __ATOMIC_ACQUIRE);
+            for (; head != cqTail; head++) {
+                struct io_uring_cqe* cqe = &sc->cqes[head & *sc->cqMask];
+                errs[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+                reaped++;
+            }
+            __atomic_store_n(sc->cqHead, head, __ATOMIC_RELEASE);
+        }
+        done += batch;
+    }
+    pthread_mutex_unlock(&sc->ringLock);
+
+    pthread_mutex_lock(&sc->lock);
+    sc->stats.statxCalls += n;
+    sc->stats.enterCalls += enters;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// Watch the directory path is in. Returns the wd and its current gen, or -1
+static inline int scWatchDir(StatCache* sc, const char* path, unsigned long* gen) {
+    const char* slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        if ((size_t)(slash - path) >= sizeof(dir)) return -1;
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    uint64_t hash = scHash(dir);
+    pthread_mutex_lock(&sc->lock);
+    ScDir* known = scFindDir(sc, dir, hash);
+    if (known) {
+        *gen = sc->watches[known->wd].gen;
+        pthread_mutex_unlock(&sc->lock);
+        return known->wd;
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    // Adding a watch that exists gives back its wd (also when dir is another
+    // name for a directory we watch), so a race here is harmless
+    int wd = inotify_add_watch(sc->inotifyFd, dir, SC_WATCH_MASK);
+    if (wd < 0) return -1;
+
+    pthread_mutex_lock(&sc->lock);
+    if ((size_t)wd >= sc->watchCap) {
+        size_t cap = sc->watchCap ? sc->watchCap : 64;
+        while (cap <= (size_t)wd) cap *= 2;
+        ScWatch* bigger = realloc(sc->watches, cap * sizeof(ScWatch));
+        if (!bigger) {
+            pthread_mutex_unlock(&sc->lock);
+            return -1;
+        }
+        memset(bigger + sc->watchCap, 0, (cap - sc->watchCap) * sizeof(ScWatch));
+        sc->watches = bigger;
+        sc->watchCap = cap;
+    }
+    if (!scFindDir(sc, dir, hash)) {
+        ScDir* d = malloc(sizeof(ScDir) + strlen(dir) + 1);
+        if (!d) {
+            pthread_mutex_unlock(&sc->lock);
+            return -1;      // Without its name, events couldn't find the paths
+        }
+        strcpy(d->dir, dir);
+        d->hash = hash;
+        d->wd = wd;
+        d->next = sc->dirs[hash % SC_DIR_BUCKETS];
+        sc->dirs[hash % SC_DIR_BUCKETS] = d;
+        if (!sc->watches[wd].names) sc->watchCount++;
+        d->sibling = sc->watches[wd].names;
+        sc->watches[wd].names = d;
+    }
+    *gen = sc->watches[wd].gen;
+    pthread_mutex_unlock(&sc->lock);
+    return wd;
+}
+
+/*
+ * Look up n paths at once, wanting at least the STATX_ fields in mask.
+ * out[i] gets path i's metadata and errs[i] 0, or errs[i] the errno stat()
+ * would have set. Returns the number of paths that failed.
+ */
+static inline size_t scStatBatch(StatCache* sc, const char* const* paths, size_t n,
+                                 unsigned mask, struct statx* out, int* errs) {
+    size_t* missing = malloc(n * sizeof(size_t));
+    const char** missPaths = malloc(n * sizeof(char*));
+    unsigned* missMasks = malloc(n * sizeof(unsigned));
+    if (!missing || !missPaths || !missMasks) {
+        free(missing);
+        free(missPaths);
+        free(missMasks);
+        for (size_t i = 0; i < n; i++) errs[i] = ENOMEM;
+        return n;
+    }
+
+    // Answer what we can from the tables
+    size_t misses = 0, failed = 0;
+    pthread_mutex_lock(&sc->lock);
+    for (size_t i = 0; i < n; i++) {
+        ScPath* p = scFindPath(sc, paths[i], scHash(paths[i]));
+        if (p && p->err) {
+            errs[i] = p->err;
+            failed++;
+            sc->stats.hits++;
+            scUsed(sc, p);
+            continue;
+        }
+        ScInode* node = p ? scFindInode(sc, p->dev, p->ino) : NULL;
+        if (node && (node->mask & mask) == mask) {
+            out[i] = node->st;
+            errs[i] = 0;
+            sc->stats.hits++;
+            scUsed(sc, p);
+            continue;
+        }
+        // Ask for what's wanted plus what the entry already has, so a hard
+        // link or a repeat lookup wanting other fields doesn't shrink it
+        missing[misses] = i;
+        missMasks[misses] = mask | (node ? node->mask : 0);
+        missPaths[misses++] = paths[i];
+        sc->stats.misses++;
+    }
+    unsigned long gen = sc->gen;
+    pthread_mutex_unlock(&sc->lock);
+    if (misses == 0) {
+        free(missing);
+        free(missPaths);
+        free(missMasks);
+        return failed;
+    }
+
+    // Watch first and stat after, so a change in between still makes an event
+    int* wds = malloc(misses * sizeof(int));
+    unsigned long* gens = malloc(misses * sizeof(unsigned long));
+    struct statx* got = malloc(misses * sizeof(struct statx));
+    int* gotErr = malloc(misses * sizeof(int));
+    if (!wds || !gens || !got || !gotErr) {
+        for (size_t m = 0; m < misses; m++) errs[missing[m]] = ENOMEM;
+        failed += misses;
+        misses = 0;
+    }
+    for (size_t m = 0; m < misses; m++) {
+        wds[m] = scWatchDir(sc, missPaths[m], &gens[m]);
+    }
+    scFetch(sc, missPaths, misses, missMasks, got, gotErr);
+
+    pthread_mutex_lock(&sc->lock);
+    // If an event came in for a directory while we were fetching, it may have
+    // been about one of these paths; answer with what we got, but don't keep it
+    int keep = sc->gen == gen;
+    for (size_t m = 0; m < misses; m++) {
+        size_t i = missing[m];
+        errs[i] = gotErr[m];
+        if (gotErr[m]) {
+            failed++;
+        } else {
+            out[i] = got[m];
+        }
+        if (!keep || wds[m] < 0 || !sc->watches[wds[m]].names ||
+            sc->watches[wds[m]].gen != gens[m]) continue;
+
+        uint64_t hash = scHash(missPaths[m]);
+        ScPath* p = scFindPath(sc, missPaths[m], hash);
+        if (!p) {
+            size_t len = strlen(missPaths[m]);
+            p = malloc(sizeof(ScPath) + len + 1);
+            if (!p) continue;
+            memcpy(p->path, missPaths[m], len + 1);
+            p->hash = hash;
+            p->wd = wds[m];
+            sc->watches[wds[m]].paths++;
+            size_t b = hash & (sc->pathBuckets - 1);
+            p->next = sc->paths[b];
+            sc->paths[b] = p;
+            p->newer = NULL;
+            p->older = sc->newest;
+            if (sc->newest) sc->newest->newer = p; else sc->oldest = p;
+            sc->newest = p;
+            if (++sc->pathCount > sc->pathBuckets) scGrowPaths(sc);
+        } else {
+            scUsed(sc, p);
+        }
+        p->err = gotErr[m];
+        if (gotErr[m]) continue;
+        p->dev = makedev(got[m].stx_dev_major, got[m].stx_dev_minor);
+        p->ino = got[m].stx_ino;
+        ScInode* node = scFindInode(sc, p->dev, p->ino);
+        if (!node) {
+            node = malloc(sizeof(ScInode));
+            if (!node) continue;
+            node->dev = p->dev;
+            node->ino = p->ino;
+            size_t slot = scInodeSlot(sc, node->dev, node->ino);
+            node->next = sc->inodes[slot];
+            sc->inodes[slot] = node;
+            if (++sc->inodeCount > sc->inodeBuckets) scGrowInodes(sc);
+        }
+        node->st = got[m];
+        // Fields this filesystem can't give count as answered, or asking for
+        // them would miss forever
+        node->mask = got[m].stx_mask | missMasks[m];
+    }
+    scEvict(sc);
+    pthread_mutex_unlock(&sc->lock);
+    free(wds);
+    free(gens);
+    free(got);
+    free(gotErr);
+    free(missing);
+    free(missPaths);
+    free(missMasks);
+    return failed;
+}
+
+// One path: returns 0, or -1 with errno set, like stat()
+static inline int scStat(StatCache* sc, const char* path, unsigned mask, struct statx* out) {
+    int err;
+    if (scStatBatch(sc, &path, 1, mask, out, &err) == 0) return 0;
+    errno = err;
+    return -1;
+}
+
+// Forget a path right now, without waiting for its event (say, after we
+// wrote the file ourselves)
+static inline void scInvalidate(StatCache* sc, const char* path) {
+    pthread_mutex_lock(&sc->lock);
+    uint64_t hash = scHash(path);
+    ScPath** link = &sc->paths[hash & (sc->pathBuckets - 1)];
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->hash == hash && strcmp((*link)->path, path) == 0) {
+            scDropPath(sc, link);
+            break;
+        }
+    }
+    sc->gen++;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+static inline void scStats(StatCache* sc, ScStats* st) {
+    pthread_mutex_lock(&sc->lock);
+    *st = sc->stats;
+    st->paths = sc->pathCount;
+    st->inodes = sc->inodeCount;
+    st->watches = sc->watchCount;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// Returns 0, or -1 with errno set. useRing = 0 skips io_uring
+static inline int scOpen(StatCache* sc, int useRing) {
+    memset(sc, 0, sizeof(*sc));
+    sc->ringFd = -1;
+    sc->pathBuckets = sc->inodeBuckets = SC_BUCKETS_MIN;
+    sc->paths = calloc(sc->pathBuckets, sizeof(ScPath*));
+    sc->inodes = calloc(sc->inodeBuckets, sizeof(ScInode*));
+    if (!sc->paths || !sc->inodes) {
+        free(sc->paths);
+        free(sc->inodes);
+        errno = ENOMEM;
+        return -1;
+    }
+    sc->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (sc->inotifyFd == -1 || pipe2(sc->stopPipe, O_CLOEXEC) == -1) {
+        int err = errno;
+        if (sc->inotifyFd != -1) close(sc->inotifyFd);
+        free(sc->paths);
+        free(sc->inodes);
+        errno = err;
+        return -1;
+    }
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_mutex_init(&sc->ringLock, NULL);
+    if (useRing) scRingSetup(sc);
+    int err = pthread_create(&sc->eventThread, NULL, scEventLoop, sc);
+    if (err) {
+        close(sc->inotifyFd);
+        close(sc->stopPipe[0]);
+        close(sc->stopPipe[1]);
+        free(sc->paths);
+        free(sc->inodes);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void scClose(StatCache* sc) {
+    if (write(sc->stopPipe[1], "x", 1) == 1) {
+        pthread_join(sc->eventThread, NULL);
+    }
+    close(sc->stopPipe[0]);
+    close(sc->stopPipe[1]);
+    close(sc->inotifyFd);       // Removes every watch
+    for (size_t b = 0; b < sc->pathBuckets; b++) {
+        while (sc->paths[b]) {
+            ScPath* next = sc->paths[b]->next;
+            free(sc->paths[b]);
+            sc->paths[b] = next;
+        }
+    }
+    for (size_t b = 0; b < sc->inodeBuckets; b++) {
+        while (sc->inodes[b]) {
+            ScInode* next = sc->inodes[b]->next;
+            free(sc->inodes[b]);
+            sc->inodes[b] = next;
+        }
+    }
+    for (size_t b = 0; b < SC_DIR_BUCKETS; b++) {
+        while (sc->dirs[b]) {
+            ScDir* next = sc->dirs[b]->next;
+            free(sc->dirs[b]);
+            sc->dirs[b] = next;
+        }
+    }
+    free(sc->watches);
+    free(sc->paths);
+    free(sc->inodes);
+    if (sc->ringFd != -1) {
+        munmap(sc->sqes, sc->sqesLen);
+        munmap(sc->cqMap, sc->cqMapLen);
+        munmap(sc->sqMap, sc->sqMapLen);
+        close(sc->ringFd);
+    }
+    pthread_mutex_destroy(&sc->lock);
+    pthread_mutex_destroy(&sc->ringLock);
+}
+
+#endif
@@ -0,0 +1,471 @@
+/*
+ weirdcopy2.c: weirdcopy.c for big files, with several threads at once.
+
+ weirdcopy.c copies with fgets()/fputs(), a line (at most 1KB) at a time.
+ That is slow, and it isn't even a copy for binary files: a 0 byte ends a
+ "line" early and the rest of it is lost. Here:
+
+   - the destination gets its full size up front with fallocate(), so the
+     filesystem can lay it out in one piece and the threads can write
+     anywhere in it without extending the file
+   - the file is split into chunks (64MB by default) and a pool of threads
+     takes them one by one: while one thread waits for the disk, the
+     others keep it busy. A fast SSD needs several requests in flight to
+     reach its full speed; one thread only ever has one
+   - each chunk is copied with copy_file_range(), which never brings the
+     bytes into our memory, or with pread()/pwrite() and a 1MB buffer per
+     thread if the kernel can't do that for these files (-m rw forces it)
+   - every 200ms the main thread shows how far along we are and how fast
+     it's going
+
+ Two more modes, for VM images and database files:
+
+   -S (sparse): a 100GB disk image may hold only 5GB of data; the rest are
+     holes, which read as zeros but take no space. A plain copy reads the
+     zeros and writes them out for real. With -S each chunk asks
+     lseek(SEEK_DATA) and lseek(SEEK_HOLE) where its data is and copies
+     only that; the destination gets its size from ftruncate(), so the
+     holes stay holes
+   -D (direct): everything we read or write normally also lands in the page
+     cache, pushing out whatever the machine was really using. With -D
+     both files are opened O_DIRECT, so the data goes between the disk and
+     our buffers only. That needs buffers aligned to ALIGN bytes, and
+     every read and write blocks until the disk is done, so instead of
+     the thread pool one thread reads into a pool of DIRECT_BUFS buffers
+     while another writes the full ones out: the read of the next MB
+     overlaps the write of this one. -S works here too
+
+ Compile: gcc -Wall -g -pthread weirdcopy2.c -o weirdcopy2
+ Usage: ./weirdcopy2 [-j threads] [-c chunk MB] [-m copy|rw] [-S] [-D] source destination
+*/
+
+#define _GNU_SOURCE   // copy_file_range(), fallocate(), O_DIRECT, SEEK_DATA
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define BUF_SIZE (1 << 20)
+#define ALIGN 4096            // O_DIRECT buffers, offsets and lengths
+#define DIRECT_BUFS 4
+
+enum { COPY, RW };
+
+int src, dst;
+long long fileSize;
+long long chunkSize = 64LL << 20;
+long long numChunks;
+int sparse = 0;
+int direct = 0;
+
+// Shared by the threads, under lock
+int mode = COPY;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+long long nextChunk = 0;
+long long copied = 0;     // Including holes we skipped, for the progress line
+long long holes = 0;
+int running;
+int failed = 0;
+
+double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Next chunk to copy, or -1 when there are none left (or we gave up),
+// and how to copy it
+long long takeChunk(int* how){
+  pthread_mutex_lock(&lock);
+  long long c = failed || nextChunk == numChunks ? -1 : nextChunk++;
+  *how = mode;
+  pthread_mutex_unlock(&lock);
+  return c;
+}
+
+void addProgress(long long n){
+  pthread_mutex_lock(&lock);
+  copied += n;
+  pthread_mutex_unlock(&lock);
+}
+
+void skipHole(long long n){
+  pthread_mutex_lock(&lock);
+  copied += n;
+  holes += n;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ Where the next data at or after off (and before end) is: sets *start and
+ *stop and returns 1, or returns 0 if the rest is a hole. lseek() moves
+ the shared file offset, but nobody uses it: every copy names its offset.
+*/
+int nextData(long long off, long long end, long long* start, long long* stop){
+  long long data = lseek(src, off, SEEK_DATA);
+  if(data == -1 || data >= end){
+    return 0;       // ENXIO: only a hole from here to the end of the file
+  }
+  long long hole = lseek(src, data, SEEK_HOLE);
+  *start = data;
+  *stop = hole == -1 || hole > end ? end : hole;
+  return 1;
+}
+
+/*
+ Copy [off, off + len) with copy_file_range(). Returns 0, 1 if the kernel
+ can't do it for these files (nothing copied), or -1 on an error.
+*/
+int copyRange(long long off, long long len){
+  loff_t in = off, out = off;
+  long long done = 0;
+  while(done < len){
+    ssize_t n = copy_file_range(src, &in, dst, &out, len - done, 0);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                              errno == EOPNOTSUPP)){
+      return 1;
+    }
+    if(n == 0){
+      errno = EIO;  // The source got shorter under us
+    }
+    if(n <= 0){
+      return -1;
+    }
+    done += n;
+    addProgress(n);
+  }
+  return 0;
+}
+
+// The same with pread()/pwrite() through buf
+int rwRange(char* buf, long long off, long long len){
+  long long done = 0;
+  while(done < len){
+    size_t want = len - done < BUF_SIZE ? len - done : BUF_SIZE;
+    ssize_t n = pread(src, buf, want, off + done);
+    if(n < 0 && errno == EINTR){
+      continue;
+    }
+    if(n == 0){
+      errno = EIO;  // The source shrank since we looked at its size
+    }
+    if(n <= 0){
+      return -1;
+    }
+    for(ssize_t w = 0; w < n; ){
+      ssize_t m = pwrite(dst, buf + w, n - w, off + done + w);
+      if(m < 0 && errno == EINTR){
+        continue;
+      }
+      if(m < 0){
+        return -1;
+      }
+      w += m;
+    }
+    done += n;
+    addProgress(n);
+  }
+  return 0;
+}
+
+// Copy one piece of data, switching everyone to pread/pwrite if need be
+int copyData(char** buf, int how, long long off, long long len){
+  int r = how == COPY ? copyRange(off, len) : 1;
+  if(r == 1){
+    if(how == COPY){
+      // Every thread would find the same; no need to ask again
+      pthread_mutex_lock(&lock);
+      mode = RW;
+      pthread_mutex_unlock(&lock);
+    }
+    if(!*buf && !(*buf = malloc(BUF_SIZE))){
+      return -1;
+    }
+    r = rwRange(*buf, off, len);
+  }
+  return r;
+}
+
+void* copier(void* arg){
+  char* buf = NULL;
+  long long c;
+  int how;
+  while((c = takeChunk(&how)) != -1){
+    long long off = c * chunkSize;
+    long long end = off + chunkSize < fileSize ? off + chunkSize : fileSize;
+    int r = 0;
+    if(!sparse){
+      r = copyData(&buf, how, off, end - off);
+    }
+    long long start, stop;
+    while(sparse && r == 0 && off < end){
+      if(!nextData(off, end, &start, &stop)){
+        start = stop = end;
+      }
+      skipHole(start - off);
+      if(start < stop){
+        r = copyData(&buf, how, start, stop - start);
+      }
+      off = stop;
+    }
+    if(r == -1){
+      perror("copy");
+      pthread_mutex_lock(&lock);
+      failed = 1;
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  free(buf);
+  pthread_mutex_lock(&lock);
+  running--;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/*
+ O_DIRECT mode: the reader fills slots in order and the writer empties them
+ in the same order. A slot belongs to the reader while it's empty and to
+ the writer while it's full.
+*/
+struct slot {
+  char* buf;
+  long long off;
+  ssize_t len;      // Bytes read; -1 marks the end
+};
+
+struct slot slots[DIRECT_BUFS];
+int slotFull[DIRECT_BUFS];
+pthread_cond_t slotCond = PTHREAD_COND_INITIALIZER;
+
+void fillSlot(int i, long long off, ssize_t len){
+  slots[i].off = off;
+  slots[i].len = len;
+  pthread_mutex_lock(&lock);
+  slotFull[i] = 1;
+  pthread_cond_broadcast(&slotCond);
+  pthread_mutex_unlock(&lock);
+}
+
+// Wait until slot i is full (or empty); returns 0 if we gave up instead
+int waitSlot(int i, int full){
+  pthread_mutex_lock(&lock);
+  while(slotFull[i] != full && !failed){
+    pthread_cond_wait(&slotCond, &lock);
+  }
+  int ok = !failed;
+  pthread_mutex_unlock(&lock);
+  return ok;
+}
+
+void giveUp(const char* what){
+  perror(what);
+  pthread_mutex_lock(&lock);
+  failed = 1;
+  pthread_cond_broadcast(&slotCond);
+  pthread_mutex_unlock(&lock);
+}
+
+void* directReader(void* arg){
+  int i = 0;
+  long long off = 0;
+  while(off < fileSize){
+    long long start = off, stop = fileSize;
+    if(sparse && !nextData(off, fileSize, &start, &stop)){
+      start = stop = fileSize;
+    }
+    skipHole(start - off);
+    for(off = start; off < stop; ){
+      if(!waitSlot(i, 0)){
+        goto done;
+      }
+      // Lengths must be whole blocks too; a short read at the end is fine
+      long long want = stop - off < BUF_SIZE ? stop - off : BUF_SIZE;
+      want = (want + ALIGN - 1) / ALIGN * ALIGN;
+      ssize_t n = pread(src, slots[i].buf, want, off);
+      if(n <= 0){
+        giveUp("read");
+        goto done;
+      }
+      if(off + n > stop){
+        n = stop - off;
+      }
+      fillSlot(i, off, n);
+      off += n;
+      i = (i + 1) % DIRECT_BUFS;
+    }
+    off = stop;
+  }
+  if(waitSlot(i, 0)){
+    fillSlot(i, 0, -1);
+  }
+done:
+  pthread_mutex_lock(&lock);
+  running--;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void* directWriter(void* arg){
+  for(int i = 0; waitSlot(i, 1) && slots[i].len != -1; i = (i + 1) % DIRECT_BUFS){
+    // Round the last block up: the destination is cut to size afterwards
+    size_t len = (slots[i].len + ALIGN - 1) / ALIGN * ALIGN;
+    if(len > (size_t)slots[i].len){
+      memset(slots[i].buf + slots[i].len, 0, len - slots[i].len);
+    }
+    if(pwrite(dst, slots[i].buf, len, slots[i].off) != (ssize_t)len){
+      giveUp("write");
+      break;
+    }
+    addProgress(slots[i].len);
+    pthread_mutex_lock(&lock);
+    slotFull[i] = 0;
+    pthread_cond_broadcast(&slotCond);
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_mutex_lock(&lock);
+  running--;
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void showProgress(long long done, double start, int last){
+  double secs = now() - start;
+  fprintf(stderr, "\r%8.2f / %.2f GB  %3.0f%%  %6.0f MB/s  %5.1f s", done / 1e9,
+          fileSize / 1e9, fileSize ? 100.0 * done / fileSize : 100.0,
+          secs > 0 ? done / secs / 1e6 : 0, secs);
+  if(last){
+    fprintf(stderr, "\n");
+  }
+}
+
+int main(int argc, char* argv[]){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus > 4 ? cpus : 4;   // Even one core can keep 4 requests in flight
+  int opt;
+  while((opt = getopt(argc, argv, "j:c:m:SD")) != -1){
+    if(opt == 'j' && atoi(optarg) > 0){
+      threads = atoi(optarg);
+    } else if(opt == 'c' && atoll(optarg) > 0){
+      chunkSize = atoll(optarg) << 20;
+    } else if(opt == 'm' && strcmp(optarg, "copy") == 0){
+      mode = COPY;
+    } else if(opt == 'm' && strcmp(optarg, "rw") == 0){
+      mode = RW;
+    } else if(opt == 'S'){
+      sparse = 1;
+    } else if(opt == 'D'){
+      direct = 1;
+    } else {
+      fprintf(stderr, "Usage: %s [-j threads] [-c chunk MB] [-m copy|rw] [-S] [-D] "
+              "source destination\n", argv[0]);
+      return 1;
+    }
+  }
+  if(argc - optind != 2){
+    fprintf(stderr, "Usage: %s [-j threads] [-c chunk MB] [-m copy|rw] [-S] [-D] "
+            "source destination\n", argv[0]);
+    return 1;
+  }
+  if(threads > MAX_THREADS){
+    threads = MAX_THREADS;
+  }
+
+  int flags = direct ? O_DIRECT : 0;
+  src = open(argv[optind], O_RDONLY | flags);
+  if(src == -1){
+    perror(argv[optind]);     // EINVAL: this filesystem can't do O_DIRECT
+    return 1;
+  }
+  struct stat st;
+  fstat(src, &st);
+  fileSize = st.st_size;
+  dst = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | flags, st.st_mode & 0777);
+  if(dst == -1){
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  // Sparse copies must not fill the holes in. Not every filesystem can
+  // preallocate; then just set the size
+  if(fileSize > 0 && (sparse || fallocate(dst, 0, 0, fileSize) == -1) &&
+     ftruncate(dst, fileSize) == -1){
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  if(!direct){
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  numChunks = (fileSize + chunkSize - 1) / chunkSize;
+  if(threads > numChunks){
+    threads = numChunks ? numChunks : 1;
+  }
+  if(direct){
+    threads = 2;
+    for(int i = 0; i < DIRECT_BUFS; i++){
+      if(posix_memalign((void**)&slots[i].buf, ALIGN, BUF_SIZE) != 0){
+        perror("posix_memalign");
+        return 1;
+      }
+    }
+  }
+  double start = now();
+  running = threads;
+  pthread_t tids[MAX_THREADS];
+  for(int i = 0; i < threads; i++){
+    void* (*run)(void*) = !direct ? copier : i == 0 ? directReader : directWriter;
+    if(pthread_create(&tids[i], NULL, run, NULL) != 0){
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  int tty = isatty(STDERR_FILENO);
+  while(1){
+    pthread_mutex_lock(&lock);
+    int left = running;
+    long long done = copied;
+    pthread_mutex_unlock(&lock);
+    if(left == 0){
+      break;
+    }
+    if(tty){
+      showProgress(done, start, 0);
+    }
+    usleep(200 * 1000);
+  }
+  for(int i = 0; i < threads; i++){
+    pthread_join(tids[i], NULL);
+  }
+  showProgress(copied, start, 1);
+  if(direct){
+    fprintf(stderr, "O_DIRECT, %d buffers of %d MB", DIRECT_BUFS, BUF_SIZE >> 20);
+    // The last write was rounded up to a whole block
+    if(!failed && ftruncate(dst, fileSize) == -1){
+      perror(argv[optind + 1]);
+      failed = 1;
+    }
+  } else {
+    fprintf(stderr, "%d threads, %lld chunks of %lld MB, %s", threads, numChunks,
+            chunkSize >> 20, mode == COPY ? "copy_file_range" : "pread/pwrite");
+  }
+  if(sparse){
+    fprintf(stderr, ", %.2f GB of holes skipped", holes / 1e9);
+  }
+  fprintf(stderr, "\n");
+
+  close(src);
+  if(close(dst) == -1 || failed){
+    fprintf(stderr, "Copy failed\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,351 @@
+/* batch_client.c */
+
+/*
+ * Scripted edits over the binary protocol in editor_proto.h.
+ *
+ * client.c waits for a prompt before every answer, so each edit costs four
+ * round trips. This client reads a whole script of edits, sends up to
+ * window commands in one write(), and then reads back the batched acks.
+ * Over a link with a 50ms RTT, 1000 edits go from minutes to well under a
+ * second.
+ *
+ * Script lines (line numbers start at 1, like the menu):
+ *   i <line> <text>     insert before <line> (one past the end appends)
+ *   r <line> <text>     replace <line>
+ *   d <line>            delete <line>
+ *   v <line> [count]    print count lines (default 20) starting at <line>
+ *   s <text>            print the numbers of lines containing <text>
+ *
+ * Compile: gcc -Wall -g batch_client.c -o batch_client
+ * Usage: ./batch_client [-w window] file [script]
+ *        (reads the script from stdin if none is given; window defaults to 1000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "editor_proto.h"
+
+#define SERVER_PORT 8080
+#define LINE_SIZE 1024
+#define BATCH_BYTES (EDIT_MAX_FRAME - 1024)   // Stay inside the server's buffer
+
+/*
+ * What we remember about a command until its ack comes back.
+ */
+struct pending {
+    int op;
+    uint32_t line;
+    size_t scriptLine;
+};
+
+/*
+ * Bytes received from the server but not yet parsed.
+ */
+struct input {
+    int sockfd;
+    char* buf;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read more from the server, growing the buffer if a frame needs it.
+ * Returns -1 on disconnect.
+ */
+int fillInput(struct input* in) {
+    if (in->start > 0) {
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    if (in->end == in->cap) {
+        char* bigger = realloc(in->buf, in->cap * 2);
+        if (!bigger) {
+            return -1;
+        }
+        in->buf = bigger;
+        in->cap *= 2;
+    }
+    int n = read(in->sockfd, in->buf + in->end, in->cap - in->end);
+    if (n <= 0) {
+        return -1;
+    }
+    in->end += n;
+    return 0;
+}
+
+/*
+ * Next reply frame from the server. Returns -1 on disconnect or garbage.
+ */
+int nextFrame(struct input* in, int* type, const char** body, size_t* bodyLen) {
+    while (1) {
+        int n = parseFrame(in->buf + in->start, in->end - in->start, type, body, bodyLen);
+        if (n < 0) {
+            return -1;
+        }
+        if (n > 0) {
+            in->start += n;
+            return 0;
+        }
+        if (fillInput(in) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Skip the text-mode prompt until the server echoes EDIT_MAGIC back.
+ */
+int waitForMagic(struct input* in) {
+    while (1) {
+        for (size_t i = in->start; i + EDIT_MAGIC_LEN <= in->end; i++) {
+            if (memcmp(in->buf + i, EDIT_MAGIC, EDIT_MAGIC_LEN) == 0) {
+                in->start = i + EDIT_MAGIC_LEN;
+                return 0;
+            }
+        }
+        if (fillInput(in) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Turn one script line into a command. Returns 0, or -1 if it's not one.
+ */
+int parseCommand(char* line, int* op, uint32_t* num, const char** payload, size_t* len,
+                 char* countBuf) {
+    char* rest;
+    *payload = "";
+    *len = 0;
+    *num = 0;
+    switch (line[0]) {
+    case 'i':
+    case 'r':
+        *op = line[0] == 'i' ? OP_INSERT : OP_REPLACE;
+        *num = strtoul(line + 1, &rest, 10);
+        if (*rest == ' ') rest++;
+        *payload = rest;
+        *len = strlen(rest);
+        return 0;
+    case 'd':
+        *op = OP_DELETE;
+        *num = strtoul(line + 1, NULL, 10);
+        return 0;
+    case 'v':
+        *op = OP_VIEW;
+        *num = strtoul(line + 1, &rest, 10);
+        unsigned long count = strtoul(rest, NULL, 10);
+        *len = putVarint(countBuf, count ? count : 20);
+        *payload = countBuf;
+        return 0;
+    case 's':
+        *op = OP_SEARCH;
+        *payload = line[1] == ' ' ? line + 2 : line + 1;
+        *len = strlen(*payload);
+        return *len ? 0 : -1;
+    }
+    return -1;
+}
+
+/*
+ * Print a REP_DATA reply for a view or search.
+ */
+void printData(struct pending* p, const char* data, size_t len) {
+    if (p->op == OP_VIEW) {
+        uint32_t count = 0;
+        int n = getVarint(data, len, &count);
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+        size_t lineNo = p->line;
+        for (uint32_t i = 0; i < count && len > 0; i++) {
+            const char* nl = memchr(data, '\n', len);
+            size_t lineLen = nl ? (size_t)(nl - data) : len;
+            printf("%4zu: %.*s\n", lineNo++, (int)lineLen, data);
+            len -= nl ? lineLen + 1 : lineLen;
+            data += lineLen + 1;
+        }
+        return;
+    }
+    printf("Matching lines:");
+    size_t count = 0;
+    uint32_t line;
+    int n;
+    while ((n = getVarint(data, len, &line)) > 0) {
+        printf(" %u", line);
+        data += n;
+        len -= n;
+        count++;
+    }
+    printf(count ? " (%zu)\n" : " none\n", count);
+}
+
+int main(int argc, char* argv[]) {
+    size_t window = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        if (opt == 'w') {
+            window = strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-w window] file [script]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || window == 0) {
+        fprintf(stderr, "Usage: %s [-w window] file [script]\n", argv[0]);
+        return 1;
+    }
+    const char* filename = argv[optind];
+    FILE* script = stdin;
+    if (optind + 1 < argc && !(script = fopen(argv[optind + 1], "r"))) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("Error creating socket");
+        return 1;
+    }
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port   = htons(SERVER_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("Connect failed");
+        close(sockfd);
+        return 1;
+    }
+
+    struct input in = {sockfd, malloc(EDIT_MAX_FRAME), 0, 0, EDIT_MAX_FRAME};
+    char* out = malloc(BATCH_BYTES + LINE_SIZE + 16);
+    struct pending* pending = malloc(window * sizeof(struct pending));
+    if (!in.buf || !out || !pending) {
+        perror("malloc");
+        return 1;
+    }
+
+    // Magic and OP_OPEN go together: one round trip to get started
+    double start = now();
+    size_t used = EDIT_MAGIC_LEN;
+    memcpy(out, EDIT_MAGIC, EDIT_MAGIC_LEN);
+    used += encodeCommand(out + used, OP_OPEN, 0, filename, strlen(filename));
+    int type;
+    const char* body;
+    size_t bodyLen;
+    if (write(sockfd, out, used) != (ssize_t)used || waitForMagic(&in) == -1 ||
+        nextFrame(&in, &type, &body, &bodyLen) == -1 || type != REP_ACK ||
+        body[bodyLen - 1] != ST_OK) {
+        fprintf(stderr, "Could not open %s on the server.\n", filename);
+        close(sockfd);
+        return 1;
+    }
+
+    size_t commands = 0, roundTrips = 1, failed = 0, scriptLine = 0;
+    uint32_t nextCmd = 1;
+    char line[LINE_SIZE];
+    int more = 1;
+    while (more) {
+        // Fill a batch
+        size_t batch = 0;
+        used = 0;
+        while (batch < window && used < BATCH_BYTES) {
+            if (!fgets(line, sizeof(line), script)) {
+                more = 0;
+                break;
+            }
+            scriptLine++;
+            line[strcspn(line, "\r\n")] = '\0';
+            int op;
+            uint32_t num;
+            const char* payload;
+            size_t len;
+            char countBuf[5];
+            if (line[0] == '\0' || line[0] == '#') {
+                continue;
+            }
+            if (parseCommand(line, &op, &num, &payload, &len, countBuf) == -1) {
+                fprintf(stderr, "script line %zu: unknown command\n", scriptLine);
+                continue;
+            }
+            used += encodeCommand(out + used, op, num, payload, len);
+            pending[batch++] = (struct pending){op, num, scriptLine};
+        }
+        if (!more) {
+            used += encodeCommand(out + used, OP_QUIT, 0, "", 0);
+        }
+        if (batch == 0 && more) {
+            continue;
+        }
+        if (write(sockfd, out, used) != (ssize_t)used) {
+            perror("write");
+            break;
+        }
+
+        // The server may ack a batch in pieces if it arrives in pieces
+        uint32_t first = nextCmd;
+        size_t acked = 0;
+        while (acked < batch) {
+            if (nextFrame(&in, &type, &body, &bodyLen) == -1) {
+                fprintf(stderr, "Server disconnected.\n");
+                more = 0;
+                break;
+            }
+            uint32_t cmd, count;
+            int n = getVarint(body, bodyLen, &cmd);
+            if (n <= 0 || cmd < first || cmd - first >= batch) {
+                continue;
+            }
+            if (type == REP_DATA) {
+                printData(&pending[cmd - first], body + n, bodyLen - n);
+                continue;
+            }
+            int m = getVarint(body + n, bodyLen - n, &count);
+            if (m <= 0) {
+                continue;
+            }
+            for (uint32_t i = 0; i < count && cmd + i - first < batch; i++) {
+                int status = body[n + m + i];
+                if (status != ST_OK) {
+                    fprintf(stderr, "script line %zu: %s\n",
+                            pending[cmd + i - first].scriptLine,
+                            status == ST_BAD_LINE ? "invalid line number" : "failed");
+                    failed++;
+                }
+                acked++;
+            }
+        }
+        nextCmd += batch;
+        commands += batch;
+        roundTrips += batch > 0;
+    }
+    double elapsed = now() - start;
+
+    fprintf(stderr, "%zu commands (%zu failed) in %zu round trips, %.1f ms\n",
+            commands, failed, roundTrips, elapsed * 1000);
+    close(sockfd);
+    if (script != stdin) {
+        fclose(script);
+    }
+    free(in.buf);
+    free(out);
+    free(pending);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,509 @@
+/* edit_journal.h */
+
+/*
+ * An append-only journal of line edits, so a save costs one small write
+ * instead of rewriting the whole file.
+ *
+ * Every edit to <file> is appended to <file>.journal as one record:
+ *
+ *   <op> <line> <len>\n<len bytes of text>\n      op is I, D or R
+ *
+ * after a header line "EDJ1 <inode>\n" naming the exact file (by inode
+ * number) the records apply to. Opening a file replays its journal on top of
+ * it, so an edit is safe as soon as its record is on disk, even if the
+ * server crashes before the file itself is rewritten. A record cut short by a
+ * crash is dropped.
+ *
+ * Group commit: fdatasync() costs the same for one record as for a hundred,
+ * so clients don't each call it. journalAppend() only adds the record to an
+ * in-memory buffer; journalSync() then waits until that record is on disk.
+ * The first waiter becomes the "leader", writes everything buffered so far
+ * with one write() and one fdatasync(), and wakes everyone it covered.
+ * Clients that arrive during that fdatasync() are covered by the next one.
+ *
+ * A background flusher can take the syncing off the clients altogether:
+ * journalWriteBuffered() on every open journal, then journalSyncWritten() on
+ * each, so the disk has all the writes queued before the first sync.
+ *
+ * Compaction (folding the journal into the file) is done by the caller:
+ * it writes the new file to a temporary name and then calls journalSwitch()
+ * to start a fresh journal for it and rename it into place, in an order that
+ * is safe whenever the crash happens (see journalSwitch()).
+ */
+
+#ifndef EDIT_JOURNAL_H
+#define EDIT_JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "EDJ1"
+
+typedef struct {
+    int fd;                     // <file>.journal, opened O_APPEND
+    size_t fileLen;             // Bytes in the journal file
+    char* pending;              // Records appended but not yet written
+    size_t pendingLen;
+    size_t pendingCap;
+    char* spare;                // The leader swaps this with pending
+    size_t spareCap;
+    unsigned long appended;     // Records appended so far
+    unsigned long durable;      // Records known to be on disk
+    unsigned long syncs;        // fdatasync() calls so far
+    unsigned long failures;     // Batches that failed to get to disk
+    int broken;                 // A failed write couldn't be cut off the file
+    int flushing;               // A leader is writing right now
+    size_t writing;             // Bytes it took out of pending
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+} Journal;
+
+// Records taken out of a journal's buffer by whoever is writing them
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+    unsigned long upTo;         // Sequence number of the last record in buf
+    int status;
+} JournalBatch;
+
+/*
+ * Called once per record while replaying; returns 0, or -1 if the record
+ * doesn't fit the document (the rest of the journal is then ignored).
+ */
+typedef int (*JournalApply)(void* arg, char op, size_t line, const char* text, size_t len);
+
+static inline void journalName(char* out, size_t size, const char* path, const char* suffix) {
+    snprintf(out, size, "%s.journal%s", path, suffix);
+}
+
+/*
+ * Read the header of a journal file. Returns the inode it belongs to, or 0
+ * if it has no valid header.
+ */
+static inline unsigned long journalBase(const char* data, size_t len, size_t* headerLen) {
+    const char* nl = memchr(data, '\n', len);
+    unsigned long ino = 0;
+    if (!nl || nl - data > 64 || strncmp(data, JOURNAL_MAGIC " ", 5) != 0) {
+        return 0;
+    }
+    ino = strtoul(data + 5, NULL, 10);
+    *headerLen = nl - data + 1;
+    return ino;
+}
+
+static inline int journalWriteAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline char* journalSlurp(int fd, size_t* len) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return NULL;
+    char* data = malloc(st.st_size + 1);
+    if (!data) return NULL;
+    *len = 0;
+    while (*len < (size_t)st.st_size) {
+        ssize_t n = pread(fd, data + *len, st.st_size - *len, *len);
+        if (n <= 0) break;
+        *len += n;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+/*
+ * Open the journal for path, whose current inode is base, and replay any
+ * records in it through apply(). Returns the number of records replayed, or
+ * -1 on error.
+ */
+static inline long journalOpen(Journal* j, const char* path, unsigned long base,
+                               JournalApply apply, void* arg) {
+    char name[PATH_MAX + 16], next[PATH_MAX + 16];
+    journalName(name, sizeof(name), path, "");
+    journalName(next, sizeof(next), path, ".new");
+
+    memset(j, 0, sizeof(*j));
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->flushed, NULL);
+
+    // A crash during journalSwitch() can leave <file>.journal.new behind. If
+    // the rename of the file went through, the new journal is the right one
+    int fd = open(next, O_RDONLY);
+    if (fd != -1) {
+        size_t len = 0, headerLen;
+        char* data = journalSlurp(fd, &len);
+        close(fd);
+        if (data && journalBase(data, len, &headerLen) == base) {
+            rename(next, name);
+        } else {
+            unlink(next);
+        }
+        free(data);
+    }
+
+    j->fd = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (j->fd == -1) {
+        return -1;
+    }
+    size_t len = 0, headerLen = 0;
+    char* data = journalSlurp(j->fd, &len);
+    if (!data) {
+        close(j->fd);
+        return -1;
+    }
+
+    long replayed = 0;
+    size_t good = 0;
+    unsigned long owner = journalBase(data, len, &headerLen);
+    if (owner == base) {
+        good = headerLen;
+        while (good < len) {
+            char op;
+            size_t line, textLen;
+            int used = 0;
+            const char* nl = memchr(data + good, '\n', len - good);
+            if (!nl || sscanf(data + good, "%c %zu %zu%n", &op, &line, &textLen, &used) != 3 ||
+                data + good + used != nl) {
+                break;
+            }
+            const char* text = nl + 1;
+            if ((size_t)(data + len - text) < textLen + 1 || text[textLen] != '\n') {
+                break;          // Cut short by a crash
+            }
+            if (apply(arg, op, line, text, textLen) == -1) {
+                break;
+            }
+            replayed++;
+            good = text + textLen + 1 - data;
+        }
+    } else if (len > 0) {
+        // Written for some other version of the file, e.g. one replaced by
+        // another editor while we weren't running
+        fprintf(stderr, "%s: journal is for a different file, ignoring it\n", path);
+    }
+    free(data);
+
+    if (good == 0) {
+        char header[64];
+        int n = snprintf(header, sizeof(header), JOURNAL_MAGIC " %lu\n", base);
+        if (ftruncate(j->fd, 0) == -1 || journalWriteAll(j->fd, header, n) == -1 ||
+            fdatasync(j->fd) == -1) {
+            close(j->fd);
+            return -1;
+        }
+        good = n;
+    } else if (good < len && ftruncate(j->fd, good) == -1) {
+        close(j->fd);
+        return -1;
+    }
+    j->fileLen = good;
+    return replayed;
+}
+
+/*
+ * Buffer one record. The caller must apply edits and append their records
+ * in the same order (e.g. under the document's write lock). Returns the
+ * record's sequence number for journalSync(), or 0 if out of memory.
+ */
+static inline unsigned long journalAppend(Journal* j, char op, size_t line,
+                                          const char* text, size_t len) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "%c %zu %zu\n", op, line, len);
+
+    pthread_mutex_lock(&j->lock);
+    size_t need = j->pendingLen + n + len + 1;
+    if (need > j->pendingCap) {
+        size_t cap = j->pendingCap ? j->pendingCap : 4096;
+        while (cap < need) cap *= 2;
+        char* bigger = realloc(j->pending, cap);
+        if (!bigger) {
+            pthread_mutex_unlock(&j->lock);
+            return 0;
+        }
+        j->pending = bigger;
+        j->pendingCap = cap;
+    }
+    memcpy(j->pending + j->pendingLen, header, n);
+    memcpy(j->pending + j->pendingLen + n, text, len);
+    j->pending[j->pendingLen + n + len] = '\n';
+    j->pendingLen = need;
+    unsigned long seq = ++j->appended;
+    pthread_mutex_unlock(&j->lock);
+    return seq;
+}
+
+/*
+ * Take everything buffered, to be written by the caller. Called with j->lock
+ * held and no other writer running.
+ */
+static inline void journalTake(Journal* j, JournalBatch* b) {
+    j->flushing = 1;
+    b->buf = j->pending;
+    b->len = j->pendingLen;
+    b->cap = j->pendingCap;
+    b->upTo = j->appended;
+    b->status = 0;
+    j->writing = b->len;
+    j->pending = j->spare;
+    j->pendingCap = j->spareCap;
+    j->pendingLen = 0;
+}
+
+/*
+ * A batch failed: cut whatever part of it reached the file back off, so the
+ * records after it can still be replayed, and put it back in front of the
+ * records appended since so the next flush tries again. If either can't be
+ * done the journal is broken and every later sync fails. Called with j->lock
+ * held.
+ */
+static inline void journalRequeue(Journal* j, JournalBatch* b) {
+    j->failures++;
+    if (ftruncate(j->fd, j->fileLen) == -1) {
+        perror("journal");
+        j->broken = 1;
+    }
+    size_t need = b->len + j->pendingLen;
+    if (need > b->cap) {
+        char* bigger = realloc(b->buf, need);
+        if (!bigger) {
+            j->broken = 1;
+            j->spare = b->buf;
+            j->spareCap = b->cap;
+            return;
+        }
+        b->buf = bigger;
+        b->cap = need;
+    }
+    memcpy(b->buf + b->len, j->pending, j->pendingLen);
+    j->spare = j->pending;
+    j->spareCap = j->pendingCap;
+    j->pending = b->buf;
+    j->pendingCap = b->cap;
+    j->pendingLen = need;
+}
+
+/*
+ * The records in b are on disk (or failed to get there, and go back in the
+ * buffer): wake everyone waiting for them. Called with j->lock held.
+ */
+static inline void journalDone(Journal* j, JournalBatch* b) {
+    if (b->len > 0) {
+        j->syncs++;
+    }
+    if (b->status == 0) {
+        j->spare = b->buf;
+        j->spareCap = b->cap;
+        j->fileLen += b->len;
+        j->durable = b->upTo;
+    } else {
+        journalRequeue(j, b);
+    }
+    j->writing = 0;
+    j->flushing = 0;
+    pthread_cond_broadcast(&j->flushed);
+}
+
+/*
+ * Write and fdatasync() everything buffered. Called with j->lock held and
+ * no other leader running; drops the lock while doing I/O.
+ */
+static inline int journalFlushLocked(Journal* j) {
+    JournalBatch b;
+    int broken = j->broken;
+    journalTake(j, &b);
+    pthread_mutex_unlock(&j->lock);
+
+    if (b.len > 0 && broken) {
+        b.status = -1;
+    } else if (b.len > 0) {
+        b.status = journalWriteAll(j->fd, b.buf, b.len);
+        if (b.status == 0) b.status = fdatasync(j->fd);
+        if (b.status == -1) perror("journal");
+    }
+
+    pthread_mutex_lock(&j->lock);
+    journalDone(j, &b);
+    return b.status;
+}
+
+/*
+ * Background flushing, step 1: write() whatever is buffered, without
+ * syncing. Returns 1 if journalSyncWritten() must follow, 0 if there was
+ * nothing to write or a client is already flushing this journal.
+ */
+static inline int journalWriteBuffered(Journal* j, JournalBatch* b) {
+    pthread_mutex_lock(&j->lock);
+    if (j->flushing || j->pendingLen == 0 || j->broken) {
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+    journalTake(j, b);
+    pthread_mutex_unlock(&j->lock);
+    b->status = journalWriteAll(j->fd, b->buf, b->len);
+    return 1;
+}
+
+/*
+ * Step 2: fdatasync() what step 1 wrote and wake anyone waiting for it.
+ */
+static inline void journalSyncWritten(Journal* j, JournalBatch* b) {
+    if (b->status == 0) b->status = fdatasync(j->fd);
+    if (b->status == -1) perror("journal");
+    pthread_mutex_lock(&j->lock);
+    journalDone(j, b);
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Wait until record seq is on disk, becoming the leader if nobody is
+ * writing. Returns 0, or -1 if a write or fdatasync() failed first: the
+ * record is still buffered and a later sync will try it again.
+ */
+static inline int journalSync(Journal* j, unsigned long seq) {
+    pthread_mutex_lock(&j->lock);
+    unsigned long failures = j->failures;
+    int status = 0;
+    while (j->durable < seq) {
+        if (j->failures != failures || j->broken) {
+            status = -1;
+            break;
+        }
+        if (j->flushing) {
+            pthread_cond_wait(&j->flushed, &j->lock);
+        } else {
+            journalFlushLocked(j);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return status;
+}
+
+/*
+ * Where the journal ends right now, counting buffered records. Everything
+ * before this mark is folded into a compaction that snapshots the document
+ * at the same moment.
+ */
+static inline size_t journalMark(Journal* j) {
+    pthread_mutex_lock(&j->lock);
+    size_t mark = j->fileLen + j->writing + j->pendingLen;
+    pthread_mutex_unlock(&j->lock);
+    return mark;
+}
+
+// Bytes appended but not yet handed to write(): how far behind the disk is
+static inline size_t journalBacklog(Journal* j) {
+    pthread_mutex_lock(&j->lock);
+    size_t len = j->pendingLen;
+    pthread_mutex_unlock(&j->lock);
+    return len;
+}
+
+static inline size_t journalSize(Journal* j) {
+    pthread_mutex_lock(&j->lock);
+    size_t size = j->fileLen + j->writing + j->pendingLen;
+    pthread_mutex_unlock(&j->lock);
+    return size;
+}
+
+/*
+ * Replace path with tmp, a compacted copy that already holds every record
+ * before mark, and keep only the records after mark. tmp must already be
+ * fdatasync'd; newBase is its inode. In order:
+ *
+ *   1. write <file>.journal.new: a header for newBase plus the records after
+ *      mark, and fdatasync it
+ *   2. rename tmp over <file>
+ *   3. rename <file>.journal.new over <file>.journal
+ *
+ * A crash before 2 leaves the old file and old journal, which still agree.
+ * A crash between 2 and 3 leaves the new file with an old journal whose
+ * header doesn't match it, and journalOpen() picks up .journal.new instead.
+ *
+ * Records can still be appended while journalFlushLocked() has the lock
+ * dropped, but they only go into the buffer, and they come after mark. No
+ * one can write the buffer to the old journal: the flush we lead holds
+ * j->flushing, and once it returns we keep the lock until the last rename.
+ * So they stay buffered and the next flush writes them to the new journal.
+ */
+static inline int journalSwitch(Journal* j, const char* path, const char* tmp,
+                                unsigned long newBase, size_t mark) {
+    char name[PATH_MAX + 16], next[PATH_MAX + 16];
+    journalName(name, sizeof(name), path, "");
+    journalName(next, sizeof(next), path, ".new");
+
+    pthread_mutex_lock(&j->lock);
+    while (j->flushing) {
+        pthread_cond_wait(&j->flushed, &j->lock);
+    }
+    // Get everything on disk, so the records after mark are all in the file
+    if (j->pendingLen > 0 && journalFlushLocked(j) == -1) {
+        pthread_mutex_unlock(&j->lock);
+        return -1;
+    }
+
+    int status = -1, renamed = 0;
+    size_t keep = j->fileLen > mark ? j->fileLen - mark : 0;
+    char header[64];
+    int n = snprintf(header, sizeof(header), JOURNAL_MAGIC " %lu\n", newBase);
+    int fd = open(next, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    char* rest = malloc(keep + 1);
+    if (fd != -1 && rest && pread(j->fd, rest, keep, mark) == (ssize_t)keep &&
+        journalWriteAll(fd, header, n) == 0 && journalWriteAll(fd, rest, keep) == 0 &&
+        fdatasync(fd) == 0 && rename(tmp, path) == 0) {
+        renamed = 1;
+        if (rename(next, name) == 0) {
+            close(j->fd);
+            j->fd = fd;
+            j->fileLen = n + keep;
+            fd = -1;
+            status = 0;
+        }
+    }
+    if (status == -1) {
+        perror("journal switch");
+        if (!renamed) unlink(next);     // Otherwise journalOpen() needs it
+    }
+    if (fd != -1) close(fd);
+    free(rest);
+    pthread_mutex_unlock(&j->lock);
+    return status;
+}
+
+/*
+ * Close the journal. If removeIt, the file on disk is deleted too (only do
+ * that once everything in it has been compacted into the file). Otherwise
+ * whatever is still buffered is written and synced first, since those
+ * edits were made and the journal is now the only place they are kept.
+ */
+static inline void journalClose(Journal* j, const char* path, int removeIt) {
+    if (removeIt) {
+        char name[PATH_MAX + 16];
+        journalName(name, sizeof(name), path, "");
+        unlink(name);
+    } else if (journalSync(j, j->appended) == -1) {
+        fprintf(stderr, "%s: lost edits that didn't make it into the journal\n", path);
+    }
+    close(j->fd);
+    free(j->pending);
+    free(j->spare);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->flushed);
+}
+
+#endif
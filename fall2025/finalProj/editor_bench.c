@@ -0,0 +1,776 @@
+/* editor_bench.c */
+
+/*
+ * Load test for the editor servers (server_scaffold.c once it is finished,
+ * and editor_server.c). It speaks the text menu, so it measures exactly what
+ * client.c users see.
+ *
+ * "check" makes sure the server saves edits right: it edits a few small
+ * files (some without a newline at the end), quits, and waits for each to
+ * be compacted into the text it should now hold.
+ *
+ * "record" works like client.c but also saves every answer you type, with
+ * the time you took, to a session file. "run" starts N clients at once.
+ * Each one replays the session, or with no session a random mix of menu
+ * operations. Some of the clients share one file and the rest get a private
+ * file each, so both the shared-document path and the one-file-per-client
+ * path get exercised. At the end it prints ops/s, latency percentiles per
+ * operation and the server's memory (VmRSS from /proc).
+ *
+ * An operation is everything from choosing a menu item to the next
+ * "Choice: " prompt, including the line number and text prompts in
+ * between. Each answer is sent only after its prompt arrives, as client.c
+ * would.
+ *
+ * Compile: gcc -Wall -g -pthread editor_bench.c -o editor_bench
+ * Usage: ./editor_bench record <session>
+ *        ./editor_bench check [-d dir]
+ *        ./editor_bench run [-c clients] [-o ops] [-s shared%] [-l lines]
+ *                           [-m mix] [-p pid] [-d dir] [-t] [session]
+ *        mix is view=20,insert=30,delete=20,edit=30,search=0 by default
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#define SERVER_PORT 8080
+#define LINE_SIZE 1024
+#define REPLY_SIZE (256 * 1024)
+
+enum { VIEW, INSERT, DELETE, EDIT, SEARCH, OTHER, NUM_OPS };
+const char* opNames[NUM_OPS] = {"view", "insert", "delete", "edit", "search", "other"};
+
+/*
+ * One menu operation: the choice, then the answers to its prompts.
+ */
+struct op {
+    int type;
+    int numLines;
+    char lines[3][LINE_SIZE];
+    double think;               // Seconds the user waited before it (recordings)
+};
+
+/*
+ * A recorded session: the file name typed first, then its operations.
+ */
+struct session {
+    struct op* ops;
+    size_t numOps;
+};
+
+/*
+ * Settings shared by all the clients.
+ */
+struct config {
+    int clients;
+    int opsPerClient;
+    int sharedPercent;
+    int lines;
+    int mix[NUM_OPS];
+    int keepThink;
+    const char* dir;
+    struct session* session;
+};
+
+/*
+ * One client thread's results.
+ */
+struct client {
+    pthread_t thread;
+    int id;
+    struct config* cfg;
+    double* latency[NUM_OPS];
+    size_t count[NUM_OPS];
+    size_t cap[NUM_OPS];
+    size_t failed;              // "Invalid ..." replies
+    int broken;                 // Lost the connection
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connectServer() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port   = htons(SERVER_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * What kind of operation a menu answer starts, and how many more answers
+ * it takes (line number, text).
+ */
+int opType(const char* choice, int* answers) {
+    *answers = 0;
+    if (strncmp(choice, "view", 4) == 0) return VIEW;
+    if (strncmp(choice, "search", 6) == 0) return SEARCH;
+    switch (atoi(choice)) {
+    case 1: return VIEW;
+    case 2: *answers = 2; return INSERT;
+    case 3: *answers = 1; return DELETE;
+    case 4: *answers = 2; return EDIT;
+    }
+    return OTHER;
+}
+
+/*
+ * Read until the server's output ends with a prompt (": " or "? ").
+ * Returns 1 if it was the menu's "Choice: ", 0 for another prompt, -1 if
+ * the connection closed. *invalid is set if an error message went by.
+ */
+int waitPrompt(int sockfd, char* buf, int* invalid) {
+    size_t used = 0;
+    while (1) {
+        if (used == REPLY_SIZE) {
+            // Long view output: keep only the tail, which has the prompt
+            memmove(buf, buf + REPLY_SIZE - 64, 64);
+            used = 64;
+        }
+        int n = read(sockfd, buf + used, REPLY_SIZE - used - 1);
+        if (n <= 0) {
+            return -1;
+        }
+        buf[used + n] = '\0';
+        if (strstr(buf + (used > 16 ? used - 16 : 0), "Invalid")) {
+            *invalid = 1;
+        }
+        used += n;
+        if (used >= 8 && memcmp(buf + used - 8, "Choice: ", 8) == 0) {
+            return 1;
+        }
+        if (used >= 2 && (memcmp(buf + used - 2, ": ", 2) == 0 ||
+                          memcmp(buf + used - 2, "? ", 2) == 0)) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Send one answer, newline included.
+ */
+int sendLine(int sockfd, const char* line) {
+    char msg[LINE_SIZE + 1];
+    int len = snprintf(msg, sizeof(msg), "%s\n", line);
+    return write(sockfd, msg, len) == len ? 0 : -1;
+}
+
+/*
+ * Make up a random operation from the mix.
+ */
+void randomOp(struct config* cfg, unsigned int* seed, int opNo, struct op* op) {
+    int total = 0;
+    for (int i = 0; i < NUM_OPS; i++) total += cfg->mix[i];
+    int pick = rand_r(seed) % total;
+    op->type = 0;
+    while (pick >= cfg->mix[op->type]) pick -= cfg->mix[op->type++];
+
+    // Stay in the first half so deletes rarely run off the end of a file
+    int line = 1 + rand_r(seed) % (cfg->lines / 2 + 1);
+    op->think = 0;
+    switch (op->type) {
+    case VIEW:
+        op->numLines = 1;
+        snprintf(op->lines[0], LINE_SIZE, "view %d", line);
+        break;
+    case INSERT:
+    case EDIT:
+        op->numLines = 3;
+        snprintf(op->lines[0], LINE_SIZE, "%d", op->type == INSERT ? 2 : 4);
+        snprintf(op->lines[1], LINE_SIZE, "%d", line);
+        snprintf(op->lines[2], LINE_SIZE, "bench edit %d of this client", opNo);
+        break;
+    case DELETE:
+        op->numLines = 2;
+        strcpy(op->lines[0], "3");
+        snprintf(op->lines[1], LINE_SIZE, "%d", line);
+        break;
+    default:
+        op->numLines = 1;
+        snprintf(op->lines[0], LINE_SIZE, "search line %d", line);
+    }
+}
+
+/*
+ * Remember how long an operation took.
+ */
+void addLatency(struct client* c, int type, double seconds) {
+    if (c->count[type] == c->cap[type]) {
+        size_t newCap = c->cap[type] ? c->cap[type] * 2 : 1024;
+        double* bigger = realloc(c->latency[type], newCap * sizeof(double));
+        if (!bigger) {
+            return;
+        }
+        c->latency[type] = bigger;
+        c->cap[type] = newCap;
+    }
+    c->latency[type][c->count[type]++] = seconds;
+}
+
+/*
+ * One client: open its file, then run its operations one after another.
+ */
+void* clientThread(void* arg) {
+    struct client* c = arg;
+    struct config* cfg = c->cfg;
+    unsigned int seed = 12345 + c->id;
+    char* buf = malloc(REPLY_SIZE);
+    int invalid = 0;
+
+    // The first sharedPercent% of the clients share a file
+    char path[LINE_SIZE];
+    if (c->id * 100 < cfg->sharedPercent * cfg->clients) {
+        snprintf(path, sizeof(path), "%s/shared.txt", cfg->dir);
+    } else {
+        snprintf(path, sizeof(path), "%s/client%d.txt", cfg->dir, c->id);
+    }
+
+    int sockfd = connectServer();
+    if (!buf || sockfd < 0 || waitPrompt(sockfd, buf, &invalid) == -1 ||
+        sendLine(sockfd, path) == -1 || waitPrompt(sockfd, buf, &invalid) != 1) {
+        c->broken = 1;
+        if (sockfd >= 0) close(sockfd);
+        free(buf);
+        return NULL;
+    }
+
+    size_t numOps = cfg->session ? cfg->session->numOps : (size_t)cfg->opsPerClient;
+    struct op generated;
+    for (size_t i = 0; i < numOps && !c->broken; i++) {
+        struct op* op = &generated;
+        if (cfg->session) {
+            op = &cfg->session->ops[i];
+            if (cfg->keepThink && op->think > 0) {
+                usleep(op->think * 1e6);
+            }
+        } else {
+            randomOp(cfg, &seed, i, op);
+        }
+
+        double start = now();
+        int atMenu = 0;
+        invalid = 0;
+        for (int j = 0; j < op->numLines && !atMenu; j++) {
+            if (sendLine(sockfd, op->lines[j]) == -1) {
+                c->broken = 1;
+                break;
+            }
+            atMenu = waitPrompt(sockfd, buf, &invalid);
+            if (atMenu == -1) {
+                c->broken = 1;
+            }
+        }
+        if (c->broken) break;
+        if (!atMenu) {
+            // The server wanted more answers than the op had
+            c->broken = 1;
+            break;
+        }
+        addLatency(c, op->type, now() - start);
+        c->failed += invalid;
+    }
+
+    sendLine(sockfd, "5");
+    close(sockfd);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Read a session written by "record".
+ */
+int loadSession(const char* path, struct session* s) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[LINE_SIZE + 32];
+    size_t cap = 0;
+    int answers = 0;
+    struct op* op = NULL;
+    s->ops = NULL;
+    s->numOps = 0;
+    int first = 1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* text;
+        double think = strtod(line, &text);
+        if (line[0] == '#' || text == line) continue;
+        if (*text == ' ') text++;
+        if (first) {
+            first = 0;          // The file name; every client uses its own
+            continue;
+        }
+        if (answers > 0) {
+            strncpy(op->lines[op->numLines++], text, LINE_SIZE - 1);
+            answers--;
+            continue;
+        }
+        int type = opType(text, &answers);
+        if (type == OTHER && atoi(text) == 5) break;
+        if (s->numOps == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct op* bigger = realloc(s->ops, cap * sizeof(struct op));
+            if (!bigger) {
+                fclose(f);
+                return -1;
+            }
+            s->ops = bigger;
+        }
+        op = &s->ops[s->numOps++];
+        op->type = type;
+        op->think = think;
+        op->numLines = 1;
+        strncpy(op->lines[0], text, LINE_SIZE - 1);
+        op->lines[0][LINE_SIZE - 1] = '\0';
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * "record": an interactive client that saves each answer and how long
+ * the user took before giving it.
+ */
+int record(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    int sockfd = connectServer();
+    if (sockfd < 0) {
+        perror("Connect failed");
+        fclose(out);
+        return 1;
+    }
+    fprintf(out, "# editor_bench session: <seconds before answer> <answer>\n");
+    printf("Connected to server, recording to %s.\n", path);
+
+    char buffer[LINE_SIZE];
+    char input[LINE_SIZE];
+    while (1) {
+        int n = read(sockfd, buffer, sizeof(buffer) - 1);
+        if (n <= 0) {
+            printf("Server disconnected.\n");
+            break;
+        }
+        buffer[n] = '\0';
+        printf("%s", buffer);
+        fflush(stdout);
+        // Only answer once the whole prompt is here
+        if (n < 2 || (memcmp(buffer + n - 2, ": ", 2) != 0 &&
+                      memcmp(buffer + n - 2, "? ", 2) != 0)) {
+            continue;
+        }
+
+        double asked = now();
+        if (!fgets(input, sizeof(input), stdin)) {
+            break;
+        }
+        input[strcspn(input, "\r\n")] = '\0';
+        fprintf(out, "%.3f %s\n", now() - asked, input);
+        if (sendLine(sockfd, input) == -1) {
+            break;
+        }
+    }
+    close(sockfd);
+    fclose(out);
+    return 0;
+}
+
+/*
+ * Resident memory of a process in KB, from /proc/<pid>/status.
+ */
+long readRss(int pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * Find a running editor_server or server_scaffold.
+ */
+int findServer() {
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        return -1;
+    }
+    struct dirent* entry;
+    int pid = -1;
+    while (pid == -1 && (entry = readdir(proc)) != NULL) {
+        char path[300], name[64] = "";
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        if (fgets(name, sizeof(name), f)) {
+            name[strcspn(name, "\n")] = '\0';
+            // A killed server can linger as a zombie, which has no RSS
+            if ((strcmp(name, "editor_server") == 0 || strcmp(name, "server_scaffold") == 0) &&
+                readRss(atoi(entry->d_name)) > 0) {
+                pid = atoi(entry->d_name);
+            }
+        }
+        fclose(f);
+    }
+    closedir(proc);
+    return pid;
+}
+
+/*
+ * Samples the server's RSS while the clients run.
+ */
+struct rssSampler {
+    int pid;
+    volatile int done;
+    long peak;
+};
+
+void* sampleRss(void* arg) {
+    struct rssSampler* s = arg;
+    while (!s->done) {
+        long kb = readRss(s->pid);
+        if (kb > s->peak) s->peak = kb;
+        usleep(20000);
+    }
+    return NULL;
+}
+
+int compareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Write a test file of the given number of lines.
+ */
+int makeFile(const char* path, int lines) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    for (int i = 1; i <= lines; i++) {
+        fprintf(f, "This is line %d of the benchmark file.\n", i);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Parse "view=20,insert=30,..." into cfg->mix.
+ */
+int parseMix(const char* text, int* mix) {
+    char copy[256];
+    strncpy(copy, text, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(mix, 0, NUM_OPS * sizeof(int));
+    int total = 0;
+    for (char* item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int i = 0;
+        while (i < OTHER && strcmp(item, opNames[i]) != 0) i++;
+        if (i == OTHER) return -1;
+        mix[i] = atoi(eq + 1);
+        total += mix[i];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+/*
+ * A file, the menu answers that edit it, and what it should hold once the
+ * server has saved it.
+ */
+struct saveCheck {
+    const char* before;
+    const char* answers[3];
+    const char* after;
+};
+
+struct saveCheck saveChecks[] = {
+    {"a\nb\n", {"4", "1", "x"}, "x\nb\n"},
+    {"a\nb", {"4", "1", "x"}, "x\nb\n"},         // No newline at the end
+    {"a\nb", {"2", "3", "c"}, "a\nb\nc\n"},
+    {"a\nb", {"4", "2", "x"}, "a\nx\n"},
+};
+
+// Print text in quotes, with its newlines as \n
+void printQuoted(const char* text) {
+    putchar('"');
+    for (; *text; text++) {
+        if (*text == '\n') fputs("\\n", stdout);
+        else putchar(*text);
+    }
+    putchar('"');
+}
+
+/*
+ * Run every saveCheck against the server and report any file that isn't
+ * saved as it should be. Returns the number that weren't.
+ */
+int check(const char* dir) {
+    int numChecks = sizeof(saveChecks) / sizeof(saveChecks[0]);
+    int bad = 0;
+    char* buf = malloc(REPLY_SIZE);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    mkdir(dir, 0755);
+    for (int i = 0; i < numChecks; i++) {
+        struct saveCheck* sc = &saveChecks[i];
+        char path[LINE_SIZE], got[256];
+        snprintf(path, sizeof(path), "%s/check%d.txt", dir, i);
+        FILE* f = fopen(path, "w");
+        if (!f) {
+            perror(path);
+            free(buf);
+            return 1;
+        }
+        fputs(sc->before, f);
+        fclose(f);
+
+        int invalid = 0;
+        int sockfd = connectServer();
+        int ok = sockfd >= 0 && waitPrompt(sockfd, buf, &invalid) == 0 &&
+                 sendLine(sockfd, path) == 0 && waitPrompt(sockfd, buf, &invalid) == 1;
+        for (int j = 0; ok && j < 3; j++) {
+            ok = sendLine(sockfd, sc->answers[j]) == 0 &&
+                 waitPrompt(sockfd, buf, &invalid) == (j == 2);
+        }
+        if (sockfd >= 0) {
+            sendLine(sockfd, "5");
+            close(sockfd);
+        }
+        if (!ok || invalid) {
+            printf("check %d: the server didn't take the edit\n", i);
+            bad++;
+            continue;
+        }
+
+        // The last client out has the compactor save the file; give it 5 s
+        size_t len = 0;
+        for (int tries = 0; tries < 100; tries++) {
+            f = fopen(path, "r");
+            len = f ? fread(got, 1, sizeof(got) - 1, f) : 0;
+            if (f) fclose(f);
+            got[len] = '\0';
+            if (strcmp(got, sc->after) == 0) break;
+            usleep(50000);
+        }
+        if (strcmp(got, sc->after) != 0) {
+            printf("check %d: saved as ", i);
+            printQuoted(got);
+            printf(", expected ");
+            printQuoted(sc->after);
+            printf("\n");
+            bad++;
+        }
+    }
+    printf("%d of %d save checks passed\n", numChecks - bad, numChecks);
+    free(buf);
+    return bad;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s record <session>\n"
+                    "       %s check [-d dir]\n"
+                    "       %s run [-c clients] [-o ops] [-s shared%%] [-l lines] [-m mix]\n"
+                    "              [-p pid] [-d dir] [-t] [session]\n", prog, prog, prog);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "record") == 0) {
+        if (argc != 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        return record(argv[2]);
+    }
+    if (strcmp(argv[1], "check") == 0) {
+        const char* dir = "/tmp/editor_bench";
+        if (argc == 4 && strcmp(argv[2], "-d") == 0) {
+            dir = argv[3];
+        } else if (argc != 2) {
+            usage(argv[0]);
+            return 1;
+        }
+        return check(dir) ? 1 : 0;
+    }
+    if (strcmp(argv[1], "run") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct config cfg = {8, 1000, 50, 1000, {20, 30, 20, 30, 0, 0}, 0, "/tmp/editor_bench", NULL};
+    int pid = -1;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "c:o:s:l:m:p:d:t")) != -1) {
+        switch (opt) {
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'o': cfg.opsPerClient = atoi(optarg); break;
+        case 's': cfg.sharedPercent = atoi(optarg); break;
+        case 'l': cfg.lines = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        case 'd': cfg.dir = optarg; break;
+        case 't': cfg.keepThink = 1; break;
+        case 'm':
+            if (parseMix(optarg, cfg.mix) == -1) {
+                fprintf(stderr, "Bad mix: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.clients < 1 || cfg.lines < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    struct session session;
+    if (optind < argc) {
+        if (loadSession(argv[optind], &session) == -1) {
+            return 1;
+        }
+        cfg.session = &session;
+    }
+
+    // Fresh files for every run, so runs compare
+    mkdir(cfg.dir, 0755);
+    char path[LINE_SIZE];
+    snprintf(path, sizeof(path), "%s/shared.txt", cfg.dir);
+    if (makeFile(path, cfg.lines) == -1) {
+        return 1;
+    }
+    int shared = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        if (i * 100 < cfg.sharedPercent * cfg.clients) {
+            shared++;
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/client%d.txt", cfg.dir, i);
+        if (makeFile(path, cfg.lines) == -1) {
+            return 1;
+        }
+    }
+
+    if (pid == -1) {
+        pid = findServer();
+    }
+    struct rssSampler sampler = {pid, 0, 0};
+    long rssBefore = pid > 0 ? readRss(pid) : -1;
+    pthread_t samplerThread;
+    if (rssBefore > 0) {
+        sampler.peak = rssBefore;
+        pthread_create(&samplerThread, NULL, sampleRss, &sampler);
+    }
+
+    struct client* clients = calloc(cfg.clients, sizeof(struct client));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+    double start = now();
+    for (int i = 0; i < cfg.clients; i++) {
+        clients[i].id = i;
+        clients[i].cfg = &cfg;
+        if (pthread_create(&clients[i].thread, NULL, clientThread, &clients[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+    long rssAfter = rssBefore > 0 ? readRss(pid) : -1;
+    if (rssBefore > 0) {
+        sampler.done = 1;
+        pthread_join(samplerThread, NULL);
+        if (rssAfter > sampler.peak) sampler.peak = rssAfter;
+    }
+
+    // Everybody's latencies together, per operation
+    size_t totalOps = 0, failed = 0;
+    int broken = 0;
+    printf("%d clients (%d on the shared file), %s\n", cfg.clients, shared,
+           cfg.session ? "recorded session" : "random mix");
+    printf("%-8s %8s %9s %9s %9s %9s\n", "op", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int t = 0; t < NUM_OPS; t++) {
+        size_t count = 0;
+        for (int i = 0; i < cfg.clients; i++) count += clients[i].count[t];
+        if (count == 0) continue;
+        double* all = malloc(count * sizeof(double));
+        if (!all) break;
+        size_t n = 0;
+        for (int i = 0; i < cfg.clients; i++) {
+            memcpy(all + n, clients[i].latency[t], clients[i].count[t] * sizeof(double));
+            n += clients[i].count[t];
+        }
+        qsort(all, count, sizeof(double), compareDouble);
+        printf("%-8s %8zu %9.3f %9.3f %9.3f %9.3f\n", opNames[t], count,
+               all[count / 2] * 1000, all[count * 9 / 10] * 1000,
+               all[count * 99 / 100] * 1000, all[count - 1] * 1000);
+        totalOps += count;
+        free(all);
+    }
+    for (int i = 0; i < cfg.clients; i++) {
+        failed += clients[i].failed;
+        broken += clients[i].broken;
+        for (int t = 0; t < NUM_OPS; t++) free(clients[i].latency[t]);
+    }
+    printf("\n%zu ops in %.2f s: %.0f ops/s", totalOps, elapsed, totalOps / elapsed);
+    printf(failed ? " (%zu answered \"Invalid\")\n" : "\n", failed);
+    if (rssBefore > 0) {
+        printf("server RSS (pid %d): %.1f MB before, %.1f MB peak, %.1f MB after\n", pid,
+               rssBefore / 1024.0, sampler.peak / 1024.0, rssAfter / 1024.0);
+    } else {
+        printf("server RSS: no server process found (use -p)\n");
+    }
+    if (broken) {
+        printf("%d clients lost their connection\n", broken);
+    }
+    free(clients);
+    free(cfg.session ? session.ops : NULL);
+    return broken ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/* editor_proto.h */
+
+/*
+ * The binary command protocol spoken by editor_server.c and batch_client.c.
+ *
+ * In text mode every edit costs several round trips: the menu, the choice,
+ * the line number and the text each wait for the other side. A binary
+ * client instead opens the connection with EDIT_MAGIC (it starts with a NUL
+ * byte, so nobody types it by accident). The server answers with the same
+ * magic, and from then on both directions are a stream of frames:
+ *
+ *   client -> server:  [ varint length ][ op ][ varint line ][ payload ]
+ *   server -> client:  [ varint length ][ type ][ body ]
+ *
+ * where length counts everything after itself. A varint stores 7 bits per
+ * byte, low bits first, with the top bit set on every byte but the last.
+ *
+ * The client doesn't wait between commands: it sends a whole batch, and the
+ * server runs every complete command it has received, then answers the
+ * batch with one REP_ACK holding a status byte per command (plus a REP_DATA
+ * before it for each view or search). A thousand scripted edits take a
+ * handful of round trips instead of thousands.
+ *
+ * Line numbers start at 1, as in the text menu.
+ */
+
+#ifndef EDITOR_PROTO_H
+#define EDITOR_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EDIT_MAGIC "\0EDB1"
+#define EDIT_MAGIC_LEN 5
+#define EDIT_MAX_FRAME (64 * 1024)  // Largest frame either side sends
+
+// Client -> server. The first command must be OP_OPEN.
+#define OP_OPEN     1   // payload: file name
+#define OP_INSERT   2   // line: insert before it (one past the end appends); payload: text
+#define OP_DELETE   3   // line
+#define OP_REPLACE  4   // line; payload: new text
+#define OP_VIEW     5   // line: first line; payload: varint count (fewer are sent if
+                        //       they don't fit in one frame, ST_ERROR if no line does)
+#define OP_SEARCH   6   // payload: text to look for
+#define OP_QUIT     7
+
+// Server -> client
+#define REP_ACK     16  // body: varint number of the first command acked, varint count,
+                        //       then one status byte per command
+#define REP_DATA    17  // body: varint command number, then for OP_VIEW a varint
+                        //       count and that many lines, each ending in '\n', for
+                        //       OP_SEARCH varint line numbers
+
+// Status bytes in REP_ACK
+#define ST_OK       0
+#define ST_BAD_LINE 1   // No such line
+#define ST_ERROR    2   // Bad command, no file open, out of memory, or not saved
+
+// Write v as a varint; returns the number of bytes used (at most 5).
+static inline int putVarint(char* out, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char)v;
+    return n;
+}
+
+// Read a varint from up to avail bytes. Returns the bytes used, 0 if more
+// are needed, or -1 if it is longer than 5 bytes.
+static inline int getVarint(const char* in, size_t avail, uint32_t* v) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < avail && i < 5; i++) {
+        result |= (uint32_t)((unsigned char)in[i] & 0x7f) << (7 * i);
+        if (!((unsigned char)in[i] & 0x80)) {
+            *v = result;
+            return i + 1;
+        }
+    }
+    return avail >= 5 ? -1 : 0;
+}
+
+// Build a command frame in out, which needs len + 11 bytes. Returns its
+// length.
+static inline int encodeCommand(char* out, int op, uint32_t line, const char* payload,
+                                size_t len) {
+    char lineBuf[5];
+    int lineLen = putVarint(lineBuf, line);
+    int n = putVarint(out, (uint32_t)(1 + lineLen + len));
+    out[n++] = (char)op;
+    memcpy(out + n, lineBuf, lineLen);
+    n += lineLen;
+    memcpy(out + n, payload, len);
+    return n + (int)len;
+}
+
+// Look for one complete frame at the start of buf. Returns the bytes it
+// occupies (filling in type, body and bodyLen), 0 if it isn't all here
+// yet, or -1 if the stream is malformed.
+static inline int parseFrame(const char* buf, size_t avail, int* type, const char** body,
+                             size_t* bodyLen) {
+    uint32_t len;
+    int n = getVarint(buf, avail, &len);
+    if (n <= 0) return n;
+    if (len == 0 || len > EDIT_MAX_FRAME) return -1;
+    if (avail - n < len) return 0;
+    *type = (unsigned char)buf[n];
+    *body = buf + n + 1;
+    *bodyLen = len - 1;
+    return n + (int)len;
+}
+
+#endif
@@ -0,0 +1,1659 @@
+/* editor_server.c */
+
+/*
+ * A finished version of server_scaffold.c where clients editing the same
+ * file share one copy of it.
+ *
+ * In the scaffold every thread calls loadFile() into its own clientData, so
+ * two clients editing notes.txt hold two copies and the last one to
+ * disconnect overwrites the other's work. Here every open file is a
+ * "document" in a process-wide table keyed by the file's canonical path
+ * (realpath), so notes.txt, ./notes.txt and ../dir/notes.txt are all the same
+ * document:
+ *   - the first client to open a file loads it; later clients just take a
+ *     reference to the copy that is already in memory
+ *   - views take the document's lock for reading, so any number of clients
+ *     can look at once; insert, delete and edit take it for writing, so edits
+ *     never get lost
+ *   - every edit is appended to <file>.journal, so saving is one small
+ *     write, not a rewrite of the whole file; a background thread folds the
+ *     journal into the file
+ *
+ * Each document is a piece table (piece_table.h): the file itself is mmap'd
+ * read-only and edits only add small pieces that point into it, so there is
+ * no limit on the number of lines and every edit or line lookup is O(log n),
+ * however big the file is.
+ *
+ * Saving works like a database log (edit_journal.h), and none of it happens
+ * on the workers:
+ *   - the flusher thread writes every document's new journal records every
+ *     AUTOSAVE_MS (sooner once one has FLUSH_BYTES waiting), then
+ *     fdatasync()s them all, one batch for every document. An edit is on
+ *     disk at most AUTOSAVE_MS after the client sees "Line inserted."
+ *   - if a journal gets BACKLOG_BYTES behind anyway (a slow disk), the
+ *     client that edits it waits for its own record to reach the disk: the
+ *     backlog can't grow without bound
+ *   - every COMPACT_SECONDS, sooner once a journal passes COMPACT_BYTES, and
+ *     when the last client leaves a file, the compactor writes a new copy of
+ *     the file to <file>.tmp and rename()s it into place. Each document
+ *     tracks the range of bytes edited since the last save: the unchanged
+ *     bytes before and after it are copied inside the kernel with
+ *     copy_file_range(), so a save writes only the changed region
+ * After a crash, opening the file replays whatever is in its journal.
+ *
+ * There is no thread per client. One event loop (epoll) holds every
+ * connection and where it is in the menu, sends the prompts and reads the
+ * answers without blocking. Only commands that touch a document (open,
+ * view, search, stats, an edit once its text is in, a binary batch, close)
+ * go to a pool of WORKERS threads, through a queue per document: a
+ * document's commands start in the order they arrived, views, searches
+ * and stats run side by side while edits run alone, and a worker waiting
+ * for the disk holds up nobody else. A client thinking
+ * about what to type costs a clientData and a LINE_SIZE buffer, not a
+ * thread and its stack.
+ *
+ * Compile: gcc -Wall -g -pthread editor_server.c -o editor_server
+ *          (piece_table.h, edit_journal.h and editor_proto.h must be in the
+ *          same directory)
+ * Usage: ./editor_server [-i ms] [-b bytes] [-w workers]
+ *        (listens on port 8080, use ./client to connect; -i sets
+ *        AUTOSAVE_MS, and -i 0 syncs every edit before answering; -b sets
+ *        FLUSH_BYTES; -w sets WORKERS)
+ */
+
+#define _GNU_SOURCE         // copy_file_range(), memmem(), accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include "piece_table.h"
+#include "edit_journal.h"
+#include "editor_proto.h"
+
+#define PORT 8080
+#define LINE_SIZE 1024
+#define IN_SIZE (2 * EDIT_MAX_FRAME)   // Largest receive buffer (binary batches)
+#define PAGE_LINES 20           // Lines per page when no count is given
+#define MAX_MATCHES 200         // Line numbers one search reports
+#define DATA_MAX (EDIT_MAX_FRAME - 11)  // REP_DATA room after its type and two varints
+#define DOC_BUCKETS 256
+#define COMPACT_SECONDS 10
+#define COMPACT_BYTES (1024 * 1024)
+#define AUTOSAVE_MS 200
+#define FLUSH_BYTES (256 * 1024)        // Unwritten journal bytes that wake the flusher
+#define BACKLOG_BYTES (8 * 1024 * 1024) // ...and that make editors wait for the disk
+#define NO_EDITS ((size_t)-1)
+#define WORKERS 4               // Threads that run commands
+#define MAX_EVENTS 64
+#define KEEP_BYTES (16 * 1024)  // Bigger buffers are freed once used
+
+// What a text session waits for next; binary sessions are BINARY throughout
+enum { WANT_FILE, WANT_CHOICE, WANT_INS_POS, WANT_INS_TEXT, WANT_DEL_POS,
+       WANT_EDIT_POS, WANT_EDIT_TEXT, BINARY, CLOSING };
+
+// Commands the event loop hands to the workers
+enum { JOB_OPEN, JOB_VIEW, JOB_SEARCH, JOB_STATS, JOB_EDIT, JOB_BATCH, JOB_CLOSE };
+
+/*
+ * A queue of sessions waiting for a worker. Each document has one, so its
+ * commands start in the order they arrived. Commands that only read (view,
+ * search, stats) run side by side; an edit or a batch waits for the
+ * readers ahead of it to finish, and everything behind it waits for it.
+ */
+struct jobQueue {
+    struct clientData* head;
+    struct clientData* tail;
+    int scheduled;              // On the run queue
+    int readers;                // Read-only jobs running
+    int writing;                // A job that may change the document is running
+    struct jobQueue* nextRun;   // Next queue on the run queue
+};
+
+/*
+ * One open file, shared by every client editing it.
+ * path, refs and next belong to the document table (docTableLock);
+ * text, loadFailed, firstDirty and cleanTail are guarded by lock; the journal has its
+ * own lock.
+ */
+struct document {
+    char* path;                 // Canonical path, the table key
+    int refs;                   // Clients that have it open
+    int loadFailed;             // Never save a document we couldn't read
+    PieceTable text;
+    Journal journal;
+    int journalOpen;
+    size_t firstDirty;          // First line changed since the file was written
+    size_t cleanTail;           // Bytes at the end unchanged since then
+    pthread_mutex_t compactLock;    // One compaction at a time
+    pthread_rwlock_t lock;
+    struct jobQueue jobs;       // Commands waiting for a worker (poolLock)
+    struct document* next;      // Next document in the same bucket
+};
+
+/*
+ * One connection. The event loop owns it, except while busy: then a
+ * worker is running its command and the loop leaves it alone.
+ */
+struct clientData {
+    int sockfd;
+    int state;                  // WANT_FILE ... CLOSING
+    int busy;
+    int eof;                    // The client has stopped sending
+    uint32_t watching;          // epoll events we asked for
+    struct document* doc;
+    size_t nextLine;            // Where "view" with no arguments starts (0-based)
+    uint32_t cmdNo;             // Binary mode: number of the next command
+
+    // The command handed to a worker
+    int job;                    // JOB_OPEN ... JOB_CLOSE
+    char op;                    // JOB_EDIT: 'I', 'D' or 'R'
+    long pos;                   // Line number (1-based)
+    long count;                 // Lines to view
+    char* arg;                  // File name, search text or new line
+    struct clientData* nextJob; // In a job queue, or the done list
+    struct jobQueue ownJobs;    // Until a document is open
+
+    char* in;                   // Bytes received but not yet used
+    size_t inCap;               // LINE_SIZE, up to IN_SIZE for binary batches
+    size_t inStart;
+    size_t inEnd;
+    char lineBuf[LINE_SIZE];    // The line being handled
+    char* out;                  // Page buffer
+    size_t outCap;
+    char* reply;                // Bytes waiting to be sent
+    size_t replyStart;
+    size_t replyLen;
+    size_t replyCap;
+};
+
+struct document* docTable[DOC_BUCKETS];
+pthread_mutex_t docTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Wakes the compactor early when a journal gets big or a file is closed
+pthread_mutex_t compactMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compactCond = PTHREAD_COND_INITIALIZER;
+
+// Wakes the flusher early when a journal has FLUSH_BYTES waiting
+pthread_mutex_t flushMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;
+int autosaveMs = AUTOSAVE_MS;
+size_t flushBytes = FLUSH_BYTES;
+
+// The worker pool: queues with jobs waiting, and sessions handed back
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+struct jobQueue* runHead;
+struct jobQueue* runTail;
+pthread_mutex_t doneLock = PTHREAD_MUTEX_INITIALIZER;
+struct clientData* doneList;
+int wakeFd;                     // eventfd: wakes the event loop for doneList
+int epollFd;
+
+unsigned hashPath(const char* path) {
+    unsigned h = 2166136261u;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h % DOC_BUCKETS;
+}
+
+void releaseDocument(struct document* doc);
+
+/*
+ * Grow the document's dirty range to cover an edit just applied at line
+ * (0-based). The range is kept as the first dirty line and the number of
+ * clean bytes at the end.
+ */
+void markDirty(struct document* doc, char op, size_t line) {
+    if (line < doc->firstDirty) {
+        doc->firstDirty = line;
+    }
+    // A deleted line leaves nothing behind; an inserted or replaced one ends
+    // where the next line starts
+    size_t end = ptLineStart(&doc->text, op == 'D' ? line : line + 1);
+    size_t tail = ptBytes(&doc->text) - end;
+    if (tail < doc->cleanTail) {
+        doc->cleanTail = tail;
+    }
+}
+
+/*
+ * Replay one journal record into a document that is being loaded.
+ */
+int replayRecord(void* arg, char op, size_t line, const char* text, size_t len) {
+    struct document* doc = arg;
+    int status = -1;
+    if (op == 'I') status = ptInsertLine(&doc->text, line, text, len);
+    else if (op == 'D') status = ptDeleteLine(&doc->text, line);
+    else if (op == 'R') status = ptReplaceLine(&doc->text, line, text, len);
+    if (status == 0) {
+        markDirty(doc, op, line);
+    }
+    return status;
+}
+
+/*
+ * Map the document's file into a piece table, then replay any edits left in
+ * its journal by a server that didn't get to compact them. Nothing is
+ * copied: lines are read straight out of the mapping until somebody edits
+ * them.
+ */
+void loadFile(struct document* doc) {
+    struct stat st;
+    doc->firstDirty = NO_EDITS;
+    doc->cleanTail = NO_EDITS;
+    if (ptOpen(&doc->text, doc->path) == -1 || stat(doc->path, &st) == -1) {
+        perror(doc->path);
+        doc->loadFailed = 1;
+        return;
+    }
+    long replayed = journalOpen(&doc->journal, doc->path, st.st_ino, replayRecord, doc);
+    if (replayed == -1) {
+        perror("journal");
+        doc->loadFailed = 1;
+        return;
+    }
+    doc->journalOpen = 1;
+    // ptOpen() gives a last line without a newline one, so the document's
+    // last bytes aren't the file's: a save can't keep any of its tail
+    if (ptBytes(&doc->text) != (size_t)st.st_size) {
+        doc->cleanTail = 0;
+    }
+    if (replayed > 0) {
+        printf("%s: recovered %ld edits from the journal\n", doc->path, replayed);
+    }
+}
+
+/*
+ * Copy len bytes at offset from in src to offset to in dst, inside the
+ * kernel. On file systems with reflinks (btrfs, XFS) nothing is copied at
+ * all.
+ */
+int copyRange(int src, size_t from, int dst, size_t to, size_t len) {
+    loff_t in = from, out = to;
+    len += from;                // Copy until in reaches len
+    while ((size_t)in < len) {
+        ssize_t n = copy_file_range(src, &in, dst, &out, len - in, 0);
+        if (n > 0) continue;
+        if (n == 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL)) {
+            return -1;
+        }
+        // No copy_file_range() here: do it by hand
+        char buf[64 * 1024];
+        while ((size_t)in < len) {
+            size_t want = len - in < sizeof(buf) ? len - in : sizeof(buf);
+            n = pread(src, buf, want, in);
+            if (n <= 0 || pwrite(dst, buf, n, out) != n) {
+                return -1;
+            }
+            in += n;
+            out += n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * fsync() the directory holding path, so a rename() in it is durable.
+ */
+void syncDir(const char* path) {
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Fold the journal into the file. Runs on the compactor thread, or on the
+ * last client out.
+ *
+ * The old contents are still mmap'd and the piece table reads from them, so
+ * we can't write over the file. Instead we build <file>.tmp: the bytes
+ * before and after the dirty range are copied from the current file by the
+ * kernel, and only the dirty range is written out of the piece table. Then
+ * journalSwitch() renames it into place and drops the journal records it
+ * covers.
+ *
+ * Holding the read lock while writing keeps editors out, but viewers can
+ * carry on.
+ */
+void compactFile(struct document* doc) {
+    pthread_mutex_lock(&doc->compactLock);
+    pthread_rwlock_rdlock(&doc->lock);
+    if (doc->loadFailed || doc->firstDirty == NO_EDITS) {
+        pthread_rwlock_unlock(&doc->lock);
+        pthread_mutex_unlock(&doc->compactLock);
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", doc->path);
+    struct stat st;
+    int src = open(doc->path, O_RDONLY);
+    size_t srcLen = 0;
+    mode_t mode = 0644;
+    if (src != -1 && fstat(src, &st) == 0) {
+        srcLen = st.st_size;
+        mode = st.st_mode & 07777;
+    }
+    size_t mark = journalMark(&doc->journal);
+    size_t total = ptBytes(&doc->text);
+    size_t prefix = ptLineStart(&doc->text, doc->firstDirty);
+    size_t tail = doc->cleanTail;
+    if (tail > total - prefix) tail = total - prefix;
+    if (tail > srcLen) tail = srcLen;
+    size_t dirtyEnd = total - tail;
+
+    int status = -1;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, mode);
+    if (src != -1 && fd != -1 && copyRange(src, 0, fd, 0, prefix) == 0 &&
+        lseek(fd, prefix, SEEK_SET) != -1 &&
+        ptWriteRange(&doc->text, fd, prefix, dirtyEnd) == 0 &&
+        copyRange(src, srcLen - tail, fd, dirtyEnd, tail) == 0) {
+        status = 0;
+        doc->firstDirty = NO_EDITS;     // Only compactors touch these under rdlock
+        doc->cleanTail = NO_EDITS;
+    }
+    pthread_rwlock_unlock(&doc->lock);
+
+    if (status == 0 && (fdatasync(fd) == -1 || fstat(fd, &st) == -1 ||
+                        journalSwitch(&doc->journal, doc->path, tmp, st.st_ino, mark) == -1)) {
+        status = -1;
+    }
+    if (src != -1) close(src);
+    if (fd != -1) close(fd);
+    if (status == -1) {
+        perror(tmp);
+        unlink(tmp);
+        // Whatever we didn't manage to write is still dirty
+        pthread_rwlock_wrlock(&doc->lock);
+        doc->firstDirty = 0;
+        doc->cleanTail = 0;
+        pthread_rwlock_unlock(&doc->lock);
+    } else {
+        syncDir(doc->path);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%s: compacted (kept %zu bytes, wrote %zu) in %.1f ms\n", doc->path,
+               prefix + tail, dirtyEnd - prefix,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    pthread_mutex_unlock(&doc->compactLock);
+}
+
+/*
+ * Free a document's text, unmap its file and close its journal. If the
+ * journal is still open, the last compaction failed, so journalClose()
+ * writes out any records it hasn't yet for the next load to replay.
+ */
+void cleanUp(struct document* doc) {
+    ptClose(&doc->text);
+    if (doc->journalOpen) {
+        journalClose(&doc->journal, doc->path, 0);
+    }
+    pthread_mutex_destroy(&doc->compactLock);
+    pthread_rwlock_destroy(&doc->lock);
+    free(doc->path);
+    free(doc);
+}
+
+/*
+ * Record an edit that has just been applied (with the write lock held) and
+ * grow the dirty range. Returns the sequence number to pass to syncEdit()
+ * once the lock is released.
+ */
+unsigned long logEdit(struct document* doc, char op, size_t line, const char* text, size_t len) {
+    markDirty(doc, op, line);
+    return journalAppend(&doc->journal, op, line, text, len);
+}
+
+/*
+ * After an edit: normally the flusher gets it to disk, so just wake it if
+ * a lot is waiting. With -i 0, or once the disk is BACKLOG_BYTES behind, the
+ * client waits for its record to be on disk (doing the write itself if
+ * nobody else is). Also nudges the compactor if the journal has grown big.
+ * Returns -1 if the client waited and the record didn't get to disk.
+ */
+int syncEdit(struct document* doc, unsigned long seq) {
+    size_t backlog = journalBacklog(&doc->journal);
+    int status = 0;
+    if (autosaveMs == 0 || backlog > BACKLOG_BYTES) {
+        status = journalSync(&doc->journal, seq);
+    } else if (backlog > flushBytes) {
+        pthread_mutex_lock(&flushMutex);
+        pthread_cond_signal(&flushCond);
+        pthread_mutex_unlock(&flushMutex);
+    }
+    if (journalSize(&doc->journal) > COMPACT_BYTES) {
+        pthread_mutex_lock(&compactMutex);
+        pthread_cond_signal(&compactCond);
+        pthread_mutex_unlock(&compactMutex);
+    }
+    return status;
+}
+
+/*
+ * Find the document for filename, loading it if nobody has it open yet.
+ * Returns NULL if the file can't be opened or created.
+ */
+struct document* openDocument(const char* filename) {
+    // Make sure the file exists, so realpath() can name it
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+    close(fd);
+    char canonical[PATH_MAX];
+    if (realpath(filename, canonical) == NULL) {
+        return NULL;
+    }
+
+    unsigned bucket = hashPath(canonical);
+    pthread_mutex_lock(&docTableLock);
+    struct document* doc = docTable[bucket];
+    while (doc && strcmp(doc->path, canonical) != 0) {
+        doc = doc->next;
+    }
+    if (doc) {
+        // Somebody already has it: share their copy
+        doc->refs++;
+        pthread_mutex_unlock(&docTableLock);
+
+        // Wait for whoever is loading it, and make sure that worked
+        pthread_rwlock_rdlock(&doc->lock);
+        int failed = doc->loadFailed;
+        pthread_rwlock_unlock(&doc->lock);
+        if (failed) {
+            releaseDocument(doc);
+            return NULL;
+        }
+        return doc;
+    }
+
+    doc = calloc(1, sizeof(struct document));
+    if (!doc || !(doc->path = strdup(canonical))) {
+        pthread_mutex_unlock(&docTableLock);
+        free(doc);
+        return NULL;
+    }
+    doc->refs = 1;
+    pthread_mutex_init(&doc->compactLock, NULL);
+    pthread_rwlock_init(&doc->lock, NULL);
+
+    // Publish it write-locked, then load outside the table lock: clients
+    // opening other files don't wait, and clients opening this one block
+    // on the document lock until it is loaded
+    pthread_rwlock_wrlock(&doc->lock);
+    doc->next = docTable[bucket];
+    docTable[bucket] = doc;
+    pthread_mutex_unlock(&docTableLock);
+
+    loadFile(doc);
+    int failed = doc->loadFailed;
+    pthread_rwlock_unlock(&doc->lock);
+    if (failed) {
+        releaseDocument(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+/*
+ * A client is done with the document. The last one out doesn't save it:
+ * the document stays in the table with no references, and the compactor
+ * saves and frees it, so the worker never waits for the disk.
+ */
+void closeDocument(struct document* doc) {
+    pthread_mutex_lock(&docTableLock);
+    int last = --doc->refs == 0;
+    pthread_mutex_unlock(&docTableLock);
+    if (last) {
+        pthread_mutex_lock(&compactMutex);
+        pthread_cond_signal(&compactCond);
+        pthread_mutex_unlock(&compactMutex);
+    }
+}
+
+/*
+ * Drop one reference. If it was the last, compact the file and free the
+ * document. If somebody reopens it while we are compacting, it stays.
+ */
+void releaseDocument(struct document* doc) {
+    pthread_mutex_lock(&docTableLock);
+    int last = --doc->refs == 0;
+    pthread_mutex_unlock(&docTableLock);
+    if (!last) {
+        return;
+    }
+
+    compactFile(doc);
+
+    pthread_mutex_lock(&docTableLock);
+    if (doc->refs > 0) {
+        pthread_mutex_unlock(&docTableLock);
+        return;
+    }
+    struct document** link = &docTable[hashPath(doc->path)];
+    while (*link != doc) {
+        link = &(*link)->next;
+    }
+    *link = doc->next;
+
+    // Everything is in the file now, so the journal can go. Do it before
+    // anyone can reopen the file and start a new one
+    int compacted = !doc->loadFailed && doc->firstDirty == NO_EDITS;
+    if (compacted && doc->journalOpen) {
+        journalClose(&doc->journal, doc->path, 1);
+        doc->journalOpen = 0;
+    }
+    pthread_mutex_unlock(&docTableLock);
+    cleanUp(doc);
+}
+
+/*
+ * Take a reference to every document in the table, so none is freed while
+ * a background thread works on it. Waits out documents still being loaded.
+ * Returns a malloc'd array of *count documents.
+ */
+struct document** grabDocuments(int* count) {
+    pthread_mutex_lock(&docTableLock);
+    int n = 0;
+    for (int b = 0; b < DOC_BUCKETS; b++) {
+        for (struct document* doc = docTable[b]; doc; doc = doc->next) n++;
+    }
+    struct document** docs = malloc((n + 1) * sizeof(struct document*));
+    n = 0;
+    for (int b = 0; docs && b < DOC_BUCKETS; b++) {
+        for (struct document* doc = docTable[b]; doc; doc = doc->next) {
+            doc->refs++;
+            docs[n++] = doc;
+        }
+    }
+    pthread_mutex_unlock(&docTableLock);
+
+    for (int i = 0; i < n; i++) {
+        pthread_rwlock_rdlock(&docs[i]->lock);
+        pthread_rwlock_unlock(&docs[i]->lock);
+    }
+    *count = n;
+    return docs;
+}
+
+/*
+ * Sleep until ms from now or until cond is signalled.
+ */
+void napOn(pthread_cond_t* cond, pthread_mutex_t* mutex, long ms) {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += ms / 1000;
+    wake.tv_nsec += (ms % 1000) * 1000000;
+    if (wake.tv_nsec >= 1000000000) {
+        wake.tv_sec++;
+        wake.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(mutex);
+    pthread_cond_timedwait(cond, mutex, &wake);
+    pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Compactor thread: every COMPACT_SECONDS (or when a journal gets big, or a
+ * file's last client leaves), fold every open document's journal into its
+ * file. Documents nobody has open any more are freed.
+ */
+void* compactor(void* arg) {
+    while (1) {
+        napOn(&compactCond, &compactMutex, COMPACT_SECONDS * 1000L);
+        int count;
+        struct document** docs = grabDocuments(&count);
+        for (int i = 0; i < count; i++) {
+            compactFile(docs[i]);
+            releaseDocument(docs[i]);
+        }
+        free(docs);
+    }
+    return NULL;
+}
+
+/*
+ * Flusher thread: every autosaveMs (or sooner if a journal has flushBytes
+ * waiting), write every document's buffered journal records, then
+ * fdatasync() them all. Writing everything before the first sync lets the
+ * disk take the whole batch at once, and no client waits for any of it.
+ */
+void* flusher(void* arg) {
+    while (1) {
+        napOn(&flushCond, &flushMutex, autosaveMs);
+        int count;
+        struct document** docs = grabDocuments(&count);
+        JournalBatch* batches = malloc((count + 1) * sizeof(JournalBatch));
+        char* written = calloc(count + 1, 1);
+        for (int i = 0; batches && written && i < count; i++) {
+            if (!docs[i]->loadFailed && docs[i]->journalOpen) {
+                written[i] = journalWriteBuffered(&docs[i]->journal, &batches[i]);
+            }
+        }
+        for (int i = 0; batches && written && i < count; i++) {
+            if (written[i]) {
+                journalSyncWritten(&docs[i]->journal, &batches[i]);
+            }
+        }
+        // Like a client leaving: an unused document goes to the compactor
+        for (int i = 0; i < count; i++) {
+            closeDocument(docs[i]);
+        }
+        free(batches);
+        free(written);
+        free(docs);
+    }
+    return NULL;
+}
+
+/*
+ * Make sure *buf (with room for *cap bytes) can take need more bytes after
+ * used, doubling it if not.
+ */
+int reserve(char** buf, size_t* cap, size_t used, size_t need) {
+    if (used + need <= *cap) {
+        return 0;
+    }
+    size_t newCap = *cap ? *cap : 4096;
+    while (newCap < used + need) newCap *= 2;
+    char* bigger = realloc(*buf, newCap);
+    if (!bigger) {
+        return -1;
+    }
+    *buf = bigger;
+    *cap = newCap;
+    return 0;
+}
+
+/*
+ * Make sure the page buffer has room for need more bytes after used.
+ */
+int reserveOut(struct clientData* d, size_t used, size_t need) {
+    return reserve(&d->out, &d->outCap, used, need);
+}
+
+/*
+ * Queue bytes for the client. Nothing here writes to the socket: the
+ * event loop sends the queue once the command is done.
+ */
+void sendText(struct clientData* d, const char* text, size_t len) {
+    if (reserve(&d->reply, &d->replyCap, d->replyLen, len) == 0) {
+        memcpy(d->reply + d->replyLen, text, len);
+        d->replyLen += len;
+    }
+}
+
+void sendStr(struct clientData* d, const char* text) {
+    sendText(d, text, strlen(text));
+}
+
+/*
+ * The menu, then the choice prompt.
+ */
+void showMenu(struct clientData* d) {
+    sendStr(d, "\n=== MENU ===\n"
+               "1. View file (next page)\n"
+               "2. Insert line\n"
+               "3. Delete line\n"
+               "4. Edit line\n"
+               "5. Exit\n"
+               "Or: view <start> [count], search <text>, stats\n"
+               "Choice: ");
+    d->state = WANT_CHOICE;
+}
+
+/*
+ * Copy lines [first, *end) (0-based) into the page buffer, numbered for the
+ * text menu or bare for binary clients, stopping early rather than go past
+ * max bytes. *end is set to the line after the last one copied. The caller
+ * holds the document lock. Returns the bytes used.
+ */
+size_t copyPage(struct clientData* d, PieceTable* text, size_t first, size_t* end,
+                int numbered, size_t max) {
+    size_t used = 0;
+    size_t i;
+    for (i = first; i < *end; i++) {
+        size_t len = ptLineStart(text, i + 1) - ptLineStart(text, i) - 1;
+        if (used + len + 1 + (numbered ? 32 : 0) > max || reserveOut(d, used, len + 32) == -1) {
+            break;
+        }
+        if (numbered) {
+            used += snprintf(d->out + used, 32, "%4zu: ", i + 1);
+        }
+        used += ptGetLine(text, i, d->out + used, len);
+        d->out[used++] = '\n';
+    }
+    *end = i;
+    return used;
+}
+
+/*
+ * Send count lines starting at line start (1-based), numbered. Only that
+ * page is sent, however big the file: the lines are copied into the
+ * client's page buffer under the read lock, and queued with their header
+ * and footer once the lock is released.
+ */
+void viewLines(struct clientData* d, size_t start, size_t count) {
+    struct document* doc = d->doc;
+    char header[96], footer[96];
+
+    pthread_rwlock_rdlock(&doc->lock);
+    size_t numLines = ptLines(&doc->text);
+    if (numLines == 0) {
+        pthread_rwlock_unlock(&doc->lock);
+        sendStr(d, "(file is empty)\n");
+        return;
+    }
+    if (start < 1 || start > numLines) {
+        pthread_rwlock_unlock(&doc->lock);
+        sendStr(d, "Invalid line number.\n");
+        return;
+    }
+    size_t end = start - 1 + count < numLines ? start - 1 + count : numLines;
+    size_t used = copyPage(d, &doc->text, start - 1, &end, 1, (size_t)-1);
+    pthread_rwlock_unlock(&doc->lock);
+
+    int headerLen = snprintf(header, sizeof(header), "\n--- Lines %zu-%zu of %zu ---\n",
+                             start, end, numLines);
+    int footerLen = end < numLines
+        ? snprintf(footer, sizeof(footer), "--- \"view %zu\" or 1 for more ---\n", end + 1)
+        : snprintf(footer, sizeof(footer), "--- end of file ---\n");
+    d->nextLine = end < numLines ? end : 0;
+
+    sendText(d, header, headerLen);
+    sendText(d, d->out, used);
+    sendText(d, footer, footerLen);
+}
+
+/*
+ * Collects line numbers for searchLines()
+ */
+struct matches {
+    struct clientData* d;
+    size_t used;
+    size_t count;
+};
+
+int addMatch(void* arg, size_t line) {
+    struct matches* m = arg;
+    if (m->count == MAX_MATCHES || reserveOut(m->d, m->used, 24) == -1) {
+        return 1;       // Stop searching
+    }
+    m->used += snprintf(m->d->out + m->used, 24, " %zu", line + 1);
+    m->count++;
+    return 0;
+}
+
+/*
+ * Send the numbers of the lines containing text (not the lines themselves;
+ * "view <n>" shows one). At most MAX_MATCHES are reported.
+ */
+void searchLines(struct clientData* d, const char* text) {
+    struct document* doc = d->doc;
+    struct matches m = {d, 0, 0};
+    if (reserveOut(d, 0, 32) == -1) {
+        return;
+    }
+    m.used = snprintf(d->out, 32, "Matching lines:");
+    pthread_rwlock_rdlock(&doc->lock);
+    ptSearch(&doc->text, text, strlen(text), addMatch, &m);
+    pthread_rwlock_unlock(&doc->lock);
+
+    char footer[64];
+    int footerLen = m.count == 0 ? snprintf(footer, sizeof(footer), " none\n")
+                  : m.count == MAX_MATCHES ? snprintf(footer, sizeof(footer),
+                                                      " (first %d shown)\n", MAX_MATCHES)
+                  : snprintf(footer, sizeof(footer), " (%zu)\n", m.count);
+    sendText(d, d->out, m.used);
+    sendText(d, footer, footerLen);
+}
+
+/*
+ * "stats": what this document costs the server.
+ */
+void memStats(struct clientData* d) {
+    struct document* doc = d->doc;
+    PtStats st;
+    pthread_rwlock_rdlock(&doc->lock);
+    ptStats(&doc->text, &st);
+    pthread_rwlock_unlock(&doc->lock);
+    pthread_mutex_lock(&docTableLock);
+    int refs = doc->refs;
+    pthread_mutex_unlock(&docTableLock);
+
+    char msg[512];
+    int len = snprintf(msg, sizeof(msg),
+                       "--- Memory for %s (%d clients) ---\n"
+                       "file (mapped):  %zu bytes\n"
+                       "typed text:     %zu live of %zu bytes (buffer %zu), %zu compactions\n"
+                       "pieces:         %zu (slabs hold %zu)\n"
+                       "heap total:     %zu bytes\n",
+                       doc->path, refs, st.fileBytes, st.addLive, st.addBytes,
+                       st.addCap, st.compactions, st.pieces, st.slabNodes, st.heapBytes);
+    sendText(d, msg, len);
+}
+
+/*
+ * Apply one edit (op 'I', 'D' or 'R') at 1-based line pos and journal it.
+ * The caller holds the write lock and calls syncEdit() with *seq after
+ * releasing it. Returns ST_OK, ST_BAD_LINE or ST_ERROR.
+ */
+int applyEdit(struct document* doc, char op, long pos, const char* text, size_t len,
+              unsigned long* seq) {
+    size_t numLines = ptLines(&doc->text);
+    if (pos < 1 || (size_t)pos > numLines + (op == 'I')) {
+        return ST_BAD_LINE;
+    }
+    int status = op == 'I' ? ptInsertLine(&doc->text, pos - 1, text, len)
+               : op == 'D' ? ptDeleteLine(&doc->text, pos - 1)
+               : ptReplaceLine(&doc->text, pos - 1, text, len);
+    if (status == -1) {
+        return ST_ERROR;
+    }
+    unsigned long s = logEdit(doc, op, pos - 1, text, op == 'D' ? 0 : len);
+    if (s > *seq) {
+        *seq = s;
+    }
+    return ST_OK;
+}
+
+/*
+ * Insert, delete or replace the line the client chose (d->op at d->pos,
+ * with d->arg as the text), then tell them how it went. The prompts were
+ * answered on the event loop, so a slow typist never holds a worker.
+ */
+void editCommand(struct clientData* d) {
+    struct document* doc = d->doc;
+    const char* text = d->arg ? d->arg : "";
+    unsigned long seq = 0;
+    pthread_rwlock_wrlock(&doc->lock);
+    int status = applyEdit(doc, d->op, d->pos, text, strlen(text), &seq);
+    pthread_rwlock_unlock(&doc->lock);
+    int saved = syncEdit(doc, seq);
+
+    if (status == ST_BAD_LINE) sendStr(d, "Invalid line number.\n");
+    else if (status == ST_ERROR) sendStr(d, "Out of memory.\n");
+    else if (saved == -1) sendStr(d, "Edit made, but it couldn't be saved to disk.\n");
+    else sendStr(d, d->op == 'I' ? "Line inserted.\n"
+                  : d->op == 'D' ? "Line deleted.\n" : "Line updated.\n");
+}
+
+/*
+ * Add a reply frame to the batch being built for a binary client.
+ */
+void addReply(struct clientData* d, int type, uint32_t cmd, const char* body, size_t len) {
+    char cmdBuf[5];
+    int cmdLen = putVarint(cmdBuf, cmd);
+    if (reserve(&d->reply, &d->replyCap, d->replyLen, len + 16) == -1) {
+        return;
+    }
+    d->replyLen += putVarint(d->reply + d->replyLen, 1 + cmdLen + len);
+    d->reply[d->replyLen++] = (char)type;
+    memcpy(d->reply + d->replyLen, cmdBuf, cmdLen);
+    memcpy(d->reply + d->replyLen + cmdLen, body, len);
+    d->replyLen += cmdLen + len;
+}
+
+/*
+ * Add one REP_ACK for count commands starting at first. The event loop
+ * sends it with the rest of the batch's replies in one write.
+ */
+void sendAck(struct clientData* d, uint32_t first, const char* status, size_t count) {
+    char head[10];
+    int headLen = putVarint(head, first);
+    headLen += putVarint(head + headLen, count);
+    if (reserve(&d->reply, &d->replyCap, d->replyLen, headLen + count + 6) == 0) {
+        d->replyLen += putVarint(d->reply + d->replyLen, 1 + headLen + count);
+        d->reply[d->replyLen++] = REP_ACK;
+        memcpy(d->reply + d->replyLen, head, headLen);
+        memcpy(d->reply + d->replyLen + headLen, status, count);
+        d->replyLen += headLen + count;
+    }
+}
+
+/*
+ * Collects line numbers as varints for a binary OP_SEARCH
+ */
+int addMatchVarint(void* arg, size_t line) {
+    struct matches* m = arg;
+    if (m->count == MAX_MATCHES || m->used + 5 > DATA_MAX ||
+        reserveOut(m->d, m->used, 5) == -1) {
+        return 1;
+    }
+    m->used += putVarint(m->d->out + m->used, line + 1);
+    m->count++;
+    return 0;
+}
+
+/*
+ * Binary mode: run every complete command in d->in as one batch.
+ *
+ * The whole batch runs under one acquisition of the document lock (write
+ * if it has any edits, read otherwise) and its edits share one journal
+ * sync. Views and searches produce REP_DATA frames; then one REP_ACK gives
+ * a status per command. Everything goes back in a single write().
+ * Returns 0, or -1 to hang up (malformed frame or OP_QUIT).
+ */
+int runBatch(struct clientData* d, uint32_t* cmdNo) {
+    struct document* doc = d->doc;
+    uint32_t first = *cmdNo;
+    char status[IN_SIZE / 2];   // A command is at least two bytes
+    char edit[IN_SIZE / 2];
+    size_t count = 0;
+    int quit = 0;
+
+    // Edits need the write lock; a batch of only views can share
+    int writes = 0;
+    size_t pos = d->inStart;
+    while (1) {
+        int type;
+        const char* body;
+        size_t bodyLen;
+        int n = parseFrame(d->in + pos, d->inEnd - pos, &type, &body, &bodyLen);
+        if (n == 0) break;
+        if (n < 0) return -1;
+        writes |= type == OP_INSERT || type == OP_DELETE || type == OP_REPLACE;
+        pos += n;
+    }
+    if (writes) pthread_rwlock_wrlock(&doc->lock);
+    else pthread_rwlock_rdlock(&doc->lock);
+
+    unsigned long seq = 0;
+    while (!quit) {
+        int type;
+        const char* body;
+        size_t bodyLen;
+        int n = parseFrame(d->in + d->inStart, d->inEnd - d->inStart, &type, &body, &bodyLen);
+        if (n <= 0) break;
+        d->inStart += n;
+
+        uint32_t line = 0;
+        int lineLen = getVarint(body, bodyLen, &line);
+        if (lineLen <= 0) {
+            status[count++] = ST_ERROR;
+            continue;
+        }
+        const char* payload = body + lineLen;
+        size_t payloadLen = bodyLen - lineLen;
+        uint32_t cmd = first + count;
+        int st = ST_ERROR;
+        edit[count] = 0;
+
+        if (type == OP_QUIT) {
+            st = ST_OK;
+            quit = 1;
+        } else if (type == OP_INSERT || type == OP_DELETE || type == OP_REPLACE) {
+            char op = type == OP_INSERT ? 'I' : type == OP_DELETE ? 'D' : 'R';
+            if (!memchr(payload, '\n', payloadLen)) {
+                st = applyEdit(doc, op, line, payload, payloadLen, &seq);
+                edit[count] = 1;
+            }
+        } else if (type == OP_VIEW) {
+            uint32_t want = PAGE_LINES;
+            getVarint(payload, payloadLen, &want);
+            size_t numLines = ptLines(&doc->text);
+            if (line >= 1 && line <= numLines) {
+                // As many lines as fit in one frame, led by how many that is
+                char countBuf[5];
+                size_t end = line - 1 + want < numLines ? line - 1 + want : numLines;
+                size_t used = copyPage(d, &doc->text, line - 1, &end, 0, DATA_MAX);
+                int countLen = putVarint(countBuf, end - (line - 1));
+                if (end > line - 1 && reserveOut(d, used, countLen) == 0) {
+                    memmove(d->out + countLen, d->out, used);
+                    memcpy(d->out, countBuf, countLen);
+                    addReply(d, REP_DATA, cmd, d->out, used + countLen);
+                    st = ST_OK;
+                }
+            } else {
+                st = ST_BAD_LINE;
+            }
+        } else if (type == OP_SEARCH && payloadLen > 0) {
+            struct matches m = {d, 0, 0};
+            ptSearch(&doc->text, payload, payloadLen, addMatchVarint, &m);
+            addReply(d, REP_DATA, cmd, d->out, m.used);
+            st = ST_OK;
+        }
+        status[count++] = st;
+    }
+    pthread_rwlock_unlock(&doc->lock);
+    if (syncEdit(doc, seq) == -1) {
+        // The edits are made but not saved: don't tell the client they're done
+        for (size_t i = 0; i < count; i++) {
+            if (status[i] == ST_OK && edit[i]) status[i] = ST_ERROR;
+        }
+    }
+
+    sendAck(d, first, status, count);
+    *cmdNo += count;
+    return quit ? -1 : 0;
+}
+
+/*
+ * Worker: run the command a session handed over. Only the worker touches
+ * the session until it is handed back.
+ */
+void runJob(struct clientData* d) {
+    switch (d->job) {
+    case JOB_OPEN:
+        d->doc = openDocument(d->arg);
+        if (d->state == BINARY) {
+            char status = d->doc ? ST_OK : ST_ERROR;
+            sendAck(d, 0, &status, 1);
+            d->cmdNo = 1;
+        } else if (d->doc) {
+            showMenu(d);
+        } else {
+            sendStr(d, "Could not open or create that file.\n");
+        }
+        if (!d->doc) d->state = CLOSING;
+        break;
+    case JOB_VIEW:
+        viewLines(d, d->pos, d->count);
+        showMenu(d);
+        break;
+    case JOB_SEARCH:
+        searchLines(d, d->arg);
+        showMenu(d);
+        break;
+    case JOB_STATS:
+        memStats(d);
+        showMenu(d);
+        break;
+    case JOB_EDIT:
+        editCommand(d);
+        showMenu(d);
+        break;
+    case JOB_BATCH:
+        if (runBatch(d, &d->cmdNo) == -1) d->state = CLOSING;
+        break;
+    case JOB_CLOSE:
+        closeDocument(d->doc);
+        d->doc = NULL;
+        break;
+    }
+    free(d->arg);
+    d->arg = NULL;
+
+    // A big view or batch shouldn't pin its buffer while the client idles
+    if (d->outCap > KEEP_BYTES) {
+        free(d->out);
+        d->out = NULL;
+        d->outCap = 0;
+    }
+}
+
+// Jobs that only take the document's read lock, so may run together
+int sharedJob(int job) {
+    return job == JOB_VIEW || job == JOB_SEARCH || job == JOB_STATS;
+}
+
+/*
+ * Put q on the run queue if the job at its head can start now: nothing
+ * that changes the document is running, and the job only reads (or is a
+ * close, which just drops a reference) or nothing is running at all. The
+ * caller holds poolLock.
+ */
+void schedule(struct jobQueue* q) {
+    if (q->scheduled || !q->head || q->writing) return;
+    int job = q->head->job;
+    if (!sharedJob(job) && job != JOB_CLOSE && q->readers > 0) return;
+    q->scheduled = 1;
+    q->nextRun = NULL;
+    if (runTail) runTail->nextRun = q;
+    else runHead = q;
+    runTail = q;
+    pthread_cond_signal(&poolCond);
+}
+
+/*
+ * A job from q is done: the ones behind it may start. The caller holds
+ * poolLock.
+ */
+void finishJob(struct jobQueue* q, int job) {
+    if (sharedJob(job)) q->readers--;
+    else q->writing = 0;
+    schedule(q);
+}
+
+/*
+ * Hand a session's command to the workers. Commands on one document start
+ * in the order they arrived; sessions that haven't opened a document yet
+ * queue on their own.
+ */
+void submitJob(struct clientData* d, int job) {
+    struct jobQueue* q = d->doc ? &d->doc->jobs : &d->ownJobs;
+    d->job = job;
+    d->busy = 1;
+    d->nextJob = NULL;
+    pthread_mutex_lock(&poolLock);
+    if (q->tail) q->tail->nextJob = d;
+    else q->head = d;
+    q->tail = d;
+    schedule(q);
+    pthread_mutex_unlock(&poolLock);
+}
+
+/*
+ * Worker thread: take the next queue with work, run its first job, and
+ * hand the session back to the event loop.
+ */
+void* worker(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&poolLock);
+        while (!runHead) {
+            pthread_cond_wait(&poolCond, &poolLock);
+        }
+        struct jobQueue* q = runHead;
+        runHead = q->nextRun;
+        if (!runHead) runTail = NULL;
+        q->scheduled = 0;
+        struct clientData* d = q->head;
+        q->head = d->nextJob;
+        if (!q->head) q->tail = NULL;
+
+        // A close isn't counted as running: the document (and its queue)
+        // may be freed once it lets go
+        int job = d->job;
+        int counted = job != JOB_CLOSE;
+        if (sharedJob(job)) q->readers++;
+        else if (counted) q->writing = 1;
+        schedule(q);        // Another reader right behind can start too
+        pthread_mutex_unlock(&poolLock);
+
+        runJob(d);
+
+        if (counted) {
+            pthread_mutex_lock(&poolLock);
+            finishJob(q, job);
+            pthread_mutex_unlock(&poolLock);
+        }
+
+        pthread_mutex_lock(&doneLock);
+        d->nextJob = doneList;
+        doneList = d;
+        pthread_mutex_unlock(&doneLock);
+        uint64_t one = 1;
+        write(wakeFd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+/*
+ * Event loop: only listen for the events the session can use next. A busy
+ * session is taken out of epoll altogether: hangups are reported even when
+ * not asked for, and would wake the loop over and over.
+ */
+void watch(struct clientData* d, uint32_t events) {
+    if (d->watching != events) {
+        struct epoll_event ev = {.events = events, .data.ptr = d};
+        int op = events == 0 ? EPOLL_CTL_DEL : d->watching == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        epoll_ctl(epollFd, op, d->sockfd, &ev);
+        d->watching = events;
+    }
+}
+
+void endSession(struct clientData* d) {
+    close(d->sockfd);
+    free(d->in);
+    free(d->out);
+    free(d->reply);
+    free(d->arg);
+    free(d);
+}
+
+/*
+ * Event loop: read what the client has sent, without blocking. Returns
+ * -1 once the client has closed its end (or the connection broke).
+ */
+int fillInput(struct clientData* d) {
+    if (d->inStart > 0) {
+        memmove(d->in, d->in + d->inStart, d->inEnd - d->inStart);
+        d->inEnd -= d->inStart;
+        d->inStart = 0;
+    }
+    // A binary frame may need more room than a text line
+    if (d->inEnd == d->inCap && d->state == BINARY && d->inCap < IN_SIZE) {
+        size_t newCap = d->inCap * 4 < IN_SIZE ? d->inCap * 4 : IN_SIZE;
+        char* bigger = realloc(d->in, newCap);
+        if (!bigger) {
+            return -1;
+        }
+        d->in = bigger;
+        d->inCap = newCap;
+    }
+    if (d->inEnd == d->inCap) {
+        return 0;       // Leave the rest in the socket until we catch up
+    }
+    ssize_t n = recv(d->sockfd, d->in + d->inEnd, d->inCap - d->inEnd, 0);
+    if (n > 0) {
+        d->inEnd += n;
+        return 0;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+/*
+ * Event loop: send whatever is queued. Returns 0 when it's all gone, 1 if
+ * the socket is full, -1 if the client is gone.
+ */
+int flushReply(struct clientData* d) {
+    while (d->replyStart < d->replyLen) {
+        ssize_t n = send(d->sockfd, d->reply + d->replyStart, d->replyLen - d->replyStart,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        d->replyStart += n;
+    }
+    d->replyStart = d->replyLen = 0;
+    return 0;
+}
+
+/*
+ * Next line of buffered input, without its \r\n, or NULL if it hasn't all
+ * arrived. Lines longer than LINE_SIZE are cut. The line stays valid until
+ * the next read.
+ */
+char* takeLine(struct clientData* d) {
+    char* start = d->in + d->inStart;
+    size_t avail = d->inEnd - d->inStart;
+    char* nl = memchr(start, '\n', avail);
+    if (!nl) {
+        if (avail < LINE_SIZE - 1) {
+            return NULL;
+        }
+        nl = start + LINE_SIZE - 1;
+    }
+    size_t len = nl - start;
+    d->inStart += len + (*nl == '\n');
+    if (len > LINE_SIZE - 1) {
+        len = LINE_SIZE - 1;
+    }
+    memcpy(d->lineBuf, start, len);
+    d->lineBuf[len] = '\0';
+    d->lineBuf[strcspn(d->lineBuf, "\r")] = '\0';
+    return d->lineBuf;
+}
+
+/*
+ * Event loop: act on the menu choice in line. Prompts are answered here;
+ * anything that reads or changes the document goes to a worker.
+ */
+void menuChoice(struct clientData* d, const char* cmd) {
+    int choice = atoi(cmd);
+    int isView = strncmp(cmd, "view", 4) == 0;
+    if (isView || choice == 1) {
+        // "view", "view <start>" or "view <start> <count>". With no
+        // start, shows the page after the last one this client saw
+        d->pos = -1;
+        d->count = PAGE_LINES;
+        if (isView) sscanf(cmd + 4, "%ld %ld", &d->pos, &d->count);
+        if (d->pos == -1) d->pos = d->nextLine + 1;
+        if (d->pos < 1 || d->count < 1) {
+            sendStr(d, "Usage: view <start> <count>\n");
+            showMenu(d);
+            return;
+        }
+        submitJob(d, JOB_VIEW);
+    } else if (strncmp(cmd, "search", 6) == 0) {
+        const char* text = cmd + 6;
+        while (*text == ' ') text++;
+        if (*text == '\0' || !(d->arg = strdup(text))) {
+            sendStr(d, "Usage: search <text>\n");
+            showMenu(d);
+            return;
+        }
+        submitJob(d, JOB_SEARCH);
+    } else if (strcmp(cmd, "stats") == 0) {
+        submitJob(d, JOB_STATS);
+    } else if (choice == 2) {
+        sendStr(d, "Insert before line number (one past the end appends): ");
+        d->state = WANT_INS_POS;
+    } else if (choice == 3) {
+        sendStr(d, "Delete line number: ");
+        d->state = WANT_DEL_POS;
+    } else if (choice == 4) {
+        sendStr(d, "Edit line number: ");
+        d->state = WANT_EDIT_POS;
+    } else if (choice == 5) {
+        sendStr(d, "Goodbye!\n");
+        d->state = CLOSING;
+    } else {
+        sendStr(d, "Invalid choice!\n");
+        showMenu(d);
+    }
+}
+
+/*
+ * Event loop: use the next complete command or answer in d->in, if there
+ * is one. Returns 0 if more input is needed, 1 otherwise.
+ */
+int handleInput(struct clientData* d) {
+    if (d->state == WANT_FILE) {
+        // Binary clients open with EDIT_MAGIC, whose first byte is NUL
+        size_t avail = d->inEnd - d->inStart;
+        if (avail > 0 && d->in[d->inStart] == '\0') {
+            if (avail < EDIT_MAGIC_LEN) {
+                return 0;
+            }
+            if (memcmp(d->in + d->inStart, EDIT_MAGIC, EDIT_MAGIC_LEN) == 0) {
+                d->inStart += EDIT_MAGIC_LEN;
+                sendText(d, EDIT_MAGIC, EDIT_MAGIC_LEN);
+                d->state = BINARY;
+                return 1;
+            }
+        }
+    }
+
+    if (d->state == BINARY) {
+        int type;
+        const char* body;
+        size_t bodyLen;
+        int n = parseFrame(d->in + d->inStart, d->inEnd - d->inStart, &type, &body, &bodyLen);
+        if (n < 0) {
+            d->state = CLOSING;
+            return 1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (d->doc) {
+            submitJob(d, JOB_BATCH);
+            return 1;
+        }
+        // The first frame must open the file, so the rest of the batch can use it
+        uint32_t line;
+        int lineLen = getVarint(body, bodyLen, &line);
+        if (type == OP_OPEN && lineLen > 0 && bodyLen - lineLen < PATH_MAX &&
+            (d->arg = malloc(bodyLen - lineLen + 1))) {
+            memcpy(d->arg, body + lineLen, bodyLen - lineLen);
+            d->arg[bodyLen - lineLen] = '\0';
+            d->inStart += n;
+            submitJob(d, JOB_OPEN);
+        } else {
+            char status = ST_ERROR;
+            d->inStart += n;
+            sendAck(d, 0, &status, 1);
+            d->state = CLOSING;
+        }
+        return 1;
+    }
+
+    char* line = takeLine(d);
+    if (!line) {
+        return 0;
+    }
+    switch (d->state) {
+    case WANT_FILE:
+        if (!(d->arg = strdup(line))) {
+            d->state = CLOSING;
+            break;
+        }
+        submitJob(d, JOB_OPEN);
+        break;
+    case WANT_CHOICE:
+        menuChoice(d, line);
+        break;
+    case WANT_INS_POS:
+    case WANT_EDIT_POS:
+        d->pos = 0;
+        sscanf(line, "%ld", &d->pos);
+        d->op = d->state == WANT_INS_POS ? 'I' : 'R';
+        sendStr(d, d->op == 'I' ? "New line: " : "New contents: ");
+        d->state = d->op == 'I' ? WANT_INS_TEXT : WANT_EDIT_TEXT;
+        break;
+    case WANT_DEL_POS:
+        d->pos = 0;
+        sscanf(line, "%ld", &d->pos);
+        d->op = 'D';
+        submitJob(d, JOB_EDIT);
+        break;
+    case WANT_INS_TEXT:
+    case WANT_EDIT_TEXT:
+        if (!(d->arg = strdup(line))) {
+            sendStr(d, "Out of memory.\n");
+            showMenu(d);
+            break;
+        }
+        submitJob(d, JOB_EDIT);
+        break;
+    }
+    return 1;
+}
+
+/*
+ * Event loop: move a session along as far as it can go without blocking:
+ * send its output, then work through its buffered input until it needs
+ * more, hands a command to a worker, or is finished.
+ */
+void advance(struct clientData* d) {
+    while (1) {
+        if (d->busy) {
+            watch(d, 0);
+            return;
+        }
+        int sent = flushReply(d);
+        if (sent == -1) {
+            d->state = CLOSING;
+        }
+        if (d->state == CLOSING) {
+            if (d->doc) {
+                submitJob(d, JOB_CLOSE);
+                continue;
+            }
+            if (sent == 1) {
+                watch(d, EPOLLOUT);     // The last reply ("Goodbye!", an error) goes first
+                return;
+            }
+            endSession(d);
+            return;
+        }
+        if (sent == 1) {
+            watch(d, EPOLLOUT);     // Read no more until the client catches up
+            return;
+        }
+        if (!handleInput(d)) {
+            if (d->eof) {
+                d->state = CLOSING;     // Everything it sent has been used
+                continue;
+            }
+            // Waiting on the client, who may take minutes: keep only the
+            // session and a LINE_SIZE input buffer
+            if (d->inStart == d->inEnd && d->inCap > LINE_SIZE) {
+                char* smaller = realloc(d->in, LINE_SIZE);
+                if (smaller) {
+                    d->in = smaller;
+                    d->inCap = LINE_SIZE;
+                }
+                d->inStart = d->inEnd = 0;
+            }
+            free(d->reply);
+            d->reply = NULL;
+            d->replyCap = 0;
+            watch(d, EPOLLIN);
+            return;
+        }
+    }
+}
+
+/*
+ * Event loop: a new connection.
+ */
+void acceptClients(int server_fd) {
+    while (1) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        // A reply and the menu after it are two small writes. With Nagle on,
+        // the menu waits for the client's delayed ACK: 40ms on every command
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct clientData* d = calloc(1, sizeof(struct clientData));
+        if (!d || !(d->in = malloc(LINE_SIZE))) {
+            free(d);
+            close(client_fd);
+            continue;
+        }
+        d->sockfd = client_fd;
+        d->inCap = LINE_SIZE;
+        d->state = WANT_FILE;
+        d->watching = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = d};
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            endSession(d);
+            continue;
+        }
+        sendStr(d, "What is the name of the file you want to edit? ");
+        advance(d);
+    }
+}
+
+/*
+ * Event loop: take back the sessions the workers have finished with.
+ */
+void takeDone() {
+    uint64_t count;
+    read(wakeFd, &count, sizeof(count));
+    pthread_mutex_lock(&doneLock);
+    struct clientData* d = doneList;
+    doneList = NULL;
+    pthread_mutex_unlock(&doneLock);
+    while (d) {
+        struct clientData* next = d->nextJob;
+        d->busy = 0;
+        advance(d);
+        d = next;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int workers = WORKERS;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:b:w:")) != -1) {
+        if (opt == 'i') {
+            autosaveMs = atoi(optarg);
+        } else if (opt == 'b') {
+            flushBytes = strtoul(optarg, NULL, 10);
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            workers = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-i autosave ms] [-b flush bytes] [-w workers]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
+
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listening socket and the workers' wake-up call are the only
+    // events that aren't a session (data.ptr NULL and &wakeFd)
+    epollFd = epoll_create1(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (epollFd == -1 || wakeFd == -1) {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.data.ptr = &wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    printf("Editor server listening on port %d (%d workers)\n", PORT, workers);
+
+    pthread_t compactThread;
+    if (pthread_create(&compactThread, NULL, compactor, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(compactThread);
+    if (autosaveMs > 0) {
+        pthread_t flushThread;
+        if (pthread_create(&flushThread, NULL, flusher, NULL) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(flushThread);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            struct clientData* d = events[i].data.ptr;
+            if (d == NULL) {
+                acceptClients(server_fd);
+            } else if ((void*)d == &wakeFd) {
+                takeDone();
+            } else if (!d->busy) {
+                // A session only sees events it asked for, and none while busy
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                    d->watching == EPOLLIN && fillInput(d) == -1) {
+                    d->eof = 1;
+                }
+                advance(d);
+            }
+        }
+    }
+
+    return 0;
+}
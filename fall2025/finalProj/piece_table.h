@@ -0,0 +1,752 @@
+/* piece_table.h */
+
+/*
+ * A piece table: the document model used by editor_server.c.
+ *
+ * The file being edited is mmap'd read-only and never changed. Text typed by
+ * clients is appended to a second buffer, the "add" buffer, and never changed
+ * either. The document is then just a sequence of pieces, each saying "bytes
+ * off..off+len of the original (or add) buffer":
+ *
+ *   original: "one\ntwo\nthree\n"        add: "TWO\n"
+ *   pieces:   [orig 0,4] [add 0,4] [orig 8,6]   ->  "one\nTWO\nthree\n"
+ *
+ * Editing a line never moves any text; it only splits a piece and links in
+ * new ones. The pieces live in a treap (a binary search tree kept balanced by
+ * random priorities) ordered by position in the document, and every node
+ * also stores the total bytes and newlines in its subtree. That lets us find
+ * "where does line 500000 start?" by walking down one path of the tree, so
+ * insert, delete, replace and line lookup are all O(log n) in the number of
+ * pieces, with no limit on the number or length of lines.
+ *
+ * The original file is cut into pieces of at most PT_CHUNK bytes when it is
+ * opened, so splitting a piece only ever has to count the newlines in a
+ * bounded amount of text.
+ *
+ * Opening a file reads nothing into memory: the only work is counting the
+ * newlines in each PT_CHUNK, which is what lets us find line n later. That
+ * count uses SSE2 or AVX2 (whichever the CPU has, plain C elsewhere) to
+ * compare 16 or 32 bytes per instruction, and files over PT_PARALLEL_MIN are
+ * split between one thread per core, so a multi-GB file opens at memory
+ * speed. No line is copied until somebody edits it.
+ *
+ * Memory is roughly the size of the text that was typed, never a buffer per
+ * line: the add buffer holds each inserted line at its exact length, and tree
+ * nodes come from per-document slabs (a free list inside blocks of nodes),
+ * which ptClose() releases in a few free() calls instead of one per piece.
+ * Deleted and replaced lines leave dead bytes behind in the add buffer; once
+ * they pass PT_COMPACT_MIN and outnumber the live ones, the live text is
+ * copied into a fresh buffer. ptStats() reports all of this.
+ *
+ * Every line ends in '\n'; a file whose last line has no newline gets one.
+ * Line numbers here are 0-based.
+ */
+
+#ifndef PIECE_TABLE_H
+#define PIECE_TABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define PT_CHUNK (4 * 1024)
+#define PT_IOV 1024                 // Pieces per writev() when saving
+#define PT_PARALLEL_MIN (16 * 1024 * 1024)  // Smaller files are counted by one thread
+#define PT_MAX_THREADS 16
+#define PT_ORIGINAL 0
+#define PT_ADDED 1
+#define PT_SLAB_MIN 64              // Nodes in a document's first slab; each next one doubles
+#define PT_SLAB_MAX 4096
+#define PT_COMPACT_MIN (64 * 1024)  // Dead add-buffer bytes worth compacting away
+
+typedef struct PtNode {
+    struct PtNode* left;
+    struct PtNode* right;
+    unsigned prio;
+    int buf;                    // PT_ORIGINAL or PT_ADDED
+    size_t off;                 // This piece is bytes [off, off + len) of buf
+    size_t len;
+    size_t nl;                  // Newlines in this piece
+    size_t sumLen;              // Bytes in this whole subtree
+    size_t sumNl;               // Newlines in this whole subtree
+} PtNode;
+
+// A block of nodes. Freed nodes go on the table's free list, not back to malloc.
+typedef struct PtSlab {
+    struct PtSlab* next;
+    size_t count;
+    PtNode nodes[];
+} PtSlab;
+
+typedef struct {
+    const char* orig;           // The file, mmap'd read-only (NULL if empty)
+    size_t origLen;
+    char* add;                  // Append-only buffer of inserted text
+    size_t addLen;
+    size_t addCap;
+    size_t addLive;             // Add-buffer bytes some piece still uses
+    PtNode* root;
+    size_t pieces;
+    unsigned seed;
+    PtSlab* slabs;              // Newest first
+    size_t slabUsed;            // Nodes handed out from the newest slab
+    size_t slabNodes;           // Nodes in all slabs
+    PtNode* freeNodes;          // Linked through ->right
+    size_t compactions;
+} PieceTable;
+
+// What a document costs, for ptStats()
+typedef struct {
+    size_t fileBytes;           // mmap'd, shared with the page cache
+    size_t addBytes;            // Add buffer in use, live and dead
+    size_t addLive;
+    size_t addCap;
+    size_t pieces;
+    size_t slabNodes;
+    size_t heapBytes;           // Add buffer capacity plus slabs
+    size_t compactions;
+} PtStats;
+
+static inline const char* ptData(const PieceTable* pt, const PtNode* n) {
+    return (n->buf == PT_ORIGINAL ? pt->orig : pt->add) + n->off;
+}
+
+static inline size_t ptCountNlScalar(const char* p, size_t len) {
+    size_t count = 0;
+    const char* end = p + len;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Compare 16 bytes at a time against '\n'. A match is 0xff (-1), so
+ * subtracting the comparison adds 1 to a per-byte counter. The byte counters
+ * are summed with _mm_sad_epu8 before any of them can pass 255.
+ */
+static inline size_t ptCountNlSse2(const char* p, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0, i = 0;
+    while (i + 16 <= len) {
+        __m128i acc = zero;
+        for (int k = 0; k < 255 && i + 16 <= len; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return count + ptCountNlScalar(p + i, len - i);
+}
+
+// The same 32 bytes at a time, compiled for AVX2 even without -mavx2
+__attribute__((target("avx2")))
+static inline size_t ptCountNlAvx2(const char* p, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0, i = 0;
+    while (i + 32 <= len) {
+        __m256i acc = zero;
+        for (int k = 0; k < 255 && i + 32 <= len; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        // Four sums, none past 16 bits: add the halves and then the two left
+        // as the SSE2 version does (there's no 64-bit extract on 32-bit x86)
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums),
+                                     _mm256_extracti128_si256(sums, 1));
+        count += _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+    }
+    return count + ptCountNlScalar(p + i, len - i);
+}
+#endif
+
+// Count the newlines in p[0..len) with the fastest code this CPU can run
+static inline size_t ptCountNl(const char* p, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int avx2 = -1;
+    if (avx2 == -1) {
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return avx2 ? ptCountNlAvx2(p, len) : ptCountNlSse2(p, len);
+#else
+    return ptCountNlScalar(p, len);
+#endif
+}
+
+static inline void ptUpdate(PtNode* n) {
+    n->sumLen = n->len;
+    n->sumNl = n->nl;
+    if (n->left) {
+        n->sumLen += n->left->sumLen;
+        n->sumNl += n->left->sumNl;
+    }
+    if (n->right) {
+        n->sumLen += n->right->sumLen;
+        n->sumNl += n->right->sumNl;
+    }
+}
+
+// A node from the free list, or the newest slab, or a new slab
+static inline PtNode* ptAllocNode(PieceTable* pt) {
+    PtNode* n = pt->freeNodes;
+    if (n) {
+        pt->freeNodes = n->right;
+        return n;
+    }
+    if (!pt->slabs || pt->slabUsed == pt->slabs->count) {
+        size_t count = pt->slabs ? pt->slabs->count * 2 : PT_SLAB_MIN;
+        if (count > PT_SLAB_MAX) count = PT_SLAB_MAX;
+        PtSlab* slab = malloc(sizeof(PtSlab) + count * sizeof(PtNode));
+        if (!slab) return NULL;
+        slab->next = pt->slabs;
+        slab->count = count;
+        pt->slabs = slab;
+        pt->slabUsed = 0;
+        pt->slabNodes += count;
+    }
+    return &pt->slabs->nodes[pt->slabUsed++];
+}
+
+static inline void ptFreeNode(PieceTable* pt, PtNode* n) {
+    if (n->buf == PT_ADDED) pt->addLive -= n->len;
+    n->right = pt->freeNodes;
+    pt->freeNodes = n;
+    pt->pieces--;
+}
+
+static inline PtNode* ptNode(PieceTable* pt, int buf, size_t off, size_t len, size_t nl) {
+    PtNode* n = ptAllocNode(pt);
+    if (!n) {
+        return NULL;
+    }
+    // xorshift: cheap random priorities keep the treap balanced
+    pt->seed ^= pt->seed << 13;
+    pt->seed ^= pt->seed >> 17;
+    pt->seed ^= pt->seed << 5;
+    n->prio = pt->seed;
+    n->left = n->right = NULL;
+    n->buf = buf;
+    n->off = off;
+    n->len = len;
+    n->nl = nl;
+    ptUpdate(n);
+    pt->pieces++;
+    if (buf == PT_ADDED) pt->addLive += len;
+    return n;
+}
+
+// Join two treaps, every piece of a before every piece of b
+static inline PtNode* ptMerge(PtNode* a, PtNode* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        a->right = ptMerge(a->right, b);
+        ptUpdate(a);
+        return a;
+    }
+    b->left = ptMerge(a, b->left);
+    ptUpdate(b);
+    return b;
+}
+
+// Split t so the first pos bytes go to *l and the rest to *r, cutting a
+// piece in two if pos falls inside it. Returns -1 if out of memory.
+static inline int ptSplit(PieceTable* pt, PtNode* t, size_t pos, PtNode** l, PtNode** r) {
+    if (!t) {
+        *l = *r = NULL;
+        return 0;
+    }
+    size_t leftLen = t->left ? t->left->sumLen : 0;
+    int status = 0;
+    if (pos <= leftLen) {
+        status = ptSplit(pt, t->left, pos, l, &t->left);
+        ptUpdate(t);
+        *r = t;
+    } else if (pos >= leftLen + t->len) {
+        status = ptSplit(pt, t->right, pos - leftLen - t->len, &t->right, r);
+        ptUpdate(t);
+        *l = t;
+    } else {
+        // Count newlines in the shorter half; the other half gets the rest
+        size_t cut = pos - leftLen;
+        const char* data = ptData(pt, t);
+        size_t headNl = cut <= t->len / 2 ? ptCountNl(data, cut)
+                                          : t->nl - ptCountNl(data + cut, t->len - cut);
+        PtNode* tail = ptNode(pt, t->buf, t->off + cut, t->len - cut, t->nl - headNl);
+        if (!tail) {
+            *l = t;
+            *r = NULL;
+            return -1;
+        }
+        tail->prio = t->prio;       // Both halves keep the heap order
+        tail->right = t->right;
+        ptUpdate(tail);
+        if (t->buf == PT_ADDED) pt->addLive -= t->len - cut;
+        t->right = NULL;
+        t->len = cut;
+        t->nl = headNl;
+        ptUpdate(t);
+        *l = t;
+        *r = tail;
+    }
+    return status;
+}
+
+static inline void ptFreeTree(PieceTable* pt, PtNode* t) {
+    if (!t) return;
+    ptFreeTree(pt, t->left);
+    ptFreeTree(pt, t->right);
+    ptFreeNode(pt, t);
+}
+
+static inline size_t ptLines(const PieceTable* pt) {
+    return pt->root ? pt->root->sumNl : 0;
+}
+
+static inline size_t ptBytes(const PieceTable* pt) {
+    return pt->root ? pt->root->sumLen : 0;
+}
+
+// Byte offset where line starts (line == ptLines() gives the end)
+static inline size_t ptLineStart(const PieceTable* pt, size_t line) {
+    if (line == 0) return 0;
+    const PtNode* t = pt->root;
+    size_t base = 0;
+    size_t k = line;            // Looking for the k-th newline
+    while (t) {
+        size_t leftNl = t->left ? t->left->sumNl : 0;
+        size_t leftLen = t->left ? t->left->sumLen : 0;
+        if (k <= leftNl) {
+            t = t->left;
+            continue;
+        }
+        k -= leftNl;
+        base += leftLen;
+        if (k <= t->nl) {
+            const char* data = ptData(pt, t);
+            const char* p = data;
+            while (1) {
+                p = memchr(p, '\n', t->len - (p - data));
+                if (--k == 0) return base + (p - data) + 1;
+                p++;
+            }
+        }
+        k -= t->nl;
+        base += t->len;
+        t = t->right;
+    }
+    return base;
+}
+
+// Copy document bytes [from, to) that fall inside subtree t (which starts at
+// base) into out, which corresponds to document offset from
+static inline void ptCopy(const PieceTable* pt, const PtNode* t, size_t base,
+                   size_t from, size_t to, char* out) {
+    while (t && from < to) {
+        size_t leftLen = t->left ? t->left->sumLen : 0;
+        size_t start = base + leftLen;          // Where this node's piece begins
+        if (from < start) {
+            ptCopy(pt, t->left, base, from, to < start ? to : start, out);
+        }
+        size_t end = start + t->len;
+        if (from < end && to > start) {
+            size_t a = from > start ? from : start;
+            size_t b = to < end ? to : end;
+            memcpy(out + (a - from), ptData(pt, t) + (a - start), b - a);
+        }
+        if (to <= end) return;
+        out += end > from ? end - from : 0;
+        from = end > from ? end : from;
+        base = end;
+        t = t->right;
+    }
+}
+
+// Copy line (without its newline) into out, up to cap bytes. Returns the
+// line's full length, so a caller with too small a buffer can grow it.
+static inline size_t ptGetLine(const PieceTable* pt, size_t line, char* out, size_t cap) {
+    size_t start = ptLineStart(pt, line);
+    size_t end = ptLineStart(pt, line + 1) - 1;
+    size_t len = end - start;
+    ptCopy(pt, pt->root, 0, start, start + (len < cap ? len : cap), out);
+    return len;
+}
+
+static inline int ptAppendAdd(PieceTable* pt, const char* text, size_t len) {
+    if (pt->addLen + len > pt->addCap) {
+        size_t cap = pt->addCap ? pt->addCap : 4096;
+        while (cap < pt->addLen + len) cap *= 2;
+        char* add = realloc(pt->add, cap);
+        if (!add) return -1;
+        pt->add = add;
+        pt->addCap = cap;
+    }
+    memcpy(pt->add + pt->addLen, text, len);
+    pt->addLen += len;
+    return 0;
+}
+
+// Insert text (one line, no newline) so it becomes line number `line`;
+// line == ptLines() appends. Returns 0 or -1.
+static inline int ptInsertLine(PieceTable* pt, size_t line, const char* text, size_t len) {
+    if (line > ptLines(pt)) return -1;
+    size_t off = pt->addLen;
+    if (ptAppendAdd(pt, text, len) == -1 || ptAppendAdd(pt, "\n", 1) == -1) return -1;
+    PtNode* piece = ptNode(pt, PT_ADDED, off, len + 1, 1);
+    if (!piece) return -1;
+
+    PtNode *l, *r;
+    int status = ptSplit(pt, pt->root, ptLineStart(pt, line), &l, &r);
+    pt->root = ptMerge(ptMerge(l, status == 0 ? piece : NULL), r);
+    if (status != 0) ptFreeNode(pt, piece);
+    return status;
+}
+
+// Point every added piece in t at its text's place in the new buffer
+static inline void ptMoveAdded(PieceTable* pt, PtNode* t, char* add, size_t* used) {
+    while (t) {
+        ptMoveAdded(pt, t->left, add, used);
+        if (t->buf == PT_ADDED) {
+            memcpy(add + *used, pt->add + t->off, t->len);
+            t->off = *used;
+            *used += t->len;
+        }
+        t = t->right;
+    }
+}
+
+// Once most of the add buffer is deleted text, copy the live text into a
+// buffer of its own size. Each byte is copied at most once per doubling of
+// the dead bytes, so this costs O(1) per byte typed.
+static inline void ptCompactAdd(PieceTable* pt) {
+    size_t dead = pt->addLen - pt->addLive;
+    if (dead < PT_COMPACT_MIN || dead < pt->addLive) return;
+    size_t cap = pt->addLive + pt->addLive / 4 + 4096;
+    char* add = malloc(cap);
+    if (!add) return;           // Keep the old buffer; nothing is lost
+    size_t used = 0;
+    ptMoveAdded(pt, pt->root, add, &used);
+    free(pt->add);
+    pt->add = add;
+    pt->addLen = used;
+    pt->addCap = cap;
+    pt->compactions++;
+}
+
+static inline int ptDeleteLine(PieceTable* pt, size_t line) {
+    if (line >= ptLines(pt)) return -1;
+    size_t start = ptLineStart(pt, line);
+    size_t end = ptLineStart(pt, line + 1);
+
+    PtNode *l, *mid, *r;
+    int status = ptSplit(pt, pt->root, start, &l, &r);
+    status |= ptSplit(pt, r, end - start, &mid, &r);
+    if (status != 0) {
+        pt->root = ptMerge(ptMerge(l, mid), r);
+        return -1;
+    }
+    ptFreeTree(pt, mid);
+    pt->root = ptMerge(l, r);
+    ptCompactAdd(pt);
+    return 0;
+}
+
+static inline int ptReplaceLine(PieceTable* pt, size_t line, const char* text, size_t len) {
+    if (line >= ptLines(pt)) return -1;
+    if (ptDeleteLine(pt, line) == -1) return -1;
+    return ptInsertLine(pt, line, text, len);
+}
+
+// State for ptSearch() while it walks the pieces in order
+typedef struct {
+    const char* needle;
+    size_t needleLen;
+    size_t line;                // Line number of the text at the current position
+    char* carry;                // The start of a line that began in an earlier piece
+    size_t carryLen;
+    size_t carryCap;
+    int (*found)(void* arg, size_t line);
+    void* arg;
+    int stop;
+} PtSearch;
+
+static inline int ptCarry(PtSearch* s, const char* p, size_t len) {
+    if (s->carryLen + len > s->carryCap) {
+        size_t cap = s->carryCap ? s->carryCap : 256;
+        while (cap < s->carryLen + len) cap *= 2;
+        char* bigger = realloc(s->carry, cap);
+        if (!bigger) return -1;
+        s->carry = bigger;
+        s->carryCap = cap;
+    }
+    memcpy(s->carry + s->carryLen, p, len);
+    s->carryLen += len;
+    return 0;
+}
+
+static inline void ptSearchPiece(const PieceTable* pt, const PtNode* t, PtSearch* s) {
+    if (!t || s->stop) return;
+    ptSearchPiece(pt, t->left, s);
+    if (s->stop) return;
+
+    const char* p = ptData(pt, t);
+    const char* end = p + t->len;
+    // Finish a line carried over from earlier pieces
+    if (s->carryLen > 0 || p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        if (s->carryLen > 0 || !nl) {
+            if (ptCarry(s, p, (nl ? nl : end) - p) == -1) {
+                s->stop = 1;
+                return;
+            }
+            if (!nl) {
+                ptSearchPiece(pt, t->right, s);
+                return;
+            }
+            if (memmem(s->carry, s->carryLen, s->needle, s->needleLen) &&
+                s->found(s->arg, s->line) != 0) {
+                s->stop = 1;
+                return;
+            }
+            s->carryLen = 0;
+            s->line++;
+            p = nl + 1;
+        }
+    }
+    // Whole lines inside this piece: let memmem() find the next match and
+    // count the newlines we skipped to learn its line number
+    const char* lastNl = p < end ? memrchr(p, '\n', end - p) : NULL;
+    if (lastNl) {
+        const char* lines = lastNl + 1;     // End of the whole lines
+        while (p < lines) {
+            const char* m = memmem(p, lines - p, s->needle, s->needleLen);
+            if (!m) {
+                s->line += ptCountNl(p, lines - p);
+                p = lines;
+                break;
+            }
+            s->line += ptCountNl(p, m - p);
+            if (s->found(s->arg, s->line) != 0) {
+                s->stop = 1;
+                return;
+            }
+            p = (const char*)memchr(m, '\n', lines - m) + 1;
+            s->line++;
+        }
+    }
+    // A line that runs on into the next piece
+    if (p < end && ptCarry(s, p, end - p) == -1) {
+        s->stop = 1;
+        return;
+    }
+    ptSearchPiece(pt, t->right, s);
+}
+
+// Call found(arg, line) for every line containing needle (which must not
+// contain '\n'), in order, until it returns non-zero. One pass over the
+// text; no line is copied unless it straddles two pieces.
+static inline void ptSearch(const PieceTable* pt, const char* needle, size_t needleLen,
+                            int (*found)(void* arg, size_t line), void* arg) {
+    PtSearch s = {needle, needleLen, 0, NULL, 0, 0, found, arg, 0};
+    if (needleLen > 0) {
+        ptSearchPiece(pt, pt->root, &s);
+    }
+    free(s.carry);
+}
+
+// Appends one iovec per piece from document offset `from` on (subtree t
+// starts at base), flushing with writev() when full
+static inline int ptWriteTree(const PieceTable* pt, const PtNode* t, size_t base, size_t from,
+                              size_t to, int fd, struct iovec* iov, int* count) {
+    if (!t || base + t->sumLen <= from || base >= to) return 0;
+    size_t start = base + (t->left ? t->left->sumLen : 0);
+    if (ptWriteTree(pt, t->left, base, from, to, fd, iov, count) == -1) return -1;
+    if (start + t->len > from && start < to) {
+        size_t skip = from > start ? from - start : 0;
+        size_t end = start + t->len < to ? t->len : to - start;
+        if (*count == PT_IOV) {
+            if (writev(fd, iov, *count) == -1) return -1;
+            *count = 0;
+        }
+        iov[*count].iov_base = (void*)(ptData(pt, t) + skip);
+        iov[*count].iov_len = end - skip;
+        (*count)++;
+    }
+    return ptWriteTree(pt, t->right, start + t->len, from, to, fd, iov, count);
+}
+
+// Write document bytes [from, to) to fd, many pieces per writev()
+static inline int ptWriteRange(const PieceTable* pt, int fd, size_t from, size_t to) {
+    struct iovec iov[PT_IOV];
+    int count = 0;
+    if (ptWriteTree(pt, pt->root, 0, from, to, fd, iov, &count) == -1) return -1;
+    return count > 0 && writev(fd, iov, count) == -1 ? -1 : 0;
+}
+
+// Write the document from byte offset `from` to the end to fd
+static inline int ptWriteFrom(const PieceTable* pt, int fd, size_t from) {
+    return ptWriteRange(pt, fd, from, ptBytes(pt));
+}
+
+// Write the whole document to fd
+static inline int ptWrite(const PieceTable* pt, int fd) {
+    return ptWriteFrom(pt, fd, 0);
+}
+
+// One thread's share of the newline count: chunks [first, last)
+typedef struct {
+    const PieceTable* pt;
+    size_t* counts;
+    size_t first;
+    size_t last;
+} PtCountJob;
+
+static inline void* ptCountChunks(void* arg) {
+    PtCountJob* job = arg;
+    for (size_t c = job->first; c < job->last; c++) {
+        size_t off = c * PT_CHUNK;
+        size_t len = job->pt->origLen - off < PT_CHUNK ? job->pt->origLen - off : PT_CHUNK;
+        job->counts[c] = ptCountNl(job->pt->orig + off, len);
+    }
+    return NULL;
+}
+
+// Build a perfectly balanced treap over chunks [lo, hi) of the original.
+// Nodes nearer the root get higher priorities, so the heap order holds and
+// later edits (with random priorities) settle in underneath.
+static inline PtNode* ptBuild(PieceTable* pt, const size_t* counts, size_t lo, size_t hi,
+                              unsigned depth) {
+    if (lo >= hi) return NULL;
+    size_t mid = lo + (hi - lo) / 2;
+    size_t off = mid * PT_CHUNK;
+    size_t len = pt->origLen - off < PT_CHUNK ? pt->origLen - off : PT_CHUNK;
+    PtNode* n = ptNode(pt, PT_ORIGINAL, off, len, counts[mid]);
+    if (!n) return NULL;
+    n->prio = UINT_MAX - depth;
+    n->left = ptBuild(pt, counts, lo, mid, depth + 1);
+    n->right = ptBuild(pt, counts, mid + 1, hi, depth + 1);
+    if ((lo < mid && !n->left) || (mid + 1 < hi && !n->right)) {
+        ptFreeTree(pt, n);
+        return NULL;
+    }
+    ptUpdate(n);
+    return n;
+}
+
+// Open path as a piece table. An empty file gives an empty document; a
+// missing one is an error, so create it first if that's what you want.
+// Returns 0, or -1 with errno set.
+static inline int ptOpen(PieceTable* pt, const char* path) {
+    memset(pt, 0, sizeof(*pt));
+    pt->seed = 2463534242u;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        pt->orig = map;
+        pt->origLen = st.st_size;
+    }
+    close(fd);      // The mapping stays valid without the descriptor
+
+    // Count the newlines in every chunk, in parallel for big files
+    size_t chunks = (pt->origLen + PT_CHUNK - 1) / PT_CHUNK;
+    size_t* counts = malloc((chunks + 1) * sizeof(size_t));
+    if (!counts) return -1;
+    long threads = 1;
+    if (pt->origLen >= PT_PARALLEL_MIN) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1) threads = 1;
+        if (threads > PT_MAX_THREADS) threads = PT_MAX_THREADS;
+        madvise((void*)pt->orig, pt->origLen, MADV_WILLNEED);
+    }
+    pthread_t tids[PT_MAX_THREADS];
+    PtCountJob jobs[PT_MAX_THREADS];
+    long started = 0;
+    for (long t = 0; t < threads; t++) {
+        jobs[t] = (PtCountJob){pt, counts, chunks * t / threads, chunks * (t + 1) / threads};
+        if (t == threads - 1 || pthread_create(&tids[t], NULL, ptCountChunks, &jobs[t]) != 0) {
+            // The last share (or any we couldn't start a thread for) is ours
+            jobs[t].last = chunks;
+            ptCountChunks(&jobs[t]);
+            break;
+        }
+        started++;
+    }
+    for (long t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+
+    pt->root = ptBuild(pt, counts, 0, chunks, 0);
+    free(counts);
+    if (chunks > 0 && !pt->root) return -1;
+
+    // Every line ends in a newline, including the last one
+    if (pt->origLen > 0 && pt->orig[pt->origLen - 1] != '\n') {
+        size_t off = pt->addLen;
+        PtNode* n;
+        if (ptAppendAdd(pt, "\n", 1) == -1 || !(n = ptNode(pt, PT_ADDED, off, 1, 1))) {
+            return -1;
+        }
+        pt->root = ptMerge(pt->root, n);
+    }
+    return 0;
+}
+
+static inline void ptStats(const PieceTable* pt, PtStats* st) {
+    st->fileBytes = pt->origLen;
+    st->addBytes = pt->addLen;
+    st->addLive = pt->addLive;
+    st->addCap = pt->addCap;
+    st->pieces = pt->pieces;
+    st->slabNodes = pt->slabNodes;
+    st->heapBytes = pt->addCap + pt->slabNodes * sizeof(PtNode);
+    for (const PtSlab* slab = pt->slabs; slab; slab = slab->next) {
+        st->heapBytes += sizeof(PtSlab);
+    }
+    st->compactions = pt->compactions;
+}
+
+static inline void ptClose(PieceTable* pt) {
+    // All nodes go at once with their slabs; no walk over the tree
+    while (pt->slabs) {
+        PtSlab* next = pt->slabs->next;
+        free(pt->slabs);
+        pt->slabs = next;
+    }
+    pt->root = NULL;
+    pt->freeNodes = NULL;
+    pt->pieces = pt->slabNodes = 0;
+    if (pt->orig) {
+        munmap((void*)pt->orig, pt->origLen);
+        pt->orig = NULL;
+    }
+    free(pt->add);
+    pt->add = NULL;
+}
+
+#endif
@@ -0,0 +1,267 @@
+/* piece_table_bench.c */
+
+/*
+ * Random line edits on a big file: the scaffold's array of lines versus the
+ * piece table in piece_table.h.
+ *
+ * The scaffold keeps a char** with one malloc'd string per line. Inserting or
+ * deleting line i shifts every pointer after it with memmove(), so an edit
+ * near the top of a 1M-line file moves 8MB. The piece table never moves
+ * anything; every edit splits a piece and relinks O(log n) tree nodes.
+ *
+ * Both sides get the same random mix of inserts, deletes, replaces and line
+ * lookups, and at the end the two documents are compared line by line, so
+ * the benchmark also checks the piece table gives the right answer.
+ *
+ * Compile: gcc -Wall -g -pthread piece_table_bench.c -o piece_table_bench
+ * Usage: ./piece_table_bench [lines] [edits] [file]
+ *        (defaults: 1000000 lines, 20000 edits, /tmp/piece_table_bench.txt)
+ */
+
+#define _GNU_SOURCE         // memmem() in piece_table.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include "piece_table.h"
+
+#define LINE_SIZE 1024
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * One edit. Both sides replay the same list.
+ */
+struct edit {
+    int op;             // 0 insert, 1 delete, 2 replace, 3 look up
+    size_t where;       // Fraction of the current line count, scaled by 2^32
+    char text[32];
+};
+
+/*
+ * Write a test file of numLines lines.
+ */
+int makeFile(const char* path, size_t numLines) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    for (size_t i = 0; i < numLines; i++) {
+        fprintf(f, "This is line %zu of the benchmark file.\n", i + 1);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Load the file the way the scaffold does, minus MAX_LINES: one malloc'd
+ * string per line in a growing array.
+ */
+char** loadArray(const char* path, size_t* numLines) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    size_t cap = 1024;
+    char** lines = malloc(cap * sizeof(char*));
+    char buffer[LINE_SIZE];
+    *numLines = 0;
+    while (lines && fgets(buffer, LINE_SIZE, f) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        if (*numLines == cap) {
+            cap *= 2;
+            lines = realloc(lines, cap * sizeof(char*));
+            if (!lines) break;
+        }
+        lines[(*numLines)++] = strdup(buffer);
+    }
+    fclose(f);
+    return lines;
+}
+
+/*
+ * Apply the edits to the array, growing it as needed. Returns the new array.
+ */
+char** runArray(char** lines, size_t* numLines, struct edit* edits, size_t numEdits,
+                size_t* checksum) {
+    size_t cap = *numLines;
+    for (size_t e = 0; e < numEdits; e++) {
+        struct edit* ed = &edits[e];
+        size_t n = *numLines;
+        if (ed->op == 0) {
+            size_t i = (ed->where * (n + 1)) >> 32;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                lines = realloc(lines, cap * sizeof(char*));
+            }
+            memmove(&lines[i + 1], &lines[i], (n - i) * sizeof(char*));
+            lines[i] = strdup(ed->text);
+            (*numLines)++;
+        } else if (n == 0) {
+            continue;
+        } else if (ed->op == 1) {
+            size_t i = (ed->where * n) >> 32;
+            free(lines[i]);
+            memmove(&lines[i], &lines[i + 1], (n - i - 1) * sizeof(char*));
+            (*numLines)--;
+        } else if (ed->op == 2) {
+            size_t i = (ed->where * n) >> 32;
+            free(lines[i]);
+            lines[i] = strdup(ed->text);
+        } else {
+            size_t i = (ed->where * n) >> 32;
+            *checksum += strlen(lines[i]);
+        }
+    }
+    return lines;
+}
+
+/*
+ * Counts ptSearch() matches, checking they come in order.
+ */
+struct searchCount {
+    size_t matches;
+    size_t last;
+};
+
+int countMatch(void* arg, size_t line) {
+    struct searchCount* c = arg;
+    if (c->matches > 0 && line <= c->last) {
+        printf("search returned line %zu after %zu\n", line, c->last);
+    }
+    c->matches++;
+    c->last = line;
+    return 0;
+}
+
+/*
+ * Apply the same edits to the piece table.
+ */
+void runPieces(PieceTable* pt, struct edit* edits, size_t numEdits, size_t* checksum) {
+    char buffer[LINE_SIZE];
+    for (size_t e = 0; e < numEdits; e++) {
+        struct edit* ed = &edits[e];
+        size_t n = ptLines(pt);
+        if (ed->op == 0) {
+            ptInsertLine(pt, (ed->where * (n + 1)) >> 32, ed->text, strlen(ed->text));
+        } else if (n == 0) {
+            continue;
+        } else if (ed->op == 1) {
+            ptDeleteLine(pt, (ed->where * n) >> 32);
+        } else if (ed->op == 2) {
+            ptReplaceLine(pt, (ed->where * n) >> 32, ed->text, strlen(ed->text));
+        } else {
+            *checksum += ptGetLine(pt, (ed->where * n) >> 32, buffer, sizeof(buffer));
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    size_t numLines = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t numEdits = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+    const char* path = argc > 3 ? argv[3] : "/tmp/piece_table_bench.txt";
+
+    if (makeFile(path, numLines) == -1) {
+        return 1;
+    }
+
+    // A quarter each of inserts, deletes, replaces and lookups
+    struct edit* edits = malloc(numEdits * sizeof(struct edit));
+    if (!edits) {
+        perror("malloc");
+        return 1;
+    }
+    srand(42);
+    for (size_t e = 0; e < numEdits; e++) {
+        edits[e].op = rand() % 4;
+        edits[e].where = ((size_t)rand() << 16 ^ (size_t)rand()) & 0xffffffff;
+        snprintf(edits[e].text, sizeof(edits[e].text), "edit %zu", e);
+    }
+
+    printf("%zu lines, %zu random edits (insert/delete/replace/lookup)\n\n",
+           numLines, numEdits);
+    printf("%-12s %10s %12s %14s\n", "model", "load (ms)", "edits (ms)", "edits/s");
+
+    // The scaffold's array of lines
+    size_t arrayLines, arraySum = 0;
+    double start = now();
+    char** lines = loadArray(path, &arrayLines);
+    if (!lines) {
+        return 1;
+    }
+    double loaded = now();
+    lines = runArray(lines, &arrayLines, edits, numEdits, &arraySum);
+    double done = now();
+    printf("%-12s %10.1f %12.1f %14.0f\n", "array", (loaded - start) * 1000,
+           (done - loaded) * 1000, numEdits / (done - loaded));
+
+    // The piece table
+    PieceTable pt;
+    size_t pieceSum = 0;
+    start = now();
+    if (ptOpen(&pt, path) == -1) {
+        perror(path);
+        return 1;
+    }
+    loaded = now();
+    runPieces(&pt, edits, numEdits, &pieceSum);
+    done = now();
+    printf("%-12s %10.1f %12.1f %14.0f\n", "piece table", (loaded - start) * 1000,
+           (done - loaded) * 1000, numEdits / (done - loaded));
+    printf("\n%zu pieces after the edits\n", pt.pieces);
+
+    // The scaffold mallocs LINE_SIZE per line; the array here strdup()s
+    size_t arrayBytes = arrayLines * sizeof(char*);
+    for (size_t i = 0; i < arrayLines; i++) {
+        arrayBytes += malloc_usable_size(lines[i]);
+    }
+    PtStats st;
+    ptStats(&pt, &st);
+    printf("memory: scaffold %.1f MB, array %.1f MB, piece table %.1f MB heap "
+           "+ %.1f MB mapped file\n",
+           arrayLines * (double)(LINE_SIZE + sizeof(char*)) / 1e6, arrayBytes / 1e6,
+           st.heapBytes / 1e6, st.fileBytes / 1e6);
+    printf("add buffer: %zu of %zu bytes live, %zu compactions\n",
+           st.addLive, st.addBytes, st.compactions);
+
+    // Both models must end up holding the same document
+    int same = arrayLines == ptLines(&pt) && arraySum == pieceSum;
+    char buffer[LINE_SIZE];
+    for (size_t i = 0; same && i < arrayLines; i++) {
+        size_t len = ptGetLine(&pt, i, buffer, sizeof(buffer));
+        same = len == strlen(lines[i]) && memcmp(buffer, lines[i], len) == 0;
+    }
+    printf("documents %s\n", same ? "match" : "DIFFER");
+
+    // Search both for a string that only the edited lines contain
+    const char* needle = "edit 1";
+    size_t arrayMatches = 0;
+    start = now();
+    for (size_t i = 0; i < arrayLines; i++) {
+        arrayMatches += strstr(lines[i], needle) != NULL;
+    }
+    double searched = now();
+    struct searchCount found = {0, 0};
+    ptSearch(&pt, needle, strlen(needle), countMatch, &found);
+    done = now();
+    printf("search \"%s\": array %zu lines in %.1f ms, piece table %zu lines in %.1f ms\n",
+           needle, arrayMatches, (searched - start) * 1000, found.matches,
+           (done - searched) * 1000);
+    same = same && arrayMatches == found.matches;
+
+    for (size_t i = 0; i < arrayLines; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    ptClose(&pt);
+    free(edits);
+    unlink(path);
+    return same ? 0 : 1;
+}
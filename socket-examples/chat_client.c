@@ -1,7 +1,10 @@
 // chat_client.c
 // Chat client with separate threads for sending and receiving.
+// With -b it speaks the binary framing from chat_proto.h (chat_server_rooms
+// only). Every line read from stdin becomes a frame, and everything read in
+// one go is sent with one send(), which suits scripts piping into the client.
 // Compile: gcc -o chat_client chat_client.c -pthread
-// Usage: ./chat_client hostname port
+// Usage: ./chat_client [-b] hostname port
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,17 +14,36 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <pthread.h>
+#include "chat_proto.h"
 
 #define BUFFER_SIZE 1024
+#define NAME_BUCKETS 1024
+
+// User ID -> name, filled in from FRAME_USER
+typedef struct UserName {
+    uint32_t id;
+    char name[64];
+    struct UserName *next;
+} UserName;
 
 int sockfd;
 volatile int running = 1;
+int binary = 0;
+UserName *names[NAME_BUCKETS];
+char current_room[64] = "";
 
 void *receive_thread(void *arg);
+void *receive_binary_thread(void *arg);
+void send_binary_input(void);
 
 int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "-b") == 0) {
+        binary = 1;
+        argv++;
+        argc--;
+    }
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s hostname port\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-b] hostname port\n", argv[0]);
         exit(1);
     }
 
@@ -55,23 +77,35 @@ int main(int argc, char *argv[]) {
     }
 
     freeaddrinfo(res);
-    printf("Connected to %s:%s\n", hostname, port);
+    printf("Connected to %s:%s%s\n", hostname, port, binary ? " (binary mode)" : "");
     printf("Type messages and press Enter. Ctrl+C to quit.\n\n");
 
+    // Binary mode starts by announcing itself
+    if (binary && send(sockfd, PROTO_MAGIC, PROTO_MAGIC_LEN, 0) == -1) {
+        perror("send");
+        close(sockfd);
+        exit(1);
+    }
+
     // Start receive thread
     pthread_t recv_thread;
-    if (pthread_create(&recv_thread, NULL, receive_thread, NULL) != 0) {
+    if (pthread_create(&recv_thread, NULL, binary ? receive_binary_thread : receive_thread,
+                       NULL) != 0) {
         perror("pthread_create");
         close(sockfd);
         exit(1);
     }
 
     // Main thread handles sending
-    char buffer[BUFFER_SIZE];
-    while (running && fgets(buffer, sizeof(buffer), stdin) != NULL) {
-        if (send(sockfd, buffer, strlen(buffer), 0) == -1) {
-            perror("send");
-            break;
+    if (binary) {
+        send_binary_input();
+    } else {
+        char buffer[BUFFER_SIZE];
+        while (running && fgets(buffer, sizeof(buffer), stdin) != NULL) {
+            if (send(sockfd, buffer, strlen(buffer), 0) == -1) {
+                perror("send");
+                break;
+            }
         }
     }
 
@@ -102,3 +136,160 @@ void *receive_thread(void *arg) {
 
     return NULL;
 }
+
+// ============================================================================
+// Binary mode
+// ============================================================================
+
+// Turn stdin lines into frames. The first line is the username; lines that
+// start with '/' or '@' are commands (FRAME_TEXT); the rest are FRAME_SAY.
+void send_binary_input(void) {
+    char in[BUFFER_SIZE];
+    char out[2 * BUFFER_SIZE + 16];   // A frame is at most 1 byte longer than its line + 5
+    int in_len = 0;
+    int logged_in = 0;
+
+    while (running) {
+        ssize_t bytes = read(STDIN_FILENO, in + in_len, sizeof(in) - in_len);
+        if (bytes <= 0) break;
+        in_len += bytes;
+
+        int out_len = 0;
+        char *p = in;
+        char *end = in + in_len;
+        while (p < end) {
+            char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL && !(p == in && in_len == (int)sizeof(in))) {
+                break;  // Partial line: wait for the rest
+            }
+            char *line_end = newline ? newline : end;
+            int len = line_end - p;
+            if (len > 0 && p[len - 1] == '\r') len--;
+            if (len > FRAME_MAX_BODY) len = FRAME_MAX_BODY;
+
+            if (len > 0) {
+                int type;
+                if (!logged_in) {
+                    type = FRAME_LOGIN;
+                    logged_in = 1;
+                } else if (p[0] == '/' || p[0] == '@') {
+                    type = FRAME_TEXT;
+                } else {
+                    type = FRAME_SAY;
+                }
+                out_len += encode_frame(out + out_len, type, -1, p, len);
+            }
+            p = newline ? newline + 1 : end;
+        }
+
+        // Everything that arrived together goes out together
+        if (out_len > 0 && send(sockfd, out, out_len, 0) == -1) {
+            perror("send");
+            break;
+        }
+        in_len = end - p;
+        memmove(in, p, in_len);
+    }
+}
+
+const char *lookup_name(uint32_t id) {
+    static char unknown[32];
+    for (UserName *u = names[id % NAME_BUCKETS]; u != NULL; u = u->next) {
+        if (u->id == id) return u->name;
+    }
+    snprintf(unknown, sizeof(unknown), "user#%u", id);
+    return unknown;
+}
+
+void remember_name(uint32_t id, const char *name, int len) {
+    UserName *u = malloc(sizeof(UserName));
+    if (u == NULL) return;
+    if (len > (int)sizeof(u->name) - 1) len = sizeof(u->name) - 1;
+    u->id = id;
+    memcpy(u->name, name, len);
+    u->name[len] = '\0';
+    u->next = names[id % NAME_BUCKETS];
+    names[id % NAME_BUCKETS] = u;
+}
+
+void print_frame(int type, const char *body, int len) {
+    uint32_t id = 0;
+    int n = 0;
+    if (type == FRAME_USER || type == FRAME_MESSAGE || type == FRAME_PRIVATE) {
+        n = get_varint(body, len, &id);
+        if (n <= 0) return;
+    }
+
+    switch (type) {
+    case FRAME_USER:
+        remember_name(id, body + n, len - n);
+        break;
+    case FRAME_MESSAGE:
+        printf("[%s %s] %.*s\n", current_room, lookup_name(id), len - n, body + n);
+        break;
+    case FRAME_PRIVATE:
+        printf("[PM from %s] %.*s\n", lookup_name(id), len - n, body + n);
+        break;
+    case FRAME_NOTICE:
+        fwrite(body, 1, len, stdout);
+        break;
+    case FRAME_ROOM:
+        snprintf(current_room, sizeof(current_room), "%.*s", len, body);
+        break;
+    }
+}
+
+void *receive_binary_thread(void *arg) {
+    (void)arg;
+    static char buffer[FRAME_MAX_REPLY + 16];
+    int len = 0;
+    int framed = 0;
+    ssize_t bytes = 0;
+
+    while (running && (bytes = recv(sockfd, buffer + len, sizeof(buffer) - len, 0)) > 0) {
+        len += bytes;
+        int pos = 0;
+
+        // Until the server echoes the magic, what arrives is its text prompt
+        if (!framed) {
+            char *nul = memchr(buffer, '\0', len);
+            int text_len = nul ? (int)(nul - buffer) : len;
+            fwrite(buffer, 1, text_len, stdout);
+            pos = text_len;
+            if (nul != NULL && len - pos >= PROTO_MAGIC_LEN) {
+                if (memcmp(buffer + pos, PROTO_MAGIC, PROTO_MAGIC_LEN) != 0) {
+                    printf("\nServer does not speak the binary protocol.\n");
+                    break;
+                }
+                framed = 1;
+                pos += PROTO_MAGIC_LEN;
+            }
+        }
+
+        // Handle every complete frame this recv() brought in
+        if (framed) {
+            int type, body_len, used;
+            const char *body;
+            while ((used = parse_frame(buffer + pos, len - pos, FRAME_MAX_REPLY,
+                                       &type, &body, &body_len)) > 0) {
+                print_frame(type, body, body_len);
+                pos += used;
+            }
+            if (used < 0) {
+                printf("\nBad frame from server.\n");
+                break;
+            }
+        }
+
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+        fflush(stdout);
+    }
+
+    if (bytes == 0 && running) {
+        printf("\nServer closed connection.\n");
+    }
+    running = 0;
+
+    return NULL;
+}
@@ -0,0 +1,102 @@
+// chat_proto.h
+// Binary framing for chat_server_rooms and chat_client -b.
+//
+// A binary client opens the connection by sending PROTO_MAGIC, a string that
+// starts with a NUL byte so nobody can type it into telnet. The server answers
+// with the same magic, and from then on both directions are a stream of
+// frames:
+//
+//   [ varint length ][ type byte ][ body: length - 1 bytes ]
+//
+// A varint stores 7 bits per byte, low bits first, with the top bit set on
+// every byte except the last; lengths and user IDs under 128 take one byte.
+// Instead of repeating "[#room alice]" on every line, the server tells each
+// binary client once which ID belongs to which name (FRAME_USER) and then
+// sends only the ID with each message.
+
+#ifndef CHAT_PROTO_H
+#define CHAT_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROTO_MAGIC "\0CHB1"
+#define PROTO_MAGIC_LEN 5
+#define FRAME_MAX_BODY 1000          // Largest frame a client may send
+#define FRAME_MAX_REPLY (128 * 1024) // Largest frame the server sends (history replay)
+
+// Client -> server
+#define FRAME_LOGIN   1   // body: username
+#define FRAME_SAY     2   // body: message for the current room, never a command
+#define FRAME_TEXT    3   // body: a line parsed like text mode ("/join #x", "@bob hi")
+
+// Server -> client
+#define FRAME_USER    16  // body: varint id, username
+#define FRAME_MESSAGE 17  // body: varint sender id, text said in your room
+#define FRAME_PRIVATE 18  // body: varint sender id, private message text
+#define FRAME_NOTICE  19  // body: server text (replies, announcements, history)
+#define FRAME_ROOM    20  // body: name of the room you are now in
+
+// Write v as a varint; returns the number of bytes used (at most 5).
+static inline int put_varint(char *out, uint32_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char)v;
+    return n;
+}
+
+// Read a varint from up to avail bytes. Returns the number of bytes used,
+// 0 if more bytes are needed, or -1 if it is longer than 5 bytes.
+static inline int get_varint(const char *in, int avail, uint32_t *v) {
+    uint32_t result = 0;
+    for (int i = 0; i < avail && i < 5; i++) {
+        result |= (uint32_t)((unsigned char)in[i] & 0x7f) << (7 * i);
+        if (!((unsigned char)in[i] & 0x80)) {
+            *v = result;
+            return i + 1;
+        }
+    }
+    return avail >= 5 ? -1 : 0;
+}
+
+// Write the length and type for a body of body_len bytes; returns the header size.
+static inline int frame_header(char *out, int type, size_t body_len) {
+    int n = put_varint(out, (uint32_t)(1 + body_len));
+    out[n++] = (char)type;
+    return n;
+}
+
+// Build a frame in out. If id is non-negative it is written as a varint in
+// front of the text. Returns the frame length; out needs room for
+// len + 11 bytes.
+static inline int encode_frame(char *out, int type, long id, const char *text, size_t len) {
+    char prefix[5];
+    int prefix_len = id >= 0 ? put_varint(prefix, (uint32_t)id) : 0;
+    int n = put_varint(out, (uint32_t)(1 + prefix_len + len));
+    out[n++] = (char)type;
+    memcpy(out + n, prefix, prefix_len);
+    n += prefix_len;
+    memcpy(out + n, text, len);
+    return n + (int)len;
+}
+
+// Look for one complete frame at the start of buf. Returns the bytes it
+// occupies (and fills in type/body/body_len), 0 if it is not all here yet,
+// or -1 if the stream is malformed or the body is longer than max_body.
+static inline int parse_frame(const char *buf, int avail, int max_body, int *type,
+                              const char **body, int *body_len) {
+    uint32_t len;
+    int n = get_varint(buf, avail, &len);
+    if (n <= 0) return n;
+    if (len == 0 || len > (uint32_t)max_body + 1) return -1;
+    if (avail - n < (int)len) return 0;
+    *type = (unsigned char)buf[n];
+    *body = buf + n + 1;
+    *body_len = (int)len - 1;
+    return n + (int)len;
+}
+
+#endif
@@ -0,0 +1,254 @@
+// chat_rooms_bench.c
+// Load generator for chat_server_rooms (and chat_server_pm with one room).
+// Logs in rooms * users_per_room clients, spreads them evenly over #r0, #r1,
+// ..., then has every client send the same number of messages and counts how
+// many lines come back. Compare many small rooms against a few big ones:
+//   ./chat_rooms_bench 127.0.0.1 9000 50 4 20     (50 rooms x 4 users)
+//   ./chat_rooms_bench 127.0.0.1 9000 2 100 20    (2 rooms x 100 users)
+// With rooms = 1 nobody sends /join, so everyone stays in the default room.
+// Compile: gcc -o chat_rooms_bench chat_rooms_bench.c -pthread
+// Usage: ./chat_rooms_bench host port rooms users_per_room messages [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define BUFFER_SIZE 4096
+
+typedef struct {
+    int fd;
+    int room;
+} BenchClient;
+
+BenchClient *bench_clients;
+int num_clients;
+int num_messages;
+int num_threads = 4;
+int epoll_fd;
+atomic_long lines_received;
+atomic_int stop_receiving;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read from a blocking socket until needle shows up. Returns 0 or -1.
+int wait_for(int fd, const char *needle) {
+    char buffer[BUFFER_SIZE];
+    int len = 0;
+    while (1) {
+        ssize_t bytes = recv(fd, buffer + len, sizeof(buffer) - 1 - len, 0);
+        if (bytes <= 0) return -1;
+        len += bytes;
+        buffer[len] = '\0';
+        if (strstr(buffer, needle) != NULL) return 0;
+        // Keep only the tail so a needle split across reads is still found
+        if (len > BUFFER_SIZE / 2) {
+            int keep = strlen(needle);
+            memmove(buffer, buffer + len - keep, keep);
+            len = keep;
+        }
+    }
+}
+
+void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) continue;
+            perror("send");
+            exit(1);
+        }
+        data += sent;
+        len -= sent;
+    }
+}
+
+// Drains every socket and counts newlines; a delivered message is one line.
+void *receiver_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[256];
+    char buffer[BUFFER_SIZE];
+
+    while (!atomic_load(&stop_receiving)) {
+        int n = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            ssize_t bytes;
+            while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+                long lines = 0;
+                char *p = buffer;
+                char *end = buffer + bytes;
+                while ((p = memchr(p, '\n', end - p)) != NULL) {
+                    lines++;
+                    p++;
+                }
+                atomic_fetch_add(&lines_received, lines);
+            }
+        }
+    }
+    return NULL;
+}
+
+void *sender_thread(void *arg) {
+    long id = (long)arg;
+    char message[128];
+
+    for (int m = 0; m < num_messages; m++) {
+        for (int i = id; i < num_clients; i += num_threads) {
+            int len = snprintf(message, sizeof(message),
+                               "benchmark message %d from client %d\n", m, i);
+            send_all(bench_clients[i].fd, message, len);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 6 && argc != 7) {
+        fprintf(stderr, "Usage: %s host port rooms users_per_room messages [threads]\n", argv[0]);
+        exit(1);
+    }
+
+    int rooms = atoi(argv[3]);
+    int users_per_room = atoi(argv[4]);
+    num_messages = atoi(argv[5]);
+    if (argc == 7) num_threads = atoi(argv[6]);
+    num_clients = rooms * users_per_room;
+    if (rooms < 1 || users_per_room < 1 || num_messages < 1 || num_threads < 1) {
+        fprintf(stderr, "rooms, users_per_room, messages and threads must be positive\n");
+        exit(1);
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(argv[1], argv[2], &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(1);
+    }
+
+    bench_clients = calloc(num_clients, sizeof(BenchClient));
+    epoll_fd = epoll_create1(0);
+    if (bench_clients == NULL || epoll_fd == -1) {
+        perror("setup");
+        exit(1);
+    }
+
+    // Start draining right away so join announcements never back up
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, receiver_thread, NULL);
+
+    printf("Logging in %d clients...\n", num_clients);
+    for (int i = 0; i < num_clients; i++) {
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd == -1 || connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+            perror("connect");
+            exit(1);
+        }
+        bench_clients[i].fd = fd;
+        bench_clients[i].room = i % rooms;
+
+        char line[64];
+        int len = snprintf(line, sizeof(line), "bench%d\n", i);
+        if (wait_for(fd, "username") == -1) goto login_failed;
+        send_all(fd, line, len);
+        if (wait_for(fd, "/quit") == -1) goto login_failed;
+
+        if (rooms > 1) {
+            len = snprintf(line, sizeof(line), "/join #r%d\n", bench_clients[i].room);
+            send_all(fd, line, len);
+            char needle[64];
+            snprintf(needle, sizeof(needle), "You joined #r%d ", bench_clients[i].room);
+            if (wait_for(fd, needle) == -1) goto login_failed;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        continue;
+
+    login_failed:
+        fprintf(stderr, "Client %d could not log in\n", i);
+        exit(1);
+    }
+    freeaddrinfo(res);
+
+    // Let the join announcements drain, then start counting from zero
+    long previous = -1;
+    while (previous != atomic_load(&lines_received)) {
+        previous = atomic_load(&lines_received);
+        usleep(200000);
+    }
+    atomic_store(&lines_received, 0);
+
+    long sent = (long)num_clients * num_messages;
+    long expected = (long)rooms * users_per_room * (users_per_room - 1) * num_messages;
+
+    double start = now_seconds();
+    pthread_t *senders = malloc(num_threads * sizeof(pthread_t));
+    for (long t = 0; t < num_threads; t++) {
+        pthread_create(&senders[t], NULL, sender_thread, (void *)t);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(senders[t], NULL);
+    }
+    double sent_done = now_seconds();
+
+    // Wait for every delivery, giving up after 5 seconds with no progress
+    double last_progress = now_seconds();
+    long last_count = 0;
+    while (atomic_load(&lines_received) < expected) {
+        usleep(10000);
+        long count = atomic_load(&lines_received);
+        if (count != last_count) {
+            last_count = count;
+            last_progress = now_seconds();
+        } else if (now_seconds() - last_progress > 5.0) {
+            break;
+        }
+    }
+    long delivered = atomic_load(&lines_received);
+    double end = delivered >= expected ? now_seconds() : last_progress;
+
+    atomic_store(&stop_receiving, 1);
+    pthread_join(receiver, NULL);
+
+    printf("rooms=%d users/room=%d clients=%d messages/client=%d\n",
+           rooms, users_per_room, num_clients, num_messages);
+    printf("  sent       %ld messages in %.3f s (%.0f msg/s)\n",
+           sent, sent_done - start, sent / (sent_done - start));
+    printf("  delivered  %ld of %ld in %.3f s (%.0f deliveries/s)\n",
+           delivered, expected, end - start, delivered / (end - start));
+    if (delivered < expected) {
+        printf("  WARNING: %ld deliveries missing\n", expected - delivered);
+    }
+
+    for (int i = 0; i < num_clients; i++) {
+        close(bench_clients[i].fd);
+    }
+    free(bench_clients);
+    free(senders);
+    return 0;
+}
@@ -0,0 +1,957 @@
+// chat_server_cluster.c
+// chat_server_pm.c split across several processes on one machine.
+// Each node accepts its own TCP clients, and the nodes form a full mesh of
+// Unix domain sockets to pass traffic between them:
+//   - a broadcast is sent to the node's own users, then forwarded once to
+//     every other node, which sends it to its users
+//   - every node keeps a user directory (username -> owning node), so a
+//     private message goes straight to the one node that has the recipient
+// Traffic for a node is appended to that node's outgoing buffer, and a writer
+// thread per node sends whatever has piled up with one write(). Under load one
+// write carries hundreds of frames; when idle, a frame goes out immediately.
+// Frames use the varint length + type layout from chat_proto.h.
+// Compile: gcc -o chat_server_cluster chat_server_cluster.c -pthread
+// Usage: ./chat_server_cluster node_id num_nodes base_port [socket_dir]
+//   Node i serves clients on TCP port base_port + i and listens for the other
+//   nodes on <socket_dir>/chat-node<i>.sock (socket_dir defaults to /tmp).
+//   Start node 0 .. num_nodes - 1 in any order; they connect as they come up.
+//
+// Commands (same as chat_server_pm):
+//   @username message  - Send private message to username, on any node
+//   /who               - List users on every node
+//   /quit              - Disconnect
+//
+// Locking (always taken in this order):
+//   clients_mutex - this node's client table
+//   dir_lock      - the user directory (rwlock; PMs and /who only read it)
+//   peer->lock    - one outgoing buffer
+//
+// Two nodes can accept the same new username at the same moment. When a node
+// hears that a lower-numbered node also has the name, the lower node wins and
+// the local user is disconnected with "Username already taken".
+//
+// A connection between nodes starts with NODE_HELLO naming the sender and
+// this run of it, then a NODE_JOIN for each of its users. When that connection
+// closes, the sender is down: its users are dropped from the directory,
+// freeing their names. When it comes back as a new run, the connection to it
+// starts over, so it hears about our users again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include "chat_proto.h"
+
+#define MAX_CLIENTS 1024
+#define MAX_NODES 16
+#define BUFFER_SIZE 1024
+#define MAX_USERNAME 32
+#define DIR_BUCKETS 4096
+#define PEER_READ_SIZE (64 * 1024)
+#define PEER_MAX_PENDING (4 * 1024 * 1024)  // Drop traffic for a node that is down
+#define STATS_INTERVAL 10
+
+// Node -> node frames
+#define NODE_JOIN      32   // body: varint node, username
+#define NODE_LEAVE     33   // body: varint node, username
+#define NODE_BROADCAST 34   // body: finished line for every user
+#define NODE_PRIVATE   35   // body: varint name length, recipient, finished line
+#define NODE_HELLO     36   // body: varint node, varint run. First frame on every connection
+
+typedef struct {
+    int fd;
+    int active;
+    char username[MAX_USERNAME];
+    char ip[INET_ADDRSTRLEN];
+} Client;
+
+typedef struct {
+    char *data;
+    int len;
+    int cap;
+} ByteBuf;
+
+// Outgoing traffic for one other node
+typedef struct {
+    int id;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    ByteBuf pending;            // Appended by client threads
+    int reset;                  // The node went down: reconnect (guarded by lock)
+    long frames;                // Stats, guarded by lock
+    long writes;
+} Peer;
+
+typedef struct DirEntry {
+    char name[MAX_USERNAME];
+    int node;
+    struct DirEntry *next;
+} DirEntry;
+
+typedef struct {
+    int fd;
+    int start;
+    int end;
+    char data[BUFFER_SIZE];
+} LineReader;
+
+Client clients[MAX_CLIENTS];
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+DirEntry *directory[DIR_BUCKETS];
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+int node_conn[MAX_NODES];       // Latest connection from each node (guarded by dir_lock)
+uint32_t node_run[MAX_NODES];   // The run of each node that made it (guarded by dir_lock)
+uint32_t my_run;                // Tells this run of the node from earlier ones
+
+Peer peers[MAX_NODES];
+int my_id;
+int num_nodes;
+const char *socket_dir = "/tmp";
+
+void *handle_client(void *arg);
+void *peer_writer(void *arg);
+void *peer_listener(void *arg);
+void *peer_reader(void *arg);
+void *stats_thread(void *arg);
+void broadcast(const char *message, Client *sender);
+void local_broadcast(const char *message, int len, Client *skip);
+int local_private(const char *to_user, const char *message, int len);
+void send_private(const char *to_user, const char *from_user, const char *message, Client *sender);
+void send_user_list(Client *c);
+void peer_push(Peer *p, int type, const char *body, int len);
+void push_all(int type, const char *body, int len);
+void push_membership(int type, const char *username);
+int dir_claim(const char *name);
+int dir_lookup(const char *name);
+void dir_learn(const char *name, int node);
+void dir_forget(const char *name, int node);
+int dir_forget_node(int node, int conn);
+void node_hello(int node, uint32_t run, int *conn);
+void node_lost(int node, int conn);
+Client *add_client(int fd, char *ip);
+void remove_client(Client *c);
+void kick_local(const char *name);
+int read_line(LineReader *lr, char *out, int out_size);
+char *trim(char *str);
+int safe_name(const char *name);
+void send_str(int fd, const char *str);
+void node_path(int node, char *out, size_t size);
+
+int main(int argc, char *argv[]) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s node_id num_nodes base_port [socket_dir]\n", argv[0]);
+        exit(1);
+    }
+
+    my_id = atoi(argv[1]);
+    num_nodes = atoi(argv[2]);
+    int port = atoi(argv[3]) + my_id;
+    if (argc == 5) {
+        socket_dir = argv[4];
+    }
+    if (num_nodes < 1 || num_nodes > MAX_NODES || my_id < 0 || my_id >= num_nodes) {
+        fprintf(stderr, "Need 0 <= node_id < num_nodes <= %d\n", MAX_NODES);
+        exit(1);
+    }
+
+    my_run = ((uint32_t)time(NULL) << 16 ^ (uint32_t)getpid()) | 1;
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+        clients[i].active = 0;
+        clients[i].username[0] = '\0';
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // The mesh: listen for the other nodes, and connect out to each of them
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, peer_listener, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+
+    for (int i = 0; i < num_nodes; i++) {
+        peers[i].id = i;
+        pthread_mutex_init(&peers[i].lock, NULL);
+        pthread_cond_init(&peers[i].ready, NULL);
+        if (i == my_id) continue;
+        if (pthread_create(&thread, NULL, peer_writer, &peers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&thread, NULL, stats_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    int optval = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    printf("Chat node %d of %d listening on port %d...\n", my_id, num_nodes, port);
+
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd == -1) {
+            perror("accept");
+            continue;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+
+        Client *client = add_client(client_fd, client_ip);
+        if (client == NULL) {
+            send_str(client_fd, "Server full. Try again later.\n");
+            close(client_fd);
+            continue;
+        }
+
+        if (pthread_create(&thread, NULL, handle_client, client) != 0) {
+            perror("pthread_create");
+            remove_client(client);
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+void *handle_client(void *arg) {
+    Client *c = arg;
+    int client_fd = c->fd;
+    LineReader reader = { .fd = client_fd, .start = 0, .end = 0 };
+    char line[BUFFER_SIZE];
+    char username[MAX_USERNAME];
+
+    send_str(client_fd, "Enter your username: ");
+    if (read_line(&reader, line, sizeof(line)) < 0) {
+        remove_client(c);
+        close(client_fd);
+        return NULL;
+    }
+
+    char *name = trim(line);
+    if (!safe_name(name) || strlen(name) >= MAX_USERNAME) {
+        send_str(client_fd, "Invalid username. Disconnecting.\n");
+        remove_client(c);
+        close(client_fd);
+        return NULL;
+    }
+
+    // Claiming the name in the directory is the cluster-wide uniqueness check
+    if (!dir_claim(name)) {
+        send_str(client_fd, "Username already taken. Disconnecting.\n");
+        remove_client(c);
+        close(client_fd);
+        return NULL;
+    }
+    strcpy(username, name);
+
+    pthread_mutex_lock(&clients_mutex);
+    strcpy(c->username, username);
+    pthread_mutex_unlock(&clients_mutex);
+    push_membership(NODE_JOIN, username);
+
+    char welcome[512];
+    snprintf(welcome, sizeof(welcome),
+             "\nWelcome, %s! (node %d of %d)\n"
+             "Commands:\n"
+             "  @username message  - Private message\n"
+             "  /who               - List users\n"
+             "  /quit              - Disconnect\n\n",
+             username, my_id, num_nodes);
+    send_str(client_fd, welcome);
+
+    char announce[256];
+    snprintf(announce, sizeof(announce), "*** %s joined the chat ***\n", username);
+    broadcast(announce, c);
+
+    while (read_line(&reader, line, sizeof(line)) >= 0) {
+        char *text = trim(line);
+        if (*text == '\0') continue;
+
+        if (strcmp(text, "/quit") == 0) {
+            break;
+        }
+
+        if (strcmp(text, "/who") == 0) {
+            send_user_list(c);
+            continue;
+        }
+
+        // Private message: @username message
+        if (text[0] == '@') {
+            char *space = strchr(text, ' ');
+            if (space == NULL || space == text + 1 || space[1] == '\0') {
+                send_str(client_fd, "Usage: @username message\n");
+                continue;
+            }
+            *space = '\0';
+            send_private(text + 1, username, space + 1, c);
+            continue;
+        }
+
+        char message[BUFFER_SIZE + MAX_USERNAME + 8];
+        snprintf(message, sizeof(message), "[%s] %s\n", username, text);
+        broadcast(message, c);
+    }
+
+    char leave[256];
+    snprintf(leave, sizeof(leave), "*** %s left the chat ***\n", username);
+    broadcast(leave, c);
+
+    // Out of the table before close(), so the fd can't be reused under us
+    remove_client(c);
+    dir_forget(username, my_id);
+    push_membership(NODE_LEAVE, username);
+    close(client_fd);
+    return NULL;
+}
+
+// ============================================================================
+// Delivery
+// ============================================================================
+
+void local_broadcast(const char *message, int len, Client *skip) {
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && clients[i].username[0] != '\0' && &clients[i] != skip) {
+            send(clients[i].fd, message, len, MSG_NOSIGNAL);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+void broadcast(const char *message, Client *sender) {
+    int len = strlen(message);
+    local_broadcast(message, len, sender);
+    push_all(NODE_BROADCAST, message, len);
+}
+
+// Returns 1 if to_user is on this node and got the message
+int local_private(const char *to_user, const char *message, int len) {
+    int found = 0;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && strcmp(clients[i].username, to_user) == 0) {
+            send(clients[i].fd, message, len, MSG_NOSIGNAL);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return found;
+}
+
+void send_private(const char *to_user, const char *from_user, const char *message, Client *sender) {
+    char pm[BUFFER_SIZE + MAX_USERNAME + 16];
+    int pm_len = snprintf(pm, sizeof(pm), "[PM from %s] %s\n", from_user, message);
+    if (pm_len >= (int)sizeof(pm)) pm_len = sizeof(pm) - 1;
+
+    int node = dir_lookup(to_user);
+    int found = 0;
+    if (node == my_id) {
+        found = local_private(to_user, pm, pm_len);
+    } else if (node >= 0) {
+        // The owning node does the final lookup and the send
+        char body[sizeof(pm) + MAX_USERNAME + 8];
+        int name_len = strlen(to_user);
+        int n = put_varint(body, name_len);
+        memcpy(body + n, to_user, name_len);
+        memcpy(body + n + name_len, pm, pm_len);
+        peer_push(&peers[node], NODE_PRIVATE, body, n + name_len + pm_len);
+        found = 1;
+    }
+
+    char reply[BUFFER_SIZE + MAX_USERNAME + 16];
+    if (found) {
+        snprintf(reply, sizeof(reply), "[PM to %s] %s\n", to_user, message);
+    } else {
+        snprintf(reply, sizeof(reply), "User '%s' not found.\n", to_user);
+    }
+    send_str(sender->fd, reply);
+}
+
+void send_user_list(Client *c) {
+    ByteBuf list = { NULL, 0, 0 };
+    char line[MAX_USERNAME + 32];
+
+    pthread_rwlock_rdlock(&dir_lock);
+    int total = 0;
+    for (int b = 0; b < DIR_BUCKETS; b++) {
+        for (DirEntry *e = directory[b]; e != NULL; e = e->next) total++;
+    }
+    list.cap = 32 + total * (int)sizeof(line);
+    list.data = malloc(list.cap);
+    if (list.data != NULL) {
+        list.len = snprintf(list.data, list.cap, "Connected users:\n");
+        for (int b = 0; b < DIR_BUCKETS; b++) {
+            for (DirEntry *e = directory[b]; e != NULL; e = e->next) {
+                int n = snprintf(line, sizeof(line), "  %s (node %d)\n", e->name, e->node);
+                memcpy(list.data + list.len, line, n);
+                list.len += n;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&dir_lock);
+
+    if (list.data != NULL) {
+        send(c->fd, list.data, list.len, MSG_NOSIGNAL);
+        free(list.data);
+    }
+}
+
+// ============================================================================
+// The mesh
+// ============================================================================
+
+void node_path(int node, char *out, size_t size) {
+    snprintf(out, size, "%s/chat-node%d.sock", socket_dir, node);
+}
+
+// Append one frame to a node's outgoing buffer and wake its writer
+void peer_push(Peer *p, int type, const char *body, int len) {
+    pthread_mutex_lock(&p->lock);
+    if (p->pending.len + len + 16 > PEER_MAX_PENDING) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    if (p->pending.len + len + 16 > p->pending.cap) {
+        int cap = p->pending.cap ? p->pending.cap : 64 * 1024;
+        while (cap < p->pending.len + len + 16) cap *= 2;
+        char *data = realloc(p->pending.data, cap);
+        if (data == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        p->pending.data = data;
+        p->pending.cap = cap;
+    }
+    int n = frame_header(p->pending.data + p->pending.len, type, len);
+    memcpy(p->pending.data + p->pending.len + n, body, len);
+    p->pending.len += n + len;
+    p->frames++;
+    pthread_cond_signal(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void push_all(int type, const char *body, int len) {
+    for (int i = 0; i < num_nodes; i++) {
+        if (i != my_id) peer_push(&peers[i], type, body, len);
+    }
+}
+
+void push_membership(int type, const char *username) {
+    char body[MAX_USERNAME + 8];
+    int n = put_varint(body, my_id);
+    int len = strlen(username);
+    memcpy(body + n, username, len);
+    push_all(type, body, n + len);
+}
+
+int write_all(int fd, const char *data, int len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Connects to one node (retrying until it is up) and sends its traffic.
+// Taking the whole pending buffer at once is what batches the frames.
+void *peer_writer(void *arg) {
+    Peer *p = arg;
+    ByteBuf batch = { NULL, 0, 0 };
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    node_path(p->id, path, sizeof(path));
+
+    while (1) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            if (fd != -1) close(fd);
+            usleep(100000);
+            continue;
+        }
+        // Say who we are before anything else, straight onto the socket:
+        // frames queued while we were away are already in pending
+        char body[16], hello[24];
+        int body_len = put_varint(body, my_id);
+        body_len += put_varint(body + body_len, my_run);
+        int hello_len = frame_header(hello, NODE_HELLO, body_len);
+        memcpy(hello + hello_len, body, body_len);
+        hello_len += body_len;
+        if (write_all(fd, hello, hello_len) == -1) {
+            close(fd);
+            usleep(100000);
+            continue;
+        }
+        printf("Node %d: connected to node %d\n", my_id, p->id);
+        pthread_mutex_lock(&p->lock);
+        p->reset = 0;           // This connection is to whatever run is up now
+        pthread_mutex_unlock(&p->lock);
+
+        // Tell the new node who lives here
+        pthread_mutex_lock(&clients_mutex);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].active && clients[i].username[0] != '\0') {
+                char body[MAX_USERNAME + 8];
+                int n = put_varint(body, my_id);
+                int len = strlen(clients[i].username);
+                memcpy(body + n, clients[i].username, len);
+                peer_push(p, NODE_JOIN, body, n + len);
+            }
+        }
+        pthread_mutex_unlock(&clients_mutex);
+
+        while (1) {
+            pthread_mutex_lock(&p->lock);
+            while (p->pending.len == 0 && !p->reset) {
+                pthread_cond_wait(&p->ready, &p->lock);
+            }
+            if (p->reset) {
+                // The node restarted: this connection went to the old run
+                // (maybe to its listener as it died), though no write has
+                // failed yet
+                p->reset = 0;
+                pthread_mutex_unlock(&p->lock);
+                break;
+            }
+            // Swap buffers so client threads can keep appending while we write
+            ByteBuf full = p->pending;
+            p->pending = batch;
+            p->pending.len = 0;
+            p->writes++;
+            pthread_mutex_unlock(&p->lock);
+
+            int failed = write_all(fd, full.data, full.len);
+            batch = full;
+            if (failed) break;
+        }
+
+        printf("Node %d: lost node %d\n", my_id, p->id);
+        close(fd);
+    }
+    return NULL;
+}
+
+void *peer_listener(void *arg) {
+    (void)arg;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    node_path(my_id, path, sizeof(path));
+    unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, MAX_NODES) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            perror("accept");
+            continue;
+        }
+        int *fd_ptr = malloc(sizeof(int));
+        *fd_ptr = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, peer_reader, fd_ptr) != 0) {
+            perror("pthread_create");
+            close(fd);
+            free(fd_ptr);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+void handle_node_frame(int type, const char *body, int len) {
+    uint32_t value;
+    int n = 0;
+    char name[MAX_USERNAME];
+
+    if (type == NODE_JOIN || type == NODE_LEAVE || type == NODE_PRIVATE) {
+        n = get_varint(body, len, &value);
+        if (n <= 0) return;
+    }
+
+    switch (type) {
+    case NODE_JOIN:
+    case NODE_LEAVE:
+        if (len - n >= MAX_USERNAME || value >= (uint32_t)num_nodes) return;
+        memcpy(name, body + n, len - n);
+        name[len - n] = '\0';
+        if (type == NODE_JOIN) {
+            dir_learn(name, value);
+        } else {
+            dir_forget(name, value);
+        }
+        break;
+    case NODE_BROADCAST:
+        local_broadcast(body, len, NULL);
+        break;
+    case NODE_PRIVATE:
+        if (value >= MAX_USERNAME || (int)value > len - n) return;
+        memcpy(name, body + n, value);
+        name[value] = '\0';
+        local_private(name, body + n + value, len - n - value);
+        break;
+    }
+}
+
+// One per incoming node connection: split the stream into frames
+void *peer_reader(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+    char *buffer = malloc(PEER_READ_SIZE);
+    int len = 0;
+    ssize_t bytes;
+    int peer = -1, conn = 0;    // Set by the connection's NODE_HELLO
+
+    while (buffer != NULL && (bytes = read(fd, buffer + len, PEER_READ_SIZE - len)) > 0) {
+        len += bytes;
+        int pos = 0;
+        int type, body_len, used;
+        const char *body;
+        while ((used = parse_frame(buffer + pos, len - pos, PEER_READ_SIZE / 2,
+                                   &type, &body, &body_len)) > 0) {
+            uint32_t node, run;
+            int n;
+            if (type == NODE_HELLO && peer == -1 && (n = get_varint(body, body_len, &node)) > 0 &&
+                get_varint(body + n, body_len - n, &run) > 0 &&
+                node < (uint32_t)num_nodes && (int)node != my_id) {
+                peer = node;
+                node_hello(peer, run, &conn);
+            } else if (peer != -1) {
+                handle_node_frame(type, body, body_len);
+            }
+            pos += used;
+        }
+        if (used < 0) {
+            fprintf(stderr, "Node %d: bad frame from another node\n", my_id);
+            break;
+        }
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+    }
+
+    free(buffer);
+    close(fd);
+    if (peer != -1) {
+        node_lost(peer, conn);
+    }
+    return NULL;
+}
+
+// A node has connected to us. A new connection is followed by a NODE_JOIN
+// for each of its users, so forget the ones we knew: any that left meanwhile
+// would otherwise stay forever. If this is a new run of the node we knew, our
+// connection to it went to the old one: have its writer reconnect (and so
+// send our users again), and drop what was queued for the old run.
+void node_hello(int node, uint32_t run, int *conn) {
+    pthread_rwlock_wrlock(&dir_lock);
+    *conn = ++node_conn[node];
+    int restarted = node_run[node] != 0 && node_run[node] != run;
+    node_run[node] = run;
+    pthread_rwlock_unlock(&dir_lock);
+    dir_forget_node(node, *conn);
+
+    if (restarted) {
+        Peer *p = &peers[node];
+        pthread_mutex_lock(&p->lock);
+        p->reset = 1;
+        p->pending.len = 0;
+        pthread_cond_signal(&p->ready);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// A node's connection to us closed, so it's down: free its users' names, so
+// they can log in again and PMs to them say "not found" instead of being
+// sent to nobody. Unless it has already connected again, in which case its
+// users are the ones it sent on the new connection.
+void node_lost(int node, int conn) {
+    int dropped = dir_forget_node(node, conn);
+    if (dropped >= 0) {
+        printf("Node %d: node %d went away, dropped its %d users\n", my_id, node, dropped);
+    }
+}
+
+void *stats_thread(void *arg) {
+    (void)arg;
+    long last_frames = 0;
+    while (1) {
+        sleep(STATS_INTERVAL);
+        long frames = 0, writes = 0;
+        for (int i = 0; i < num_nodes; i++) {
+            pthread_mutex_lock(&peers[i].lock);
+            frames += peers[i].frames;
+            writes += peers[i].writes;
+            pthread_mutex_unlock(&peers[i].lock);
+        }
+        if (frames != last_frames && writes > 0) {
+            printf("Node %d: %ld frames to other nodes in %ld writes (%.1f per write)\n",
+                   my_id, frames, writes, (double)frames / writes);
+            fflush(stdout);
+        }
+        last_frames = frames;
+    }
+    return NULL;
+}
+
+// ============================================================================
+// User directory: username -> node, replicated on every node
+// ============================================================================
+
+unsigned dir_hash(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h % DIR_BUCKETS;
+}
+
+DirEntry *dir_find(const char *name, DirEntry ***link_out) {
+    DirEntry **link = &directory[dir_hash(name)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    if (link_out != NULL) *link_out = link;
+    return *link;
+}
+
+void dir_insert(DirEntry **link, const char *name, int node) {
+    DirEntry *e = malloc(sizeof(DirEntry));
+    if (e == NULL) return;
+    strcpy(e->name, name);
+    e->node = node;
+    e->next = NULL;
+    *link = e;
+}
+
+// Claim name for a user on this node; returns 0 if someone has it
+int dir_claim(const char *name) {
+    pthread_rwlock_wrlock(&dir_lock);
+    DirEntry **link;
+    int ok = dir_find(name, &link) == NULL;
+    if (ok) dir_insert(link, name, my_id);
+    pthread_rwlock_unlock(&dir_lock);
+    return ok;
+}
+
+int dir_lookup(const char *name) {
+    pthread_rwlock_rdlock(&dir_lock);
+    DirEntry *e = dir_find(name, NULL);
+    int node = e ? e->node : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return node;
+}
+
+// Another node says name lives there. If we have the same name, the lower
+// node number keeps it.
+void dir_learn(const char *name, int node) {
+    int kick = 0;
+    pthread_rwlock_wrlock(&dir_lock);
+    DirEntry **link;
+    DirEntry *e = dir_find(name, &link);
+    if (e == NULL) {
+        dir_insert(link, name, node);
+    } else if (node < e->node) {
+        kick = e->node == my_id;
+        e->node = node;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    if (kick) kick_local(name);
+}
+
+void dir_forget(const char *name, int node) {
+    pthread_rwlock_wrlock(&dir_lock);
+    DirEntry **link;
+    DirEntry *e = dir_find(name, &link);
+    if (e != NULL && e->node == node) {
+        *link = e->next;
+        free(e);
+    }
+    pthread_rwlock_unlock(&dir_lock);
+}
+
+// Drop every user of node, if conn is still its latest connection. Returns
+// how many there were, or -1 if there is a newer connection.
+int dir_forget_node(int node, int conn) {
+    int dropped = -1;
+    pthread_rwlock_wrlock(&dir_lock);
+    if (node_conn[node] == conn) {
+        dropped = 0;
+        for (int b = 0; b < DIR_BUCKETS; b++) {
+            DirEntry **link = &directory[b];
+            while (*link != NULL) {
+                if ((*link)->node == node) {
+                    DirEntry *dead = *link;
+                    *link = dead->next;
+                    free(dead);
+                    dropped++;
+                } else {
+                    link = &(*link)->next;
+                }
+            }
+        }
+    }
+    pthread_rwlock_unlock(&dir_lock);
+    return dropped;
+}
+
+// Lost a name race: hang up on our user; their thread does the cleanup
+void kick_local(const char *name) {
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && strcmp(clients[i].username, name) == 0) {
+            send_str(clients[i].fd, "Username already taken. Disconnecting.\n");
+            shutdown(clients[i].fd, SHUT_RDWR);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// ============================================================================
+// Clients and helpers
+// ============================================================================
+
+Client *add_client(int fd, char *ip) {
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!clients[i].active) {
+            clients[i].fd = fd;
+            clients[i].active = 1;
+            clients[i].username[0] = '\0';
+            strncpy(clients[i].ip, ip, INET_ADDRSTRLEN);
+            pthread_mutex_unlock(&clients_mutex);
+            return &clients[i];
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return NULL;
+}
+
+void remove_client(Client *c) {
+    pthread_mutex_lock(&clients_mutex);
+    c->active = 0;
+    c->fd = -1;
+    c->username[0] = '\0';
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Reads one line (without the '\n') into out. Returns its length, or -1
+// when the client has gone.
+int read_line(LineReader *lr, char *out, int out_size) {
+    while (1) {
+        char *data = lr->data + lr->start;
+        int avail = lr->end - lr->start;
+        char *newline = memchr(data, '\n', avail);
+
+        // A line longer than the whole buffer is cut into pieces
+        if (newline != NULL || avail == BUFFER_SIZE) {
+            int len = newline ? (int)(newline - data) : avail;
+            int copy = len < out_size - 1 ? len : out_size - 1;
+            memcpy(out, data, copy);
+            out[copy] = '\0';
+            lr->start += newline ? len + 1 : len;
+            return copy;
+        }
+
+        if (lr->start > 0) {
+            memmove(lr->data, data, avail);
+            lr->start = 0;
+            lr->end = avail;
+        }
+
+        ssize_t bytes = recv(lr->fd, lr->data + lr->end, BUFFER_SIZE - lr->end, 0);
+        if (bytes <= 0) {
+            return -1;
+        }
+        lr->end += bytes;
+    }
+}
+
+char *trim(char *str) {
+    int len = strlen(str);
+    while (len > 0 && (str[len - 1] == '\n' || str[len - 1] == '\r' ||
+                       str[len - 1] == ' ' || str[len - 1] == '\t')) {
+        str[--len] = '\0';
+    }
+    while (*str == ' ' || *str == '\t') {
+        str++;
+    }
+    return str;
+}
+
+int safe_name(const char *name) {
+    if (*name == '\0') return 0;
+    for (; *name; name++) {
+        char ch = *name;
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+              (ch >= '0' && ch <= '9') || ch == '_' || ch == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void send_str(int fd, const char *str) {
+    send(fd, str, strlen(str), MSG_NOSIGNAL);
+}
@@ -281,7 +281,8 @@ void send_private(char *to_user, char *from_user, char *message, int sender_fd)
 }
 
 void send_user_list(int client_fd) {
-    char list[BUFFER_SIZE] = "Connected users:\n";
+    // Room for every user: "  " + name + "\n" each
+    char list[32 + MAX_CLIENTS * (MAX_USERNAME + 3)] = "Connected users:\n";
 
     pthread_mutex_lock(&clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
@@ -359,8 +359,9 @@ void send_private(char *to_user, char *from_user, char *message, int sender_fd)
 // SEND USER LIST
 // ============================================================================
 void send_user_list(int client_fd) {
-    // Build a list of all connected users
-    char list[BUFFER_SIZE] = "Connected users:\n";
+    // Build a list of all connected users. The buffer is sized for the worst
+    // case: MAX_CLIENTS users, each taking "  " + name + "\n".
+    char list[32 + MAX_CLIENTS * (MAX_USERNAME + 3)] = "Connected users:\n";
 
     pthread_mutex_lock(&clients_mutex);
 
@@ -370,9 +371,9 @@ void send_user_list(int client_fd) {
             strcat(list, clients[i].username);
             strcat(list, "\n");
 
-            // SECURITY NOTE: This code uses strcat() which is vulnerable to
-            // buffer overflow if there are many users with long names.
-            // Production code should use strncat() or track remaining buffer size.
+            // SECURITY NOTE: strcat() never checks the space left. It is only
+            // safe here because the buffer above fits every possible user; with
+            // a BUFFER_SIZE list, about 70 users crashed the server.
         }
     }
 
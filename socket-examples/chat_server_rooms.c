@@ -0,0 +1,1343 @@
+// chat_server_rooms.c
+// Chat server with rooms, usernames and private messaging.
+// This builds on chat_server_pm.c. Instead of one global room guarded by one
+// global lock, every room keeps its own member list behind its own mutex, and
+// the table of rooms is split into shards so that joining #a never waits on
+// a broadcast in #b.
+// Each room also keeps its recent messages in a fixed-size ring inside an
+// mmap'd file, so people who join late see what was just said, and private
+// messages to someone who is offline are saved until they next log in.
+// Clients may speak plain text (telnet, nc) or the binary framing described
+// in chat_proto.h, which chat_client -b and bots use.
+// Compile: gcc -o chat_server_rooms chat_server_rooms.c -pthread
+// Usage: ./chat_server_rooms port [history_dir]
+//
+// Commands:
+//   /join #room        - Move to #room (created on first join)
+//   /part              - Leave the current room and go back to #lobby
+//   /who               - List users in the current room
+//   /rooms             - List rooms and how many users are in each
+//   @username message  - Send private message to username
+//   /quit              - Disconnect
+//
+// Locking:
+//   clients_lock  (rwlock) - the client table and usernames. Taken for
+//                            reading to look up a PM target, for writing
+//                            on connect/disconnect.
+//   shard->lock   (mutex)  - the chain of rooms in one shard. Only taken to
+//                            find, create or delete a room, and never held
+//                            while anything is sent or a file is opened.
+//   room->lock    (mutex)  - one room's member list. This is the only lock
+//                            a broadcast takes.
+//   mailbox_lock  (mutex)  - the offline mail files. May take clients_lock
+//                            inside it, never the other way round.
+//   Lock order is shard -> room. A room whose last member is leaving is only
+//   deleted if nobody is part way through joining it (room->joining), so a
+//   joiner can drop the shard lock before the slow part of joining.
+//   A client's room pointer is only changed
+//   by that client's own thread, so a sender is always a member of the room
+//   it broadcasts to and the room cannot be freed underneath it.
+//
+// History (one <history_dir>/<room>.ring file per room):
+//   [ header page: two HistoryHeader copies ][ HISTORY_SIZE bytes of text ]
+//   A broadcast only memcpy's its line into the mapping, under ring->lock.
+//   The history_flusher thread does all the disk work: once a second it
+//   msync's the data, then writes the *other* header copy with a higher seq
+//   and msync's that. A crash mid-write leaves the older copy intact, and
+//   startup picks the newest copy whose checksums match.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "chat_proto.h"
+
+#define MAX_CLIENTS 4096
+#define BUFFER_SIZE 1024
+#define MAX_USERNAME 32
+#define MAX_ROOMNAME 32
+#define ROOM_SHARDS 64
+#define DEFAULT_ROOM "#lobby"
+
+#define HISTORY_SIZE (64 * 1024)           // Ring bytes per room on disk
+#define HISTORY_WINDOW (HISTORY_SIZE / 2)  // Most text we ever keep, see history_append
+#define HISTORY_HEADER 4096                // One page holding both header copies
+#define HISTORY_MAGIC 0x43484852           // "CHHR"
+#define REPLAY_LINES 20                    // Messages shown to someone joining
+#define FLUSH_INTERVAL_MS 1000
+#define MAX_MAILBOX (64 * 1024)            // Cap on saved offline messages per user
+
+typedef struct Room Room;
+
+// On-disk header. Offsets are logical: they only grow, and the byte at
+// logical offset x lives at data[x % HISTORY_SIZE].
+typedef struct {
+    uint32_t magic;
+    uint32_t size;          // HISTORY_SIZE of the server that wrote it
+    uint64_t seq;           // Higher seq wins at startup
+    uint64_t head;          // One past the newest byte
+    uint64_t tail;          // First byte of the oldest message kept
+    uint32_t data_sum;      // Checksum of the text in [tail, head)
+    uint32_t header_sum;    // Checksum of the fields above
+} HistoryHeader;
+
+typedef struct HistoryRing {
+    char name[MAX_ROOMNAME];
+    int fd;
+    char *map;              // Header page followed by the ring data
+    char *data;
+    pthread_mutex_t lock;   // Protects head and tail; held only for memcpy
+    uint64_t head;
+    uint64_t tail;
+    uint64_t seq;           // The fields below belong to whoever is flushing
+    uint64_t committed_head;
+    int active_slot;
+    int refs;               // Protected by history_lock
+    struct HistoryRing *next;
+} HistoryRing;
+
+typedef struct {
+    int fd;
+    int active;
+    char username[MAX_USERNAME];
+    char ip[INET_ADDRSTRLEN];
+    Room *room;        // Current room (only written by this client's thread)
+    int room_slot;     // Index in room->members (protected by room->lock)
+    int binary;        // Speaks chat_proto.h frames instead of text lines
+    uint32_t user_id;  // Sent instead of the username in binary frames
+    int mail_read;     // deliver_offline() has run (protected by mailbox_lock)
+} Client;
+
+struct Room {
+    char name[MAX_ROOMNAME];
+    pthread_mutex_t lock;   // Protects members and count
+    Client **members;
+    int count;
+    int capacity;
+    Room *next;             // Next room in the same shard
+    int joining;            // Clients that found the room but aren't members
+                            // yet (protected by the shard lock)
+    int history_pending;    // history_open() not called yet (protected by lock)
+    HistoryRing *history;   // NULL if this room has no history file
+};
+
+typedef struct {
+    pthread_mutex_t lock;   // Protects the chain of rooms
+    Room *head;
+} RoomShard;
+
+// One line of output in both wire formats, encoded once and then sent to
+// every member of a room.
+typedef struct {
+    char text[BUFFER_SIZE + MAX_USERNAME + MAX_ROOMNAME + 16];
+    size_t text_len;
+    char frame[BUFFER_SIZE + MAX_USERNAME + MAX_ROOMNAME + 16];
+    size_t frame_len;
+} Outgoing;
+
+// Reads newline-terminated lines (or binary frames) from a socket. TCP is a byte stream, so one
+// recv() may hold half a line or several lines; this keeps the leftovers.
+typedef struct {
+    int fd;
+    char data[BUFFER_SIZE];
+    int start;
+    int end;
+} LineReader;
+
+Client clients[MAX_CLIENTS];
+pthread_rwlock_t clients_lock = PTHREAD_RWLOCK_INITIALIZER;
+uint32_t next_user_id = 1;   // Protected by clients_lock
+RoomShard shards[ROOM_SHARDS];
+
+const char *history_dir = "chat_history";
+HistoryRing *history_rings = NULL;
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mailbox_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *handle_client(void *arg);
+Room *join_room(Client *c, const char *name);
+void part_room(Client *c);
+void remove_member(Room *room, Client *c);
+void room_broadcast(Room *room, Outgoing *out, Client *sender, int record);
+void make_notice(Outgoing *out, const char *text);
+void announce_user(Client *c);
+int send_live(Client *from, char *to_user, char *message);
+void send_private(Client *from, char *to_user, char *message);
+void send_user_list(Client *c);
+void send_room_list(Client *c);
+Client *add_client(int fd, char *ip);
+void remove_client(Client *c);
+int claim_username(Client *c, char *username);
+int read_line(LineReader *lr, char *out, int out_size);
+int detect_binary(LineReader *lr);
+int read_frame(LineReader *lr, int *type, char *out, int out_size);
+char *trim(char *str);
+int safe_name(const char *name);
+void send_str(int fd, const char *str);
+void send_notice(Client *c, const char *text);
+void history_setup(void);
+HistoryRing *history_open(const char *room_name);
+void history_release(HistoryRing *ring);
+void history_append(HistoryRing *ring, const char *message, size_t len);
+void history_replay(HistoryRing *ring, Client *c, int lines);
+void *history_flusher(void *arg);
+int mail_collected(const char *to_user);
+int store_offline(const char *to_user, const char *from_user, const char *message);
+void deliver_offline(Client *c);
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s port [history_dir]\n", argv[0]);
+        exit(1);
+    }
+
+    int port = atoi(argv[1]);
+    if (argc == 3) {
+        history_dir = argv[2];
+    }
+
+    // Initialize client array and room shards
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+        clients[i].active = 0;
+        clients[i].username[0] = '\0';
+        clients[i].room = NULL;
+    }
+    for (int i = 0; i < ROOM_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].head = NULL;
+    }
+
+    // Thousands of clients need thousands of descriptors
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    history_setup();
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    int optval = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(server_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    printf("Chat server (with rooms) listening on port %d...\n", port);
+
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd == -1) {
+            perror("accept");
+            continue;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+
+        Client *client = add_client(client_fd, client_ip);
+        if (client == NULL) {
+            send_str(client_fd, "Server full. Try again later.\n");
+            close(client_fd);
+            continue;
+        }
+
+        printf("New connection from %s\n", client_ip);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, handle_client, client) != 0) {
+            perror("pthread_create");
+            remove_client(client);
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+void *handle_client(void *arg) {
+    Client *client = (Client *)arg;
+    int client_fd = client->fd;
+
+    LineReader reader = { .fd = client_fd, .start = 0, .end = 0 };
+    char buffer[BUFFER_SIZE];
+    char *name;
+
+    // Prompt for username. A binary client ignores this text, sends its
+    // magic bytes and then a FRAME_LOGIN instead of typing a name.
+    send_str(client_fd, "Enter your username: ");
+
+    client->binary = detect_binary(&reader);
+    if (client->binary == 1) {
+        send(client_fd, PROTO_MAGIC, PROTO_MAGIC_LEN, MSG_NOSIGNAL);
+        int type;
+        if (read_frame(&reader, &type, buffer, sizeof(buffer)) < 0 || type != FRAME_LOGIN) {
+            remove_client(client);
+            close(client_fd);
+            return NULL;
+        }
+        name = buffer;
+    } else if (client->binary == 0 && read_line(&reader, buffer, sizeof(buffer)) >= 0) {
+        name = trim(buffer);
+    } else {
+        remove_client(client);
+        close(client_fd);
+        return NULL;
+    }
+
+    if (strlen(name) >= MAX_USERNAME) {
+        name[MAX_USERNAME - 1] = '\0';
+    }
+
+    // Validate username
+    if (strlen(name) == 0 || strchr(name, ' ') != NULL) {
+        send_notice(client, "Invalid username. Disconnecting.\n");
+        remove_client(client);
+        close(client_fd);
+        return NULL;
+    }
+
+    if (claim_username(client, name) == -1) {
+        send_notice(client, "Username already taken. Disconnecting.\n");
+        remove_client(client);
+        close(client_fd);
+        return NULL;
+    }
+
+    char *username = client->username;
+
+    // Welcome message
+    char welcome[512];
+    snprintf(welcome, sizeof(welcome),
+             "\nWelcome, %s!\n"
+             "Commands:\n"
+             "  /join #room        - Join a room\n"
+             "  /part              - Leave the room (back to " DEFAULT_ROOM ")\n"
+             "  /who               - List users in this room\n"
+             "  /rooms             - List rooms\n"
+             "  @username message  - Private message\n"
+             "  /quit              - Disconnect\n\n",
+             username);
+    send_notice(client, welcome);
+
+    announce_user(client);
+    deliver_offline(client);
+    join_room(client, DEFAULT_ROOM);
+
+    // Main message loop
+    while (1) {
+        char *line;
+        int say_only = 0;
+
+        if (client->binary) {
+            // Every complete frame already in the buffer is handled before
+            // the next recv(), so a bot can send a whole batch at once
+            int type;
+            if (read_frame(&reader, &type, buffer, sizeof(buffer)) < 0) break;
+            if (type == FRAME_SAY) {
+                say_only = 1;
+            } else if (type != FRAME_TEXT) {
+                continue;
+            }
+            line = buffer;
+        } else {
+            if (read_line(&reader, buffer, sizeof(buffer)) < 0) break;
+            line = trim(buffer);
+        }
+
+        if (line[0] == '\0') continue;
+
+        if (!say_only) {
+            // Handle commands
+            if (strcmp(line, "/quit") == 0) {
+                break;
+            }
+
+            if (strcmp(line, "/who") == 0) {
+                send_user_list(client);
+                continue;
+            }
+
+            if (strcmp(line, "/rooms") == 0) {
+                send_room_list(client);
+                continue;
+            }
+
+            if (strcmp(line, "/part") == 0) {
+                if (strcmp(client->room->name, DEFAULT_ROOM) == 0) {
+                    send_notice(client, "You are already in " DEFAULT_ROOM ".\n");
+                    continue;
+                }
+                part_room(client);
+                join_room(client, DEFAULT_ROOM);
+                continue;
+            }
+
+            if (strncmp(line, "/join", 5) == 0 && (line[5] == ' ' || line[5] == '\0')) {
+                char *room_name = trim(line + 5);
+                if (room_name[0] != '#' || strlen(room_name) >= MAX_ROOMNAME ||
+                    !safe_name(room_name + 1)) {
+                    send_notice(client, "Usage: /join #room\n");
+                    continue;
+                }
+                if (strcmp(client->room->name, room_name) == 0) {
+                    send_notice(client, "You are already in that room.\n");
+                    continue;
+                }
+                part_room(client);
+                join_room(client, room_name);
+                continue;
+            }
+
+            // Private message: @username message
+            if (line[0] == '@') {
+                char *space = strchr(line, ' ');
+                if (space == NULL) {
+                    send_notice(client, "Usage: @username message\n");
+                    continue;
+                }
+
+                *space = '\0';
+                char *target_user = line + 1;  // Skip @
+                char *message = space + 1;
+
+                if (target_user[0] == '\0' || message[0] == '\0') {
+                    send_notice(client, "Usage: @username message\n");
+                    continue;
+                }
+
+                send_private(client, target_user, message);
+                continue;
+            }
+        }
+
+        // Regular message: only the current room hears it. Text clients get
+        // the whole line; binary clients get the sender's ID and the words.
+        Outgoing out;
+        out.text_len = snprintf(out.text, sizeof(out.text), "[%s %s] %s\n",
+                                client->room->name, username, line);
+        if (out.text_len >= sizeof(out.text)) out.text_len = sizeof(out.text) - 1;
+        out.frame_len = encode_frame(out.frame, FRAME_MESSAGE, client->user_id,
+                                     line, strlen(line));
+        room_broadcast(client->room, &out, client, 1);
+    }
+
+    // Client leaving
+    printf("*** %s left the chat ***\n", username);
+    part_room(client);
+
+    // Remove before closing so a PM can never hit a recycled descriptor
+    remove_client(client);
+    close(client_fd);
+    return NULL;
+}
+
+// FNV-1a hash of a room name, used to pick its shard
+unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Room and user names become file names, so only allow [A-Za-z0-9_-]
+int safe_name(const char *name) {
+    if (*name == '\0') return 0;
+    for (; *name; name++) {
+        char ch = *name;
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+              (ch >= '0' && ch <= '9') || ch == '_' || ch == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+Room *join_room(Client *c, const char *name) {
+    RoomShard *shard = &shards[hash_name(name) % ROOM_SHARDS];
+
+    // Find or create the room and count ourselves as joining it, which keeps
+    // it from being deleted once we let go of the shard
+    pthread_mutex_lock(&shard->lock);
+
+    Room *room = shard->head;
+    while (room != NULL && strcmp(room->name, name) != 0) {
+        room = room->next;
+    }
+
+    if (room == NULL) {
+        room = calloc(1, sizeof(Room));
+        if (room == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            perror("calloc");
+            exit(1);
+        }
+        strncpy(room->name, name, MAX_ROOMNAME - 1);
+        pthread_mutex_init(&room->lock, NULL);
+        room->history_pending = 1;
+        room->next = shard->head;
+        shard->head = room;
+    }
+    room->joining++;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Everything slow happens under the room's own lock, so joining (or
+    // leaving) other rooms in this shard doesn't wait for it
+    pthread_mutex_lock(&room->lock);
+    if (room->history_pending) {
+        room->history = history_open(room->name);
+        room->history_pending = 0;
+    }
+    if (room->count == room->capacity) {
+        int new_capacity = room->capacity ? room->capacity * 2 : 8;
+        Client **grown = realloc(room->members, new_capacity * sizeof(Client *));
+        if (grown == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        room->members = grown;
+        room->capacity = new_capacity;
+    }
+    c->room_slot = room->count;
+    room->members[room->count++] = c;
+
+    char note[128];
+    snprintf(note, sizeof(note), "You joined %s (%d user%s here).\n",
+             room->name, room->count, room->count == 1 ? "" : "s");
+    send_notice(c, note);
+    if (c->binary) {
+        char frame[MAX_ROOMNAME + 8];
+        int len = encode_frame(frame, FRAME_ROOM, -1, room->name, strlen(room->name));
+        send(c->fd, frame, len, MSG_NOSIGNAL);
+    }
+
+    // Replay while still holding the room lock, so no new message can slip
+    // in ahead of the history
+    history_replay(room->history, c, REPLAY_LINES);
+    pthread_mutex_unlock(&room->lock);
+
+    // Being a member keeps the room alive from here on
+    pthread_mutex_lock(&shard->lock);
+    room->joining--;
+    pthread_mutex_unlock(&shard->lock);
+
+    c->room = room;
+
+    char announce[128];
+    snprintf(announce, sizeof(announce), "*** %s joined %s ***\n", c->username, room->name);
+    Outgoing out;
+    make_notice(&out, announce);
+    room_broadcast(room, &out, c, 0);
+
+    return room;
+}
+
+// Called with room->lock held. Swaps the last member into c's slot so
+// removal is O(1)
+void remove_member(Room *room, Client *c) {
+    Client *last = room->members[--room->count];
+    room->members[c->room_slot] = last;
+    last->room_slot = c->room_slot;
+}
+
+void part_room(Client *c) {
+    Room *room = c->room;
+    if (room == NULL) return;
+
+    char announce[128];
+    snprintf(announce, sizeof(announce), "*** %s left %s ***\n", c->username, room->name);
+    Outgoing out;
+    make_notice(&out, announce);
+    room_broadcast(room, &out, c, 0);
+
+    RoomShard *shard = &shards[hash_name(room->name) % ROOM_SHARDS];
+
+    // Only the last one out may have to delete the room and needs the shard
+    // lock; anyone else leaves without touching it
+    pthread_mutex_lock(&room->lock);
+    if (room->count > 1) {
+        remove_member(room, c);
+        pthread_mutex_unlock(&room->lock);
+        c->room = NULL;
+        return;
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    pthread_mutex_lock(&shard->lock);
+    pthread_mutex_lock(&room->lock);
+    remove_member(room, c);
+
+    // Someone may have started joining since we looked
+    int empty = (room->count == 0 && room->joining == 0);
+    if (empty) {
+        Room **link = &shard->head;
+        while (*link != room) {
+            link = &(*link)->next;
+        }
+        *link = room->next;
+    }
+
+    pthread_mutex_unlock(&room->lock);
+    pthread_mutex_unlock(&shard->lock);
+
+    c->room = NULL;
+
+    // Nobody else can reach an unlinked room, so it is safe to free
+    if (empty) {
+        history_release(room->history);
+        pthread_mutex_destroy(&room->lock);
+        free(room->members);
+        free(room);
+    }
+}
+
+// Send to everyone in the room except the sender, each in their own format.
+// When record is set the text form also goes into the room's history ring
+// (a memcpy, never a syscall).
+void room_broadcast(Room *room, Outgoing *out, Client *sender, int record) {
+    pthread_mutex_lock(&room->lock);
+    if (record) {
+        history_append(room->history, out->text, out->text_len);
+    }
+    for (int i = 0; i < room->count; i++) {
+        Client *member = room->members[i];
+        if (member == sender) continue;
+        if (member->binary) {
+            send(member->fd, out->frame, out->frame_len, MSG_NOSIGNAL);
+        } else {
+            send(member->fd, out->text, out->text_len, MSG_NOSIGNAL);
+        }
+    }
+    pthread_mutex_unlock(&room->lock);
+}
+
+// Server text that is the same for everybody (join/leave announcements)
+void make_notice(Outgoing *out, const char *text) {
+    out->text_len = snprintf(out->text, sizeof(out->text), "%s", text);
+    if (out->text_len >= sizeof(out->text)) out->text_len = sizeof(out->text) - 1;
+    out->frame_len = encode_frame(out->frame, FRAME_NOTICE, -1, out->text, out->text_len);
+}
+
+// Tell every binary client which ID this user has, and tell this user (if
+// binary) the IDs of everyone already here. Runs after claim_username, so of
+// any two users logging in at once, the later one always sees the earlier.
+void announce_user(Client *c) {
+    char frame[MAX_USERNAME + 16];
+    int frame_len = encode_frame(frame, FRAME_USER, c->user_id, c->username, strlen(c->username));
+
+    // Frames for the newcomer are batched into as few sends as possible
+    char batch[4096];
+    int batch_len = 0;
+
+    pthread_rwlock_rdlock(&clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Client *other = &clients[i];
+        if (!other->active || other->username[0] == '\0' || other == c) continue;
+
+        if (other->binary) {
+            send(other->fd, frame, frame_len, MSG_NOSIGNAL);
+        }
+        if (c->binary) {
+            if (batch_len > (int)sizeof(batch) - MAX_USERNAME - 16) {
+                send(c->fd, batch, batch_len, MSG_NOSIGNAL);
+                batch_len = 0;
+            }
+            batch_len += encode_frame(batch + batch_len, FRAME_USER, other->user_id,
+                                      other->username, strlen(other->username));
+        }
+    }
+    pthread_rwlock_unlock(&clients_lock);
+
+    if (batch_len > 0) {
+        send(c->fd, batch, batch_len, MSG_NOSIGNAL);
+    }
+}
+
+// Send a PM to to_user if they're logged in. Returns whether they were.
+int send_live(Client *from, char *to_user, char *message) {
+    char pm[BUFFER_SIZE + MAX_USERNAME + 16];
+    int found = 0;
+
+    pthread_rwlock_rdlock(&clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && strcmp(clients[i].username, to_user) == 0) {
+            if (clients[i].binary) {
+                int len = encode_frame(pm, FRAME_PRIVATE, from->user_id, message, strlen(message));
+                send(clients[i].fd, pm, len, MSG_NOSIGNAL);
+            } else {
+                snprintf(pm, sizeof(pm), "[PM from %s] %s\n", from->username, message);
+                send_str(clients[i].fd, pm);
+            }
+            found = 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    return found;
+}
+
+void send_private(Client *from, char *to_user, char *message) {
+    char pm[BUFFER_SIZE + MAX_USERNAME + 16];
+    int found = 0;
+    int saved = 0;
+
+    // The mailbox is written without clients_lock, so the target may log in
+    // in between. If they have already been sent their mail, store_offline()
+    // says so instead of saving, and we try them live again.
+    while (!(found = send_live(from, to_user, message))) {
+        int stored = store_offline(to_user, from->username, message);
+        if (stored != 1) {
+            saved = stored == 0;
+            break;
+        }
+    }
+
+    if (found) {
+        // Confirm to sender
+        snprintf(pm, sizeof(pm), "[PM to %s] %s\n", to_user, message);
+        send_notice(from, pm);
+    } else if (saved) {
+        snprintf(pm, sizeof(pm), "%s is offline; your message will be delivered when they log in.\n", to_user);
+        send_notice(from, pm);
+    } else {
+        char err[128];
+        snprintf(err, sizeof(err), "User '%s' not found.\n", to_user);
+        send_notice(from, err);
+    }
+}
+
+void send_user_list(Client *c) {
+    Room *room = c->room;
+    char list[BUFFER_SIZE];
+    int len = snprintf(list, sizeof(list), "Users in %s:\n", room->name);
+
+    pthread_mutex_lock(&room->lock);
+    for (int i = 0; i < room->count && len < (int)sizeof(list) - MAX_USERNAME - 4; i++) {
+        len += snprintf(list + len, sizeof(list) - len, "  %s\n", room->members[i]->username);
+    }
+    if (len >= (int)sizeof(list) - MAX_USERNAME - 4) {
+        len += snprintf(list + len, sizeof(list) - len, "  ...\n");
+    }
+    pthread_mutex_unlock(&room->lock);
+
+    send_notice(c, list);
+}
+
+void send_room_list(Client *c) {
+    char list[BUFFER_SIZE];
+    int len = snprintf(list, sizeof(list), "Rooms:\n");
+
+    for (int s = 0; s < ROOM_SHARDS; s++) {
+        pthread_mutex_lock(&shards[s].lock);
+        for (Room *room = shards[s].head; room != NULL; room = room->next) {
+            if (len >= (int)sizeof(list) - MAX_ROOMNAME - 24) break;
+            pthread_mutex_lock(&room->lock);
+            int count = room->count;
+            pthread_mutex_unlock(&room->lock);
+            len += snprintf(list + len, sizeof(list) - len, "  %s (%d)\n", room->name, count);
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+
+    send_notice(c, list);
+}
+
+Client *add_client(int fd, char *ip) {
+    pthread_rwlock_wrlock(&clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!clients[i].active) {
+            clients[i].fd = fd;
+            clients[i].active = 1;
+            clients[i].username[0] = '\0';
+            clients[i].room = NULL;
+            clients[i].binary = 0;
+            clients[i].mail_read = 0;
+            strncpy(clients[i].ip, ip, INET_ADDRSTRLEN);
+            pthread_rwlock_unlock(&clients_lock);
+            return &clients[i];
+        }
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    return NULL;
+}
+
+void remove_client(Client *c) {
+    pthread_rwlock_wrlock(&clients_lock);
+    c->active = 0;
+    c->fd = -1;
+    c->username[0] = '\0';
+    pthread_rwlock_unlock(&clients_lock);
+}
+
+// Check and set the username under one lock, so two clients racing for the
+// same name cannot both get it.
+int claim_username(Client *c, char *username) {
+    pthread_rwlock_wrlock(&clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && strcmp(clients[i].username, username) == 0) {
+            pthread_rwlock_unlock(&clients_lock);
+            return -1;
+        }
+    }
+    strncpy(c->username, username, MAX_USERNAME - 1);
+    c->username[MAX_USERNAME - 1] = '\0';
+    c->user_id = next_user_id++;
+    pthread_rwlock_unlock(&clients_lock);
+    return 0;
+}
+
+// Copy the next line (without the newline) into out.
+// Returns the line length, or -1 when the client disconnects.
+int read_line(LineReader *lr, char *out, int out_size) {
+    while (1) {
+        char *data = lr->data + lr->start;
+        int avail = lr->end - lr->start;
+        char *newline = memchr(data, '\n', avail);
+
+        // A line longer than the whole buffer is cut into pieces
+        if (newline != NULL || avail == BUFFER_SIZE) {
+            int len = newline ? (int)(newline - data) : avail;
+            int copy = len < out_size - 1 ? len : out_size - 1;
+            memcpy(out, data, copy);
+            out[copy] = '\0';
+            lr->start += newline ? len + 1 : len;
+            return copy;
+        }
+
+        // Slide the partial line to the front to make room for more
+        if (lr->start > 0) {
+            memmove(lr->data, data, avail);
+            lr->start = 0;
+            lr->end = avail;
+        }
+
+        ssize_t bytes = recv(lr->fd, lr->data + lr->end, BUFFER_SIZE - lr->end, 0);
+        if (bytes <= 0) {
+            return -1;
+        }
+        lr->end += bytes;
+    }
+}
+
+// Binary clients open with PROTO_MAGIC, whose first byte is NUL; a text
+// client's first byte is part of a username. Returns 1, 0, or -1 on error.
+int detect_binary(LineReader *lr) {
+    while (lr->end - lr->start < 1 ||
+           (lr->data[lr->start] == '\0' && lr->end - lr->start < PROTO_MAGIC_LEN)) {
+        ssize_t bytes = recv(lr->fd, lr->data + lr->end, BUFFER_SIZE - lr->end, 0);
+        if (bytes <= 0) {
+            return -1;
+        }
+        lr->end += bytes;
+    }
+    if (lr->data[lr->start] != '\0') {
+        return 0;
+    }
+    if (memcmp(lr->data + lr->start, PROTO_MAGIC, PROTO_MAGIC_LEN) != 0) {
+        return -1;
+    }
+    lr->start += PROTO_MAGIC_LEN;
+    return 1;
+}
+
+// Copy the body of the next frame into out (NUL-terminated) and set type.
+// Returns the body length, or -1 on disconnect or a malformed frame.
+int read_frame(LineReader *lr, int *type, char *out, int out_size) {
+    while (1) {
+        const char *body;
+        int body_len;
+        int used = parse_frame(lr->data + lr->start, lr->end - lr->start,
+                               FRAME_MAX_BODY, type, &body, &body_len);
+        if (used < 0) {
+            return -1;
+        }
+        if (used > 0) {
+            int copy = body_len < out_size - 1 ? body_len : out_size - 1;
+            memcpy(out, body, copy);
+            out[copy] = '\0';
+            lr->start += used;
+            return copy;
+        }
+
+        // FRAME_MAX_BODY is below BUFFER_SIZE, so a whole frame always fits
+        // once the partial one is slid to the front
+        int avail = lr->end - lr->start;
+        if (lr->start > 0) {
+            memmove(lr->data, lr->data + lr->start, avail);
+            lr->start = 0;
+            lr->end = avail;
+        }
+
+        ssize_t bytes = recv(lr->fd, lr->data + lr->end, BUFFER_SIZE - lr->end, 0);
+        if (bytes <= 0) {
+            return -1;
+        }
+        lr->end += bytes;
+    }
+}
+
+// Strip whitespace in place and return the first non-blank character.
+char *trim(char *str) {
+    int len = strlen(str);
+    while (len > 0 && (str[len - 1] == '\n' || str[len - 1] == '\r' ||
+                       str[len - 1] == ' ' || str[len - 1] == '\t')) {
+        str[--len] = '\0';
+    }
+    while (*str == ' ' || *str == '\t') {
+        str++;
+    }
+    return str;
+}
+
+void send_str(int fd, const char *str) {
+    send(fd, str, strlen(str), MSG_NOSIGNAL);
+}
+
+// Server text for one client: a plain string, or a FRAME_NOTICE if binary
+void send_notice(Client *c, const char *text) {
+    if (!c->binary) {
+        send_str(c->fd, text);
+        return;
+    }
+    size_t len = strlen(text);
+    char header[8];
+    int header_len = frame_header(header, FRAME_NOTICE, len);
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (char *)text, .iov_len = len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+}
+
+// ============================================================================
+// Room history: a ring of recent lines in an mmap'd file per room
+// ============================================================================
+
+// FNV-1a over a byte range, used for both header and data checksums
+uint32_t checksum(uint32_t h, const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Checksum of logical range [from, to), following the wrap-around
+uint32_t ring_sum(HistoryRing *ring, uint64_t from, uint64_t to) {
+    uint32_t h = 2166136261u;
+    while (from < to) {
+        size_t pos = from % HISTORY_SIZE;
+        size_t chunk = HISTORY_SIZE - pos;
+        if (chunk > to - from) chunk = to - from;
+        h = checksum(h, ring->data + pos, chunk);
+        from += chunk;
+    }
+    return h;
+}
+
+HistoryHeader *header_slot(HistoryRing *ring, int slot) {
+    return (HistoryHeader *)(ring->map + slot * 128);
+}
+
+int header_valid(HistoryHeader *h) {
+    return h->magic == HISTORY_MAGIC && h->size == HISTORY_SIZE &&
+           h->header_sum == checksum(2166136261u, (char *)h, offsetof(HistoryHeader, header_sum)) &&
+           h->tail <= h->head && h->head - h->tail <= HISTORY_WINDOW;
+}
+
+void history_setup(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mail", history_dir);
+    if ((mkdir(history_dir, 0755) == -1 && errno != EEXIST) ||
+        (mkdir(path, 0700) == -1 && errno != EEXIST)) {
+        perror("history directory");
+        fprintf(stderr, "Continuing without history or offline messages.\n");
+        history_dir = NULL;
+        return;
+    }
+
+    pthread_t flusher;
+    pthread_create(&flusher, NULL, history_flusher, NULL);
+    pthread_detach(flusher);
+}
+
+// Find the room's ring, or map its file and recover it from the newest
+// valid header. Called under the room's lock by the first join after the
+// room is created, so the shard stays free while the file is read.
+HistoryRing *history_open(const char *room_name) {
+    if (history_dir == NULL) return NULL;
+
+    pthread_mutex_lock(&history_lock);
+    for (HistoryRing *ring = history_rings; ring != NULL; ring = ring->next) {
+        if (strcmp(ring->name, room_name) == 0) {
+            ring->refs++;
+            pthread_mutex_unlock(&history_lock);
+            return ring;
+        }
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.ring", history_dir, room_name + 1);  // Skip '#'
+    size_t total = HISTORY_HEADER + HISTORY_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        ((size_t)st.st_size != total && ftruncate(fd, total) == -1)) {
+        perror(path);
+        if (fd != -1) close(fd);
+        pthread_mutex_unlock(&history_lock);
+        return NULL;
+    }
+
+    // MAP_POPULATE faults every page in now, so a broadcast's memcpy never
+    // has to wait for the disk
+    char *map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    HistoryRing *ring = calloc(1, sizeof(HistoryRing));
+    if (map == MAP_FAILED || ring == NULL) {
+        perror("history mmap");
+        if (map != MAP_FAILED) munmap(map, total);
+        free(ring);
+        close(fd);
+        pthread_mutex_unlock(&history_lock);
+        return NULL;
+    }
+
+    strncpy(ring->name, room_name, MAX_ROOMNAME - 1);
+    ring->fd = fd;
+    ring->map = map;
+    ring->data = map + HISTORY_HEADER;
+    pthread_mutex_init(&ring->lock, NULL);
+
+    // Pick the newest header whose checksums hold up; otherwise start empty
+    int best = -1;
+    for (int slot = 0; slot < 2; slot++) {
+        HistoryHeader *h = header_slot(ring, slot);
+        if (header_valid(h) && (best == -1 || h->seq > header_slot(ring, best)->seq)) {
+            best = slot;
+        }
+    }
+    if (best != -1 && ring_sum(ring, header_slot(ring, best)->tail,
+                               header_slot(ring, best)->head) == header_slot(ring, best)->data_sum) {
+        HistoryHeader *h = header_slot(ring, best);
+        ring->head = h->head;
+        ring->tail = h->tail;
+        ring->seq = h->seq;
+        ring->active_slot = best;
+    } else {
+        ring->head = ring->tail = 0;
+        ring->seq = 0;
+        ring->active_slot = 1;  // So the first flush writes slot 0
+    }
+    ring->committed_head = ring->head;
+
+    ring->refs = 1;
+    ring->next = history_rings;
+    history_rings = ring;
+    pthread_mutex_unlock(&history_lock);
+    return ring;
+}
+
+// Make [tail, head) durable: data first, then the other header copy.
+// Only one thread ever flushes a given ring (see history_release).
+void history_flush(HistoryRing *ring) {
+    pthread_mutex_lock(&ring->lock);
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    if (head == ring->committed_head) {
+        pthread_mutex_unlock(&ring->lock);
+        return;
+    }
+    uint32_t data_sum = ring_sum(ring, tail, head);
+    pthread_mutex_unlock(&ring->lock);
+
+    msync(ring->data, HISTORY_SIZE, MS_SYNC);
+
+    HistoryHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = HISTORY_MAGIC;
+    h.size = HISTORY_SIZE;
+    h.seq = ring->seq + 1;
+    h.head = head;
+    h.tail = tail;
+    h.data_sum = data_sum;
+    h.header_sum = checksum(2166136261u, (char *)&h, offsetof(HistoryHeader, header_sum));
+
+    int slot = 1 - ring->active_slot;
+    memcpy(header_slot(ring, slot), &h, sizeof(h));
+    msync(ring->map, HISTORY_HEADER, MS_SYNC);
+
+    ring->active_slot = slot;
+    ring->seq = h.seq;
+    ring->committed_head = head;
+}
+
+// Drop a reference. The last one flushes and unmaps; since the flusher holds
+// a reference while it works, whoever drops the last one is the only flusher.
+void history_release(HistoryRing *ring) {
+    if (ring == NULL) return;
+
+    pthread_mutex_lock(&history_lock);
+    int last = (--ring->refs == 0);
+    if (last) {
+        HistoryRing **link = &history_rings;
+        while (*link != ring) {
+            link = &(*link)->next;
+        }
+        *link = ring->next;
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    if (last) {
+        history_flush(ring);
+        munmap(ring->map, HISTORY_HEADER + HISTORY_SIZE);
+        close(ring->fd);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+    }
+}
+
+// Called from room_broadcast with the room lock held. No system calls here:
+// the line is copied into the mapping and the flusher writes it out later.
+void history_append(HistoryRing *ring, const char *message, size_t len) {
+    if (ring == NULL || len > HISTORY_WINDOW / 4) return;
+
+    pthread_mutex_lock(&ring->lock);
+    size_t pos = ring->head % HISTORY_SIZE;
+    size_t first = HISTORY_SIZE - pos;
+    if (first > len) first = len;
+    memcpy(ring->data + pos, message, first);
+    memcpy(ring->data, message + first, len - first);
+    ring->head += len;
+
+    // Keep at most HISTORY_WINDOW bytes, dropping whole lines from the front.
+    // The other half of the ring is slack: new lines written after the last
+    // flush land there instead of on top of the text the header on disk
+    // still points at.
+    while (ring->head - ring->tail > HISTORY_WINDOW) {
+        size_t tpos = ring->tail % HISTORY_SIZE;
+        size_t chunk = HISTORY_SIZE - tpos;
+        if (chunk > ring->head - ring->tail) chunk = ring->head - ring->tail;
+        char *newline = memchr(ring->data + tpos, '\n', chunk);
+        ring->tail += newline ? (uint64_t)(newline - (ring->data + tpos)) + 1 : chunk;
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Send the last few lines straight out of the mapping with one sendmsg().
+// Binary clients get the same bytes wrapped in one FRAME_NOTICE.
+// Called with the room lock held.
+void history_replay(HistoryRing *ring, Client *c, int lines) {
+    if (ring == NULL) return;
+
+    pthread_mutex_lock(&ring->lock);
+
+    // Walk back over `lines` complete lines (each ends in '\n')
+    uint64_t start = ring->head;
+    int seen = 0;
+    while (start > ring->tail) {
+        if (ring->data[(start - 1) % HISTORY_SIZE] == '\n' && start != ring->head) {
+            if (++seen == lines) break;
+        }
+        start--;
+    }
+
+    size_t len = ring->head - start;
+    if (len > 0) {
+        char banner[64];
+        snprintf(banner, sizeof(banner), "--- Recent messages ---\n");
+        char footer[] = "--- End of history ---\n";
+
+        struct iovec iov[5];
+        int n = 0;
+        size_t pos = start % HISTORY_SIZE;
+        size_t first = HISTORY_SIZE - pos;
+        if (first > len) first = len;
+        char header[8];
+        if (c->binary) {
+            iov[n].iov_base = header;
+            iov[n++].iov_len = frame_header(header, FRAME_NOTICE,
+                                            strlen(banner) + len + strlen(footer));
+        }
+        iov[n].iov_base = banner;
+        iov[n++].iov_len = strlen(banner);
+        iov[n].iov_base = ring->data + pos;
+        iov[n++].iov_len = first;
+        if (first < len) {
+            iov[n].iov_base = ring->data;
+            iov[n++].iov_len = len - first;
+        }
+        iov[n].iov_base = footer;
+        iov[n++].iov_len = strlen(footer);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// All history disk I/O happens here, once per FLUSH_INTERVAL_MS.
+void *history_flusher(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(FLUSH_INTERVAL_MS * 1000);
+
+        // Take a reference to every ring so none can be freed mid-flush
+        pthread_mutex_lock(&history_lock);
+        int count = 0;
+        for (HistoryRing *ring = history_rings; ring != NULL; ring = ring->next) {
+            count++;
+        }
+        HistoryRing **batch = malloc((count + 1) * sizeof(HistoryRing *));
+        count = 0;
+        for (HistoryRing *ring = history_rings; ring != NULL && batch != NULL; ring = ring->next) {
+            ring->refs++;
+            batch[count++] = ring;
+        }
+        pthread_mutex_unlock(&history_lock);
+
+        for (int i = 0; i < count; i++) {
+            history_flush(batch[i]);
+            history_release(batch[i]);
+        }
+        free(batch);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// Offline private messages: <history_dir>/mail/<user>.txt
+// ============================================================================
+
+// Whether to_user is logged in and has already been sent their offline mail,
+// so anything saved now would wait for their next login. Called with
+// mailbox_lock held, which deliver_offline() sets mail_read under.
+int mail_collected(const char *to_user) {
+    int collected = 0;
+    pthread_rwlock_rdlock(&clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].active && strcmp(clients[i].username, to_user) == 0) {
+            collected = clients[i].mail_read;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&clients_lock);
+    return collected;
+}
+
+// Append a PM to to_user's mailbox. Returns 0, -1 if it couldn't be saved,
+// or 1 if to_user has logged in and collected their mail since the caller
+// looked, so it should be sent live instead.
+int store_offline(const char *to_user, const char *from_user, const char *message) {
+    if (history_dir == NULL || !safe_name(to_user)) return -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mail/%s.txt", history_dir, to_user);
+
+    char line[BUFFER_SIZE + MAX_USERNAME + 32];
+    int len = snprintf(line, sizeof(line), "[PM from %s (while you were away)] %s\n",
+                       from_user, message);
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+    pthread_mutex_lock(&mailbox_lock);
+    if (mail_collected(to_user)) {
+        pthread_mutex_unlock(&mailbox_lock);
+        return 1;
+    }
+    int result = -1;
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size + len <= MAX_MAILBOX &&
+        write(fd, line, len) == len) {
+        result = 0;
+    }
+    if (fd != -1) close(fd);
+    pthread_mutex_unlock(&mailbox_lock);
+    return result;
+}
+
+// Called right after the user's name is claimed. mailbox_lock keeps new mail
+// out between sending the file and deleting it, and once mail_read is set,
+// store_offline() turns senders back to send_live().
+void deliver_offline(Client *c) {
+    if (history_dir == NULL || !safe_name(c->username)) return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mail/%s.txt", history_dir, c->username);
+
+    pthread_mutex_lock(&mailbox_lock);
+    c->mail_read = 1;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        const char *banner = "--- Messages while you were away ---\n";
+        const char *footer = "--- End of messages ---\n";
+        if (c->binary) {
+            // One notice frame around banner, file and footer
+            char header[8];
+            int header_len = frame_header(header, FRAME_NOTICE,
+                                          strlen(banner) + st.st_size + strlen(footer));
+            send(c->fd, header, header_len, MSG_NOSIGNAL | MSG_MORE);
+        }
+        send(c->fd, banner, strlen(banner), MSG_NOSIGNAL | MSG_MORE);
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            if (sendfile(c->fd, fd, &offset, st.st_size - offset) <= 0) break;
+        }
+        send_str(c->fd, footer);
+    }
+    if (fd != -1) {
+        close(fd);
+        unlink(path);
+    }
+    pthread_mutex_unlock(&mailbox_lock);
+}
@@ -0,0 +1,784 @@
+// chat_sim.c
+// Load simulator for the chat servers. One process, one epoll loop, thousands
+// of scripted clients. Every client logs in with a unique username, then the
+// simulator sends a mix of room broadcasts, private messages and /who at a
+// fixed total rate, picking a random client for each one.
+//
+// Each message carries "sim:<run>:<id>" in its text. The simulator remembers
+// when message <id> was sent and how many clients should receive it, so every
+// copy that comes back gives a delivery latency (send -> that recipient), and
+// the last copy gives the completion latency (send -> every recipient).
+//
+// Servers speak different dialects, picked with -p:
+//   basic  chat_server.c                  no login, broadcast only
+//   pm     chat_server_pm.c               "@user msg", "/who"
+//   rooms  chat_server_rooms.c            as pm, plus -R rooms and -b binary
+//   select socket_exercise5_solution.c    "/msg user msg", "/list", 10 clients max
+// With -N nodes, client i connects to port + i % nodes, which spreads the
+// clients over a chat_server_cluster (it speaks the pm dialect).
+//
+// Compile: gcc -o chat_sim chat_sim.c
+// Usage: ./chat_sim [-p dialect] [-n clients] [-r msgs/sec] [-d seconds]
+//                   [-m bcast,pm,who] [-s bytes] [-R rooms] [-w logins] [-N nodes]
+//                   [-b] [-c] host port
+
+#define _GNU_SOURCE    // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include "chat_proto.h"
+
+#define IN_SIZE 16384
+#define MAX_EVENTS 512
+#define MAX_TEXT 900
+#define WHO_QUEUE 16
+#define MSG_SLOTS (1 << 20)         // Messages that can be in flight at once
+#define HIST_SUB 16                 // Histogram buckets per power of two (~6%)
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define LOGIN_TIMEOUT 15.0
+#define DRAIN_TIMEOUT 3.0
+
+enum { DIALECT_BASIC, DIALECT_PM, DIALECT_ROOMS, DIALECT_SELECT };
+enum { ST_CONNECTING, ST_PROMPT, ST_WELCOME, ST_JOIN, ST_READY, ST_DEAD };
+enum { OP_BROADCAST, OP_PRIVATE, OP_WHO };
+
+typedef struct {
+    int fd;
+    int index;
+    int state;
+    int room;
+    int framed;                 // Binary mode: the server's magic has arrived
+    long skip;                  // Binary mode: bytes of an oversized frame to drop
+    char in[IN_SIZE];
+    int in_len;
+    char *out;                  // Bytes the kernel would not take yet
+    int out_len;
+    int out_cap;
+    double who_sent[WHO_QUEUE]; // Send times of unanswered /who requests
+    int who_head;
+    int who_count;
+} SimClient;
+
+typedef struct {
+    double sent;
+    uint32_t id;
+    int expected;
+    int remaining;
+} Message;
+
+typedef struct {
+    long count;
+    long buckets[HIST_BUCKETS];
+    double max;
+} Histogram;
+
+SimClient *sim_clients;
+int num_clients = 100;
+int num_rooms = 1;
+int *room_size;
+int dialect = DIALECT_PM;
+int binary = 0;
+int epoll_fd;
+int logins_pending;
+int login_window = 8;          // Logins in progress at once
+int num_nodes = 1;             // Clients spread over ports port .. port + nodes - 1
+unsigned run_id;
+
+Message *messages;
+uint32_t next_id = 1;
+long in_flight;
+long lost;
+Histogram delivery_hist, completion_hist, who_hist;
+long deliveries, dup_deliveries;
+long sent_ops[3];
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// Latency histogram: log-linear buckets over microseconds
+// ============================================================================
+
+int hist_index(uint64_t us) {
+    if (us < HIST_SUB) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - 4;    // Keep the top 5 bits: 1 implied + 4 for the sub-bucket
+    return (shift + 1) * HIST_SUB + (int)((us >> shift) & (HIST_SUB - 1));
+}
+
+uint64_t hist_value(int index) {
+    if (index < HIST_SUB) return index;
+    int shift = index / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + index % HIST_SUB)) << shift;
+}
+
+void hist_add(Histogram *h, double seconds) {
+    uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+    int i = hist_index(us);
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+    h->buckets[i]++;
+    h->count++;
+    if (seconds > h->max) h->max = seconds;
+}
+
+// Returns the percentile in milliseconds
+double hist_percentile(const Histogram *h, double pct) {
+    if (h->count == 0) return 0;
+    long target = (long)(h->count * pct / 100.0);
+    if (target >= h->count) target = h->count - 1;
+    long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target) return hist_value(i) / 1000.0;
+    }
+    return h->max * 1000.0;
+}
+
+void hist_print(const char *label, const Histogram *h) {
+    printf("  %-11s p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  max %.3f ms\n",
+           label, hist_percentile(h, 50), hist_percentile(h, 90),
+           hist_percentile(h, 99), hist_percentile(h, 99.9), h->max * 1000.0);
+}
+
+// ============================================================================
+// Sending
+// ============================================================================
+
+void watch(SimClient *c, int want_out) {
+    struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_dead(SimClient *c, const char *why) {
+    if (c->state == ST_DEAD) return;
+    fprintf(stderr, "client %d: %s\n", c->index, why);
+    if (c->state == ST_READY) {
+        room_size[c->room]--;
+    } else {
+        logins_pending--;
+    }
+    c->state = ST_DEAD;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+}
+
+// Send now if the socket takes it, otherwise queue the rest for EPOLLOUT
+void queue_send(SimClient *c, const char *data, int len) {
+    if (c->state == ST_DEAD) return;
+    if (c->out_len == 0) {
+        ssize_t sent = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_dead(c, strerror(errno));
+            return;
+        }
+        if (sent > 0) {
+            data += sent;
+            len -= sent;
+        }
+        if (len == 0) return;
+    }
+    if (c->out_len + len > c->out_cap) {
+        int cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (out == NULL) {
+            client_dead(c, "out of memory");
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    if (c->out_len == 0) watch(c, 1);
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void flush_out(SimClient *c) {
+    while (c->out_len > 0) {
+        ssize_t sent = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            client_dead(c, strerror(errno));
+            return;
+        }
+        memmove(c->out, c->out + sent, c->out_len - sent);
+        c->out_len -= sent;
+    }
+    watch(c, 0);
+}
+
+// Sends one line of text, or the matching frame in binary mode. A line that
+// starts with '/' or '@' is a command; anything else is said to the room.
+void send_line(SimClient *c, const char *line, int len) {
+    if (binary) {
+        char frame[MAX_TEXT + 96];
+        int type = (line[0] == '/' || line[0] == '@') ? FRAME_TEXT : FRAME_SAY;
+        if (c->state != ST_READY && c->state != ST_JOIN) type = FRAME_LOGIN;
+        queue_send(c, frame, encode_frame(frame, type, -1, line, len));
+    } else {
+        char text[MAX_TEXT + 96];
+        memcpy(text, line, len);
+        text[len] = '\n';
+        queue_send(c, text, len + 1);
+    }
+}
+
+void client_name(int index, char *out, size_t size) {
+    snprintf(out, size, "sim%x_%d", run_id, index);
+}
+
+// ============================================================================
+// Receiving
+// ============================================================================
+
+// A copy of "sim:<run>:<id>" arrived somewhere
+void record_delivery(const char *text, int len) {
+    char marker[32];
+    int mlen = snprintf(marker, sizeof(marker), "sim:%x:", run_id);
+    const char *p = memmem(text, len, marker, mlen);
+    if (p == NULL) return;
+    p += mlen;
+    const char *end = text + len;
+    uint32_t id = 0;
+    while (p < end && *p >= '0' && *p <= '9') id = id * 10 + (*p++ - '0');
+
+    Message *m = &messages[id % MSG_SLOTS];
+    if (m->id != id || m->remaining == 0) {
+        dup_deliveries++;
+        return;
+    }
+    double elapsed = now_seconds() - m->sent;
+    hist_add(&delivery_hist, elapsed);
+    deliveries++;
+    if (--m->remaining == 0) {
+        hist_add(&completion_hist, elapsed);
+        in_flight--;
+    }
+}
+
+void record_who(SimClient *c) {
+    if (c->who_count == 0) return;
+    hist_add(&who_hist, now_seconds() - c->who_sent[c->who_head]);
+    c->who_head = (c->who_head + 1) % WHO_QUEUE;
+    c->who_count--;
+}
+
+void become_ready(SimClient *c) {
+    c->state = ST_READY;
+    logins_pending--;
+    room_size[c->room]++;
+}
+
+// Login finished: join this client's room, or start right away
+void logged_in(SimClient *c) {
+    if (num_rooms > 1) {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "/join #s%d", c->room);
+        c->state = ST_JOIN;
+        send_line(c, line, len);
+    } else {
+        become_ready(c);
+    }
+}
+
+void handle_text_line(SimClient *c, const char *line, int len) {
+    // The sender's own copy of a private message is not a delivery
+    if ((len > 7 && memcmp(line, "[PM to ", 7) == 0) ||
+        (len > 12 && memcmp(line, "[Private to ", 12) == 0)) {
+        return;
+    }
+    if ((len >= 9 && memcmp(line, "Users in ", 9) == 0) ||
+        (len >= 16 && memcmp(line, "Connected users:", 16) == 0)) {
+        record_who(c);
+        return;
+    }
+    record_delivery(line, len);
+}
+
+// Looks for needle in the input so far; on a match, drops everything up to
+// and including it. Prompts have no newline, so login works on raw bytes.
+int consume_until(SimClient *c, const char *needle) {
+    const char *p = memmem(c->in, c->in_len, needle, strlen(needle));
+    if (p == NULL) return 0;
+    int used = (p - c->in) + strlen(needle);
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return 1;
+}
+
+void handle_text(SimClient *c) {
+    char needle[64];
+    char name[32];
+    int progress = 1;
+
+    while (progress && c->state != ST_READY && c->state != ST_DEAD) {
+        progress = 0;
+        switch (c->state) {
+        case ST_PROMPT:
+            if (consume_until(c, dialect == DIALECT_SELECT ? "nickname: " : "username: ")) {
+                client_name(c->index, name, sizeof(name));
+                send_line(c, name, strlen(name));
+                c->state = ST_WELCOME;
+                progress = 1;
+            }
+            break;
+        case ST_WELCOME:
+            if (consume_until(c, dialect == DIALECT_PM || dialect == DIALECT_ROOMS
+                                     ? "/quit" : "Welcome to the chat")) {
+                logged_in(c);
+                progress = 1;
+            }
+            break;
+        case ST_JOIN:
+            snprintf(needle, sizeof(needle), "You joined #s%d ", c->room);
+            if (consume_until(c, needle)) {
+                become_ready(c);
+                progress = 1;
+            }
+            break;
+        }
+    }
+    if (c->state != ST_READY) {
+        // Keep only a tail while waiting, in case the needle is split
+        if (c->in_len > IN_SIZE / 2) {
+            memmove(c->in, c->in + c->in_len - 64, 64);
+            c->in_len = 64;
+        }
+        return;
+    }
+
+    char *p = c->in;
+    char *end = c->in + c->in_len;
+    char *newline;
+    while ((newline = memchr(p, '\n', end - p)) != NULL) {
+        handle_text_line(c, p, newline - p);
+        p = newline + 1;
+    }
+    c->in_len = end - p;
+    if (c->in_len == IN_SIZE) c->in_len = 0;   // One enormous line: drop it
+    memmove(c->in, p, c->in_len);
+}
+
+void handle_frame(SimClient *c, int type, const char *body, int len) {
+    uint32_t id;
+    int n;
+    char needle[64];
+
+    switch (type) {
+    case FRAME_MESSAGE:
+    case FRAME_PRIVATE:
+        n = get_varint(body, len, &id);
+        if (n > 0 && c->state == ST_READY) record_delivery(body + n, len - n);
+        break;
+    case FRAME_NOTICE:
+        if (c->state == ST_WELCOME && memmem(body, len, "/quit", 5) != NULL) {
+            logged_in(c);
+        } else if (c->state == ST_JOIN) {
+            int nlen = snprintf(needle, sizeof(needle), "You joined #s%d ", c->room);
+            if (memmem(body, len, needle, nlen) != NULL) become_ready(c);
+        } else if (c->state == ST_READY && len >= 9 && memcmp(body, "Users in ", 9) == 0) {
+            record_who(c);
+        }
+        break;
+    }
+}
+
+void handle_binary(SimClient *c) {
+    int pos = 0;
+
+    if (!c->framed) {
+        char *nul = memchr(c->in, '\0', c->in_len);
+        if (nul == NULL) {
+            c->in_len = 0;      // Still the text prompt
+            return;
+        }
+        pos = nul - c->in;
+        if (c->in_len - pos < PROTO_MAGIC_LEN) goto keep;
+        if (memcmp(c->in + pos, PROTO_MAGIC, PROTO_MAGIC_LEN) != 0) {
+            client_dead(c, "server does not speak the binary protocol");
+            return;
+        }
+        c->framed = 1;
+        c->state = ST_WELCOME;
+        pos += PROTO_MAGIC_LEN;
+    }
+
+    while (pos < c->in_len && c->state != ST_DEAD) {
+        if (c->skip > 0) {
+            int drop = c->skip < c->in_len - pos ? (int)c->skip : c->in_len - pos;
+            c->skip -= drop;
+            pos += drop;
+            continue;
+        }
+        int type, body_len;
+        const char *body;
+        int used = parse_frame(c->in + pos, c->in_len - pos, FRAME_MAX_REPLY,
+                               &type, &body, &body_len);
+        if (used < 0) {
+            client_dead(c, "bad frame");
+            return;
+        }
+        if (used == 0) {
+            // A history replay can be bigger than our buffer; we never need it
+            uint32_t len;
+            int n = get_varint(c->in + pos, c->in_len - pos, &len);
+            if (n > 0 && n + len > IN_SIZE) {
+                c->skip = n + len;
+                continue;
+            }
+            break;
+        }
+        handle_frame(c, type, body, body_len);
+        pos += used;
+    }
+
+keep:
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+void handle_input(SimClient *c) {
+    while (c->state != ST_DEAD) {
+        ssize_t bytes = recv(c->fd, c->in + c->in_len, IN_SIZE - c->in_len, 0);
+        if (bytes == 0) {
+            client_dead(c, "server closed the connection");
+            return;
+        }
+        if (bytes == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) client_dead(c, strerror(errno));
+            return;
+        }
+        c->in_len += bytes;
+        if (binary) {
+            handle_binary(c);
+        } else {
+            handle_text(c);
+        }
+    }
+}
+
+void handle_connected(SimClient *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        client_dead(c, strerror(err));
+        return;
+    }
+    if (binary) {
+        char name[32];
+        queue_send(c, PROTO_MAGIC, PROTO_MAGIC_LEN);
+        client_name(c->index, name, sizeof(name));
+        send_line(c, name, strlen(name));       // Login frame right behind the magic
+        c->state = ST_PROMPT;                   // Until the server's magic arrives
+    } else {
+        c->state = dialect == DIALECT_BASIC ? ST_WELCOME : ST_PROMPT;
+    }
+    if (c->out_len == 0) watch(c, 0);
+}
+
+void poll_once(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        SimClient *c = events[i].data.ptr;
+        if (c->state == ST_CONNECTING) {
+            handle_connected(c);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) handle_input(c);
+        if ((events[i].events & EPOLLOUT) && c->state != ST_DEAD) flush_out(c);
+    }
+}
+
+// ============================================================================
+// The scripted traffic
+// ============================================================================
+
+int pick_op(const int mix[3]) {
+    int r = rand() % 100;
+    if (r < mix[0]) return OP_BROADCAST;
+    if (r < mix[0] + mix[1]) return OP_PRIVATE;
+    return OP_WHO;
+}
+
+SimClient *pick_ready(void) {
+    for (int tries = 0; tries < 64; tries++) {
+        SimClient *c = &sim_clients[rand() % num_clients];
+        if (c->state == ST_READY) return c;
+    }
+    return NULL;
+}
+
+// Builds "sim:<run>:<id> xxxx..." of about size bytes and registers the message
+int new_message(char *out, int size, int expected) {
+    uint32_t id = next_id++;
+    Message *m = &messages[id % MSG_SLOTS];
+    if (m->remaining > 0) {
+        lost += m->remaining;   // Wrapped around before it ever completed
+        in_flight--;
+    }
+    m->id = id;
+    m->sent = now_seconds();
+    m->expected = expected;
+    m->remaining = expected;
+    if (expected > 0) in_flight++;
+
+    int len = snprintf(out, MAX_TEXT, "sim:%x:%u ", run_id, id);
+    while (len < size && len < MAX_TEXT) out[len++] = 'x';
+    return len;
+}
+
+void send_op(int op, int msg_size) {
+    SimClient *c = pick_ready();
+    if (c == NULL) return;
+    char line[MAX_TEXT + 64];
+    char text[MAX_TEXT];
+    char name[32];
+    int len;
+
+    if (op == OP_PRIVATE) {
+        SimClient *to = pick_ready();
+        if (to == NULL || to == c) return;
+        client_name(to->index, name, sizeof(name));
+        int tlen = new_message(text, msg_size, 1);
+        len = snprintf(line, sizeof(line),
+                       dialect == DIALECT_SELECT ? "/msg %s %.*s" : "@%s %.*s",
+                       name, tlen, text);
+    } else if (op == OP_WHO) {
+        if (c->who_count == WHO_QUEUE) return;
+        c->who_sent[(c->who_head + c->who_count) % WHO_QUEUE] = now_seconds();
+        c->who_count++;
+        len = snprintf(line, sizeof(line), dialect == DIALECT_SELECT ? "/list" : "/who");
+    } else {
+        len = new_message(line, msg_size, room_size[c->room] - 1);
+    }
+    sent_ops[op]++;
+    send_line(c, line, len);
+}
+
+void start_connect(SimClient *c, int index, struct addrinfo *addr) {
+    c->index = index;
+    c->room = index % num_rooms;
+    struct sockaddr_in target = *(struct sockaddr_in *)addr->ai_addr;
+    target.sin_port = htons(ntohs(target.sin_port) + index % num_nodes);
+    c->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol);
+    if (c->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    // We are measuring the server, so our own small writes must not wait on Nagle
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) == -1 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    logins_pending++;
+}
+
+int parse_dialect(const char *name) {
+    if (strcmp(name, "basic") == 0) return DIALECT_BASIC;
+    if (strcmp(name, "pm") == 0) return DIALECT_PM;
+    if (strcmp(name, "rooms") == 0) return DIALECT_ROOMS;
+    if (strcmp(name, "select") == 0) return DIALECT_SELECT;
+    fprintf(stderr, "Unknown dialect '%s' (basic, pm, rooms, select)\n", name);
+    exit(1);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-p basic|pm|rooms|select] [-n clients] [-r msgs/sec] [-d seconds]\n"
+            "          [-m bcast,pm,who] [-s bytes] [-R rooms] [-w logins] [-N nodes] [-b] [-c]\n"
+            "          host port\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    double rate = 1000;
+    double duration = 10;
+    int mix[3] = { 90, 8, 2 };
+    int msg_size = 64;
+    int csv = 0;
+    const char *dialect_name = "pm";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:r:d:m:s:R:w:N:bc")) != -1) {
+        switch (opt) {
+        case 'p': dialect_name = optarg; dialect = parse_dialect(optarg); break;
+        case 'n': num_clients = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+                mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] != 100) {
+                fprintf(stderr, "-m wants three percentages adding up to 100\n");
+                exit(1);
+            }
+            break;
+        case 's': msg_size = atoi(optarg); break;
+        case 'R': num_rooms = atoi(optarg); break;
+        case 'w': login_window = atoi(optarg); break;
+        case 'N': num_nodes = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'c': csv = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) usage(argv[0]);
+    if (num_clients < 2 || rate <= 0 || duration <= 0 || num_rooms < 1 || login_window < 1 ||
+        num_nodes < 1) {
+        fprintf(stderr, "Need at least 2 clients, 1 room, 1 node and a positive rate and duration\n");
+        exit(1);
+    }
+    if (msg_size > MAX_TEXT - 64) msg_size = MAX_TEXT - 64;
+    if ((binary || num_rooms > 1) && dialect != DIALECT_ROOMS) {
+        fprintf(stderr, "-b and -R only work with -p rooms\n");
+        exit(1);
+    }
+    if (dialect == DIALECT_BASIC && (mix[1] || mix[2])) {
+        mix[0] = 100;   // chat_server.c has no private messages or /who
+        mix[1] = mix[2] = 0;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(argv[optind], argv[optind + 1], &hints, &res);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(1);
+    }
+
+    run_id = (unsigned)(getpid() ^ time(NULL)) & 0xffff;
+    srand(run_id);
+    sim_clients = calloc(num_clients, sizeof(SimClient));
+    room_size = calloc(num_rooms, sizeof(int));
+    messages = calloc(MSG_SLOTS, sizeof(Message));
+    epoll_fd = epoll_create1(0);
+    if (sim_clients == NULL || room_size == NULL || messages == NULL || epoll_fd == -1) {
+        perror("setup");
+        exit(1);
+    }
+
+    // Logins overlap, but only login_window at a time: the older servers
+    // listen() with a backlog of 10 and silently drop connections beyond it
+    double login_start = now_seconds();
+    int started = 0;
+    int ready = 0;
+    while (ready < num_clients) {
+        while (started < num_clients && logins_pending < login_window) {
+            start_connect(&sim_clients[started], started, res);
+            started++;
+        }
+        poll_once(10);
+        ready = 0;
+        int dead = 0;
+        for (int i = 0; i < started; i++) {
+            ready += sim_clients[i].state == ST_READY;
+            dead += sim_clients[i].state == ST_DEAD;
+        }
+        if (dead > 0 || now_seconds() - login_start > LOGIN_TIMEOUT) break;
+    }
+    freeaddrinfo(res);
+    if (ready < num_clients) {
+        fprintf(stderr, "Only %d of %d clients logged in\n", ready, num_clients);
+        exit(1);
+    }
+    double login_time = now_seconds() - login_start;
+
+    // Let the join announcements drain before the clock starts
+    double quiet_until = now_seconds() + 0.3;
+    while (now_seconds() < quiet_until) poll_once(10);
+
+    double start = now_seconds();
+    double stop = start + duration;
+    long total_sent = 0;
+    while (1) {
+        double now = now_seconds();
+        if (now >= stop) break;
+        // Catch up to where the target rate says we should be
+        long due = (long)((now - start) * rate);
+        while (total_sent < due) {
+            send_op(pick_op(mix), msg_size);
+            total_sent++;
+        }
+        poll_once(1);
+    }
+    double send_time = now_seconds() - start;
+
+    // Wait for stragglers, giving up after DRAIN_TIMEOUT with nothing arriving
+    long last = deliveries;
+    double last_progress = now_seconds();
+    while (in_flight > 0 && now_seconds() - last_progress < DRAIN_TIMEOUT) {
+        poll_once(10);
+        if (deliveries != last) {
+            last = deliveries;
+            last_progress = now_seconds();
+        }
+    }
+    double end = in_flight > 0 ? last_progress : now_seconds();
+    for (int i = 0; i < MSG_SLOTS; i++) lost += messages[i].remaining;
+
+    int alive = 0;
+    for (int i = 0; i < num_clients; i++) alive += sim_clients[i].state == ST_READY;
+
+    if (csv) {
+        printf("%s%s,%d,%d,%d,%.0f,%ld,%.0f,%ld,%.0f,%.3f,%.3f,%.3f,%.3f,%ld\n",
+               dialect_name, binary ? "-b" : "", num_clients, num_rooms, num_nodes, rate,
+               sent_ops[0] + sent_ops[1] + sent_ops[2],
+               (sent_ops[0] + sent_ops[1] + sent_ops[2]) / send_time,
+               deliveries, deliveries / (end - start),
+               hist_percentile(&delivery_hist, 50), hist_percentile(&delivery_hist, 99),
+               hist_percentile(&delivery_hist, 99.9), delivery_hist.max * 1000.0, lost);
+    } else {
+        printf("%s%s: %d clients in %d room%s on %d node%s, logged in in %.2f s\n",
+               dialect_name, binary ? " (binary)" : "", num_clients, num_rooms,
+               num_rooms == 1 ? "" : "s", num_nodes, num_nodes == 1 ? "" : "s", login_time);
+        printf("  sent        %ld broadcasts, %ld private, %ld /who in %.2f s (%.0f ops/s, target %.0f)\n",
+               sent_ops[0], sent_ops[1], sent_ops[2], send_time,
+               (sent_ops[0] + sent_ops[1] + sent_ops[2]) / send_time, rate);
+        printf("  delivered   %ld copies in %.2f s (%.0f deliveries/s fan-out)\n",
+               deliveries, end - start, deliveries / (end - start));
+        hist_print("delivery", &delivery_hist);
+        hist_print("completion", &completion_hist);
+        if (who_hist.count > 0) hist_print("/who", &who_hist);
+        if (lost > 0) printf("  WARNING: %ld deliveries never arrived\n", lost);
+        if (dup_deliveries > 0) printf("  WARNING: %ld unexpected copies\n", dup_deliveries);
+        if (alive < num_clients) printf("  WARNING: %d clients were disconnected\n", num_clients - alive);
+    }
+
+    for (int i = 0; i < num_clients; i++) {
+        if (sim_clients[i].state != ST_DEAD) close(sim_clients[i].fd);
+        free(sim_clients[i].out);
+    }
+    free(sim_clients);
+    free(room_size);
+    free(messages);
+    return 0;
+}